@@ -0,0 +1,209 @@
+/*
+* File: aot.cpp
+*
+* Ahead-of-time compiler: aot FILE.byte OUT.o
+*
+* The chunk is loaded with hybrid.c's loadChunkBytecode and translated, like
+* jit.cpp does at run time, into one LLVM function with a basic block per pc
+* built by step.cpp's create_op_* builders. The function is optimized and
+* written to OUT.o, position independent, as
+*
+*     void interpret(MiniLuaState *mls);
+*     const uint64_t aot_code_hash;   // codeHash() of the chunk
+*
+* The constants are baked into the object, so LLVM folds their loads. It
+* still calls step_in_C and error_default, so it runs on top of hybrid.c,
+* either linked in place of interpret.o or, built as a shared object,
+* loaded by hybrid-aot (make examples/FILE.so hybrid-aot).
+*/
+
+#include <cstdio>
+#include <cstring>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "step.h"
+
+// LLVM includes
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/MC/TargetRegistry.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Target/TargetOptions.h>
+//
+
+
+// Defined in hybrid.c
+extern "C" Proto * loadChunkBytecode(FILE *F);
+extern "C" Byte operandTypes(Proto *f, int pc);
+extern "C" uint64_t codeHash(Proto *f);
+
+
+static void fatal(const char *msg, const std::string &arg = "") {
+    fprintf(stderr, "aot: %s%s\n", msg, arg.c_str());
+    exit(1);
+}
+
+// The constants as a private constant array, in place of mls->proto->k.
+// The loader only accepts nil, booleans and numbers, which have no pointers.
+static llvm::Constant* create_constants(Proto *p) {
+    llvm::ArrayType *k_type = llvm::ArrayType::get(value_struct_type, p->sizek);
+    std::vector<llvm::Constant *> values;
+    for (int i = 0; i < p->sizek; i++) {
+        Value *v = &p->k[i];
+        uint64_t payload = 0;
+        if (v->typ == LUA_TNUMFLT) {
+            memcpy(&payload, &v->u.n, sizeof(payload));
+        } else if (v->typ == LUA_TNUMINT) {
+            payload = (uint64_t) v->u.i;
+        } else {
+            payload = (uint64_t) (int64_t) v->u.b;
+        }
+        values.push_back(llvm::ConstantStruct::get(value_struct_type, {
+            llvm::ConstantInt::get(context, llvm::APInt(32, v->typ, true)),
+            llvm::ConstantInt::get(context, llvm::APInt(64, payload, false))}));
+    }
+    llvm::GlobalVariable *k = new llvm::GlobalVariable(*module, k_type, true,
+        llvm::GlobalValue::PrivateLinkage, llvm::ConstantArray::get(k_type, values), "k");
+
+    std::vector<llvm::Constant *> temp;
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)));
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)));
+    return llvm::ConstantExpr::getInBoundsGetElementPtr(k_type, k, temp);
+}
+
+// Same translation as jit.cpp's create_chunk_function, with the constants
+// of the module instead of the address of p->k.
+static llvm::Function* create_chunk_function(Proto *p) {
+    llvm::FunctionType *chunk_type = llvm::FunctionType::get(llvm::Type::getVoidTy(context), p_miniluastate_struct_type, false);
+    llvm::Function *f = llvm::Function::Create(chunk_type, llvm::Function::ExternalLinkage, "interpret", module);
+
+    // the builders read these globals instead of step's arguments
+    step_func = f;
+    _mls = &*f->arg_begin();
+    _constants = create_constants(p);
+
+    llvm::BasicBlock *entry = llvm::BasicBlock::Create(context, "entry", f);
+    std::vector<llvm::BasicBlock *> pc_blocks;
+    for (int pc = 0; pc < p->sizecode; pc++) {
+        pc_blocks.push_back(llvm::BasicBlock::Create(context, "pc_" + std::to_string(pc), f));
+    }
+    error_block = llvm::BasicBlock::Create(context, "error_block", f);
+
+    builder.SetInsertPoint(entry);
+    builder.CreateBr(pc_blocks[0]);
+
+    builder.SetInsertPoint(error_block);
+    builder.CreateCall(error);
+    builder.CreateUnreachable();
+
+    for (int pc = 0; pc < p->sizecode; pc++) {
+        Instruction inst = p->code[pc];
+        uint32_t op = (inst >> POS_OP) & 0x3F;
+
+        builder.SetInsertPoint(pc_blocks[pc]);
+        if (op == OP_RETURN) {
+            create_return_block(inst, NULL);
+            continue;
+        }
+
+        bool called_C;
+        llvm::Value *pc_offset = create_inline_op(inst, operandTypes(p, pc), &called_C);
+        std::set<int64_t> offsets = pc_offsets(inst);
+        if (called_C) {
+            // step_in_C may also skip the next instruction
+            offsets.insert(1);
+        }
+
+        llvm::SwitchInst *next = builder.CreateSwitch(pc_offset, error_block, offsets.size());
+        for (int64_t offset : offsets) {
+            int64_t target = pc + 1 + offset;
+            if (target < 0 || target >= p->sizecode) {
+                continue; // left to error_block
+            }
+            next->addCase(llvm::ConstantInt::get(context, llvm::APInt(64, offset, true)), pc_blocks[target]);
+        }
+    }
+
+    add_alias_info(f);
+    add_branch_weights(f);
+    add_argument_attributes(f, 0, -1);
+    return f;
+}
+
+// Checked by hybrid-aot before it runs the code on the chunk it loaded
+static void create_code_hash(Proto *p) {
+    llvm::Type *i64 = llvm::Type::getInt64Ty(context);
+    new llvm::GlobalVariable(*module, i64, true, llvm::GlobalValue::ExternalLinkage,
+        llvm::ConstantInt::get(context, llvm::APInt(64, codeHash(p), false)), "aot_code_hash");
+}
+
+static void write_object(llvm::TargetMachine *tm, const char *path) {
+    std::error_code ec;
+    llvm::raw_fd_ostream out(path, ec, llvm::sys::fs::OF_None);
+    if (ec) {
+        fatal("could not open ", path);
+    }
+    llvm::legacy::PassManager pm;
+    if (tm->addPassesToEmitFile(pm, out, NULL, llvm::CGFT_ObjectFile)) {
+        fatal("cannot emit an object file for this target");
+    }
+    pm.run(*module);
+    out.flush();
+}
+
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s FILE.byte OUT.o\n", argv[0]);
+        exit(1);
+    }
+
+    FILE *F = fopen(argv[1], "r");
+    if (!F) {
+        fatal("could not open file ", argv[1]);
+    }
+    Proto *p = loadChunkBytecode(F);
+    fclose(F);
+
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+
+    std::string triple = llvm::sys::getDefaultTargetTriple();
+    std::string target_error;
+    const llvm::Target *target = llvm::TargetRegistry::lookupTarget(triple, target_error);
+    if (!target) {
+        fatal("", target_error);
+    }
+    llvm::TargetOptions options;
+    std::unique_ptr<llvm::TargetMachine> tm(target->createTargetMachine(
+        triple, llvm::sys::getHostCPUName(), "", options, llvm::Reloc::PIC_, llvm::None, llvm::CodeGenOpt::Aggressive));
+
+    // the chunk goes to a module of its own, in step.cpp's context
+    create_types();
+    Owner.reset(new llvm::Module(argv[1], context));
+    module = Owner.get();
+    module->setDataLayout(tm->createDataLayout());
+    module->setTargetTriple(triple);
+
+    create_declarations();
+    create_chunk_function(p);
+    create_code_hash(p);
+
+    if (llvm::verifyModule(*module, &llvm::errs())) {
+        module->print(llvm::errs(), NULL);
+        fatal("invalid module");
+    }
+    optimize_module_O3(module, tm.get());
+
+    if (getenv("MINILUA_JIT_DUMP")) {
+        module->print(llvm::errs(), NULL);
+    }
+
+    write_object(tm.get(), argv[2]);
+    return 0;
+}
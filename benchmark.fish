@@ -25,7 +25,20 @@ function bench
 end
 
 bench ./c-minilua $inputbyte
+bench ./c-minilua-threaded $inputbyte
+bench ./c-minilua-pgo $inputbyte
+bench ./c-minilua-cp $inputbyte
+bench ./c-minilua-ct $inputbyte
 bench ./hybrid $inputbyte
+bench ./hybrid-lto $inputbyte
+bench ./hybrid-pgo $inputbyte
+bench ./hybrid-threaded $inputbyte
+bench ./hybrid-indirectbr $inputbyte
+bench ./jit $inputbyte
+bench ./jit-tiered $inputbyte
+bench ./trace $inputbyte
+# needs make examples/$input.so
+bench ./hybrid-aot $inputbyte
 bench lua           ./lua-minilua.lua $inputbyte
 bench luajit -j off ./lua-minilua.lua $inputlua
 bench luajit -O3    ./lua-minilua.lua $inputlua
@@ -25,6 +25,10 @@
 
 // for strdup:
 #define _XOPEN_SOURCE 500
+#if defined(COPY_AND_PATCH) || defined(CONTEXT_THREADING)
+// for MAP_ANONYMOUS:
+#define _DEFAULT_SOURCE
+#endif
 
 #include <assert.h>
 #include <math.h>
@@ -33,6 +37,24 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(COPY_AND_PATCH) || defined(CONTEXT_THREADING)
+#include <stddef.h>
+#include <sys/mman.h>
+#include "perfmap.h"
+#endif
+
+// branch hints: error() is cold and noreturn, so gcc already lays out every
+// path into it out of line; UNLIKELY marks the quickened guards that fail
+#if defined(__GNUC__)
+#define UNLIKELY(x) __builtin_expect(!!(x), 0)
+#define COLD        __attribute__((cold))
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define UNLIKELY(x) (x)
+#define COLD
+#define ALWAYS_INLINE inline
+#endif
+
 // magic constants
 #define LUA_SIGNATURE "\x1bLua"
 #define LUA_VERSION 0x53
@@ -97,6 +119,18 @@ typedef struct {
     } u;
 } Value;
 
+// Instruction decoded at load time (see decodeCode). Register and constant
+// operands are frame offsets, so RK(x) needs no ISK test: registers are at
+// 0.. and constants below them, K(k) at MYK(k).
+typedef struct DInstruction {
+    Byte op;       /* original opcode */
+    Byte handler;  /* opcode or superinstruction that executes it */
+    Int a;
+    Int b;         /* R/K offset or plain argument */
+    Int c;
+    Int target;    /* absolute jump target */
+} DInstruction;
+
 // Function prototype
 typedef struct Proto {
     Byte numparams;  /* number of fixed parameters */
@@ -112,6 +146,9 @@ typedef struct Proto {
     Int lastlinedefined;  /* debug information  */
     Value *k;  /* constants used by the function */
     Instruction *code;  /* opcodes */
+    DInstruction *dcode;  /* opcodes decoded for the interpreter */
+    Byte *types;  /* register types before each pc, see inferTypes() */
+    uintptr_t *native;  /* code address of each pc, see compileProto() */
     //struct Proto **p;  /* functions defined inside the function */
     //int *lineinfo;  /* map from opcodes to source lines (debug information) */
     //LocVar *locvars;  /* information about local variables (debug information) */
@@ -389,6 +426,40 @@ OP_EXTRAARG   = 46, /*  Ax      extra (larger) argument for previous opcode
 
 #define NUM_OPCODES     (1 + ((int) OP_EXTRAARG))
 
+// Superinstructions, only used as DInstruction handlers (see fuseCode).
+// They take the free opcode numbers after OP_EXTRAARG.
+enum {
+OP_EQ_JMP     = 47, /*  A B C   if ((RK(B) == RK(C)) == A) then pc := target else pc++ */
+OP_LT_JMP     = 48, /*  A B C   if ((RK(B) <  RK(C)) == A) then pc := target else pc++ */
+OP_LE_JMP     = 49, /*  A B C   if ((RK(B) <= RK(C)) == A) then pc := target else pc++ */
+OP_ADD_KI     = 50, /*  A B C   R(A) := RK(B) + K(C), K(C) is an integer                */
+OP_SUB_KI     = 51, /*  A B C   R(A) := RK(B) - K(C), K(C) is an integer                */
+OP_MUL_KI     = 52, /*  A B C   R(A) := RK(B) * K(C), K(C) is an integer                */
+OP_MOD_KI     = 53, /*  A B C   R(A) := RK(B) % K(C), K(C) is an integer                */
+OP_IDIV_KI    = 54, /*  A B C   R(A) := RK(B) // K(C), K(C) is an integer               */
+
+// quickened by the interpreter, see quicken(): OP_ADD_II, OP_ADD_FF, ...,
+// OP_LT_JMP_FF, as listed by the QUICK column of opcodes.def. Each one has
+// an untested twin, OP_ADD_I, OP_ADD_F, ..., chosen at load time when
+// inferTypes() proves the operand types (see specializeCode()).
+#define QUICK_II(OP)    OP_##OP##_II, OP_##OP##_I,
+#define QUICK_FF(OP)    OP_##OP##_FF, OP_##OP##_F,
+#define QUICK_II_FF(OP) QUICK_II(OP) QUICK_FF(OP)
+#define OPSPEC_ARITH(OP, INT, FLT, QUICK)    QUICK_##QUICK(OP)
+#define OPSPEC_COMPARE(OP, INT, FLT, QUICK)  QUICK_##QUICK(OP) QUICK_##QUICK(OP##_JMP)
+#define OPSPEC_EQUALITY(OP, INT, FLT, QUICK) QUICK_##QUICK(OP) QUICK_##QUICK(OP##_JMP)
+#include "opcodes.def"
+#undef QUICK_II
+#undef QUICK_FF
+#undef QUICK_II_FF
+
+// chosen by FORPREP for its FORLOOP, see forPrep()
+OP_FORLOOP_I,       /*  A sBx   if R(A+1)-- > 0 then { R(A)+=R(A+2); pc=target; R(A+3)=R(A) } */
+OP_FORLOOP_F,       /*  A sBx   R(A)+=R(A+2); if R(A) <= R(A+1) then { pc=target; R(A+3)=R(A) } */
+};
+
+#define NUM_HANDLERS    (1 + ((int) OP_FORLOOP_F))
+
 /*===========================================================================
   Notes:
   (*) In OP_CALL, if (B == 0) then B = top. If (C == 0), then 'top' is
@@ -541,7 +612,7 @@ const Byte lua_opmodes[] = {
 
 #define EOF_ERROR "unexpected end of file"
 
-static
+static COLD _Noreturn
 void error(const char *msg)
 {
     fprintf(stderr, "%s\n", msg);
@@ -618,7 +689,7 @@ String * loadString(FILE * F)
 
         char * buff = calloc(size, 1);
         loadVector(F, buff, 1, size-1);
-        buff[size] = '\0';
+        buff[size-1] = '\0';
        
         String *string = calloc(1, sizeof(String));
         string->typ = LONG_STRING;
@@ -663,6 +734,131 @@ void loadValue(FILE *F, Value *v)
     }
 }
 
+#define MYK(x)          (-1-(x))
+
+#include "typeinfer.h"
+
+static
+Int decodeArg(enum OpArgMask mode, uint32_t x)
+{
+    if (mode == OpArgK) {
+        return ISK(x) ? MYK((Int) INDEXK(x)) : (Int) x;
+    }
+    return x;
+}
+
+// Pre-decodes f->code so that the interpreters don't have to extract
+// operands or test ISK on every execution.
+static
+DInstruction * decodeCode(Proto *f)
+{
+    DInstruction *dcode = calloc(f->sizecode, sizeof(DInstruction));
+    for (int pc = 0; pc < f->sizecode; pc++) {
+        Instruction instr = f->code[pc];
+        uint32_t op = OP(instr);
+        DInstruction *d = &dcode[pc];
+
+        d->op = op;
+        d->handler = op;
+        d->a = A(instr);
+        switch (getOpMode(op)) {
+            case iABC:
+                d->b = decodeArg(getBMode(op), B(instr));
+                d->c = decodeArg(getCMode(op), C(instr));
+                break;
+            case iABx:
+                d->b = (getBMode(op) == OpArgK) ? MYK((Int) Bx(instr)) : (Int) Bx(instr);
+                break;
+            case iAsBx:
+                d->target = pc + 1 + sBx(instr);
+                break;
+            case iAx:
+                d->a = Ax(instr);
+                break;
+        }
+
+        // a constant operand is just a negative frame offset
+        if (op == OP_LOADK) {
+            d->handler = OP_MOVE;
+        }
+        if (op == OP_LOADKX && pc + 1 < f->sizecode) {
+            d->b = MYK((Int) Ax(f->code[pc + 1]));
+            d->handler = OP_MOVE;
+        }
+    }
+    return dcode;
+}
+
+// Rewrites common sequences of f->dcode into superinstructions:
+//  - EQ/LT/LE followed by a JMP become one compare-and-jump. The JMP stays
+//    in place, it is just skipped over.
+//  - Arithmetic with an integer constant as C skips the type test on C.
+static
+void fuseCode(Proto *f)
+{
+    DInstruction *dcode = f->dcode;
+    for (int pc = 0; pc < f->sizecode; pc++) {
+        DInstruction *d = &dcode[pc];
+        switch (d->op) {
+            case OP_EQ:
+            case OP_LT:
+            case OP_LE: {
+                DInstruction *next = &dcode[pc + 1];
+                // JMP with A != 0 also closes upvalues
+                if (pc + 1 < f->sizecode && next->op == OP_JMP && next->a == 0) {
+                    d->handler = OP_EQ_JMP + (d->op - OP_EQ);
+                    d->target = next->target;
+                }
+            } break;
+
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_MOD:
+            case OP_IDIV: {
+                if (d->c < 0 && f->k[MYK(d->c)].typ == LUA_TNUMINT) {
+                    switch (d->op) {
+                        case OP_ADD:  d->handler = OP_ADD_KI;  break;
+                        case OP_SUB:  d->handler = OP_SUB_KI;  break;
+                        case OP_MUL:  d->handler = OP_MUL_KI;  break;
+                        case OP_MOD:  d->handler = OP_MOD_KI;  break;
+                        case OP_IDIV: d->handler = OP_IDIV_KI; break;
+                    }
+                }
+            } break;
+        }
+    }
+}
+
+// Gives the instructions whose operand types inferTypes() proved their
+// untested handler: OP_ADD_I for an OP_ADD or OP_ADD_KI on two integers,
+// OP_LT_JMP_F for an OP_LT_JMP on two floats, ...
+static
+void specializeCode(Proto *f)
+{
+#define PROVEN_II(OP)    if (types == TYPE_INT) { d->handler = OP_##OP##_I; }
+#define PROVEN_FF(OP)    if (types == TYPE_FLT) { d->handler = OP_##OP##_F; }
+#define PROVEN_II_FF(OP) PROVEN_II(OP) PROVEN_FF(OP)
+#define OPSPEC_ARITH(OP, INT, FLT, QUICK)                           \
+            case OP_##OP:                                           \
+            case OP_##OP##_KI: PROVEN_##QUICK(OP) break;
+#define OPSPEC_COMPARE(OP, INT, FLT, QUICK)                         \
+            case OP_##OP: PROVEN_##QUICK(OP) break;                 \
+            case OP_##OP##_JMP: PROVEN_##QUICK(OP##_JMP) break;
+#define OPSPEC_EQUALITY(OP, INT, FLT, QUICK) OPSPEC_COMPARE(OP, INT, FLT, QUICK)
+
+    for (int pc = 0; pc < f->sizecode; pc++) {
+        DInstruction *d = &f->dcode[pc];
+        Byte types = operandTypes(f, pc);
+        switch (d->handler) {
+#include "opcodes.def"
+        }
+    }
+#undef PROVEN_II
+#undef PROVEN_FF
+#undef PROVEN_II_FF
+}
+
 static
 Proto * loadFunction(FILE *F, String *parent_source)
 {
@@ -728,6 +924,15 @@ Proto * loadFunction(FILE *F, String *parent_source)
         // TODO
     }
 
+    inferTypes(f);
+    if (getenv("MINILUA_TYPES")) {
+        printTypes(f);
+    }
+
+    f->dcode = decodeCode(f);
+    fuseCode(f);
+    specializeCode(f);
+
     return f;
 }
 
@@ -756,7 +961,6 @@ Proto * loadChunkBytecode(FILE *F)
     return f;
 }
 
-#define MYK(x)          (-1-(x))
 void printInstruction(Instruction instr)
 {
     uint32_t op = OP(instr);
@@ -871,150 +1075,149 @@ int isTruthy(Value *v) {
 }
 
 
+// Primitives of opcodes.def
+#define INT_ADD(x, y)       ((x) + (y))
+#define INT_SUB(x, y)       ((x) - (y))
+#define INT_MUL(x, y)       ((x) * (y))
+#define INT_REM(x, y)       ((x) % (y))
+#define INT_QUOT(x, y)      ((x) / (y))
+#define INT_EQ(x, y)        ((x) == (y))
+#define INT_LT(x, y)        ((x) < (y))
+#define INT_LE(x, y)        ((x) <= (y))
+
+#define FLT_ADD(x, y)       ((x) + (y))
+#define FLT_SUB(x, y)       ((x) - (y))
+#define FLT_MUL(x, y)       ((x) * (y))
+#define FLT_DIV(x, y)       ((x) / (y))
+#define FLT_FMOD(x, y)      fmod((x), (y))
+#define FLT_FLOORDIV(x, y)  floor((x) / (y))
+#define FLT_POW(x, y)       pow((x), (y))
+#define FLT_EQ(x, y)        ((x) == (y))
+#define FLT_LT(x, y)        ((x) < (y))
+#define FLT_LE(x, y)        ((x) <= (y))
+
+// vm_ADD, vm_SUB, ...
+#define OPSPEC_ARITH(OP, INT, FLT, QUICK)                               \
+static                                                                  \
+void vm_##OP(Value *out, Value *v1, Value *v2)                          \
+{                                                                       \
+    if (isNumerical(v1) && isNumerical(v2)) {                           \
+        if (v1->typ == LUA_TNUMINT && v2->typ == LUA_TNUMINT) {         \
+            set_int(out, INT_##INT(v1->u.i, v2->u.i));                  \
+        } else {                                                        \
+            set_float(out, FLT_##FLT(castToFloat(v1), castToFloat(v2)));\
+        }                                                               \
+    } else {                                                            \
+        error("type error");                                            \
+        assert(0);                                                      \
+    }                                                                   \
+}
+
+#define OPSPEC_ARITH_FLOAT(OP, FLT)                                     \
+static                                                                  \
+void vm_##OP(Value *out, Value *v1, Value *v2)                          \
+{                                                                       \
+    if (isNumerical(v1) && isNumerical(v2)) {                           \
+        set_float(out, FLT_##FLT(castToFloat(v1), castToFloat(v2)));    \
+    } else {                                                            \
+        error("type error");                                            \
+        assert(0);                                                      \
+    }                                                                   \
+}
+
+#include "opcodes.def"
+
 static
-void vm_ADD(Value *out, Value *v1, Value *v2)
+void vm_UNM(Value *out, Value *v1)
 {
-    if (isNumerical(v1) && isNumerical(v2)) {
-        if (v1->typ == LUA_TNUMINT && v2->typ == LUA_TNUMINT) {
-            lua_integer i1 = v1->u.i;
-            lua_integer i2 = v2->u.i;
-            set_int(out, i1 + i2);
-        } else {
-            lua_float n1 = castToFloat(v1);
-            lua_float n2 = castToFloat(v2);
-            set_float(out, n1 + n2);
-        }
+    if (v1->typ == LUA_TNUMINT) {
+        set_int(out, - v1->u.i);
+    } else if (v1->typ == LUA_TNUMFLT) {
+        set_float(out, - v1->u.n);
     } else {
         error("type error");
         assert(0);
-    } 
+    }
 }
 
 static
-void vm_SUB(Value *out, Value *v1, Value *v2)
+void vm_NOT(Value *out, Value *v1)
 {
-    if (isNumerical(v1) && isNumerical(v2)) {
-        if (v1->typ == LUA_TNUMINT && v2->typ == LUA_TNUMINT) {
-            lua_integer i1 = v1->u.i;
-            lua_integer i2 = v2->u.i;
-            set_int(out, i1 - i2);
-        } else {
-            lua_float n1 = castToFloat(v1);
-            lua_float n2 = castToFloat(v2);
-            set_float(out, n1 - n2);
-        }
-    } else {
-        error("type error");
-        assert(0);
-    } 
+    set_bool(out, !isTruthy(v1));
 }
 
+// Operand of a bitwise operation: an integer, or a float with an exact
+// integer representation.
 static
-void vm_MUL(Value *out, Value *v1, Value *v2)
+lua_integer castToInteger(Value *v)
 {
-    if (isNumerical(v1) && isNumerical(v2)) {
-        if (v1->typ == LUA_TNUMINT && v2->typ == LUA_TNUMINT) {
-            lua_integer i1 = v1->u.i;
-            lua_integer i2 = v2->u.i;
-            set_int(out, i1 * i2);
-        } else {
-            lua_float n1 = castToFloat(v1);
-            lua_float n2 = castToFloat(v2);
-            set_float(out, n1 * n2);
-        }
+    if (v->typ == LUA_TNUMINT) {
+        return v->u.i;
+    } else if (v->typ == LUA_TNUMFLT && floor(v->u.n) == v->u.n
+               && v->u.n >= -0x1p63 && v->u.n < 0x1p63) {
+        return (lua_integer) v->u.n;
     } else {
-        error("type error");
+        error("number has no integer representation");
         assert(0);
-    } 
+    }
 }
 
+// x << y as in luaV_shiftl: a negative y shifts right (logically) and
+// shifting by 64 bits or more gives 0.
 static
-void vm_DIV(Value *out, Value *v1, Value *v2)
+lua_integer shiftLeft(lua_integer x, lua_integer y)
 {
-    // Float division (always with floats)
-
-    if (isNumerical(v1) && isNumerical(v2)) {
-        lua_float n1 = castToFloat(v1);
-        lua_float n2 = castToFloat(v2);
-        set_float(out, n1 / n2);
+    if (y < 0) {
+        if (y <= -64) return 0;
+        return (lua_integer) ((uint64_t) x >> -y);
     } else {
-        error("type error");
-        assert(0);
+        if (y >= 64) return 0;
+        return (lua_integer) ((uint64_t) x << y);
     }
 }
 
 static
-void vm_MOD(Value *out, Value *v1, Value *v2)
+void vm_BAND(Value *out, Value *v1, Value *v2)
 {
-    if (isNumerical(v1) && isNumerical(v2)) {
-        if (v1->typ == LUA_TNUMINT && v2->typ == LUA_TNUMINT) {
-            lua_integer i1 = v1->u.i;
-            lua_integer i2 = v2->u.i;
-            set_int(out, i1 % i2);
-        } else {
-            lua_float n1 = castToFloat(v1);
-            lua_float n2 = castToFloat(v2);
-            set_float(out, fmod(n1, n2));
-        }
-    } else {
-        error("type error");
-        assert(0);
-    } 
-
+    set_int(out, castToInteger(v1) & castToInteger(v2));
 }
 
+static
+void vm_BOR(Value *out, Value *v1, Value *v2)
+{
+    set_int(out, castToInteger(v1) | castToInteger(v2));
+}
 
 static
-void vm_IDIV(Value *out, Value *v1, Value *v2)
+void vm_BXOR(Value *out, Value *v1, Value *v2)
 {
-    if (isNumerical(v1) && isNumerical(v2)) {
-        if (v1->typ == LUA_TNUMINT && v2->typ == LUA_TNUMINT) {
-            lua_integer i1 = v1->u.i;
-            lua_integer i2 = v2->u.i;
-            set_int(out, i1 / i2);
-        } else {
-            lua_float n1 = castToFloat(v1);
-            lua_float n2 = castToFloat(v2);
-            set_float(out, floor(n1/n2));
-        }
-    } else {
-        error("type error");
-        assert(0);
-    } 
+    set_int(out, castToInteger(v1) ^ castToInteger(v2));
 }
 
 static
-void vm_POW(Value *out, Value *v1, Value *v2)
+void vm_SHL(Value *out, Value *v1, Value *v2)
 {
-    // Float division (always with floats)
+    set_int(out, shiftLeft(castToInteger(v1), castToInteger(v2)));
+}
 
-    if (isNumerical(v1) && isNumerical(v2)) {
-        lua_float n1 = castToFloat(v1);
-        lua_float n2 = castToFloat(v2);
-        set_float(out, pow(n1, n2));
-    } else {
-        error("type error");
-        assert(0);
-    }
+static
+void vm_SHR(Value *out, Value *v1, Value *v2)
+{
+    set_int(out, shiftLeft(castToInteger(v1), - (uint64_t) castToInteger(v2)));
 }
 
 static
-void vm_UNM(Value *out, Value *v1)
+void vm_BNOT(Value *out, Value *v1)
 {
-    if (v1->typ == LUA_TNUMINT) {
-        set_int(out, - v1->u.i);
-    } else if (v1->typ == LUA_TNUMFLT) {
-        set_float(out, - v1->u.n);
-    } else {
-        error("type error");
-        assert(0);
-    }
+    set_int(out, ~castToInteger(v1));
 }
 
 static
-void vm_NOT(Value *out, Value *v1)
+void vm_LOADNIL(Value *first, uint32_t n)
 {
-    set_bool(out, !isTruthy(v1));
+    for (uint32_t i = 0; i <= n; i++) {
+        set_nil(&first[i]);
+    }
 }
 
 static
@@ -1027,7 +1230,7 @@ uint32_t vm_EQ(Value *v1, Value *v2)
         } break;
 
         case LUA_TBOOLEAN: {
-            if (v2->typ != LUA_TBOOLEAN) return (v1->u.b == v2->u.b);
+            if (v2->typ == LUA_TBOOLEAN) return (v1->u.b == v2->u.b);
             return 0;
         } break;
 
@@ -1050,42 +1253,24 @@ uint32_t vm_EQ(Value *v1, Value *v2)
     }
 }
 
-static
-uint32_t vm_LT(Value *v1, Value *v2)
-{
-  if (isNumerical(v1) && isNumerical(v2)) {
-    if (v1->typ == LUA_TNUMINT && v2->typ == LUA_TNUMINT) {
-      lua_integer i1 = v1->u.i;
-      lua_integer i2 = v2->u.i;
-      return (i1 < i2);
-    } else {
-      lua_float n1 = castToFloat(v1);
-      lua_float n2 = castToFloat(v2);
-      return (n1 < n2);
-    }
-  } else {
-    error("type error");
-    assert(0);
-  } 
+// vm_LT, vm_LE (vm_EQ is above)
+#define OPSPEC_COMPARE(OP, INT, FLT, QUICK)                             \
+static                                                                  \
+uint32_t vm_##OP(Value *v1, Value *v2)                                  \
+{                                                                       \
+    if (isNumerical(v1) && isNumerical(v2)) {                           \
+        if (v1->typ == LUA_TNUMINT && v2->typ == LUA_TNUMINT) {         \
+            return INT_##INT(v1->u.i, v2->u.i);                         \
+        } else {                                                        \
+            return FLT_##FLT(castToFloat(v1), castToFloat(v2));         \
+        }                                                               \
+    } else {                                                            \
+        error("type error");                                            \
+        assert(0);                                                      \
+    }                                                                   \
 }
 
-uint32_t vm_LE(Value *v1, Value *v2)
-{
-  if (isNumerical(v1) && isNumerical(v2)) {
-    if (v1->typ == LUA_TNUMINT && v2->typ == LUA_TNUMINT) {
-      lua_integer i1 = v1->u.i;
-      lua_integer i2 = v2->u.i;
-      return (i1 <= i2);
-    } else {
-      lua_float n1 = castToFloat(v1);
-      lua_float n2 = castToFloat(v2);
-      return (n1 <= n2);
-    }
-  } else {
-    error("type error");
-    assert(0);
-  } 
-}
+#include "opcodes.def"
 
 //
 // Interpreter
@@ -1100,181 +1285,1214 @@ typedef struct MiniLuaState {
 } MiniLuaState;
 
 #define R(n) &mls->registers[n]
-#define K(n) &constants[n]
-#define RK(n) (ISK(n) ? K(INDEXK(n)) : R(n))
 
-//
-size_t step(MiniLuaState *mls, Instruction inst, uint32_t op, Value *constants) {
-    size_t pc_offset = 0;
-    switch (op) {
-        case OP_MOVE: {
-            // R(A) := R(B)
-            Value *a = R(A(inst));
-            Value *b = R(B(inst));
-            *a = *b;
-        } break;
+// Registers for a fresh activation of f. The constants are copied right
+// below register 0, which is where the frame offsets of decoded K operands
+// point (see decodeCode).
+static
+Value * newFrame(Proto *f)
+{
+    Value *frame = calloc(f->sizek + f->maxstacksize, sizeof(Value));
+    Value *registers = frame + f->sizek;
+    for (int i = 0; i < f->sizek; i++) {
+        registers[MYK(i)] = f->k[i];
+    }
+    for (int i = 0; i < f->maxstacksize; i++) {
+        set_nil(&registers[i]);
+    }
+    return registers;
+}
+
+#define IS_II(b, c) ((b)->typ == LUA_TNUMINT && (c)->typ == LUA_TNUMINT)
+#define IS_FF(b, c) ((b)->typ == LUA_TNUMFLT && (c)->typ == LUA_TNUMFLT)
 
-        case OP_LOADK: {
-            Value *a = R(A(inst));
-            Value *b = K(Bx(inst));
+// Type feedback: the generic arithmetic and comparison handlers call this
+// with the operands they are about to use, and inst is rewritten in place to
+// the variant specialized for those types. The specialized handlers guard on
+// the types and hand the instruction back to the generic handler when the
+// guard fails. Mixed operand types keep the generic handler.
+static inline
+void quicken(DInstruction *inst, Value *b, Value *c)
+{
+    int ii = IS_II(b, c);
+    int ff = IS_FF(b, c);
+    Byte handler = inst->handler;
+
+#define PICK_II(OP)    ii ? OP_##OP##_II : handler
+#define PICK_FF(OP)    ff ? OP_##OP##_FF : handler
+#define PICK_II_FF(OP) ii ? OP_##OP##_II : ff ? OP_##OP##_FF : handler
+#define OPSPEC_ARITH(OP, INT, FLT, QUICK) \
+        case OP_##OP: handler = PICK_##QUICK(OP); break;
+#define OPSPEC_COMPARE(OP, INT, FLT, QUICK) \
+        case OP_##OP: handler = PICK_##QUICK(OP); break; \
+        case OP_##OP##_JMP: handler = PICK_##QUICK(OP##_JMP); break;
+#define OPSPEC_EQUALITY(OP, INT, FLT, QUICK) OPSPEC_COMPARE(OP, INT, FLT, QUICK)
+
+    switch (inst->handler) {
+#include "opcodes.def"
+    }
+    inst->handler = handler;
+}
+
+// The limit of an integer loop with a positive step as an integer, as in
+// Lua's forlimit(): a float limit is floored and clipped to the integer
+// range. Returns 0 if the loop cannot run at all (a NaN or too small limit).
+static
+int forLimit(Value *limit, lua_integer *ilimit)
+{
+    if (limit->typ == LUA_TNUMINT) {
+        *ilimit = limit->u.i;
+        return 1;
+    }
+    lua_float f = floor(limit->u.n);
+    if (!(f >= -9223372036854775808.0)) {
+        return 0;
+    }
+    *ilimit = f >= 9223372036854775808.0 ? INT64_MAX : (lua_integer) f;
+    return 1;
+}
+
+// Prepares the control registers of a numeric for loop and returns the
+// handler its FORLOOP should run with. Only loops with a positive step are
+// specialized:
+//  - integer init and step: R(A+1) becomes the number of iterations left
+//    (saturated, for a loop over the whole integer range), so FORLOOP_I
+//    just counts it down while it bumps the index. A float limit goes
+//    through forLimit() first, the index stays an integer as in Lua;
+//  - a float init or step: all three are converted to floats once, so
+//    FORLOOP_F needs no type tests.
+// Anything else keeps the generic FORLOOP.
+// The index is pre-decremented (and FORLOOP_I bumps it) in unsigned
+// arithmetic, like Lua's intop(), as it may step out of the integer range.
+static
+Byte forPrep(Value *init, Value *limit, Value *step)
+{
+    if (init->typ == LUA_TNUMINT && step->typ == LUA_TNUMINT && step->u.i > 0 && isNumerical(limit)) {
+        lua_integer ilimit;
+        uint64_t count = 0;
+        if (forLimit(limit, &ilimit) && init->u.i <= ilimit) {
+            count = ((uint64_t) ilimit - (uint64_t) init->u.i) / (uint64_t) step->u.i;
+            if (count < UINT64_MAX) {
+                count++;
+            }
+        }
+        set_int(limit, (lua_integer) count);
+        set_int(init, (lua_integer) ((uint64_t) init->u.i - (uint64_t) step->u.i));
+        return OP_FORLOOP_I;
+    }
+
+    if (isNumerical(init) && isNumerical(limit) && isNumerical(step) && castToFloat(step) > 0) {
+        set_float(init, castToFloat(init));
+        set_float(limit, castToFloat(limit));
+        set_float(step, castToFloat(step));
+        set_float(init, init->u.n - step->u.n);
+        return OP_FORLOOP_F;
+    }
+
+    vm_SUB(init, init, step);
+    return OP_FORLOOP;
+}
+
+// --- Handlers generated from opcodes.def
+// Expanded in both step()'s switch and the threaded interpret(), which
+// define how a handler starts (HANDLER), ends (NEXT), hands the instruction
+// back to its generic handler (DEOPT), skips the next instruction (SKIP) and
+// jumps to inst->target (JUMP).
+
+#define GEN_ARITH(OP)                                       \
+    HANDLER(OP) {                                           \
+        Value *a = R(inst->a);                              \
+        Value *b = R(inst->b);                              \
+        Value *c = R(inst->c);                              \
+        quicken(inst, b, c);                                \
+        vm_##OP(a,b,c);                                     \
+    } NEXT();
+
+#define GEN_ARITH_FLOAT(OP)                                 \
+    HANDLER(OP) {                                           \
+        Value *a = R(inst->a);                              \
+        Value *b = R(inst->b);                              \
+        Value *c = R(inst->c);                              \
+        vm_##OP(a,b,c);                                     \
+    } NEXT();
+
+// K(C) is known to be an integer, only RK(B) is tested
+#define GEN_ARITH_KI(OP, INT)                               \
+    HANDLER(OP##_KI) {                                      \
+        Value *a = R(inst->a);                              \
+        Value *b = R(inst->b);                              \
+        Value *c = R(inst->c);                              \
+        if (b->typ == LUA_TNUMINT) {                        \
+            set_int(a, INT_##INT(b->u.i, c->u.i));          \
+        } else {                                            \
+            vm_##OP(a,b,c);                                 \
+        }                                                   \
+    } NEXT();
+
+// The quickened handlers go back to the generic one when the operand types
+// change, the ones proven by inferTypes() have nothing to test.
+#define GUARD_II(b, c, OP)  if (UNLIKELY(!IS_II(b, c))) { DEOPT(OP); }
+#define GUARD_FF(b, c, OP)  if (UNLIKELY(!IS_FF(b, c))) { DEOPT(OP); }
+#define GUARD_I(b, c, OP)
+#define GUARD_F(b, c, OP)
+
+#define GEN_ARITH_QUICK(OP, T, PRIM, FIELD, SET)            \
+    HANDLER(OP##_##T) {                                     \
+        Value *a = R(inst->a);                              \
+        Value *b = R(inst->b);                              \
+        Value *c = R(inst->c);                              \
+        GUARD_##T(b, c, OP)                                 \
+        SET(a, PRIM(b->u.FIELD, c->u.FIELD));               \
+    } NEXT();
+
+#define GEN_ARITH_II(OP, INT, FLT)                          \
+    GEN_ARITH_QUICK(OP, II, INT_##INT, i, set_int)          \
+    GEN_ARITH_QUICK(OP, I, INT_##INT, i, set_int)
+#define GEN_ARITH_FF(OP, INT, FLT)                          \
+    GEN_ARITH_QUICK(OP, FF, FLT_##FLT, n, set_float)        \
+    GEN_ARITH_QUICK(OP, F, FLT_##FLT, n, set_float)
+#define GEN_ARITH_II_FF(OP, INT, FLT) GEN_ARITH_II(OP, INT, FLT) GEN_ARITH_FF(OP, INT, FLT)
+
+#define GEN_COMPARE(OP)                                     \
+    HANDLER(OP) {                                           \
+        uint32_t a = inst->a;                               \
+        Value *b = R(inst->b);                              \
+        Value *c = R(inst->c);                              \
+        quicken(inst, b, c);                                \
+        if ( vm_##OP(b, c) != a ) {                         \
+            SKIP();                                         \
+        }                                                   \
+    } NEXT();
+
+#define GEN_COMPARE_JMP(OP)                                 \
+    HANDLER(OP##_JMP) {                                     \
+        uint32_t a = inst->a;                               \
+        Value *b = R(inst->b);                              \
+        Value *c = R(inst->c);                              \
+        quicken(inst, b, c);                                \
+        if ( vm_##OP(b, c) == a ) {                         \
+            JUMP();                                         \
+        } else {                                            \
+            SKIP();                                         \
+        }                                                   \
+    } NEXT();
+
+#define GEN_COMPARE_QUICK(OP, T, PRIM, FIELD)               \
+    HANDLER(OP##_##T) {                                     \
+        uint32_t a = inst->a;                               \
+        Value *b = R(inst->b);                              \
+        Value *c = R(inst->c);                              \
+        GUARD_##T(b, c, OP)                                 \
+        if ( PRIM(b->u.FIELD, c->u.FIELD) != a ) {          \
+            SKIP();                                         \
+        }                                                   \
+    } NEXT();                                               \
+    HANDLER(OP##_JMP_##T) {                                 \
+        uint32_t a = inst->a;                               \
+        Value *b = R(inst->b);                              \
+        Value *c = R(inst->c);                              \
+        GUARD_##T(b, c, OP##_JMP)                           \
+        if ( PRIM(b->u.FIELD, c->u.FIELD) == a ) {          \
+            JUMP();                                         \
+        } else {                                            \
+            SKIP();                                         \
+        }                                                   \
+    } NEXT();
+
+#define GEN_COMPARE_II(OP, INT, FLT)                        \
+    GEN_COMPARE_QUICK(OP, II, INT_##INT, i)                 \
+    GEN_COMPARE_QUICK(OP, I, INT_##INT, i)
+#define GEN_COMPARE_FF(OP, INT, FLT)                        \
+    GEN_COMPARE_QUICK(OP, FF, FLT_##FLT, n)                 \
+    GEN_COMPARE_QUICK(OP, F, FLT_##FLT, n)
+#define GEN_COMPARE_II_FF(OP, INT, FLT) GEN_COMPARE_II(OP, INT, FLT) GEN_COMPARE_FF(OP, INT, FLT)
+
+#define GEN_HANDLERS_ARITH(OP, INT, FLT, QUICK) \
+    GEN_ARITH(OP) GEN_ARITH_KI(OP, INT) GEN_ARITH_##QUICK(OP, INT, FLT)
+#define GEN_HANDLERS_COMPARE(OP, INT, FLT, QUICK) \
+    GEN_COMPARE(OP) GEN_COMPARE_JMP(OP) GEN_COMPARE_##QUICK(OP, INT, FLT)
+
+size_t step(MiniLuaState *mls, DInstruction *inst, size_t pc);
+
+// Executes inst, the instruction at pc-1, with handler and returns the next
+// pc. With a constant handler the switch folds away, which is how the
+// context-threaded code gets a function per handler (see ctHandlers).
+static ALWAYS_INLINE
+size_t stepAs(MiniLuaState *mls, DInstruction *inst, size_t pc, Byte handler) {
+    switch (handler) {
+        case OP_MOVE: {
+            // R(A) := R(B), also LOADK: R(A) := K(Bx)
+            Value *a = R(inst->a);
+            Value *b = R(inst->b);
             *a = *b;
         } break;
 
-        case OP_ADD: {
-            Value *a = R(A(inst));
-            Value *b = RK(B(inst));
-            Value *c = RK(C(inst));
-            vm_ADD(a,b,c);
-        } break; 
-
-        case OP_SUB: {
-            Value *a = R(A(inst));
-            Value *b = RK(B(inst));
-            Value *c = RK(C(inst));
-            vm_SUB(a,b,c);
-        } break; 
-
-        case OP_MUL: {
-            Value *a = R(A(inst));
-            Value *b = RK(B(inst));
-            Value *c = RK(C(inst));
-            vm_MUL(a,b,c);
-        } break; 
-
-        case OP_DIV: {
-            Value *a = R(A(inst));
-            Value *b = RK(B(inst));
-            Value *c = RK(C(inst));
-            vm_DIV(a,b,c);
-        } break; 
-
-        case OP_MOD: {
-            Value *a = R(A(inst));
-            Value *b = RK(B(inst));
-            Value *c = RK(C(inst));
-            vm_MOD(a,b,c);
-        } break; 
-
-        case OP_IDIV: {
-            Value *a = R(A(inst));
-            Value *b = RK(B(inst));
-            Value *c = RK(C(inst));
-            vm_IDIV(a,b,c);
-        } break; 
-
-        case OP_POW: {
-            Value *a = R(A(inst));
-            Value *b = RK(B(inst));
-            Value *c = RK(C(inst));
-            vm_POW(a,b,c);
-        } break; 
+#define HANDLER(name)   case OP_##name:
+#define NEXT()          break
+#define DEOPT(generic)  do { inst->handler = OP_##generic; return step(mls, inst, pc); } while (0)
+#define SKIP()          pc++
+#define JUMP()          pc = inst->target
+#define OPSPEC_ARITH(OP, INT, FLT, QUICK)    GEN_HANDLERS_ARITH(OP, INT, FLT, QUICK)
+#define OPSPEC_ARITH_FLOAT(OP, FLT)          GEN_ARITH_FLOAT(OP)
+#define OPSPEC_COMPARE(OP, INT, FLT, QUICK)  GEN_HANDLERS_COMPARE(OP, INT, FLT, QUICK)
+#define OPSPEC_EQUALITY(OP, INT, FLT, QUICK) GEN_HANDLERS_COMPARE(OP, INT, FLT, QUICK)
+#include "opcodes.def"
+#undef HANDLER
+#undef NEXT
+#undef DEOPT
+#undef SKIP
+#undef JUMP
 
         case OP_UNM: {
-            Value *a = R(A(inst));
-            Value *b = R(B(inst));
+            Value *a = R(inst->a);
+            Value *b = R(inst->b);
             vm_UNM(a, b);
         } break;
 
         case OP_NOT: {
-            Value *a = R(A(inst));
-            Value *b = R(B(inst));
+            Value *a = R(inst->a);
+            Value *b = R(inst->b);
             vm_NOT(a, b);
         } break;
 
-        case OP_JMP: {
-            // uint32_t a = A(instr);
-            int32_t sbx = sBx(inst);
-            pc_offset = sbx;
-            // if (a) close upvalues;
+        case OP_LOADBOOL: {
+            set_bool(R(inst->a), inst->b);
+            if (inst->c) {
+                pc++;
+            }
         } break;
 
-        case OP_EQ: {
-            uint32_t a = A(inst);
-            Value *b = RK(B(inst));
-            Value *c = RK(C(inst));
-            if ( vm_EQ(b, c) != a ) { 
-                pc_offset++;
-            }
+        case OP_LOADNIL: {
+            vm_LOADNIL(R(inst->a), inst->b);
+        } break;
+
+        case OP_BAND: {
+            Value *a = R(inst->a);
+            Value *b = R(inst->b);
+            Value *c = R(inst->c);
+            vm_BAND(a,b,c);
+        } break;
+
+        case OP_BOR: {
+            Value *a = R(inst->a);
+            Value *b = R(inst->b);
+            Value *c = R(inst->c);
+            vm_BOR(a,b,c);
+        } break;
+
+        case OP_BXOR: {
+            Value *a = R(inst->a);
+            Value *b = R(inst->b);
+            Value *c = R(inst->c);
+            vm_BXOR(a,b,c);
+        } break;
+
+        case OP_SHL: {
+            Value *a = R(inst->a);
+            Value *b = R(inst->b);
+            Value *c = R(inst->c);
+            vm_SHL(a,b,c);
+        } break;
+
+        case OP_SHR: {
+            Value *a = R(inst->a);
+            Value *b = R(inst->b);
+            Value *c = R(inst->c);
+            vm_SHR(a,b,c);
+        } break;
+
+        case OP_BNOT: {
+            Value *a = R(inst->a);
+            Value *b = R(inst->b);
+            vm_BNOT(a, b);
         } break;
 
-        case OP_LT: {
-            uint32_t a = A(inst);
-            Value *b = RK(B(inst));
-            Value *c = RK(C(inst));
-            if ( vm_LT(b, c) != a ) { 
-                pc_offset++;
+        case OP_TEST: {
+            Value *a = R(inst->a);
+            if (isTruthy(a) != inst->c) {
+                pc++;
             }
         } break;
 
-        case OP_LE: {
-            uint32_t a = A(inst);
-            Value *b = RK(B(inst));
-            Value *c = RK(C(inst));
-            if ( vm_LE(b, c) != a ) { 
-                pc_offset++;
+        case OP_TESTSET: {
+            Value *a = R(inst->a);
+            Value *b = R(inst->b);
+            if (isTruthy(b) != inst->c) {
+                pc++;
+            } else {
+                *a = *b;
             }
         } break;
 
+        case OP_EXTRAARG: {
+            // argument of the LOADKX before it, already decoded there
+        } break;
+
+        case OP_JMP: {
+            pc = inst->target;
+            // if (a) close upvalues;
+        } break;
+
         case OP_FORLOOP: {
-            uint32_t ia = A(inst);
-            int32_t sbx = sBx(inst);
-            Value *init  = R(ia + 0);
-            Value *limit = R(ia + 1);
-            Value *step  = R(ia + 2);
-            Value *var   = R(ia + 3);
+            Value *init  = R(inst->a + 0);
+            Value *limit = R(inst->a + 1);
+            Value *step  = R(inst->a + 2);
+            Value *var   = R(inst->a + 3);
 
             vm_ADD(init, init, step);
             if (vm_LE(init, limit)) {
-                pc_offset = sbx;
+                pc = inst->target;
                 *var = *init;
             } 
         } break;
 
         case OP_FORPREP: {
-            uint32_t ia = A(inst);
-            int32_t sbx = sBx(inst);
-            Value *init = R(ia + 0);
-            Value *step = R(ia + 2);
-            
-            vm_SUB(init, init, step);
-            pc_offset = sbx;
+            Value *init  = R(inst->a + 0);
+            Value *limit = R(inst->a + 1);
+            Value *step  = R(inst->a + 2);
+
+            mls->proto->dcode[inst->target].handler = forPrep(init, limit, step);
+            pc = inst->target;
+        } break;
+
+        case OP_FORLOOP_I: {
+            Value *init  = R(inst->a + 0);
+            Value *count = R(inst->a + 1);
+            Value *step  = R(inst->a + 2);
+            Value *var   = R(inst->a + 3);
+
+            if (count->u.i != 0) {
+                count->u.i = (lua_integer) ((uint64_t) count->u.i - 1);
+                init->u.i = (lua_integer) ((uint64_t) init->u.i + (uint64_t) step->u.i);
+                set_int(var, init->u.i);
+                pc = inst->target;
+            }
+        } break;
+
+        case OP_FORLOOP_F: {
+            Value *init  = R(inst->a + 0);
+            Value *limit = R(inst->a + 1);
+            Value *step  = R(inst->a + 2);
+            Value *var   = R(inst->a + 3);
+
+            init->u.n += step->u.n;
+            if (init->u.n <= limit->u.n) {
+                set_float(var, init->u.n);
+                pc = inst->target;
+            }
         } break;
 
         default:
-            fprintf(stderr, "Opcode %s is not implemented yet\n", lua_opnames[op]);
+            fprintf(stderr, "Opcode %s is not implemented yet\n", lua_opnames[inst->op]);
             exit(1);
             break;
     }
     
-    return pc_offset;
+    return pc;
+}
+
+// Executes inst, the instruction at pc-1, and returns the next pc.
+size_t step(MiniLuaState *mls, DInstruction *inst, size_t pc) {
+    return stepAs(mls, inst, pc, inst->handler);
+}
+
+#ifdef COPY_AND_PATCH
+
+// Copy-and-patch compiler (make c-minilua-cp). Instead of dispatching on
+// every instruction, compileProto() builds native code for the whole Proto
+// by pasting, one after the other, the machine code of the stencil of each
+// instruction (see stencils.c) and filling its holes with the operands and
+// the addresses of the code it continues at. Stencils hand anything but the
+// integer and float fast paths back to step().
+
+typedef void (*native_code)(Value *registers, MiniLuaState *mls);
+
+typedef enum {
+    HOLE_A, HOLE_B, HOLE_C,
+    HOLE_INST, HOLE_PC, HOLE_TABLE,
+    HOLE_CONTINUE, HOLE_SKIP, HOLE_JUMP,
+    HOLE_SYMBOL,
+} HoleKind;
+
+typedef struct {
+    size_t offset;    /* of the 64-bit immediate in the code */
+    HoleKind kind;
+    int64_t addend;
+    uintptr_t symbol; /* address of the function, for HOLE_SYMBOL */
+} StencilHole;
+
+typedef struct {
+    const unsigned char *code;
+    size_t size;
+    size_t fallthrough;  /* size without the final jump to CONTINUE, or 0 */
+    const StencilHole *holes;
+    size_t nholes;
+} Stencil;
+
+#include "stencils.h"
+
+static
+const Stencil * selectStencil(DInstruction *d)
+{
+    switch (d->handler) {
+        case OP_MOVE:    return &stencil_MOVE;
+        case OP_JMP:     return &stencil_JMP;
+        case OP_FORPREP: return &stencil_FORPREP;
+        case OP_FORLOOP: return &stencil_FORLOOP;
+        case OP_RETURN:  return d->b != 0 ? &stencil_RETURN : &stencil_STEP;
+
+#define SELECT_II(OP)    case OP_##OP##_I: return &stencil_##OP##_I;
+#define SELECT_FF(OP)    case OP_##OP##_F: return &stencil_##OP##_F;
+#define SELECT_II_FF(OP) SELECT_II(OP) SELECT_FF(OP)
+#define OPSPEC_ARITH(OP, INT, FLT, QUICK)                               \
+        case OP_##OP:                                                   \
+        case OP_##OP##_KI: return &stencil_##OP;                        \
+        SELECT_##QUICK(OP)
+#define OPSPEC_ARITH_FLOAT(OP, FLT)                                     \
+        case OP_##OP: return &stencil_##OP;
+#define OPSPEC_COMPARE(OP, INT, FLT, QUICK)                             \
+        case OP_##OP: return &stencil_##OP;                             \
+        case OP_##OP##_JMP: return &stencil_##OP##_JMP;                 \
+        SELECT_##QUICK(OP) SELECT_##QUICK(OP##_JMP)
+#define OPSPEC_EQUALITY(OP, INT, FLT, QUICK) OPSPEC_COMPARE(OP, INT, FLT, QUICK)
+#include "opcodes.def"
+#undef SELECT_II
+#undef SELECT_FF
+#undef SELECT_II_FF
+
+        default:         return &stencil_STEP;
+    }
+}
+
+static
+void compileProto(Proto *f)
+{
+    size_t n = f->sizecode;
+    const Stencil **stencils = calloc(n + 1, sizeof(Stencil *));
+    size_t *offsets = calloc(n + 1, sizeof(size_t));
+
+    // The jump to the next instruction is left out when its code follows
+    size_t size = 0;
+    for (size_t pc = 0; pc < n; pc++) {
+        const Stencil *s = selectStencil(&f->dcode[pc]);
+        stencils[pc] = s;
+        offsets[pc] = size;
+        size += (s->fallthrough && pc + 1 < n) ? s->fallthrough : s->size;
+    }
+
+    unsigned char *code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        error("could not allocate native code");
+    }
+    f->native = calloc(n + 1, sizeof(uintptr_t));
+    for (size_t pc = 0; pc < n; pc++) {
+        f->native[pc] = (uintptr_t) &code[offsets[pc]];
+    }
+
+    for (size_t pc = 0; pc < n; pc++) {
+        const Stencil *s = stencils[pc];
+        DInstruction *d = &f->dcode[pc];
+        unsigned char *dst = &code[offsets[pc]];
+        size_t copied = (s->fallthrough && pc + 1 < n) ? s->fallthrough : s->size;
+        memcpy(dst, s->code, copied);
+
+        for (size_t i = 0; i < s->nholes; i++) {
+            const StencilHole *h = &s->holes[i];
+            if (h->offset + 8 > copied) {
+                continue;  /* the dropped jump */
+            }
+            uint64_t value;
+            switch (h->kind) {
+                case HOLE_A:        value = (uint64_t) (int64_t) d->a; break;
+                case HOLE_B:        value = (uint64_t) (int64_t) d->b; break;
+                case HOLE_C:        value = (uint64_t) (int64_t) d->c; break;
+                case HOLE_INST:     value = (uintptr_t) d; break;
+                case HOLE_PC:       value = pc + 1; break;
+                case HOLE_TABLE:    value = (uintptr_t) f->native; break;
+                case HOLE_CONTINUE: value = f->native[pc + 1]; break;
+                case HOLE_SKIP:     value = pc + 2 <= n ? f->native[pc + 2] : 0; break;
+                case HOLE_JUMP:     value = f->native[d->target]; break;
+                case HOLE_SYMBOL:   value = h->symbol; break;
+                default:            error("bad stencil hole");
+            }
+            value += h->addend;
+            memcpy(&dst[h->offset], &value, sizeof(value));
+        }
+    }
+
+    if (mprotect(code, size, PROT_READ | PROT_EXEC) != 0) {
+        error("could not make native code executable");
+    }
+    if (perfEnabled()) {
+        for (size_t pc = 0; pc < n; pc++) {
+            size_t end = pc + 1 < n ? offsets[pc + 1] : size;
+            perfRegisterRange(f->source->str, f->linedefined, lua_opnames[f->dcode[pc].op],
+                              pc, pc, &code[offsets[pc]], end - offsets[pc]);
+        }
+    }
+    free(stencils);
+    free(offsets);
 }
 
 void interpret(MiniLuaState *mls)
 {
-    Value *constants = mls->proto->k;
+    Proto *f = mls->proto;
+    if (!f->native) {
+        compileProto(f);
+    }
+    native_code entry = (native_code) f->native[0];
+    entry(mls->registers, mls);
+}
+
+#elif defined(CONTEXT_THREADING)
+
+// Context-threaded code (make c-minilua-ct, x86-64 only). compileProto()
+// turns every Proto into native code that holds one call per instruction to
+// its handler, so each one gets a call site of its own, and the hardware
+// return stack predicts where it goes back to. JMP is a native jump, and
+// the next pc the other control flow handlers return becomes a compare and
+// a native branch at their call site, instead of the shared dispatch of
+// step().
+//
+// Handlers that may still be rewritten at run time (by quicken() or by a
+// FORPREP) are called through ctHandlers[inst->handler]; the rest are
+// called directly.
+
+typedef size_t (*ct_handler)(MiniLuaState *mls, DInstruction *inst, size_t pc);
+typedef void (*native_code)(MiniLuaState *mls);
+
+// room for the longest instruction: its call, a compare and two jumps
+#define CT_MAX_INST_SIZE  64
+
+// ct_MOVE, ct_ADD, ct_ADD_II, ...: stepAs() for each handler
+#define CT_HANDLER(name)                                                \
+static                                                                  \
+size_t ct_##name(MiniLuaState *mls, DInstruction *inst, size_t pc)      \
+{                                                                       \
+    return stepAs(mls, inst, pc, OP_##name);                            \
+}
+
+#define CT_II(OP)    CT_HANDLER(OP##_II) CT_HANDLER(OP##_I)
+#define CT_FF(OP)    CT_HANDLER(OP##_FF) CT_HANDLER(OP##_F)
+#define CT_II_FF(OP) CT_II(OP) CT_FF(OP)
+#define OPSPEC_ARITH(OP, INT, FLT, QUICK) \
+    CT_HANDLER(OP) CT_HANDLER(OP##_KI) CT_##QUICK(OP)
+#define OPSPEC_ARITH_FLOAT(OP, FLT) CT_HANDLER(OP)
+#define OPSPEC_COMPARE(OP, INT, FLT, QUICK) \
+    CT_HANDLER(OP) CT_HANDLER(OP##_JMP) CT_##QUICK(OP) CT_##QUICK(OP##_JMP)
+#define OPSPEC_EQUALITY(OP, INT, FLT, QUICK) OPSPEC_COMPARE(OP, INT, FLT, QUICK)
+#include "opcodes.def"
+#undef CT_II
+#undef CT_FF
+#undef CT_II_FF
+
+CT_HANDLER(MOVE)
+CT_HANDLER(LOADBOOL)
+CT_HANDLER(LOADNIL)
+CT_HANDLER(UNM)
+CT_HANDLER(NOT)
+CT_HANDLER(BAND)
+CT_HANDLER(BOR)
+CT_HANDLER(BXOR)
+CT_HANDLER(SHL)
+CT_HANDLER(SHR)
+CT_HANDLER(BNOT)
+CT_HANDLER(TEST)
+CT_HANDLER(TESTSET)
+CT_HANDLER(FORLOOP)
+CT_HANDLER(FORPREP)
+CT_HANDLER(FORLOOP_I)
+CT_HANDLER(FORLOOP_F)
+#undef CT_HANDLER
+
+// the unimplemented opcodes are left to step(), see initHandlers()
+static ct_handler ctHandlers[NUM_HANDLERS] = {
+    [OP_MOVE]      = ct_MOVE,
+    [OP_LOADBOOL]  = ct_LOADBOOL,
+    [OP_LOADNIL]   = ct_LOADNIL,
+    [OP_UNM]       = ct_UNM,
+    [OP_NOT]       = ct_NOT,
+    [OP_BAND]      = ct_BAND,
+    [OP_BOR]       = ct_BOR,
+    [OP_BXOR]      = ct_BXOR,
+    [OP_SHL]       = ct_SHL,
+    [OP_SHR]       = ct_SHR,
+    [OP_BNOT]      = ct_BNOT,
+    [OP_TEST]      = ct_TEST,
+    [OP_TESTSET]   = ct_TESTSET,
+    [OP_FORLOOP]   = ct_FORLOOP,
+    [OP_FORPREP]   = ct_FORPREP,
+    [OP_FORLOOP_I] = ct_FORLOOP_I,
+    [OP_FORLOOP_F] = ct_FORLOOP_F,
+#define CT_II(OP)    [OP_##OP##_II] = ct_##OP##_II, [OP_##OP##_I] = ct_##OP##_I,
+#define CT_FF(OP)    [OP_##OP##_FF] = ct_##OP##_FF, [OP_##OP##_F] = ct_##OP##_F,
+#define CT_II_FF(OP) CT_II(OP) CT_FF(OP)
+#define OPSPEC_ARITH(OP, INT, FLT, QUICK) \
+    [OP_##OP] = ct_##OP, [OP_##OP##_KI] = ct_##OP##_KI, CT_##QUICK(OP)
+#define OPSPEC_ARITH_FLOAT(OP, FLT) [OP_##OP] = ct_##OP,
+#define OPSPEC_COMPARE(OP, INT, FLT, QUICK) \
+    [OP_##OP] = ct_##OP, [OP_##OP##_JMP] = ct_##OP##_JMP, CT_##QUICK(OP) CT_##QUICK(OP##_JMP)
+#define OPSPEC_EQUALITY(OP, INT, FLT, QUICK) OPSPEC_COMPARE(OP, INT, FLT, QUICK)
+#include "opcodes.def"
+#undef CT_II
+#undef CT_FF
+#undef CT_II_FF
+};
+
+static
+void initHandlers(void)
+{
+    for (int h = 0; h < NUM_HANDLERS; h++) {
+        if (!ctHandlers[h]) {
+            ctHandlers[h] = step;
+        }
+    }
+}
+
+// Whether the handler of an instruction can change after load time
+static
+int isRewritten(Byte handler)
+{
+    switch (handler) {
+#define OPSPEC_ARITH(OP, INT, FLT, QUICK) \
+        case OP_##OP:
+#define OPSPEC_COMPARE(OP, INT, FLT, QUICK) \
+        case OP_##OP: case OP_##OP##_JMP:
+#define OPSPEC_EQUALITY(OP, INT, FLT, QUICK) OPSPEC_COMPARE(OP, INT, FLT, QUICK)
+#include "opcodes.def"
+        case OP_FORLOOP:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static
+void ctReturn(MiniLuaState *mls, DInstruction *inst)
+{
+    if (inst->b == 0) {
+        error("not implemented: OP_RETURN with b == 0");
+    }
+    mls->return_begin = inst->a;
+    mls->return_end   = inst->a + inst->b - 1;
+}
+
+// Native code being emitted, and its jumps to pcs not emitted yet
+typedef struct {
+    unsigned char *code;
+    size_t size;
+    size_t *jumps;   /* offsets of the rel32 of each jump */
+    Int *targets;    /* pc each jump goes to */
+    size_t njumps;
+} Emitter;
+
+static
+void emitBytes(Emitter *e, const char *bytes, size_t n)
+{
+    memcpy(&e->code[e->size], bytes, n);
+    e->size += n;
+}
+
+static
+void emitImm32(Emitter *e, uint32_t imm)
+{
+    memcpy(&e->code[e->size], &imm, sizeof(imm));
+    e->size += sizeof(imm);
+}
+
+static
+void emitImm64(Emitter *e, uint64_t imm)
+{
+    memcpy(&e->code[e->size], &imm, sizeof(imm));
+    e->size += sizeof(imm);
+}
+
+// jmp or jcc (opcode) to the code of target, patched by compileProto()
+static
+void emitJump(Emitter *e, const char *opcode, size_t n, Int target)
+{
+    emitBytes(e, opcode, n);
+    e->jumps[e->njumps] = e->size;
+    e->targets[e->njumps] = target;
+    e->njumps++;
+    emitImm32(e, 0);
+}
+
+// A direct call when fn is within reach of a rel32, else through %rax
+static
+void emitCall(Emitter *e, uintptr_t fn)
+{
+    intptr_t rel = (intptr_t) fn - (intptr_t) &e->code[e->size + 5];
+    if (rel == (int32_t) rel) {
+        emitBytes(e, "\xe8", 1);                 /* call rel32 */
+        emitImm32(e, (uint32_t) rel);
+    } else {
+        emitBytes(e, "\x48\xb8", 2);             /* movabs $fn, %rax */
+        emitImm64(e, fn);
+        emitBytes(e, "\xff\xd0", 2);             /* call *%rax */
+    }
+}
+
+// handler(mls, inst, pc + 1), the next pc is left in %rax
+static
+void emitHandlerCall(Emitter *e, DInstruction *d, size_t pc)
+{
+    emitBytes(e, "\x48\x89\xdf", 3);             /* mov %rbx, %rdi */
+    emitBytes(e, "\x48\xbe", 2);                 /* movabs $d, %rsi */
+    emitImm64(e, (uintptr_t) d);
+    emitBytes(e, "\xba", 1);                     /* mov $pc+1, %edx */
+    emitImm32(e, (uint32_t) (pc + 1));
+    if (isRewritten(d->handler)) {
+        emitBytes(e, "\x0f\xb6\x46", 3);         /* movzbl handler(%rsi), %eax */
+        emitBytes(e, (const char[]) { offsetof(DInstruction, handler) }, 1);
+        emitBytes(e, "\x48\xb9", 2);             /* movabs $ctHandlers, %rcx */
+        emitImm64(e, (uintptr_t) ctHandlers);
+        emitBytes(e, "\xff\x14\xc1", 3);         /* call *(%rcx,%rax,8) */
+    } else {
+        emitCall(e, (uintptr_t) ctHandlers[d->handler]);
+    }
+}
+
+// je to the code of target when the handler returned it
+static
+void emitBranchIf(Emitter *e, Int target)
+{
+    emitBytes(e, "\x48\x3d", 2);                 /* cmp $target, %rax */
+    emitImm32(e, (uint32_t) target);
+    emitJump(e, "\x0f\x84", 2, target);          /* je target */
+}
+
+static
+void compileProto(Proto *f)
+{
+    size_t n = f->sizecode;
+    size_t capacity = 16 + n * CT_MAX_INST_SIZE;
+
+    // placed close to the handlers, so they can be called directly
+    void *hint = (void *) (((uintptr_t) &step + (1 << 30)) & ~(uintptr_t) 0xfff);
+    Emitter e = { 0 };
+    e.code = mmap(hint, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (e.code == MAP_FAILED) {
+        error("could not allocate native code");
+    }
+    e.jumps = calloc(2 * n, sizeof(size_t));
+    e.targets = calloc(2 * n, sizeof(Int));
+    f->native = calloc(n + 1, sizeof(uintptr_t));
+
+    // the entry point, native[n]: %rbx holds mls, and pushing it also aligns
+    // the stack for the calls
+    f->native[n] = (uintptr_t) e.code;
+    emitBytes(&e, "\x53", 1);                    /* push %rbx */
+    emitBytes(&e, "\x48\x89\xfb", 3);            /* mov %rdi, %rbx */
+
+    for (size_t pc = 0; pc < n; pc++) {
+        DInstruction *d = &f->dcode[pc];
+        f->native[pc] = (uintptr_t) &e.code[e.size];
+
+        switch (d->handler) {
+            case OP_RETURN:
+                emitBytes(&e, "\x48\x89\xdf", 3);        /* mov %rbx, %rdi */
+                emitBytes(&e, "\x48\xbe", 2);            /* movabs $d, %rsi */
+                emitImm64(&e, (uintptr_t) d);
+                emitCall(&e, (uintptr_t) ctReturn);
+                emitBytes(&e, "\x5b\xc3", 2);            /* pop %rbx; ret */
+                break;
+
+            case OP_JMP:
+                emitJump(&e, "\xe9", 1, d->target);
+                break;
+
+            case OP_EXTRAARG:
+                break;
+
+            case OP_FORPREP:
+                emitHandlerCall(&e, d, pc);
+                emitJump(&e, "\xe9", 1, d->target);
+                break;
+
+            case OP_FORLOOP:
+            case OP_FORLOOP_I:
+            case OP_FORLOOP_F:
+                emitHandlerCall(&e, d, pc);
+                emitBranchIf(&e, d->target);
+                break;
+
+            case OP_LOADBOOL:
+                emitHandlerCall(&e, d, pc);
+                if (d->c) {
+                    emitJump(&e, "\xe9", 1, pc + 2);
+                }
+                break;
+
+            case OP_EQ_JMP:
+            case OP_LT_JMP:
+            case OP_LE_JMP:
+            case OP_EQ_JMP_I:
+            case OP_LT_JMP_I:
+            case OP_LE_JMP_I:
+            case OP_LT_JMP_F:
+            case OP_LE_JMP_F:
+                // either target or the instruction after the fused JMP
+                emitHandlerCall(&e, d, pc);
+                emitBranchIf(&e, d->target);
+                emitJump(&e, "\xe9", 1, pc + 2);
+                break;
+
+            case OP_EQ:
+            case OP_LT:
+            case OP_LE:
+            case OP_EQ_I:
+            case OP_LT_I:
+            case OP_LE_I:
+            case OP_LT_F:
+            case OP_LE_F:
+            case OP_TEST:
+            case OP_TESTSET:
+                emitHandlerCall(&e, d, pc);
+                emitBranchIf(&e, pc + 2);
+                break;
+
+            default:
+                emitHandlerCall(&e, d, pc);
+                break;
+        }
+    }
+
+    for (size_t i = 0; i < e.njumps; i++) {
+        if (e.targets[i] < 0 || (size_t) e.targets[i] >= n) {
+            error("jump out of the code");
+        }
+        int32_t rel = (int32_t) (f->native[e.targets[i]] - (uintptr_t) &e.code[e.jumps[i] + 4]);
+        memcpy(&e.code[e.jumps[i]], &rel, sizeof(rel));
+    }
+
+    if (mprotect(e.code, capacity, PROT_READ | PROT_EXEC) != 0) {
+        error("could not make native code executable");
+    }
+    if (perfEnabled()) {
+        char name[256];
+        snprintf(name, sizeof(name), "%s:%d entry", f->source->str, f->linedefined);
+        perfRegister(name, e.code, f->native[0] - (uintptr_t) e.code);
+        for (size_t pc = 0; pc < n; pc++) {
+            uintptr_t end = pc + 1 < n ? f->native[pc + 1] : (uintptr_t) &e.code[e.size];
+            perfRegisterRange(f->source->str, f->linedefined, lua_opnames[f->dcode[pc].op],
+                              pc, pc, (const void *) f->native[pc], end - f->native[pc]);
+        }
+    }
+    free(e.jumps);
+    free(e.targets);
+}
+
+void interpret(MiniLuaState *mls)
+{
+    Proto *f = mls->proto;
+    if (!f->native) {
+        initHandlers();
+        compileProto(f);
+    }
+    native_code entry = (native_code) f->native[f->sizecode];
+    entry(mls);
+}
+
+#elif !defined(COMPUTED_GOTO)
+
+void interpret(MiniLuaState *mls)
+{
+    DInstruction *code = mls->proto->dcode;
 
     size_t pc = 0;
     while (1) {
 
-        Instruction inst = mls->proto->code[pc++];
-        uint32_t op = OP(inst);
+        DInstruction *inst = &code[pc++];
 
-        if (op == OP_RETURN) {
-            uint32_t a = A(inst);
-            uint32_t b = B(inst);
-            if (b == 0) {
+        if (inst->handler == OP_RETURN) {
+            if (inst->b == 0) {
                 error("not implemented: OP_RETURN with b == 0");
             }
-            mls->return_begin = a;
-            mls->return_end   = a + b - 1;
+            mls->return_begin = inst->a;
+            mls->return_end   = inst->a + inst->b - 1;
             return;
         }
         
-        pc += step(mls, inst, op, constants);
+        pc = step(mls, inst, pc);
     }
     
     return;
 }
+
+#else
+
+// Direct-threaded interpreter (GNU C labels as values). Every handler ends
+// with its own fetch and dispatch, so each opcode gets a separate indirect
+// branch instead of the single one behind step()'s switch.
+// Build with -DCOMPUTED_GOTO (make c-minilua-threaded).
+
+#undef R
+#define R(n) &registers[n]
+
+#define DISPATCH() do {                 \
+        inst = pc++;                    \
+        goto *dispatch[inst->handler];  \
+    } while (0)
+
+void interpret(MiniLuaState *mls)
+{
+    static void *dispatch[NUM_HANDLERS] = {
+        [OP_MOVE]     = &&op_MOVE,
+        [OP_LOADK]    = &&op_MOVE,
+        [OP_LOADKX]   = &&op_MOVE,
+        [OP_LOADBOOL] = &&op_LOADBOOL,
+        [OP_LOADNIL]  = &&op_LOADNIL,
+        [OP_GETUPVAL] = &&op_unimplemented,
+        [OP_GETTABUP] = &&op_unimplemented,
+        [OP_GETTABLE] = &&op_unimplemented,
+        [OP_SETTABUP] = &&op_unimplemented,
+        [OP_SETUPVAL] = &&op_unimplemented,
+        [OP_SETTABLE] = &&op_unimplemented,
+        [OP_NEWTABLE] = &&op_unimplemented,
+        [OP_SELF]     = &&op_unimplemented,
+        [OP_ADD]      = &&op_ADD,
+        [OP_SUB]      = &&op_SUB,
+        [OP_MUL]      = &&op_MUL,
+        [OP_MOD]      = &&op_MOD,
+        [OP_POW]      = &&op_POW,
+        [OP_DIV]      = &&op_DIV,
+        [OP_IDIV]     = &&op_IDIV,
+        [OP_BAND]     = &&op_BAND,
+        [OP_BOR]      = &&op_BOR,
+        [OP_BXOR]     = &&op_BXOR,
+        [OP_SHL]      = &&op_SHL,
+        [OP_SHR]      = &&op_SHR,
+        [OP_UNM]      = &&op_UNM,
+        [OP_BNOT]     = &&op_BNOT,
+        [OP_NOT]      = &&op_NOT,
+        [OP_LEN]      = &&op_unimplemented,
+        [OP_CONCAT]   = &&op_unimplemented,
+        [OP_JMP]      = &&op_JMP,
+        [OP_EQ]       = &&op_EQ,
+        [OP_LT]       = &&op_LT,
+        [OP_LE]       = &&op_LE,
+        [OP_TEST]     = &&op_TEST,
+        [OP_TESTSET]  = &&op_TESTSET,
+        [OP_CALL]     = &&op_unimplemented,
+        [OP_TAILCALL] = &&op_unimplemented,
+        [OP_RETURN]   = &&op_RETURN,
+        [OP_FORLOOP]  = &&op_FORLOOP,
+        [OP_FORPREP]  = &&op_FORPREP,
+        [OP_TFORCALL] = &&op_unimplemented,
+        [OP_TFORLOOP] = &&op_unimplemented,
+        [OP_SETLIST]  = &&op_unimplemented,
+        [OP_CLOSURE]  = &&op_unimplemented,
+        [OP_VARARG]   = &&op_unimplemented,
+        [OP_EXTRAARG] = &&op_EXTRAARG,
+        [OP_EQ_JMP]  = &&op_EQ_JMP,
+        [OP_LT_JMP]  = &&op_LT_JMP,
+        [OP_LE_JMP]  = &&op_LE_JMP,
+        [OP_ADD_KI]  = &&op_ADD_KI,
+        [OP_SUB_KI]  = &&op_SUB_KI,
+        [OP_MUL_KI]  = &&op_MUL_KI,
+        [OP_MOD_KI]  = &&op_MOD_KI,
+        [OP_IDIV_KI] = &&op_IDIV_KI,
+#define QUICK_II(OP)    [OP_##OP##_II] = &&op_##OP##_II, [OP_##OP##_I] = &&op_##OP##_I,
+#define QUICK_FF(OP)    [OP_##OP##_FF] = &&op_##OP##_FF, [OP_##OP##_F] = &&op_##OP##_F,
+#define QUICK_II_FF(OP) QUICK_II(OP) QUICK_FF(OP)
+#define OPSPEC_ARITH(OP, INT, FLT, QUICK)    QUICK_##QUICK(OP)
+#define OPSPEC_COMPARE(OP, INT, FLT, QUICK)  QUICK_##QUICK(OP) QUICK_##QUICK(OP##_JMP)
+#define OPSPEC_EQUALITY(OP, INT, FLT, QUICK) QUICK_##QUICK(OP) QUICK_##QUICK(OP##_JMP)
+#include "opcodes.def"
+#undef QUICK_II
+#undef QUICK_FF
+#undef QUICK_II_FF
+        [OP_FORLOOP_I] = &&op_FORLOOP_I,
+        [OP_FORLOOP_F] = &&op_FORLOOP_F,
+    };
+
+    DInstruction *code = mls->proto->dcode;
+    DInstruction *pc = code;
+    Value *registers = mls->registers;
+    DInstruction *inst;
+
+    DISPATCH();
+
+    op_MOVE: {
+        // R(A) := R(B), also LOADK: R(A) := K(Bx)
+        Value *a = R(inst->a);
+        Value *b = R(inst->b);
+        *a = *b;
+    } DISPATCH();
+
+#define HANDLER(name)   op_##name:
+#define NEXT()          DISPATCH()
+#define DEOPT(generic)  do { inst->handler = OP_##generic; goto op_##generic; } while (0)
+#define SKIP()          pc++
+#define JUMP()          pc = code + inst->target
+#define OPSPEC_ARITH(OP, INT, FLT, QUICK)    GEN_HANDLERS_ARITH(OP, INT, FLT, QUICK)
+#define OPSPEC_ARITH_FLOAT(OP, FLT)          GEN_ARITH_FLOAT(OP)
+#define OPSPEC_COMPARE(OP, INT, FLT, QUICK)  GEN_HANDLERS_COMPARE(OP, INT, FLT, QUICK)
+#define OPSPEC_EQUALITY(OP, INT, FLT, QUICK) GEN_HANDLERS_COMPARE(OP, INT, FLT, QUICK)
+#include "opcodes.def"
+#undef HANDLER
+#undef NEXT
+#undef DEOPT
+#undef SKIP
+#undef JUMP
+
+    op_UNM: {
+        Value *a = R(inst->a);
+        Value *b = R(inst->b);
+        vm_UNM(a, b);
+    } DISPATCH();
+
+    op_NOT: {
+        Value *a = R(inst->a);
+        Value *b = R(inst->b);
+        vm_NOT(a, b);
+    } DISPATCH();
+
+    op_LOADBOOL: {
+        set_bool(R(inst->a), inst->b);
+        if (inst->c) {
+            pc++;
+        }
+    } DISPATCH();
+
+    op_LOADNIL: {
+        vm_LOADNIL(R(inst->a), inst->b);
+    } DISPATCH();
+
+    op_BAND: {
+        Value *a = R(inst->a);
+        Value *b = R(inst->b);
+        Value *c = R(inst->c);
+        vm_BAND(a,b,c);
+    } DISPATCH();
+
+    op_BOR: {
+        Value *a = R(inst->a);
+        Value *b = R(inst->b);
+        Value *c = R(inst->c);
+        vm_BOR(a,b,c);
+    } DISPATCH();
+
+    op_BXOR: {
+        Value *a = R(inst->a);
+        Value *b = R(inst->b);
+        Value *c = R(inst->c);
+        vm_BXOR(a,b,c);
+    } DISPATCH();
+
+    op_SHL: {
+        Value *a = R(inst->a);
+        Value *b = R(inst->b);
+        Value *c = R(inst->c);
+        vm_SHL(a,b,c);
+    } DISPATCH();
+
+    op_SHR: {
+        Value *a = R(inst->a);
+        Value *b = R(inst->b);
+        Value *c = R(inst->c);
+        vm_SHR(a,b,c);
+    } DISPATCH();
+
+    op_BNOT: {
+        Value *a = R(inst->a);
+        Value *b = R(inst->b);
+        vm_BNOT(a, b);
+    } DISPATCH();
+
+    op_TEST: {
+        Value *a = R(inst->a);
+        if (isTruthy(a) != inst->c) {
+            pc++;
+        }
+    } DISPATCH();
+
+    op_TESTSET: {
+        Value *a = R(inst->a);
+        Value *b = R(inst->b);
+        if (isTruthy(b) != inst->c) {
+            pc++;
+        } else {
+            *a = *b;
+        }
+    } DISPATCH();
+
+    op_EXTRAARG: {
+        // argument of the LOADKX before it, already decoded there
+    } DISPATCH();
+
+    op_JMP: {
+        // if (a) close upvalues;
+        pc = code + inst->target;
+    } DISPATCH();
+
+    op_FORLOOP: {
+        Value *init  = R(inst->a + 0);
+        Value *limit = R(inst->a + 1);
+        Value *step  = R(inst->a + 2);
+        Value *var   = R(inst->a + 3);
+
+        vm_ADD(init, init, step);
+        if (vm_LE(init, limit)) {
+            pc = code + inst->target;
+            *var = *init;
+        }
+    } DISPATCH();
+
+    op_FORPREP: {
+        Value *init  = R(inst->a + 0);
+        Value *limit = R(inst->a + 1);
+        Value *step  = R(inst->a + 2);
+
+        code[inst->target].handler = forPrep(init, limit, step);
+        pc = code + inst->target;
+    } DISPATCH();
+
+    op_FORLOOP_I: {
+        Value *init  = R(inst->a + 0);
+        Value *count = R(inst->a + 1);
+        Value *step  = R(inst->a + 2);
+        Value *var   = R(inst->a + 3);
+
+        if (count->u.i != 0) {
+            count->u.i = (lua_integer) ((uint64_t) count->u.i - 1);
+            init->u.i = (lua_integer) ((uint64_t) init->u.i + (uint64_t) step->u.i);
+            set_int(var, init->u.i);
+            pc = code + inst->target;
+        }
+    } DISPATCH();
+
+    op_FORLOOP_F: {
+        Value *init  = R(inst->a + 0);
+        Value *limit = R(inst->a + 1);
+        Value *step  = R(inst->a + 2);
+        Value *var   = R(inst->a + 3);
+
+        init->u.n += step->u.n;
+        if (init->u.n <= limit->u.n) {
+            set_float(var, init->u.n);
+            pc = code + inst->target;
+        }
+    } DISPATCH();
+
+    op_RETURN: {
+        if (inst->b == 0) {
+            error("not implemented: OP_RETURN with b == 0");
+        }
+        mls->return_begin = inst->a;
+        mls->return_end   = inst->a + inst->b - 1;
+        return;
+    }
+
+    op_unimplemented:
+        fprintf(stderr, "Opcode %s is not implemented yet\n", lua_opnames[inst->op]);
+        exit(1);
+}
+
+#undef DISPATCH
+
+#endif
 //
 
 
@@ -1310,10 +2528,7 @@ int main(int argc, char **argv)
     
     MiniLuaState *mls = calloc(1, sizeof(MiniLuaState));
     mls->proto = loadChunkBytecode(F);
-    mls->registers = calloc(mls->proto->maxstacksize, sizeof(Value));
-    for (int i = 0; i < mls->proto->maxstacksize; i++) {
-        set_nil(&mls->registers[i]);
-    }
+    mls->registers = newFrame(mls->proto);
     mls->return_begin = 0;
     mls->return_end = 0;
     
@@ -0,0 +1,7 @@
+local a = true
+local b = true
+local c = 0
+if a == b then c = c + 1 end
+local d = false
+if a == d then c = c + 10 end
+return c
@@ -33,6 +33,18 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef AOT_DLOPEN
+#include <dlfcn.h>
+#endif
+
+// error() and error_default() are cold and noreturn, so the compiler lays
+// out every path into them out of line
+#if defined(__GNUC__)
+#define COLD        __attribute__((cold))
+#else
+#define COLD
+#endif
+
 // magic constants
 #define LUA_SIGNATURE "\x1bLua"
 #define LUA_VERSION 0x53
@@ -112,6 +124,7 @@ typedef struct Proto {
     Int lastlinedefined;  /* debug information  */
     Value *k;  /* constants used by the function */
     Instruction *code;  /* opcodes */
+    Byte *types;  /* register types before each pc, see inferTypes() */
     //struct Proto **p;  /* functions defined inside the function */
     //int *lineinfo;  /* map from opcodes to source lines (debug information) */
     //LocVar *locvars;  /* information about local variables (debug information) */
@@ -389,6 +402,30 @@ OP_EXTRAARG   = 46, /*  Ax      extra (larger) argument for previous opcode
 
 #define NUM_OPCODES     (1 + ((int) OP_EXTRAARG))
 
+// Superinstructions written into the code array by fuseCode. They take the
+// free opcode numbers after OP_EXTRAARG, so both step_in_C and the LLVM step
+// see them as ordinary instructions.
+enum {
+OP_EQ_JMP     = 47, /*  A B C   if ((RK(B) == RK(C)) == A&1) then pc+=sJ+1 else pc++  */
+OP_LT_JMP     = 48, /*  A B C   if ((RK(B) <  RK(C)) == A&1) then pc+=sJ+1 else pc++  */
+OP_LE_JMP     = 49, /*  A B C   if ((RK(B) <= RK(C)) == A&1) then pc+=sJ+1 else pc++  */
+OP_ADD_KI     = 50, /*  A B C   R(A) := RK(B) + K(C), K(C) is an integer                */
+OP_SUB_KI     = 51, /*  A B C   R(A) := RK(B) - K(C), K(C) is an integer                */
+OP_MUL_KI     = 52, /*  A B C   R(A) := RK(B) * K(C), K(C) is an integer                */
+OP_MOD_KI     = 53, /*  A B C   R(A) := RK(B) % K(C), K(C) is an integer                */
+OP_IDIV_KI    = 54, /*  A B C   R(A) := RK(B) // K(C), K(C) is an integer               */
+};
+
+// A compare-and-jump keeps the compare's A in bit 0 of its A field and the
+// sBx of the following JMP (sJ) in the other 7 bits, in excess-MAXARG_sJ.
+#define MAXARG_sJ       63
+
+static inline
+int32_t sJ(Instruction instr)
+{
+    return (int32_t) (A(instr) >> 1) - MAXARG_sJ;
+}
+
 /*===========================================================================
   Notes:
   (*) In OP_CALL, if (B == 0) then B = top. If (C == 0), then 'top' is
@@ -541,6 +578,7 @@ const Byte lua_opmodes[] = {
 
 #define EOF_ERROR "unexpected end of file"
 //
+COLD _Noreturn
 void error_default() {
     fprintf(stderr, "Error\n");
     exit(1);
@@ -577,7 +615,7 @@ void error_6() {
 }
 //
 
-static
+static COLD _Noreturn
 void error(const char *msg)
 {
     fprintf(stderr, "%s\n", msg);
@@ -654,7 +692,7 @@ String * loadString(FILE * F)
 
         char * buff = calloc(size, 1);
         loadVector(F, buff, 1, size-1);
-        buff[size] = '\0';
+        buff[size-1] = '\0';
 
         String *string = calloc(1, sizeof(String));
         string->typ = LONG_STRING;
@@ -699,6 +737,57 @@ void loadValue(FILE *F, Value *v)
     }
 }
 
+#include "typeinfer.h"
+
+// Rewrites common sequences of f->code into superinstructions:
+//  - EQ/LT/LE followed by a JMP become one compare-and-jump, when the jump
+//    fits in sJ. The JMP stays in place, it is just skipped over.
+//  - Arithmetic with an integer constant as C skips the type test on C.
+static
+void fuseCode(Proto *f)
+{
+    for (int pc = 0; pc < f->sizecode; pc++) {
+        Instruction instr = f->code[pc];
+        uint32_t op = OP(instr);
+        uint32_t fused = op;
+        uint32_t a = A(instr);
+
+        switch (op) {
+            case OP_EQ:
+            case OP_LT:
+            case OP_LE: {
+                if (pc + 1 >= f->sizecode) break;
+                Instruction next = f->code[pc + 1];
+                int32_t sbx = sBx(next);
+                // JMP with A != 0 also closes upvalues
+                if (OP(next) == OP_JMP && A(next) == 0 &&
+                    sbx >= -MAXARG_sJ && sbx <= MAXARG_sJ + 1) {
+                    fused = OP_EQ_JMP + (op - OP_EQ);
+                    a = ((sbx + MAXARG_sJ) << 1) | a;
+                }
+            } break;
+
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_MOD:
+            case OP_IDIV: {
+                uint32_t c = C(instr);
+                if (ISK(c) && f->k[INDEXK(c)].typ == LUA_TNUMINT) {
+                    switch (op) {
+#define OPSPEC_ARITH(OP, INT, FLT, QUICK) \
+                        case OP_##OP: fused = OP_##OP##_KI; break;
+#include "opcodes.def"
+                    }
+                }
+            } break;
+        }
+
+        f->code[pc] = (instr & ~((MAXARG_A << POS_A) | (0x3F << POS_OP)))
+                    | (a << POS_A) | (fused << POS_OP);
+    }
+}
+
 static
 Proto * loadFunction(FILE *F, String *parent_source)
 {
@@ -764,6 +853,13 @@ Proto * loadFunction(FILE *F, String *parent_source)
         // TODO
     }
 
+    inferTypes(f);
+    if (getenv("MINILUA_TYPES")) {
+        printTypes(f);
+    }
+
+    fuseCode(f);
+
     return f;
 }
 
@@ -792,6 +888,26 @@ Proto * loadChunkBytecode(FILE *F)
     return f;
 }
 
+// FNV-1a over the instructions and constants of f. Ties a chunk compiled
+// ahead of time (see aot.cpp) to the bytecode it was compiled from.
+uint64_t codeHash(Proto *f)
+{
+    uint64_t h = 0xcbf29ce484222325u;
+    const Byte *code = (const Byte *) f->code;
+    for (size_t i = 0; i < f->sizecode * sizeof(Instruction); i++) {
+        h = (h ^ code[i]) * 0x100000001b3u;
+    }
+    for (int i = 0; i < f->sizek; i++) {
+        Value *k = &f->k[i];
+        const Byte *payload = (const Byte *) &k->u;
+        h = (h ^ (Byte) k->typ) * 0x100000001b3u;
+        for (size_t j = 0; j < sizeof(k->u); j++) {
+            h = (h ^ payload[j]) * 0x100000001b3u;
+        }
+    }
+    return h;
+}
+
 #define MYK(x)          (-1-(x))
 void printInstruction(Instruction instr)
 {
@@ -908,150 +1024,149 @@ int isTruthy(Value *v) {
 
 
 
-void vm_ADD(Value *out, Value *v1, Value *v2)
-{
-    if (isNumerical(v1) && isNumerical(v2)) {
-        if (v1->typ == LUA_TNUMINT && v2->typ == LUA_TNUMINT) {
-            lua_integer i1 = v1->u.i;
-            lua_integer i2 = v2->u.i;
-            set_int(out, i1 + i2);
-        } else {
-            lua_float n1 = castToFloat(v1);
-            lua_float n2 = castToFloat(v2);
-            set_float(out, n1 + n2);
-        }
-    } else {
-        error("type error - vm_ADD");
-        assert(0);
-    }
+// Primitives of opcodes.def
+#define INT_ADD(x, y)       ((x) + (y))
+#define INT_SUB(x, y)       ((x) - (y))
+#define INT_MUL(x, y)       ((x) * (y))
+#define INT_REM(x, y)       ((x) % (y))
+#define INT_QUOT(x, y)      ((x) / (y))
+#define INT_EQ(x, y)        ((x) == (y))
+#define INT_LT(x, y)        ((x) < (y))
+#define INT_LE(x, y)        ((x) <= (y))
+
+#define FLT_ADD(x, y)       ((x) + (y))
+#define FLT_SUB(x, y)       ((x) - (y))
+#define FLT_MUL(x, y)       ((x) * (y))
+#define FLT_DIV(x, y)       ((x) / (y))
+#define FLT_FMOD(x, y)      fmod((x), (y))
+#define FLT_FLOORDIV(x, y)  floor((x) / (y))
+#define FLT_POW(x, y)       pow((x), (y))
+#define FLT_EQ(x, y)        ((x) == (y))
+#define FLT_LT(x, y)        ((x) < (y))
+#define FLT_LE(x, y)        ((x) <= (y))
+
+// vm_ADD, vm_SUB, ...
+#define OPSPEC_ARITH(OP, INT, FLT, QUICK)                               \
+static                                                                  \
+void vm_##OP(Value *out, Value *v1, Value *v2)                          \
+{                                                                       \
+    if (isNumerical(v1) && isNumerical(v2)) {                           \
+        if (v1->typ == LUA_TNUMINT && v2->typ == LUA_TNUMINT) {         \
+            set_int(out, INT_##INT(v1->u.i, v2->u.i));                  \
+        } else {                                                        \
+            set_float(out, FLT_##FLT(castToFloat(v1), castToFloat(v2)));\
+        }                                                               \
+    } else {                                                            \
+        error("type error - vm_" #OP);                                  \
+        assert(0);                                                      \
+    }                                                                   \
+}
+
+#define OPSPEC_ARITH_FLOAT(OP, FLT)                                     \
+static                                                                  \
+void vm_##OP(Value *out, Value *v1, Value *v2)                          \
+{                                                                       \
+    if (isNumerical(v1) && isNumerical(v2)) {                           \
+        set_float(out, FLT_##FLT(castToFloat(v1), castToFloat(v2)));    \
+    } else {                                                            \
+        error("type error - vm_" #OP);                                  \
+        assert(0);                                                      \
+    }                                                                   \
 }
 
+#include "opcodes.def"
+
 static
-void vm_SUB(Value *out, Value *v1, Value *v2)
+void vm_UNM(Value *out, Value *v1)
 {
-    if (isNumerical(v1) && isNumerical(v2)) {
-        if (v1->typ == LUA_TNUMINT && v2->typ == LUA_TNUMINT) {
-            lua_integer i1 = v1->u.i;
-            lua_integer i2 = v2->u.i;
-            set_int(out, i1 - i2);
-        } else {
-            lua_float n1 = castToFloat(v1);
-            lua_float n2 = castToFloat(v2);
-            set_float(out, n1 - n2);
-        }
+    if (v1->typ == LUA_TNUMINT) {
+        set_int(out, - v1->u.i);
+    } else if (v1->typ == LUA_TNUMFLT) {
+        set_float(out, - v1->u.n);
     } else {
-        error("type error - vm_SUB");
+        error("type error - vm_UNM");
         assert(0);
     }
 }
 
 static
-void vm_MUL(Value *out, Value *v1, Value *v2)
+void vm_NOT(Value *out, Value *v1)
 {
-    if (isNumerical(v1) && isNumerical(v2)) {
-        if (v1->typ == LUA_TNUMINT && v2->typ == LUA_TNUMINT) {
-            lua_integer i1 = v1->u.i;
-            lua_integer i2 = v2->u.i;
-            set_int(out, i1 * i2);
-        } else {
-            lua_float n1 = castToFloat(v1);
-            lua_float n2 = castToFloat(v2);
-            set_float(out, n1 * n2);
-        }
-    } else {
-        error("type error");
-        error("vm_MUL");
-        assert(0);
-    }
+    set_bool(out, !isTruthy(v1));
 }
 
+// Operand of a bitwise operation: an integer, or a float with an exact
+// integer representation.
 static
-void vm_DIV(Value *out, Value *v1, Value *v2)
+lua_integer castToInteger(Value *v)
 {
-    // Float division (always with floats)
-
-    if (isNumerical(v1) && isNumerical(v2)) {
-        lua_float n1 = castToFloat(v1);
-        lua_float n2 = castToFloat(v2);
-        set_float(out, n1 / n2);
+    if (v->typ == LUA_TNUMINT) {
+        return v->u.i;
+    } else if (v->typ == LUA_TNUMFLT && floor(v->u.n) == v->u.n
+               && v->u.n >= -0x1p63 && v->u.n < 0x1p63) {
+        return (lua_integer) v->u.n;
     } else {
-        error("type error - vm_DIV");
+        error("number has no integer representation");
         assert(0);
     }
 }
 
+// x << y as in luaV_shiftl: a negative y shifts right (logically) and
+// shifting by 64 bits or more gives 0.
 static
-void vm_MOD(Value *out, Value *v1, Value *v2)
+lua_integer shiftLeft(lua_integer x, lua_integer y)
 {
-    if (isNumerical(v1) && isNumerical(v2)) {
-        if (v1->typ == LUA_TNUMINT && v2->typ == LUA_TNUMINT) {
-            lua_integer i1 = v1->u.i;
-            lua_integer i2 = v2->u.i;
-            set_int(out, i1 % i2);
-        } else {
-            lua_float n1 = castToFloat(v1);
-            lua_float n2 = castToFloat(v2);
-            set_float(out, fmod(n1, n2));
-        }
+    if (y < 0) {
+        if (y <= -64) return 0;
+        return (lua_integer) ((uint64_t) x >> -y);
     } else {
-        error("type error - vm_MOD");
-        assert(0);
+        if (y >= 64) return 0;
+        return (lua_integer) ((uint64_t) x << y);
     }
+}
 
+static
+void vm_BAND(Value *out, Value *v1, Value *v2)
+{
+    set_int(out, castToInteger(v1) & castToInteger(v2));
 }
 
+static
+void vm_BOR(Value *out, Value *v1, Value *v2)
+{
+    set_int(out, castToInteger(v1) | castToInteger(v2));
+}
 
 static
-void vm_IDIV(Value *out, Value *v1, Value *v2)
+void vm_BXOR(Value *out, Value *v1, Value *v2)
 {
-    if (isNumerical(v1) && isNumerical(v2)) {
-        if (v1->typ == LUA_TNUMINT && v2->typ == LUA_TNUMINT) {
-            lua_integer i1 = v1->u.i;
-            lua_integer i2 = v2->u.i;
-            set_int(out, i1 / i2);
-        } else {
-            lua_float n1 = castToFloat(v1);
-            lua_float n2 = castToFloat(v2);
-            set_float(out, floor(n1/n2));
-        }
-    } else {
-        error("type error - vm_IDIV");
-        assert(0);
-    }
+    set_int(out, castToInteger(v1) ^ castToInteger(v2));
 }
 
 static
-void vm_POW(Value *out, Value *v1, Value *v2)
+void vm_SHL(Value *out, Value *v1, Value *v2)
 {
-    // Float division (always with floats)
+    set_int(out, shiftLeft(castToInteger(v1), castToInteger(v2)));
+}
 
-    if (isNumerical(v1) && isNumerical(v2)) {
-        lua_float n1 = castToFloat(v1);
-        lua_float n2 = castToFloat(v2);
-        set_float(out, pow(n1, n2));
-    } else {
-        error("type error - vm_POW");
-        assert(0);
-    }
+static
+void vm_SHR(Value *out, Value *v1, Value *v2)
+{
+    set_int(out, shiftLeft(castToInteger(v1), - (uint64_t) castToInteger(v2)));
 }
 
 static
-void vm_UNM(Value *out, Value *v1)
+void vm_BNOT(Value *out, Value *v1)
 {
-    if (v1->typ == LUA_TNUMINT) {
-        set_int(out, - v1->u.i);
-    } else if (v1->typ == LUA_TNUMFLT) {
-        set_float(out, - v1->u.n);
-    } else {
-        error("type error - vm_UNM");
-        assert(0);
-    }
+    set_int(out, ~castToInteger(v1));
 }
 
 static
-void vm_NOT(Value *out, Value *v1)
+void vm_LOADNIL(Value *first, uint32_t n)
 {
-    set_bool(out, !isTruthy(v1));
+    for (uint32_t i = 0; i <= n; i++) {
+        set_nil(&first[i]);
+    }
 }
 
 static
@@ -1064,7 +1179,7 @@ uint32_t vm_EQ(Value *v1, Value *v2)
         } break;
 
         case LUA_TBOOLEAN: {
-            if (v2->typ != LUA_TBOOLEAN) return (v1->u.b == v2->u.b);
+            if (v2->typ == LUA_TBOOLEAN) return (v1->u.b == v2->u.b);
             return 0;
         } break;
 
@@ -1087,42 +1202,24 @@ uint32_t vm_EQ(Value *v1, Value *v2)
     }
 }
 
-static
-uint32_t vm_LT(Value *v1, Value *v2)
-{
-  if (isNumerical(v1) && isNumerical(v2)) {
-    if (v1->typ == LUA_TNUMINT && v2->typ == LUA_TNUMINT) {
-      lua_integer i1 = v1->u.i;
-      lua_integer i2 = v2->u.i;
-      return (i1 < i2);
-    } else {
-      lua_float n1 = castToFloat(v1);
-      lua_float n2 = castToFloat(v2);
-      return (n1 < n2);
-    }
-  } else {
-    error("type error - vm_LT");
-    assert(0);
-  }
+// vm_LT, vm_LE
+#define OPSPEC_COMPARE(OP, INT, FLT, QUICK)                             \
+static                                                                  \
+uint32_t vm_##OP(Value *v1, Value *v2)                                  \
+{                                                                       \
+    if (isNumerical(v1) && isNumerical(v2)) {                           \
+        if (v1->typ == LUA_TNUMINT && v2->typ == LUA_TNUMINT) {         \
+            return INT_##INT(v1->u.i, v2->u.i);                         \
+        } else {                                                        \
+            return FLT_##FLT(castToFloat(v1), castToFloat(v2));         \
+        }                                                               \
+    } else {                                                            \
+        error("type error - vm_" #OP);                                  \
+        assert(0);                                                      \
+    }                                                                   \
 }
 
-uint32_t vm_LE(Value *v1, Value *v2)
-{
-  if (isNumerical(v1) && isNumerical(v2)) {
-    if (v1->typ == LUA_TNUMINT && v2->typ == LUA_TNUMINT) {
-      lua_integer i1 = v1->u.i;
-      lua_integer i2 = v2->u.i;
-      return (i1 <= i2);
-    } else {
-      lua_float n1 = castToFloat(v1);
-      lua_float n2 = castToFloat(v2);
-      return (n1 <= n2);
-    }
-  } else {
-    error("type error - vm_LE");
-    assert(0);
-  }
-}
+#include "opcodes.def"
 
 //
 // Interpreter
@@ -1139,6 +1236,8 @@ typedef struct MiniLuaState {
 #define R(n) &mls->registers[n]
 #define K(n) &constants[n]
 #define RK(n) (ISK(n) ? K(INDEXK(n)) : R(n))
+#define IS_INT_LOOP(init, limit, step) \
+    ((init)->typ == LUA_TNUMINT && (limit)->typ == LUA_TNUMINT && (step)->typ == LUA_TNUMINT)
 
 //
 size_t step_in_C(MiniLuaState *mls, Instruction inst, uint32_t op, Value *constants) {
@@ -1157,65 +1256,97 @@ size_t step_in_C(MiniLuaState *mls, Instruction inst, uint32_t op, Value *consta
             *a = *b;
         } break;
 
-        case OP_ADD: {
+#define ARITH_CASE(OP)                      \
+        case OP_##OP: {                     \
+            Value *a = R(A(inst));          \
+            Value *b = RK(B(inst));         \
+            Value *c = RK(C(inst));         \
+            vm_##OP(a,b,c);                 \
+        } break;
+#define OPSPEC_ARITH(OP, INT, FLT, QUICK)   ARITH_CASE(OP)
+#define OPSPEC_ARITH_FLOAT(OP, FLT)         ARITH_CASE(OP)
+#include "opcodes.def"
+#undef ARITH_CASE
+
+        case OP_UNM: {
             Value *a = R(A(inst));
-            Value *b = RK(B(inst));
-            Value *c = RK(C(inst));
-            vm_ADD(a,b,c);
+            Value *b = R(B(inst));
+            vm_UNM(a, b);
         } break;
 
-        case OP_SUB: {
+        case OP_NOT: {
             Value *a = R(A(inst));
-            Value *b = RK(B(inst));
-            Value *c = RK(C(inst));
-            vm_SUB(a,b,c);
+            Value *b = R(B(inst));
+            vm_NOT(a, b);
+        } break;
+
+        case OP_LOADBOOL: {
+            set_bool(R(A(inst)), B(inst));
+            if (C(inst)) {
+                pc_offset = 1;
+            }
+        } break;
+
+        case OP_LOADNIL: {
+            vm_LOADNIL(R(A(inst)), B(inst));
         } break;
 
-        case OP_MUL: {
+        case OP_BAND: {
             Value *a = R(A(inst));
             Value *b = RK(B(inst));
             Value *c = RK(C(inst));
-            vm_MUL(a,b,c);
+            vm_BAND(a,b,c);
         } break;
 
-        case OP_DIV: {
+        case OP_BOR: {
             Value *a = R(A(inst));
             Value *b = RK(B(inst));
             Value *c = RK(C(inst));
-            vm_DIV(a,b,c);
+            vm_BOR(a,b,c);
         } break;
 
-        case OP_MOD: {
+        case OP_BXOR: {
             Value *a = R(A(inst));
             Value *b = RK(B(inst));
             Value *c = RK(C(inst));
-            vm_MOD(a,b,c);
+            vm_BXOR(a,b,c);
         } break;
 
-        case OP_IDIV: {
+        case OP_SHL: {
             Value *a = R(A(inst));
             Value *b = RK(B(inst));
             Value *c = RK(C(inst));
-            vm_IDIV(a,b,c);
+            vm_SHL(a,b,c);
         } break;
 
-        case OP_POW: {
+        case OP_SHR: {
             Value *a = R(A(inst));
             Value *b = RK(B(inst));
             Value *c = RK(C(inst));
-            vm_POW(a,b,c);
+            vm_SHR(a,b,c);
         } break;
 
-        case OP_UNM: {
+        case OP_BNOT: {
             Value *a = R(A(inst));
             Value *b = R(B(inst));
-            vm_UNM(a, b);
+            vm_BNOT(a, b);
         } break;
 
-        case OP_NOT: {
+        case OP_TEST: {
+            Value *a = R(A(inst));
+            if (isTruthy(a) != (int) C(inst)) {
+                pc_offset = 1;
+            }
+        } break;
+
+        case OP_TESTSET: {
             Value *a = R(A(inst));
             Value *b = R(B(inst));
-            vm_NOT(a, b);
+            if (isTruthy(b) != (int) C(inst)) {
+                pc_offset = 1;
+            } else {
+                *a = *b;
+            }
         } break;
 
         case OP_JMP: {
@@ -1225,33 +1356,31 @@ size_t step_in_C(MiniLuaState *mls, Instruction inst, uint32_t op, Value *consta
             // if (a) close upvalues;
         } break;
 
-        case OP_EQ: {
-            uint32_t a = A(inst);
-            Value *b = RK(B(inst));
-            Value *c = RK(C(inst));
-            if ( vm_EQ(b, c) != a ) {
-                pc_offset++;
-            }
-        } break;
-
-        case OP_LT: {
-            uint32_t a = A(inst);
-            Value *b = RK(B(inst));
-            Value *c = RK(C(inst));
-            if ( vm_LT(b, c) != a ) {
-                pc_offset++;
-            }
-        } break;
-
-        case OP_LE: {
-            uint32_t a = A(inst);
-            Value *b = RK(B(inst));
-            Value *c = RK(C(inst));
-            if ( vm_LE(b, c) != a ) {
-                pc_offset++;
-            }
+#define OPSPEC_COMPARE(OP, INT, FLT, QUICK)                         \
+        case OP_##OP: {                                             \
+            uint32_t a = A(inst);                                   \
+            Value *b = RK(B(inst));                                 \
+            Value *c = RK(C(inst));                                 \
+            if ( vm_##OP(b, c) != a ) {                             \
+                pc_offset++;                                        \
+            }                                                       \
+        } break;                                                    \
+                                                                    \
+        case OP_##OP##_JMP: {                                       \
+            uint32_t a = A(inst) & 1;                               \
+            Value *b = RK(B(inst));                                 \
+            Value *c = RK(C(inst));                                 \
+            if ( vm_##OP(b, c) == a ) {                             \
+                pc_offset = sJ(inst) + 1;                           \
+            } else {                                                \
+                pc_offset = 1;                                      \
+            }                                                       \
         } break;
+#define OPSPEC_EQUALITY(OP, INT, FLT, QUICK) OPSPEC_COMPARE(OP, INT, FLT, QUICK)
+#include "opcodes.def"
 
+        // An integer loop with a positive step keeps the number of
+        // iterations left in R(A+1), see create_int_forloop in step.cpp
         case OP_FORLOOP: {
             uint32_t ia = A(inst);
             int32_t sbx = sBx(inst);
@@ -1260,6 +1389,15 @@ size_t step_in_C(MiniLuaState *mls, Instruction inst, uint32_t op, Value *consta
             Value *step  = R(ia + 2);
             Value *var   = R(ia + 3);
 
+            if (IS_INT_LOOP(init, limit, step) && step->u.i > 0) {
+                if (limit->u.i != 0) {
+                    limit->u.i = (lua_integer) ((uint64_t) limit->u.i - 1);
+                    init->u.i = (lua_integer) ((uint64_t) init->u.i + (uint64_t) step->u.i);
+                    pc_offset = sbx;
+                    *var = *init;
+                }
+                break;
+            }
             vm_ADD(init, init, step);
             if (vm_LE(init, limit)) {
                 pc_offset = sbx;
@@ -1270,13 +1408,39 @@ size_t step_in_C(MiniLuaState *mls, Instruction inst, uint32_t op, Value *consta
         case OP_FORPREP: {
             uint32_t ia = A(inst);
             int32_t sbx = sBx(inst);
-            Value *init = R(ia + 0);
-            Value *step = R(ia + 2);
+            Value *init  = R(ia + 0);
+            Value *limit = R(ia + 1);
+            Value *step  = R(ia + 2);
 
-            vm_SUB(init, init, step);
+            if (IS_INT_LOOP(init, limit, step) && step->u.i > 0) {
+                uint64_t count = 0;
+                if (init->u.i <= limit->u.i) {
+                    count = ((uint64_t) limit->u.i - (uint64_t) init->u.i) / (uint64_t) step->u.i;
+                    if (count < UINT64_MAX) {
+                        count++;
+                    }
+                }
+                set_int(limit, (lua_integer) count);
+                set_int(init, (lua_integer) ((uint64_t) init->u.i - (uint64_t) step->u.i));
+            } else {
+                vm_SUB(init, init, step);
+            }
             pc_offset = sbx;
         } break;
 
+#define OPSPEC_ARITH(OP, INT, FLT, QUICK)                           \
+        case OP_##OP##_KI: {                                        \
+            Value *a = R(A(inst));                                  \
+            Value *b = RK(B(inst));                                 \
+            Value *c = K(INDEXK(C(inst)));                          \
+            if (b->typ == LUA_TNUMINT) {                            \
+                set_int(a, INT_##INT(b->u.i, c->u.i));              \
+            } else {                                                \
+                vm_##OP(a,b,c);                                     \
+            }                                                       \
+        } break;
+#include "opcodes.def"
+
         default:
             fprintf(stderr, "Opcode %s is not implemented yet\n", lua_opnames[op]);
             exit(1);
@@ -1315,7 +1479,37 @@ void interpret(MiniLuaState *mls);
 /* } */
 //
 
+#ifdef AOT_DLOPEN
+
+// interpret() of hybrid-aot: runs the chunk compiled ahead of time by aot
+// (make examples/FILE.so), from MINILUA_AOT or else FILE.so next to FILE.byte.
+static char *aot_path;
+
+void interpret(MiniLuaState *mls)
+{
+    static void (*compiled)(MiniLuaState *mls) = NULL;
+    if (!compiled) {
+        void *lib = dlopen(aot_path, RTLD_NOW);
+        if (!lib) {
+            error(dlerror());
+        }
+        const uint64_t *hash = dlsym(lib, "aot_code_hash");
+        if (!hash || *hash != codeHash(mls->proto)) {
+            error("the compiled chunk does not match the bytecode");
+        }
+        // POSIX way of converting the result of dlsym to a function pointer
+        *(void **) &compiled = dlsym(lib, "interpret");
+        if (!compiled) {
+            error(dlerror());
+        }
+    }
+    compiled(mls);
+}
+
+#endif
+
 
+#ifndef HYBRID_NO_MAIN
 int main(int argc, char **argv)
 {
     assert(sizeof(Int) == SIZE_INT);
@@ -1346,6 +1540,26 @@ int main(int argc, char **argv)
         }
     }
 
+#ifdef AOT_DLOPEN
+    aot_path = getenv("MINILUA_AOT");
+    if (!aot_path) {
+        size_t len = strlen(argv[1]);
+        if (len > 5 && strcmp(&argv[1][len - 5], ".byte") == 0) {
+            len -= 5;
+        }
+        aot_path = calloc(len + 4, 1);
+        memcpy(aot_path, argv[1], len);
+        strcpy(&aot_path[len], ".so");
+    }
+    // dlopen() looks for a name without a '/' in the library search path
+    if (!strchr(aot_path, '/')) {
+        char *local = calloc(strlen(aot_path) + 3, 1);
+        strcpy(local, "./");
+        strcat(local, aot_path);
+        aot_path = local;
+    }
+#endif
+
     MiniLuaState *mls = calloc(1, sizeof(MiniLuaState));
     mls->proto = loadChunkBytecode(F);
     mls->registers = calloc(mls->proto->maxstacksize, sizeof(Value));
@@ -1365,3 +1579,4 @@ int main(int argc, char **argv)
 
     return 0;
 }
+#endif
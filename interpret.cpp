@@ -154,6 +154,7 @@ int main() {
     proto_elements.push_back(llvm::Type::getInt32Ty(context));    //lastlinedefined
     proto_elements.push_back(p_value_struct_type);                //*k
     proto_elements.push_back(llvm::Type::getInt32PtrTy(context)); //*code
+    proto_elements.push_back(llvm::Type::getInt8PtrTy(context));  //*types
     proto_elements.push_back(p_string_struct_type);               //*source
     proto_struct_type->setBody(proto_elements);
     // std::cout << "Struct Proto dump:\n";
@@ -231,7 +232,7 @@ int main() {
     llvm::Value *mls_GEP = builder.CreateInBoundsGEP(miniluastate_struct_type, _mls, temp);
 
     //mls->proto (Proto*)
-    llvm::Value *proto_LD = builder.CreateLoad(mls_GEP);
+    llvm::Value *proto_LD = builder.CreateLoad(p_proto_struct_type, mls_GEP);
 
 
     temp.clear();
@@ -240,7 +241,7 @@ int main() {
     llvm::Value *k_GEP = builder.CreateInBoundsGEP(proto_struct_type, proto_LD, temp);
 
     //mls->proto->k (Value*)
-    llvm::Value *k_LD = builder.CreateLoad(k_GEP);
+    llvm::Value *k_LD = builder.CreateLoad(p_value_struct_type, k_GEP);
 
 
     temp.clear();
@@ -249,10 +250,10 @@ int main() {
     llvm::Value *code_GEP = builder.CreateInBoundsGEP(proto_struct_type, proto_LD, temp);
 
     //mls->proto->code* (i32*)
-    llvm::Value *code_LD = builder.CreateLoad(code_GEP);
+    llvm::Value *code_LD = builder.CreateLoad(llvm::Type::getInt32PtrTy(context), code_GEP);
 
     //mls->proto->code[i] (i32)
-    llvm::Value *code_value = builder.CreateLoad(code_LD); //code[i]
+    llvm::Value *code_value = builder.CreateLoad(llvm::Type::getInt32Ty(context), code_LD); //code[i]
 
     //op = mls->proto->code && 0x3F
     llvm::Value *op_value = builder.CreateAnd(code_value, llvm::APInt(32, 0x3F, true));
@@ -292,26 +293,15 @@ int main() {
     new_pc->mutateType(llvm::Type::getInt64Ty(context));
 
 
-    //TODO check if this is really necessary. The generated IR has the same load
-    // apparently yes, because as llvm ir is ssa, the assignment in the entry block is unique
-    // and references the initial value. Here we have to make another assignment to get
-    // the updated value.
-    // Maybe the CreateLoad(mls_GEP) is the only one that is unnecessary
-    llvm::Value *proto_LD_loop = builder.CreateLoad(mls_GEP);
-
-    temp.clear();
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)));
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 10, true)));
-    llvm::Value *code_GEP_loop = builder.CreateInBoundsGEP(proto_struct_type, proto_LD_loop, temp);
-
-    llvm::Value *code_LD_loop = builder.CreateLoad(code_GEP_loop);
-
+    // mls->proto->code never changes while a proto runs, but step() is an
+    // opaque call so LLVM can't prove it and would reload it every iteration:
+    // reuse the pointer loaded in the entry block
     //get the code[...]
     temp.clear();
     temp.push_back(new_pc);
-    llvm::Value *code_GEP_offset_loop = builder.CreateInBoundsGEP(llvm::Type::getInt32Ty(context), code_LD_loop, temp);
+    llvm::Value *code_GEP_offset_loop = builder.CreateInBoundsGEP(llvm::Type::getInt32Ty(context), code_LD, temp);
 
-    llvm::Value *code_LD_offset_loop = builder.CreateLoad(code_GEP_offset_loop);
+    llvm::Value *code_LD_offset_loop = builder.CreateLoad(llvm::Type::getInt32Ty(context), code_GEP_offset_loop);
 
     //op = mls->proto->code && 0x3F
     llvm::Value *op_value_loop = builder.CreateAnd(code_LD_offset_loop, llvm::APInt(32, 0x3F, true));
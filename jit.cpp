@@ -0,0 +1,858 @@
+/*
+* File: jit.cpp
+*
+* Method JIT. Instead of calling step() once per instruction, the whole Proto
+* is translated at run time into one LLVM function with a basic block per
+* bytecode pc. Each block is built by the same create_op_*_block functions
+* that generate step.ll, with the instruction word as a constant, and the pc
+* offset they return becomes a real branch to the target pc.
+*
+* MINILUA_CACHE=DIR in the environment keeps the compiled objects in DIR,
+* so a later run of the same chunk loads them instead of compiling again
+* (see CodeCache). The constants are passed as an argument rather than
+* baked into the code, and the helpers are resolved when an object is
+* linked, so an object does not depend on the process that compiled it.
+*
+* Built with -DTIERED (make jit-tiered), chunks start in the interpreter and
+* are compiled by a background thread once they get hot, see TierState. A run
+* still in the interpreter moves to the compiled code at the next loop header
+* it reaches (on-stack replacement, see loop_headers). The interpreter also
+* profiles operand types, and instructions that only saw one of them are
+* compiled for it behind a type guard; a failed guard returns to the
+* interpreter at that pc (deoptimization, see deoptimize). MINILUA_TIERS=1
+* reports the compilations and transfers on stderr.
+*
+* Chunks are optimized by one of the pipelines of opt_tiers, chosen with
+* MINILUA_JIT_OPT=fast|full (full by default). MINILUA_JIT_FAST and
+* MINILUA_JIT_FULL replace their pass lists (opt -passes syntax), and
+* MINILUA_JIT_BUDGET=MS caps the time the full pipeline may take on a
+* chunk: past it, the chunk is optimized by the fast one instead (see
+* optimize_chunk). MINILUA_JIT_STATS=1 reports per chunk the pipeline used,
+* the compile times and the code size, and at exit the speedup of the
+* compiled code over the interpreter when both ran whole calls (jit-tiered).
+* MINILUA_PERF_MAP and MINILUA_JITDUMP name the chunks for perf, see
+* perfmap.h.
+*
+* This file replaces interpret() from interpret.ll and is linked with
+* hybrid.c, which provides the loader, main(), step_in_C and error_default:
+* make jit
+*/
+
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "perfmap.h"
+#include "step.h"
+
+// LLVM includes
+#include <llvm/Config/llvm-config.h>
+#include <llvm/ExecutionEngine/ObjectCache.h>
+#include <llvm/ExecutionEngine/Orc/CompileUtils.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
+#include <llvm/ExecutionEngine/Orc/ObjectTransformLayer.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/Object/ObjectFile.h>
+#include <llvm/Object/SymbolSize.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+//
+
+
+// Defined in hybrid.c
+extern "C" size_t step_in_C(MiniLuaState *mls, Instruction inst, uint32_t op, Value *constants);
+extern "C" void error_default();
+extern "C" Byte operandTypes(Proto *f, int pc);
+extern "C" uint64_t codeHash(Proto *f);
+
+// Bumped whenever the generated code changes in a way the LLVM version and
+// the bytecode don't account for, so stale cached objects are not reused.
+#define CODE_CACHE_VERSION  3
+
+// Runs the chunk from pc, which is 0 or one of its loop_headers(). Returns
+// -1 when the chunk returned, or the pc the interpreter resumes at after a
+// failed type guard (see create_speculation_guard).
+typedef int64_t (*compiled_chunk)(MiniLuaState *, Value *constants, int64_t pc);
+
+// Operand types assumed at each pc, TYPE_INT, TYPE_FLT or 0 for none
+typedef std::vector<Byte> Speculation;
+
+static std::unique_ptr<llvm::orc::LLJIT> jit;
+static llvm::orc::ThreadSafeContext jit_context;
+static std::map<Proto *, compiled_chunk> compiled_chunks;
+
+// --- Optimization pipelines
+// A cleanup of the IR the builders emit, and the whole -O3 pipeline with
+// its loop passes. passes is in PassBuilder::parsePassPipeline syntax.
+struct OptTier {
+    const char *name;
+    const char *env;  // replaces passes
+    std::string passes;
+};
+
+#define OPT_FAST    0
+#define OPT_FULL    1
+
+static OptTier opt_tiers[] = {
+    {"fast", "MINILUA_JIT_FAST", "function(mem2reg,instcombine,simplifycfg)"},
+    {"full", "MINILUA_JIT_FULL", "default<O3>"},
+};
+static int opt_tier = OPT_FULL;
+static double opt_budget_ms = 0;  // 0 for no budget
+static const bool jit_stats = getenv("MINILUA_JIT_STATS") != NULL;
+static size_t last_code_size;     // of the last object linked, for jit_stats
+static std::map<std::string, size_t> function_sizes;  // of the objects linked, for perfmap.h
+
+
+static void fatal(const char *msg) {
+    fprintf(stderr, "jit: %s\n", msg);
+    exit(1);
+}
+
+static uint64_t fnv1a(uint64_t h, const std::string &s) {
+    for (unsigned char c : s) {
+        h = (h ^ c) * 0x100000001b3u;
+    }
+    return h;
+}
+
+static double elapsed_ms(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// --- Persistent code cache
+// An object is stored as DIR/chunk_KEY.o, where KEY hashes the chunk
+// (codeHash), the types it was specialized for, the optimization pipeline,
+// CODE_CACHE_VERSION, the LLVM version and the host CPU with its features,
+// which the code is compiled for. A chunk's function is named
+// after its key too, so the object is looked up as if it had just been
+// compiled. Objects are written to a temporary file and renamed, so workers
+// sharing DIR never read one half written. A chunk that went over
+// MINILUA_JIT_BUDGET is not stored (compile_proto clears its module
+// identifier), so later runs try the full pipeline again.
+class CodeCache : public llvm::ObjectCache {
+public:
+    explicit CodeCache(const std::string &dir) : dir(dir), host(host_key()) {}
+
+    uint64_t key(Proto *p, const Speculation &speculation) {
+        uint64_t h = fnv1a(fnv1a(codeHash(p), host), opt_tiers[opt_tier].passes);
+        return fnv1a(h, std::string(speculation.begin(), speculation.end()));
+    }
+
+    std::unique_ptr<llvm::MemoryBuffer> load(const std::string &name) {
+        auto buffer = llvm::MemoryBuffer::getFile(path(name));
+        if (!buffer) {
+            return nullptr;
+        }
+        return std::move(*buffer);
+    }
+
+    void notifyObjectCompiled(const llvm::Module *m, llvm::MemoryBufferRef obj) override {
+        if (m->getModuleIdentifier().empty()) {
+            return;
+        }
+        std::string file = path(m->getModuleIdentifier());
+        int fd;
+        llvm::SmallString<128> temp;
+        if (llvm::sys::fs::createUniqueFile(file + ".%%%%%%.tmp", fd, temp)) {
+            return; // not cached, the code itself is fine
+        }
+        {
+            llvm::raw_fd_ostream out(fd, true);
+            out << obj.getBuffer();
+        }
+        if (llvm::sys::fs::rename(temp, file)) {
+            llvm::sys::fs::remove(temp);
+        }
+    }
+
+    // hits are loaded by compile_proto before any IR is built
+    std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module *) override {
+        return nullptr;
+    }
+
+private:
+    std::string dir;
+    std::string host;
+
+    std::string path(const std::string &name) {
+        return dir + "/" + name + ".o";
+    }
+
+    static std::string host_key() {
+        std::string s = std::to_string(CODE_CACHE_VERSION) + " " LLVM_VERSION_STRING " ";
+        s += llvm::sys::getProcessTriple() + " " + llvm::sys::getHostCPUName().str();
+        llvm::StringMap<bool> features;
+        if (llvm::sys::getHostCPUFeatures(features)) {
+            std::map<std::string, bool> sorted;
+            for (auto &feature : features) {
+                sorted[feature.getKey().str()] = feature.getValue();
+            }
+            for (auto &feature : sorted) {
+                s += (feature.second ? " +" : " -") + feature.first;
+            }
+        }
+        return s;
+    }
+};
+
+static std::unique_ptr<CodeCache> code_cache;
+
+// Reads the size of the machine code in obj and of each of its functions
+static void inspect_object(const llvm::MemoryBuffer &obj) {
+    auto file = llvm::object::ObjectFile::createObjectFile(obj.getMemBufferRef());
+    if (!file) {
+        llvm::consumeError(file.takeError());
+        return;
+    }
+    last_code_size = 0;
+    for (const llvm::object::SectionRef &section : (*file)->sections()) {
+        if (section.isText()) {
+            last_code_size += section.getSize();
+        }
+    }
+    for (auto &symbol : llvm::object::computeSymbolSizes(**file)) {
+        auto type = symbol.first.getType();
+        auto name = symbol.first.getName();
+        if (type && name && *type == llvm::object::SymbolRef::ST_Function) {
+            function_sizes[name->str()] = symbol.second;
+        } else {
+            llvm::consumeError(type.takeError());
+            llvm::consumeError(name.takeError());
+        }
+    }
+}
+
+static void init_opt_tiers() {
+    for (OptTier &tier : opt_tiers) {
+        if (const char *passes = getenv(tier.env)) {
+            tier.passes = passes;
+        }
+        llvm::PassBuilder pb;
+        llvm::ModulePassManager mpm;
+        if (llvm::Error err = pb.parsePassPipeline(mpm, tier.passes)) {
+            llvm::logAllUnhandledErrors(std::move(err), llvm::errs(), std::string("jit: ") + tier.env + ": ");
+            exit(1);
+        }
+    }
+    if (const char *name = getenv("MINILUA_JIT_OPT")) {
+        if (!strcmp(name, "fast")) {
+            opt_tier = OPT_FAST;
+        } else if (!strcmp(name, "full")) {
+            opt_tier = OPT_FULL;
+        } else {
+            fatal("MINILUA_JIT_OPT must be fast or full");
+        }
+    }
+    if (const char *budget = getenv("MINILUA_JIT_BUDGET")) {
+        opt_budget_ms = atof(budget);
+    }
+}
+
+static void init_jit() {
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+    llvm::InitializeNativeTargetAsmParser();
+    init_opt_tiers();
+
+    llvm::orc::LLJITBuilder jit_builder;
+    if (const char *dir = getenv("MINILUA_CACHE")) {
+        if (llvm::sys::fs::create_directories(dir)) {
+            fatal("could not create the MINILUA_CACHE directory");
+        }
+        code_cache.reset(new CodeCache(dir));
+        jit_builder.setCompileFunctionCreator([](llvm::orc::JITTargetMachineBuilder jtmb)
+                -> llvm::Expected<std::unique_ptr<llvm::orc::IRCompileLayer::IRCompiler>> {
+            auto tm = jtmb.createTargetMachine();
+            if (!tm) {
+                return tm.takeError();
+            }
+            return std::make_unique<llvm::orc::TMOwningSimpleCompiler>(std::move(*tm), code_cache.get());
+        });
+    }
+
+    auto jit_or_error = jit_builder.create();
+    if (!jit_or_error) {
+        llvm::logAllUnhandledErrors(jit_or_error.takeError(), llvm::errs(), "jit: ");
+        exit(1);
+    }
+    jit = std::move(*jit_or_error);
+    if (jit_stats || perfEnabled()) {
+        jit->getObjTransformLayer().setTransform([](std::unique_ptr<llvm::MemoryBuffer> obj)
+                -> llvm::Expected<std::unique_ptr<llvm::MemoryBuffer>> {
+            inspect_object(*obj);
+            return obj;
+        });
+    }
+
+    // libm (pow, fmod, floor) is found in the process, the runtime helpers
+    // are defined explicitly so the executable does not need -rdynamic.
+    llvm::orc::JITDylib &dylib = jit->getMainJITDylib();
+    char prefix = jit->getDataLayout().getGlobalPrefix();
+    dylib.addGenerator(llvm::cantFail(
+        llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(prefix)));
+
+    llvm::orc::MangleAndInterner mangle(jit->getExecutionSession(), jit->getDataLayout());
+    llvm::orc::SymbolMap helpers;
+    helpers[mangle("step_in_C")] = llvm::JITEvaluatedSymbol(
+        llvm::pointerToJITTargetAddress(&step_in_C), llvm::JITSymbolFlags::Exported);
+    helpers[mangle("error_default")] = llvm::JITEvaluatedSymbol(
+        llvm::pointerToJITTargetAddress(&error_default), llvm::JITSymbolFlags::Exported);
+    llvm::cantFail(dylib.define(llvm::orc::absoluteSymbols(helpers)));
+
+    // The struct types live in step.cpp's context, so every chunk module is
+    // created in it and the JIT takes ownership of it. step.cpp's own module
+    // is not used here and must not outlive the context.
+    create_types();
+    Owner.reset();
+    jit_context = llvm::orc::ThreadSafeContext(std::move(OwnerContext));
+}
+
+// Runs the pipeline of tier over m. When budget_ms is not 0 and runs out,
+// the passes left are skipped and false is returned, m is then valid but
+// only partly optimized.
+static bool optimize_module(llvm::Module *m, const OptTier &tier, double budget_ms) {
+    auto start = std::chrono::steady_clock::now();
+    bool over_budget = false;
+    llvm::PassInstrumentationCallbacks pic;
+    if (budget_ms > 0) {
+        pic.registerShouldRunOptionalPassCallback([&](llvm::StringRef, llvm::Any) {
+            over_budget = over_budget || elapsed_ms(start) > budget_ms;
+            return !over_budget;
+        });
+    }
+
+    llvm::LoopAnalysisManager lam;
+    llvm::FunctionAnalysisManager fam;
+    llvm::CGSCCAnalysisManager cgam;
+    llvm::ModuleAnalysisManager mam;
+
+    llvm::PassBuilder pb(nullptr, llvm::PipelineTuningOptions(), llvm::None, &pic);
+    pb.registerModuleAnalyses(mam);
+    pb.registerCGSCCAnalyses(cgam);
+    pb.registerFunctionAnalyses(fam);
+    pb.registerLoopAnalyses(lam);
+    pb.crossRegisterProxies(lam, fam, cgam, mam);
+
+    llvm::ModulePassManager mpm;
+    llvm::cantFail(pb.parsePassPipeline(mpm, tier.passes)); // checked by init_opt_tiers
+    mpm.run(*m, mam);
+    return !over_budget;
+}
+
+// Optimizes the chunk in owner with opt_tier and returns the tier used: a
+// chunk the full pipeline does not finish within opt_budget_ms is
+// optimized by the fast one instead, from a copy taken before.
+static int optimize_chunk(std::unique_ptr<llvm::Module> &owner) {
+    std::unique_ptr<llvm::Module> copy;
+    if (opt_budget_ms > 0 && opt_tier != OPT_FAST) {
+        copy = llvm::CloneModule(*owner);
+    }
+    if (optimize_module(owner.get(), opt_tiers[opt_tier], copy ? opt_budget_ms : 0)) {
+        return opt_tier;
+    }
+    owner = std::move(copy);
+    module = owner.get();
+    optimize_module(module, opt_tiers[OPT_FAST], 0);
+    return OPT_FAST;
+}
+
+// Deoptimization: goes on with the untagged code of inst only if its typed
+// operands hold the tags of types, else returns pc to the interpreter before
+// inst runs. Every instruction leaves its results in mls->registers, so the
+// boxed Values are already where the interpreter expects them.
+static void create_speculation_guard(Instruction inst, Byte types, int pc) {
+    llvm::BasicBlock *deopt_block = create_type_guard(inst, types, "pc_" + std::to_string(pc));
+    if (deopt_block) {
+        llvm::IRBuilderBase::InsertPointGuard guard(builder);
+        builder.SetInsertPoint(deopt_block);
+        builder.CreateRet(llvm::ConstantInt::get(context, llvm::APInt(64, pc, true)));
+    }
+}
+
+// Where the interpreter may enter compiled code in the middle of a run: the
+// FORLOOP of each numeric for loop and the target of every other backward
+// jump. Those are the natural headers of the loops (FORPREP jumps to the
+// FORLOOP), so entering there keeps every loop single-entry for LLVM.
+static std::set<int> loop_headers(Proto *p) {
+    std::set<int> headers;
+    for (int pc = 0; pc < p->sizecode; pc++) {
+        Instruction inst = p->code[pc];
+        uint32_t op = (inst >> POS_OP) & 0x3F;
+        if (op == OP_FORLOOP) {
+            headers.insert(pc);
+            continue;
+        }
+        for (int64_t offset : pc_offsets(inst)) {
+            if (offset < 0) {
+                headers.insert(pc + 1 + offset);
+            }
+        }
+    }
+    return headers;
+}
+
+// Emits "int64_t name(MiniLuaState *mls, Value *constants, int64_t pc)" for
+// the whole proto into module. The registers stay in mls->registers between
+// instructions, which makes any loop header a valid entry point and any
+// instruction a valid exit.
+static llvm::Function* create_chunk_function(Proto *p, const std::string &name, const Speculation &speculation) {
+    std::vector<llvm::Type *> args;
+    args.push_back(p_miniluastate_struct_type);
+    args.push_back(p_value_struct_type);
+    args.push_back(llvm::Type::getInt64Ty(context));
+    llvm::FunctionType *chunk_type = llvm::FunctionType::get(llvm::Type::getInt64Ty(context), args, false);
+    llvm::Function *f = llvm::Function::Create(chunk_type, llvm::Function::ExternalLinkage, name, module);
+
+    // the builders read these globals instead of step's arguments
+    step_func = f;
+    auto argiter = f->arg_begin();
+    _mls = &*argiter++;
+    _constants = &*argiter++;
+    llvm::Value *entry_pc = &*argiter++;
+
+    llvm::BasicBlock *entry = llvm::BasicBlock::Create(context, "entry", f);
+    std::vector<llvm::BasicBlock *> pc_blocks;
+    for (int pc = 0; pc < p->sizecode; pc++) {
+        pc_blocks.push_back(llvm::BasicBlock::Create(context, "pc_" + std::to_string(pc), f));
+    }
+    error_block = llvm::BasicBlock::Create(context, "error_block", f);
+
+    builder.SetInsertPoint(entry);
+    std::set<int> headers = loop_headers(p);
+    headers.insert(0);
+    llvm::SwitchInst *start = builder.CreateSwitch(entry_pc, error_block, headers.size());
+    for (int pc : headers) {
+        start->addCase(llvm::ConstantInt::get(context, llvm::APInt(64, pc, true)), pc_blocks[pc]);
+    }
+
+    builder.SetInsertPoint(error_block);
+    builder.CreateCall(error);
+    builder.CreateUnreachable();
+
+    for (int pc = 0; pc < p->sizecode; pc++) {
+        Instruction inst = p->code[pc];
+        uint32_t op = (inst >> POS_OP) & 0x3F;
+
+        builder.SetInsertPoint(pc_blocks[pc]);
+        if (op == OP_RETURN) {
+            create_return_block(inst, llvm::ConstantInt::get(context, llvm::APInt(64, -1, true))); // chunk returned
+            continue;
+        }
+
+        // instructions with proven operand types get untagged IR, so do the
+        // speculated ones behind a guard
+        Byte types = operandTypes(p, pc);
+        if (!types && !speculation.empty() && speculation[pc]) {
+            types = speculation[pc];
+            create_speculation_guard(inst, types, pc);
+        }
+        bool called_C;
+        llvm::Value *pc_offset = create_inline_op(inst, types, &called_C);
+        std::set<int64_t> offsets = pc_offsets(inst);
+        if (called_C) {
+            // step_in_C may also skip the next instruction
+            offsets.insert(1);
+        }
+
+        llvm::SwitchInst *next = builder.CreateSwitch(pc_offset, error_block, offsets.size());
+        for (int64_t offset : offsets) {
+            int64_t target = pc + 1 + offset;
+            if (target < 0 || target >= p->sizecode) {
+                continue; // left to error_block
+            }
+            next->addCase(llvm::ConstantInt::get(context, llvm::APInt(64, offset, true)), pc_blocks[target]);
+        }
+    }
+
+    add_alias_info(f);
+    add_branch_weights(f);
+    add_argument_attributes(f, 0, 1);
+    return f;
+}
+
+// Looks the chunk up, which links it, and names its code for perf
+static compiled_chunk lookup_chunk(Proto *p, const std::string &name) {
+    llvm::JITEvaluatedSymbol sym = llvm::cantFail(jit->lookup(name));
+    compiled_chunk f = (compiled_chunk) sym.getAddress();
+    if (perfEnabled()) {
+        perfRegisterRange(p->source->str, p->linedefined, "chunk", 0, p->sizecode - 1,
+                          (const void *) f, function_sizes[name]);
+    }
+    return f;
+}
+
+static compiled_chunk compile_proto(Proto *p, const Speculation &speculation) {
+    static int chunk_count = 0;
+    std::string name;
+    if (code_cache) {
+        char key[32];
+        snprintf(key, sizeof(key), "chunk_%016" PRIx64, code_cache->key(p, speculation));
+        name = key;
+        if (std::unique_ptr<llvm::MemoryBuffer> obj = code_cache->load(name)) {
+            if (getenv("MINILUA_JIT_DUMP")) {
+                fprintf(stderr, "jit: %s loaded from MINILUA_CACHE\n", name.c_str());
+            }
+            auto start = std::chrono::steady_clock::now();
+            llvm::cantFail(jit->addObjectFile(std::move(obj)));
+            compiled_chunk f = lookup_chunk(p, name);
+            if (jit_stats) {
+                fprintf(stderr, "jit: %s: loaded from MINILUA_CACHE, link %.2fms, %zu bytes of code\n",
+                        name.c_str(), elapsed_ms(start), last_code_size);
+            }
+            return f;
+        }
+    } else {
+        name = "chunk_" + std::to_string(chunk_count++);
+    }
+
+    std::unique_ptr<llvm::Module> owner(new llvm::Module(name, context));
+    module = owner.get();
+    module->setDataLayout(jit->getDataLayout());
+    module->setTargetTriple(jit->getTargetTriple().str());
+
+    create_declarations();
+    create_chunk_function(p, name, speculation);
+
+    if (llvm::verifyModule(*module, &llvm::errs())) {
+        module->print(llvm::errs(), NULL);
+        fatal("invalid module");
+    }
+    auto start = std::chrono::steady_clock::now();
+    int tier = optimize_chunk(owner);
+    double opt_ms = elapsed_ms(start);
+    if (code_cache && tier != opt_tier) {
+        // not the code the key stands for
+        module->setModuleIdentifier("");
+    }
+
+    if (getenv("MINILUA_JIT_DUMP")) {
+        module->print(llvm::errs(), NULL);
+    }
+
+    // the code is generated by the lookup
+    start = std::chrono::steady_clock::now();
+    llvm::cantFail(jit->addIRModule(llvm::orc::ThreadSafeModule(std::move(owner), jit_context)));
+    compiled_chunk f = lookup_chunk(p, name);
+    if (jit_stats) {
+        fprintf(stderr, "jit: %s: %d instructions, %s pipeline%s, opt %.2fms, codegen %.2fms, %zu bytes of code\n",
+                name.c_str(), p->sizecode, opt_tiers[tier].name, tier != opt_tier ? " (over budget)" : "",
+                opt_ms, elapsed_ms(start), last_code_size);
+    }
+    return f;
+}
+
+
+#ifndef TIERED
+
+extern "C" void interpret(MiniLuaState *mls) {
+    if (!jit) {
+        init_jit();
+    }
+
+    compiled_chunk f = compiled_chunks[mls->proto];
+    if (!f) {
+        f = compile_proto(mls->proto, Speculation());
+        compiled_chunks[mls->proto] = f;
+    }
+
+    f(mls, mls->proto->k, 0);
+}
+
+#else
+
+// --- Tiered execution (make jit-tiered)
+// Every Proto starts in the interpreter (step_in_C). Calls to interpret() and
+// backward jumps are counted per Proto, and a hot one is queued for the
+// compiler thread, which owns LLVM and everything jit.cpp builds with it.
+// The interpreter never waits for it: the compiled code is published
+// through an atomic pointer, used from the next call of interpret() on and
+// entered by the running one at its next loop header.
+
+// calls to interpret() before a Proto is compiled
+#define HOT_CALLS       2
+// backward jumps executed before a Proto is compiled
+#define HOT_BACKEDGES   1000
+// failed guards at one pc before the Proto is compiled without speculating there
+#define MAX_DEOPTS      8
+// profile of an instruction whose typed operands were seen with differing tags
+#define PROFILE_MIXED   0x80
+
+// run_compiled() results besides the pc of a failed guard
+#define CHUNK_RETURNED  -1
+#define NOT_COMPILED    -2
+
+struct TierState {
+    std::atomic<compiled_chunk> compiled{nullptr};
+    int generation = 0;          // bumped when compiled is discarded
+    int calls = 0;
+    int backedges = 0;
+    bool queued = false;
+    std::vector<Byte> profile;   // per pc, observed_types() seen so far
+    std::vector<int> deopts;     // per pc, failed guards of compiled
+
+    // jit_stats: whole calls run by each tier
+    bool entered = false;
+    int interpreted_calls = 0;
+    int compiled_calls = 0;
+    double interpreted_ms = 0;
+    double compiled_ms = 0;
+};
+
+struct CompileJob {
+    Proto *p;
+    TierState *state;
+    Speculation speculation;
+    int generation;
+};
+
+class Compiler {
+public:
+    ~Compiler() {
+        // exit() runs this before jit is destroyed (it was defined earlier),
+        // a compilation in progress is finished and thrown away
+        if (thread.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wake.notify_one();
+            thread.join();
+        }
+    }
+
+    void enqueue(Proto *p, TierState *state, const Speculation &speculation) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(CompileJob{p, state, speculation, state->generation});
+        }
+        if (!thread.joinable()) {
+            thread = std::thread(&Compiler::run, this);
+        }
+        wake.notify_one();
+    }
+
+    // Unpublishes the compiled code of state, a compilation already
+    // running for it is not published either
+    void discard(TierState *state) {
+        std::lock_guard<std::mutex> lock(mutex);
+        state->generation++;
+        state->compiled.store(nullptr, std::memory_order_relaxed);
+    }
+
+private:
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<CompileJob> queue;
+    bool stopping = false;
+
+    void run() {
+        init_jit();
+        for (;;) {
+            CompileJob job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this] { return stopping || !queue.empty(); });
+                if (stopping) {
+                    return;
+                }
+                job = queue.front();
+                queue.pop_front();
+            }
+            compiled_chunk f = compile_proto(job.p, job.speculation);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (job.state->generation != job.generation) {
+                    continue;
+                }
+                job.state->compiled.store(f, std::memory_order_release);
+            }
+            if (getenv("MINILUA_TIERS")) {
+                int speculated = 0;
+                for (Byte types : job.speculation) {
+                    speculated += types != 0;
+                }
+                fprintf(stderr, "jit: compiled chunk (%d instructions, %d speculated)\n",
+                        job.p->sizecode, speculated);
+            }
+        }
+    }
+};
+
+static std::map<Proto *, TierState> tier_states;
+static Compiler compiler;
+
+// Reports at exit, before tier_states is destroyed, how much faster than
+// the interpreter the compiled code ran the calls of each Proto
+struct SpeedupReport {
+    ~SpeedupReport() {
+        if (!jit_stats) {
+            return;
+        }
+        for (auto &entry : tier_states) {
+            TierState &state = entry.second;
+            if (!state.interpreted_calls || !state.compiled_calls) {
+                continue;
+            }
+            double interpreted = state.interpreted_ms / state.interpreted_calls;
+            double compiled = state.compiled_ms / state.compiled_calls;
+            fprintf(stderr, "jit: proto %p: interpreted %.3fms/call (%d), compiled %.3fms/call (%d), speedup %.1fx\n",
+                    (void *) entry.first, interpreted, state.interpreted_calls, compiled, state.compiled_calls,
+                    interpreted / compiled);
+        }
+    }
+};
+static SpeedupReport speedup_report;
+
+// Types the interpreter saw at pc, collected until the Proto is queued
+static void profile_types(MiniLuaState *mls, TierState &state, size_t pc, Instruction inst) {
+    Byte types = observed_types(mls, inst);
+    if (!types && !typed_operands(inst).empty()) {
+        types = PROFILE_MIXED;
+    }
+    state.profile[pc] |= types;
+}
+
+// Queues p for compilation, speculating that every instruction keeps the
+// single type it was profiled with
+static void tier_up(Proto *p, TierState &state) {
+    if (state.queued) {
+        return;
+    }
+    state.queued = true;
+    Speculation speculation(p->sizecode);
+    for (int pc = 0; pc < p->sizecode; pc++) {
+        Byte types = state.profile[pc];
+        if (types == TYPE_INT || types == TYPE_FLT) {
+            speculation[pc] = types;
+        }
+    }
+    compiler.enqueue(p, &state, speculation);
+}
+
+// A guard failed before the instruction at pc ran. When it keeps failing,
+// the code is discarded and p compiled again without speculating at pc.
+static void deoptimize(Proto *p, TierState &state, int64_t pc) {
+    if (getenv("MINILUA_TIERS")) {
+        fprintf(stderr, "jit: deoptimized at pc %" PRId64 "\n", pc);
+    }
+    if (++state.deopts[pc] < MAX_DEOPTS) {
+        return;
+    }
+    state.deopts[pc] = 0;
+    state.profile[pc] |= PROFILE_MIXED;
+    compiler.discard(&state);
+    state.queued = false;
+    tier_up(p, state);
+}
+
+// Runs the compiled code from pc, 0 or a loop header (on-stack replacement),
+// once it is published. mls->registers is the frame of both tiers, so after a
+// failed guard the interpreter goes on from the pc returned.
+static int64_t run_compiled(MiniLuaState *mls, TierState &state, size_t pc) {
+    compiled_chunk f = state.compiled.load(std::memory_order_acquire);
+    if (!f) {
+        return NOT_COMPILED;
+    }
+    if (pc != 0 && getenv("MINILUA_TIERS")) {
+        fprintf(stderr, "jit: entering compiled code at pc %zu\n", pc);
+    }
+    state.entered = true;
+    int64_t exit = f(mls, mls->proto->k, pc);
+    if (exit != CHUNK_RETURNED) {
+        deoptimize(mls->proto, state, exit);
+    }
+    return exit;
+}
+
+static void run_tiers(MiniLuaState *mls, TierState &state) {
+    Proto *p = mls->proto;
+    if (state.profile.empty()) {
+        state.profile.resize(p->sizecode);
+        state.deopts.resize(p->sizecode);
+    }
+    if (++state.calls >= HOT_CALLS) {
+        tier_up(p, state);
+    }
+
+    size_t pc = 0;
+    bool enter = true;
+    for (;;) {
+        if (enter) {
+            int64_t exit = run_compiled(mls, state, pc);
+            if (exit == CHUNK_RETURNED) {
+                return;
+            }
+            if (exit != NOT_COMPILED) {
+                pc = exit;
+            }
+        }
+
+        Instruction inst = p->code[pc];
+        uint32_t op = (inst >> POS_OP) & 0x3F;
+
+        if (op == OP_RETURN) {
+            uint32_t a = (inst >> POS_A) & MAXARG_A;
+            uint32_t b = (inst >> POS_B) & MAXARG_B;
+            if (b == 0) {
+                error_default();
+            }
+            mls->return_begin = a;
+            mls->return_end = a + b - 1;
+            return;
+        }
+
+        if (!state.queued) {
+            profile_types(mls, state, pc, inst);
+        }
+        int64_t offset = (int64_t) step_in_C(mls, inst, op, p->k);
+        pc += 1 + offset;
+        if (offset < 0 && ++state.backedges >= HOT_BACKEDGES) {
+            tier_up(p, state);
+        }
+
+        // the loop headers of loop_headers(): FORLOOP before it runs, and
+        // the target of any other backward jump
+        enter = (offset < 0 && op != OP_FORLOOP) || ((p->code[pc] >> POS_OP) & 0x3F) == OP_FORLOOP;
+    }
+}
+
+extern "C" void interpret(MiniLuaState *mls) {
+    TierState &state = tier_states[mls->proto];
+    if (!jit_stats) {
+        run_tiers(mls, state);
+        return;
+    }
+
+    // calls that moved between the tiers are not counted
+    auto start = std::chrono::steady_clock::now();
+    bool compiled = state.compiled.load(std::memory_order_acquire) != nullptr;
+    state.entered = false;
+    run_tiers(mls, state);
+    double ms = elapsed_ms(start);
+    if (compiled) {
+        state.compiled_calls++;
+        state.compiled_ms += ms;
+    } else if (!state.entered) {
+        state.interpreted_calls++;
+        state.interpreted_ms += ms;
+    }
+}
+
+#endif
@@ -0,0 +1,186 @@
+/*
+* File: perfmap.h
+*
+* Names the code generated at run time for the Linux perf tools, which
+* otherwise only see anonymous addresses in it. Every engine that emits
+* code (the stencils of c-minilua-cp, the context-threaded code of
+* c-minilua-ct, the chunks of jit.cpp and the traces of trace.cpp) calls
+* perfRegisterRange() once the code is in place, with a name made of the
+* Proto's source, its linedefined and the bytecode pcs the code runs,
+* numbered from 1 as in luac -l:
+*
+*     @fib.lua:0 chunk pc 1-21
+*
+* MINILUA_PERF_MAP=1 in the environment appends such entries to
+* /tmp/perf-PID.map, which perf report reads as is. MINILUA_JITDUMP=1
+* writes them, with a copy of the code, to jit-PID.dump in JITDUMPDIR (or
+* the current directory) in the jitdump format, for annotated profiles:
+*
+*     perf record -k mono ./jit FILE.byte
+*     perf inject --jit -i perf.data -o perf.jit.data
+*     perf report -i perf.jit.data
+*
+* Included by c-minilua.c (as C) and by jit.cpp and trace.cpp (as C++).
+* Only one thread at a time may register code.
+*/
+
+#include <elf.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define JITDUMP_MAGIC           0x4A695444
+#define JITDUMP_VERSION         1
+#define JITDUMP_CODE_LOAD       0
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t total_size;
+    uint32_t elf_mach;
+    uint32_t pad1;
+    uint32_t pid;
+    uint64_t timestamp;
+    uint64_t flags;
+} JitdumpHeader;
+
+typedef struct {
+    uint32_t id;
+    uint32_t total_size;     /* of the record, with the name and the code */
+    uint64_t timestamp;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t vma;
+    uint64_t code_addr;
+    uint64_t code_size;
+    uint64_t code_index;
+    /* followed by the name, NUL terminated, and code_size bytes of code */
+} JitdumpCodeLoad;
+
+typedef struct {
+    int initialized;
+    FILE *map;             /* /tmp/perf-PID.map */
+    FILE *dump;            /* jit-PID.dump */
+    uint64_t code_index;
+} PerfState;
+
+static PerfState perf;
+
+// jitdump timestamps must match perf record -k mono
+static
+uint64_t perfTimestamp(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static
+FILE * openJitdump(int pid)
+{
+    const char *dir = getenv("JITDUMPDIR");
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/jit-%d.dump", dir ? dir : ".", pid);
+    FILE *F = fopen(path, "w+");
+    if (!F) {
+        fprintf(stderr, "perf: could not open %s\n", path);
+        return NULL;
+    }
+
+    JitdumpHeader h;
+    memset(&h, 0, sizeof(h));
+    h.magic = JITDUMP_MAGIC;
+    h.version = JITDUMP_VERSION;
+    h.total_size = sizeof(h);
+#if defined(__x86_64__)
+    h.elf_mach = EM_X86_64;
+#elif defined(__aarch64__)
+    h.elf_mach = EM_AARCH64;
+#endif
+    h.pid = pid;
+    h.timestamp = perfTimestamp();
+    fwrite(&h, sizeof(h), 1, F);
+    fflush(F);
+
+    // perf record learns about the file from this executable mapping of it
+    void *marker = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC, MAP_PRIVATE, fileno(F), 0);
+    if (marker == MAP_FAILED) {
+        fprintf(stderr, "perf: could not map %s\n", path);
+        fclose(F);
+        return NULL;
+    }
+    return F;
+}
+
+// Whether any output was asked for, checked before building names
+static
+int perfEnabled(void)
+{
+    if (!perf.initialized) {
+        perf.initialized = 1;
+        int pid = (int) getpid();
+        if (getenv("MINILUA_PERF_MAP")) {
+            char path[64];
+            snprintf(path, sizeof(path), "/tmp/perf-%d.map", pid);
+            perf.map = fopen(path, "w");
+            if (!perf.map) {
+                fprintf(stderr, "perf: could not open %s\n", path);
+            }
+        }
+        if (getenv("MINILUA_JITDUMP")) {
+            perf.dump = openJitdump(pid);
+        }
+    }
+    return perf.map || perf.dump;
+}
+
+static
+void perfRegister(const char *name, const void *code, size_t size)
+{
+    if (!perfEnabled() || size == 0) {
+        return;
+    }
+    if (perf.map) {
+        fprintf(perf.map, "%lx %lx %s\n", (unsigned long) (uintptr_t) code, (unsigned long) size, name);
+        fflush(perf.map);
+    }
+    if (perf.dump) {
+        JitdumpCodeLoad r;
+        size_t name_size = strlen(name) + 1;
+        r.id = JITDUMP_CODE_LOAD;
+        r.total_size = (uint32_t) (sizeof(r) + name_size + size);
+        r.timestamp = perfTimestamp();
+        r.pid = (uint32_t) getpid();
+        r.tid = r.pid;
+        r.vma = (uintptr_t) code;
+        r.code_addr = (uintptr_t) code;
+        r.code_size = size;
+        r.code_index = perf.code_index++;
+        fwrite(&r, sizeof(r), 1, perf.dump);
+        fwrite(name, 1, name_size, perf.dump);
+        fwrite(code, 1, size, perf.dump);
+        fflush(perf.dump);
+    }
+}
+
+// Registers code that runs the pcs first to last (from 0) of a Proto, as
+// "SOURCE:LINEDEFINED KIND pc FIRST-LAST" (from 1)
+static
+void perfRegisterRange(const char *source, int linedefined, const char *kind,
+                       int first, int last, const void *code, size_t size)
+{
+    if (!perfEnabled()) {
+        return;
+    }
+    char name[256];
+    if (first == last) {
+        snprintf(name, sizeof(name), "%s:%d %s pc %d", source, linedefined, kind, first + 1);
+    } else {
+        snprintf(name, sizeof(name), "%s:%d %s pc %d-%d", source, linedefined, kind, first + 1, last + 1);
+    }
+    perfRegister(name, code, size);
+}
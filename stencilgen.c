@@ -0,0 +1,167 @@
+/*
+* File: stencilgen.c
+*
+* Build-time tool of the copy-and-patch compiler: reads stencils.o (an
+* x86-64 ELF object built from stencils.c with -ffunction-sections and
+* -mcmodel=large) and prints stencils.h, which holds for every stencil_X
+* function its machine code and its holes, the places compileProto() in
+* c-minilua.c has to patch.
+*
+* Every relocation of a stencil must be an absolute R_X86_64_64 against
+* either a _HOLE_* symbol or an external function; anything else (a
+* constant pool in .rodata, a call to a local function, ...) could not be
+* pasted elsewhere, so it is an error.
+*
+* usage: stencilgen stencils.o > stencils.h
+*/
+
+#include <elf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HOLE_PREFIX     "_HOLE_"
+#define STENCIL_PREFIX  ".text.stencil_"
+
+static const char *input;
+
+static
+void fail(const char *msg, const char *arg)
+{
+    fprintf(stderr, "stencilgen: %s: %s%s\n", input, msg, arg);
+    exit(1);
+}
+
+static
+unsigned char * readFile(const char *name, size_t *size)
+{
+    FILE *F = fopen(name, "rb");
+    if (!F) {
+        fail("could not open file", "");
+    }
+    fseek(F, 0, SEEK_END);
+    *size = ftell(F);
+    fseek(F, 0, SEEK_SET);
+    unsigned char *buf = malloc(*size);
+    if (fread(buf, 1, *size, F) != *size) {
+        fail("could not read file", "");
+    }
+    fclose(F);
+    return buf;
+}
+
+// Offset where the code ends with "movabs $_HOLE_CONTINUE, %reg; jmp *%reg",
+// which compileProto() drops when the next instruction's code follows
+// anyway; 0 when it doesn't end like that.
+static
+size_t fallthroughOffset(const unsigned char *code, size_t size, size_t hole)
+{
+    if (hole < 2 || hole + 8 > size) {
+        return 0;
+    }
+    unsigned char rex = code[hole - 2];
+    unsigned char mov = code[hole - 1];
+    if ((rex != 0x48 && rex != 0x49) || mov < 0xb8 || mov > 0xbf) {
+        return 0;
+    }
+    int reg = mov - 0xb8;
+    const unsigned char *jmp = &code[hole + 8];
+    size_t rest = size - (hole + 8);
+    if (rex == 0x48 && rest == 2 && jmp[0] == 0xff && jmp[1] == 0xe0 + reg) {
+        return hole - 2;
+    }
+    if (rex == 0x49 && rest == 3 && jmp[0] == 0x41 && jmp[1] == 0xff && jmp[2] == 0xe0 + reg) {
+        return hole - 2;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s stencils.o > stencils.h\n", argv[0]);
+        exit(1);
+    }
+    input = argv[1];
+
+    size_t size;
+    unsigned char *buf = readFile(input, &size);
+    Elf64_Ehdr *eh = (Elf64_Ehdr *) buf;
+    if (size < sizeof(Elf64_Ehdr) || memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 ||
+        eh->e_ident[EI_CLASS] != ELFCLASS64 || eh->e_machine != EM_X86_64 || eh->e_type != ET_REL) {
+        fail("not an x86-64 ELF object file", "");
+    }
+
+    Elf64_Shdr *sh = (Elf64_Shdr *) (buf + eh->e_shoff);
+    const char *shstrtab = (const char *) (buf + sh[eh->e_shstrndx].sh_offset);
+
+    Elf64_Sym *symtab = NULL;
+    const char *strtab = NULL;
+    for (int i = 0; i < eh->e_shnum; i++) {
+        if (sh[i].sh_type == SHT_SYMTAB) {
+            symtab = (Elf64_Sym *) (buf + sh[i].sh_offset);
+            strtab = (const char *) (buf + sh[sh[i].sh_link].sh_offset);
+        }
+    }
+    if (!symtab) {
+        fail("no symbol table", "");
+    }
+
+    printf("/* Generated by stencilgen from %s, do not edit. */\n\n", input);
+
+    for (int i = 0; i < eh->e_shnum; i++) {
+        const char *section = shstrtab + sh[i].sh_name;
+        if (strncmp(section, STENCIL_PREFIX, strlen(STENCIL_PREFIX)) != 0) {
+            continue;
+        }
+        const char *name = section + strlen(".text.");
+        const unsigned char *code = buf + sh[i].sh_offset;
+        size_t code_size = sh[i].sh_size;
+
+        printf("static const unsigned char %s_code[] = {", name);
+        for (size_t j = 0; j < code_size; j++) {
+            printf("%s0x%02x,", j % 12 == 0 ? "\n    " : " ", code[j]);
+        }
+        printf("\n};\n");
+
+        size_t nholes = 0;
+        size_t fallthrough = 0;
+        printf("static const StencilHole %s_holes[] = {\n", name);
+        for (int j = 0; j < eh->e_shnum; j++) {
+            if (sh[j].sh_type != SHT_RELA || sh[j].sh_info != (Elf64_Word) i) {
+                continue;
+            }
+            Elf64_Rela *rela = (Elf64_Rela *) (buf + sh[j].sh_offset);
+            size_t n = sh[j].sh_size / sizeof(Elf64_Rela);
+            for (size_t k = 0; k < n; k++) {
+                Elf64_Sym *sym = &symtab[ELF64_R_SYM(rela[k].r_info)];
+                const char *sym_name = strtab + sym->st_name;
+                if (ELF64_R_TYPE(rela[k].r_info) != R_X86_64_64) {
+                    fail("relocation is not R_X86_64_64 in ", name);
+                }
+                if (strncmp(sym_name, HOLE_PREFIX, strlen(HOLE_PREFIX)) == 0) {
+                    printf("    { %lu, HOLE_%s, %ld, 0 },\n", (unsigned long) rela[k].r_offset,
+                           sym_name + strlen(HOLE_PREFIX), (long) rela[k].r_addend);
+                    if (strcmp(sym_name, HOLE_PREFIX "CONTINUE") == 0 && !fallthrough) {
+                        fallthrough = fallthroughOffset(code, code_size, rela[k].r_offset);
+                    }
+                } else if (sym->st_shndx == SHN_UNDEF && sym->st_name != 0) {
+                    printf("    { %lu, HOLE_SYMBOL, %ld, (uintptr_t) %s },\n", (unsigned long) rela[k].r_offset,
+                           (long) rela[k].r_addend, sym_name);
+                } else {
+                    fail("relocation against a local symbol in ", name);
+                }
+                nholes++;
+            }
+        }
+        if (nholes == 0) {
+            fail("no holes in ", name);
+        }
+        printf("};\n");
+        printf("static const Stencil %s = { %s_code, sizeof(%s_code), %lu, %s_holes, %lu };\n\n",
+               name, name, name, (unsigned long) fallthrough, name, (unsigned long) nholes);
+    }
+
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,304 @@
+/*
+* File: stencils.c
+*
+* Machine code templates ("stencils") for the copy-and-patch compiler of
+* c-minilua (make c-minilua-cp). Each stencil_X function is the handler of
+* one decoded instruction and ends by tail-calling the code of the next one.
+*
+* Operands and jump targets are the addresses of the _HOLE_* symbols, which
+* are never defined: built with -mcmodel=large, every use of one becomes a
+* 64-bit immediate with an R_X86_64_64 relocation. stencilgen copies the
+* code and those relocations into stencils.h, and compileProto() in
+* c-minilua.c pastes the code once per instruction and overwrites the holes
+* with the operands, the addresses of the following code, and of the
+* functions the stencil calls (step(), fmod, ...).
+*
+* The numeric handlers are generated from opcodes.def, like c-minilua.c's.
+* They only have the integer and float fast paths, anything else is handed
+* to step(), c-minilua's own interpreter, and continues at the code of the
+* pc it returns. Opcodes without a stencil of their own go through
+* stencil_STEP.
+*/
+
+#include <math.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// --- Type definitions copied from c-minilua.c
+typedef int64_t lua_integer;
+typedef double lua_float;
+
+#define LUA_TNUMBER     3
+#define LUA_TNUMFLT     (LUA_TNUMBER | (0 << 4))  /* float numbers */
+#define LUA_TNUMINT     (LUA_TNUMBER | (1 << 4))  /* integer numbers */
+
+typedef struct {
+    int typ;
+    union {
+        int b;
+        lua_integer i;
+        lua_float n;
+    } u;
+} Value;
+
+typedef struct Proto Proto;
+typedef struct DInstruction DInstruction;
+
+typedef struct MiniLuaState {
+    Proto *proto;
+    Value *registers;
+    size_t return_begin;
+    size_t return_end;
+} MiniLuaState;
+// --- End of type definitions
+
+size_t step(MiniLuaState *mls, DInstruction *inst, size_t pc);
+
+typedef void (*native_code)(Value *registers, MiniLuaState *mls);
+
+// Holes, see compileProto() for their values. They are weak so that the
+// compiler cannot assume their addresses are non-null, as A may well be 0.
+#define WEAK __attribute__((weak))
+extern char _HOLE_A[] WEAK;         /* inst->a */
+extern char _HOLE_B[] WEAK;         /* inst->b */
+extern char _HOLE_C[] WEAK;         /* inst->c */
+extern char _HOLE_INST[] WEAK;      /* the DInstruction itself */
+extern char _HOLE_PC[] WEAK;        /* pc of the next instruction */
+extern char _HOLE_TABLE[] WEAK;     /* code address of every pc */
+extern void _HOLE_CONTINUE(Value *registers, MiniLuaState *mls) WEAK;  /* next instruction */
+extern void _HOLE_SKIP(Value *registers, MiniLuaState *mls) WEAK;      /* the one after it */
+extern void _HOLE_JUMP(Value *registers, MiniLuaState *mls) WEAK;      /* inst->target */
+
+#define HOLE(name)  ((intptr_t) _HOLE_##name)
+#define R(n)        (&registers[n])
+
+#define STENCIL(name) \
+    void stencil_##name(Value *registers, MiniLuaState *mls)
+
+#define GOTO(next) \
+    do { _HOLE_##next(registers, mls); return; } while (0)
+
+// step() executes the instruction, the code of the pc it returns follows
+#define SLOW_PATH() \
+    do {                                                                    \
+        size_t next = step(mls, (DInstruction *) _HOLE_INST, HOLE(PC));     \
+        ((native_code) ((uintptr_t *) _HOLE_TABLE)[next])(registers, mls);  \
+        return;                                                             \
+    } while (0)
+
+#define IS_II(b, c) ((b)->typ == LUA_TNUMINT && (c)->typ == LUA_TNUMINT)
+#define IS_FF(b, c) ((b)->typ == LUA_TNUMFLT && (c)->typ == LUA_TNUMFLT)
+
+static inline
+void set_int(Value *v, lua_integer i)
+{
+    v->typ = LUA_TNUMINT;
+    v->u.i = i;
+}
+
+static inline
+void set_float(Value *v, lua_float n)
+{
+    v->typ = LUA_TNUMFLT;
+    v->u.n = n;
+}
+
+// Primitives of opcodes.def, as in c-minilua.c
+#define INT_ADD(x, y)       ((x) + (y))
+#define INT_SUB(x, y)       ((x) - (y))
+#define INT_MUL(x, y)       ((x) * (y))
+#define INT_REM(x, y)       ((x) % (y))
+#define INT_QUOT(x, y)      ((x) / (y))
+#define INT_EQ(x, y)        ((x) == (y))
+#define INT_LT(x, y)        ((x) < (y))
+#define INT_LE(x, y)        ((x) <= (y))
+
+#define FLT_ADD(x, y)       ((x) + (y))
+#define FLT_SUB(x, y)       ((x) - (y))
+#define FLT_MUL(x, y)       ((x) * (y))
+#define FLT_DIV(x, y)       ((x) / (y))
+#define FLT_FMOD(x, y)      fmod((x), (y))
+#define FLT_FLOORDIV(x, y)  floor((x) / (y))
+#define FLT_POW(x, y)       pow((x), (y))
+#define FLT_EQ(x, y)        ((x) == (y))
+#define FLT_LT(x, y)        ((x) < (y))
+#define FLT_LE(x, y)        ((x) <= (y))
+
+
+STENCIL(STEP) {
+    SLOW_PATH();
+}
+
+// also LOADK and LOADKX, whose constant is at a negative offset
+STENCIL(MOVE) {
+    *R(HOLE(A)) = *R(HOLE(B));
+    GOTO(CONTINUE);
+}
+
+STENCIL(JMP) {
+    GOTO(JUMP);
+}
+
+STENCIL(RETURN) {
+    (void) registers;
+    mls->return_begin = HOLE(A);
+    mls->return_end = HOLE(A) + HOLE(B) - 1;
+}
+
+// Integer loops with a positive step count their iterations down in
+// R(A+1), as FORLOOP_I does, the other cases are left to forPrep() in
+// step(). The index is bumped in unsigned arithmetic, as it may step out of
+// the integer range.
+STENCIL(FORPREP) {
+    Value *init = R(HOLE(A) + 0);
+    Value *limit = R(HOLE(A) + 1);
+    Value *stp = R(HOLE(A) + 2);
+    if (IS_II(init, limit) && stp->typ == LUA_TNUMINT && stp->u.i > 0) {
+        uint64_t count = 0;
+        if (init->u.i <= limit->u.i) {
+            count = ((uint64_t) limit->u.i - (uint64_t) init->u.i) / (uint64_t) stp->u.i;
+            if (count < UINT64_MAX) {
+                count++;
+            }
+        }
+        set_int(limit, (lua_integer) count);
+        set_int(init, (lua_integer) ((uint64_t) init->u.i - (uint64_t) stp->u.i));
+        GOTO(JUMP);
+    }
+    SLOW_PATH();
+}
+
+// An integer loop with a positive step was prepared as FORLOOP_I, a float
+// one the same way as FORLOOP_F or the generic FORLOOP
+STENCIL(FORLOOP) {
+    Value *init = R(HOLE(A) + 0);
+    Value *limit = R(HOLE(A) + 1);
+    Value *stp = R(HOLE(A) + 2);
+    Value *var = R(HOLE(A) + 3);
+    if (IS_II(init, limit) && stp->typ == LUA_TNUMINT && stp->u.i > 0) {
+        if (limit->u.i != 0) {
+            limit->u.i = (lua_integer) ((uint64_t) limit->u.i - 1);
+            init->u.i = (lua_integer) ((uint64_t) init->u.i + (uint64_t) stp->u.i);
+            set_int(var, init->u.i);
+            GOTO(JUMP);
+        }
+        GOTO(CONTINUE);
+    }
+    if (IS_FF(init, limit) && stp->typ == LUA_TNUMFLT) {
+        init->u.n += stp->u.n;
+        if (init->u.n <= limit->u.n) {
+            set_float(var, init->u.n);
+            GOTO(JUMP);
+        }
+        GOTO(CONTINUE);
+    }
+    SLOW_PATH();
+}
+
+// --- Stencils generated from opcodes.def
+// OP for the generic handler (and OP_KI), OP_I and OP_F for the handlers
+// specializeCode() gives to proven operand types.
+
+#define GEN_ARITH(OP, INT, FLT)                             \
+    STENCIL(OP) {                                           \
+        Value *a = R(HOLE(A));                              \
+        Value *b = R(HOLE(B));                              \
+        Value *c = R(HOLE(C));                              \
+        if (IS_II(b, c)) {                                  \
+            set_int(a, INT_##INT(b->u.i, c->u.i));          \
+        } else if (IS_FF(b, c)) {                           \
+            set_float(a, FLT_##FLT(b->u.n, c->u.n));        \
+        } else {                                            \
+            SLOW_PATH();                                    \
+        }                                                   \
+        GOTO(CONTINUE);                                     \
+    }
+
+#define GEN_ARITH_FLOAT(OP, FLT)                            \
+    STENCIL(OP) {                                           \
+        Value *a = R(HOLE(A));                              \
+        Value *b = R(HOLE(B));                              \
+        Value *c = R(HOLE(C));                              \
+        if (IS_II(b, c)) {                                  \
+            set_float(a, FLT_##FLT((lua_float) b->u.i, (lua_float) c->u.i)); \
+        } else if (IS_FF(b, c)) {                           \
+            set_float(a, FLT_##FLT(b->u.n, c->u.n));        \
+        } else {                                            \
+            SLOW_PATH();                                    \
+        }                                                   \
+        GOTO(CONTINUE);                                     \
+    }
+
+#define GEN_ARITH_QUICK(OP, T, PRIM, FIELD, SET)            \
+    STENCIL(OP##_##T) {                                     \
+        SET(R(HOLE(A)), PRIM(R(HOLE(B))->u.FIELD, R(HOLE(C))->u.FIELD)); \
+        GOTO(CONTINUE);                                     \
+    }
+
+#define GEN_ARITH_II(OP, INT, FLT)  GEN_ARITH_QUICK(OP, I, INT_##INT, i, set_int)
+#define GEN_ARITH_FF(OP, INT, FLT)  GEN_ARITH_QUICK(OP, F, FLT_##FLT, n, set_float)
+#define GEN_ARITH_II_FF(OP, INT, FLT) GEN_ARITH_II(OP, INT, FLT) GEN_ARITH_FF(OP, INT, FLT)
+
+// compare: skips the next instruction unless the result is A;
+// compare-and-jump: jumps to the target when it is, else skips the JMP
+#define GEN_COMPARE(OP, INT, FLT)                           \
+    STENCIL(OP) {                                           \
+        Value *b = R(HOLE(B));                              \
+        Value *c = R(HOLE(C));                              \
+        intptr_t result;                                    \
+        if (IS_II(b, c)) {                                  \
+            result = INT_##INT(b->u.i, c->u.i);             \
+        } else if (IS_FF(b, c)) {                           \
+            result = FLT_##FLT(b->u.n, c->u.n);             \
+        } else {                                            \
+            SLOW_PATH();                                    \
+        }                                                   \
+        if (result != HOLE(A)) {                            \
+            GOTO(SKIP);                                     \
+        }                                                   \
+        GOTO(CONTINUE);                                     \
+    }                                                       \
+    STENCIL(OP##_JMP) {                                     \
+        Value *b = R(HOLE(B));                              \
+        Value *c = R(HOLE(C));                              \
+        intptr_t result;                                    \
+        if (IS_II(b, c)) {                                  \
+            result = INT_##INT(b->u.i, c->u.i);             \
+        } else if (IS_FF(b, c)) {                           \
+            result = FLT_##FLT(b->u.n, c->u.n);             \
+        } else {                                            \
+            SLOW_PATH();                                    \
+        }                                                   \
+        if (result == HOLE(A)) {                            \
+            GOTO(JUMP);                                     \
+        }                                                   \
+        GOTO(SKIP);                                         \
+    }
+
+#define GEN_COMPARE_QUICK(OP, T, PRIM, FIELD)               \
+    STENCIL(OP##_##T) {                                     \
+        if (PRIM(R(HOLE(B))->u.FIELD, R(HOLE(C))->u.FIELD) != HOLE(A)) { \
+            GOTO(SKIP);                                     \
+        }                                                   \
+        GOTO(CONTINUE);                                     \
+    }                                                       \
+    STENCIL(OP##_JMP_##T) {                                 \
+        if (PRIM(R(HOLE(B))->u.FIELD, R(HOLE(C))->u.FIELD) == HOLE(A)) { \
+            GOTO(JUMP);                                     \
+        }                                                   \
+        GOTO(SKIP);                                         \
+    }
+
+#define GEN_COMPARE_II(OP, INT, FLT)  GEN_COMPARE_QUICK(OP, I, INT_##INT, i)
+#define GEN_COMPARE_FF(OP, INT, FLT)  GEN_COMPARE_QUICK(OP, F, FLT_##FLT, n)
+#define GEN_COMPARE_II_FF(OP, INT, FLT) GEN_COMPARE_II(OP, INT, FLT) GEN_COMPARE_FF(OP, INT, FLT)
+
+#define OPSPEC_ARITH(OP, INT, FLT, QUICK) \
+    GEN_ARITH(OP, INT, FLT) GEN_ARITH_##QUICK(OP, INT, FLT)
+#define OPSPEC_ARITH_FLOAT(OP, FLT) \
+    GEN_ARITH_FLOAT(OP, FLT)
+#define OPSPEC_COMPARE(OP, INT, FLT, QUICK) \
+    GEN_COMPARE(OP, INT, FLT) GEN_COMPARE_##QUICK(OP, INT, FLT)
+#define OPSPEC_EQUALITY(OP, INT, FLT, QUICK) \
+    GEN_COMPARE(OP, INT, FLT) GEN_COMPARE_##QUICK(OP, INT, FLT)
+#include "opcodes.def"
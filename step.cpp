@@ -1,8 +1,13 @@
 /*
-* File: onefunction.cpp
+* File: step.cpp
 * Author: Matheus Coelho Ambrozio
 * Date: May, 2017
 *
+* Builds step(), the LLVM IR function that runs one instruction, from one
+* create_op_*_block builder per opcode. Its main() writes step.ll for
+* hybrid; compiled with -DSTEP_NO_MAIN, the builders are a library for the
+* code generators that reuse them (see step.h).
+*
 * To compile , execute on terminal :
 * clang++ -o step step.cpp `llvm-config --cxxflags --ldflags --libs all --system-libs`
 */
@@ -15,218 +20,22 @@
 #include <sstream>
 //
 
-// LLVM includes
-#include <llvm/IR/IRBuilder.h>
-#include <llvm/IR/LLVMContext.h>
-#include <llvm/IR/Module.h>
-#include <llvm/Support/TargetSelect.h>
-#include <llvm/Support/DynamicLibrary.h>
-//
-
 //
 #define DEBUG do { std::cout << "AQUI" << std::endl; } while (0);
 //
 
-#define SIZE_C          9
-#define SIZE_B          9
-#define SIZE_Bx         (SIZE_C + SIZE_B)
-#define SIZE_A          8
-#define SIZE_Ax         (SIZE_C + SIZE_B + SIZE_A)
-
-#define SIZE_OP         6
-
-#define POS_OP          0
-#define POS_A           (POS_OP + SIZE_OP)
-#define POS_C           (POS_A + SIZE_A)
-#define POS_B           (POS_C + SIZE_C)
-#define POS_Bx          POS_C
-#define POS_Ax          POS_A
-
-
-#define MAXARG_A        ((1<<SIZE_A)-1)
-#define MAXARG_B        ((1<<SIZE_B)-1)
-#define MAXARG_C        ((1<<SIZE_C)-1)
+#include "step.h"
 
-#define MAXARG_Ax       ((1<<SIZE_Ax)-1)
-#define MAXARG_Bx       ((1<<SIZE_Bx)-1)
-#define MAXARG_sBx      (MAXARG_Bx>>1)    // 'sBx' is signed
-
-/* this bit 1 means constant (0 means register) */
-#define BITRK           (1 << (SIZE_B - 1))
-
-// Lua parameters
-#define LUAI_MAXSHORTLEN 40
-
-#define LUA_TNIL                0
-#define LUA_TBOOLEAN            1
-#define LUA_TLIGHTUSERDATA      2
-#define LUA_TNUMBER             3
-#define LUA_TSTRING             4
-#define LUA_TTABLE              5
-#define LUA_TFUNCTION           6
-#define LUA_TUSERDATA           7
-#define LUA_TTHREAD             8
-#define LUA_NUMTAGS             9
-
-#define LUA_TNUMFLT     (LUA_TNUMBER | (0 << 4))  /* float numbers */
-#define LUA_TNUMINT     (LUA_TNUMBER | (1 << 4))  /* integer numbers */
-
-#define LUA_TSHRSTR     (LUA_TSTRING | (0 << 4))  /* short strings */
-#define LUA_TLNGSTR     (LUA_TSTRING | (1 << 4))  /* long strings */
-
-
-typedef enum {
-/*----------------------------------------------------------------------
-name          code     args    description
-------------------------------------------------------------------------*/
-OP_MOVE       =  0, /*  A B     R(A) := R(B)                                    */
-OP_LOADK      =  1, /*  A Bx    R(A) := Kst(Bx)                                 */
-OP_LOADKX     =  2, /*  A       R(A) := Kst(extra arg)                          */
-OP_LOADBOOL   =  3, /*  A B C   R(A) := (Bool)B; if (C) pc++                    */
-OP_LOADNIL    =  4, /*  A B     R(A), R(A+1), ..., R(A+B) := nil                */
-OP_GETUPVAL   =  5, /*  A B     R(A) := UpValue[B]                              */
-
-OP_GETTABUP   =  6, /*  A B C   R(A) := UpValue[B][RK(C)]                       */
-OP_GETTABLE   =  7, /*  A B C   R(A) := R(B)[RK(C)]                             */
-
-OP_SETTABUP   =  8, /*  A B C   UpValue[A][RK(B)] := RK(C)                      */
-OP_SETUPVAL   =  9, /*  A B     UpValue[B] := R(A)                              */
-OP_SETTABLE   = 10, /*  A B C   R(A)[RK(B)] := RK(C)                            */
-
-OP_NEWTABLE   = 11, /*  A B C   R(A) := {} (size = B,C)                         */
-
-OP_SELF       = 12, /*  A B C   R(A+1) := R(B); R(A) := R(B)[RK(C)]   */
-
-OP_ADD        = 13, /*  A B C   R(A) := RK(B) + RK(C)                           */
-OP_SUB        = 14, /*  A B C   R(A) := RK(B) - RK(C)                           */
-OP_MUL        = 15, /*  A B C   R(A) := RK(B) * RK(C)                           */
-OP_MOD        = 16, /*  A B C   R(A) := RK(B) % RK(C)                           */
-OP_POW        = 17, /*  A B C   R(A) := RK(B) ^ RK(C)                           */
-OP_DIV        = 18, /*  A B C   R(A) := RK(B) / RK(C)                           */
-OP_IDIV       = 19, /*  A B C   R(A) := RK(B) // RK(C)                          */
-OP_BAND       = 20, /*  A B C   R(A) := RK(B) & RK(C)                           */
-OP_BOR        = 21, /*  A B C   R(A) := RK(B) | RK(C)                           */
-OP_BXOR       = 22, /*  A B C   R(A) := RK(B) ~ RK(C)                           */
-OP_SHL        = 23, /*  A B C   R(A) := RK(B) << RK(C)                          */
-OP_SHR        = 24, /*  A B C   R(A) := RK(B) >> RK(C)                          */
-OP_UNM        = 25, /*  A B     R(A) := -R(B)                                   */
-OP_BNOT       = 26, /*  A B     R(A) := ~R(B)                                   */
-OP_NOT        = 27, /*  A B     R(A) := not R(B)                                */
-OP_LEN        = 28, /*  A B     R(A) := length of R(B)                          */
-
-OP_CONCAT     = 29, /*  A B C   R(A) := R(B).. ... ..R(C)                       */
-
-OP_JMP        = 30, /*  A sBx   pc+=sBx; if (A) close all upvalues >= R(A - 1)  */
-OP_EQ         = 31, /*  A B C   if ((RK(B) == RK(C)) ~= A) then pc++            */
-OP_LT         = 32, /*  A B C   if ((RK(B) <  RK(C)) ~= A) then pc++            */
-OP_LE         = 33, /*  A B C   if ((RK(B) <= RK(C)) ~= A) then pc++            */
-
-OP_TEST       = 34, /*  A C     if not (R(A) <=> C) then pc++                   */
-OP_TESTSET    = 35, /*  A B C   if (R(B) <=> C) then R(A) := R(B) else pc++     */
-
-OP_CALL       = 36, /*  A B C   R(A), ... ,R(A+C-2) := R(A)(R(A+1), ... ,R(A+B-1)) */
-OP_TAILCALL   = 37, /*  A B C   return R(A)(R(A+1), ... ,R(A+B-1))              */
-OP_RETURN     = 38, /*  A B     return R(A), ... ,R(A+B-2)      (see note)      */
-
-OP_FORLOOP    = 39, /*  A sBx   R(A)+=R(A+2); if R(A) <?= R(A+1) then { pc+=sBx; R(A+3)=R(A) }*/
-OP_FORPREP    = 40, /*  A sBx   R(A)-=R(A+2); pc+=sBx                           */
-
-OP_TFORCALL   = 41, /*  A C     R(A+3), ... ,R(A+2+C) := R(A)(R(A+1), R(A+2));  */
-OP_TFORLOOP   = 42, /*  A sBx   if R(A+1) ~= nil then { R(A)=R(A+1); pc += sBx }*/
-
-OP_SETLIST    = 43, /*  A B C   R(A)[(C-1)*FPF+i] := R(A+i), 1 <= i <= B        */
-
-OP_CLOSURE    = 44, /*  A Bx    R(A) := closure(KPROTO[Bx])                     */
-
-OP_VARARG     = 45, /*  A B     R(A), R(A+1), ..., R(A+B-2) = vararg            */
-
-OP_EXTRAARG   = 46, /*  Ax      extra (larger) argument for previous opcode     */
-} OpCode;
-
-
-
-// --- Type definitions copied from c-minilua.c
-typedef uint8_t Byte;
-typedef int32_t Int;
-typedef uint32_t Instruction;
-typedef int64_t lua_integer;
-typedef double lua_float;
-
-typedef enum { SHORT_STRING, LONG_STRING } StringType;
-typedef struct {
-    StringType typ;
-    const char *str;
-} String;
-
-typedef struct {
-    int typ;
-    union {
-        int b;
-        lua_integer i;
-        lua_float n;
-    } u;
-} Value;
-
-// Function prototype
-typedef struct Proto {
-    Byte numparams;  /* number of fixed parameters */
-    Byte is_vararg;
-    Byte maxstacksize;  /* number of registers needed by this function */
-    Int sizeupvalues;  /* size of 'upvalues' */
-    Int sizek;  /* size of 'k' */
-    Int sizecode;
-    //Int sizelineinfo;
-    Int sizep;  /* size of 'p' */
-    //Int sizelocvars;
-    Int linedefined;  /* debug information  */
-    Int lastlinedefined;  /* debug information  */
-    Value *k;  /* constants used by the function */
-    Instruction *code;  /* opcodes */
-    //struct Proto **p;  /* functions defined inside the function */
-    //int *lineinfo;  /* map from opcodes to source lines (debug information) */
-    //LocVar *locvars;  /* information about local variables (debug information) */
-    //Upvaldesc *upvalues;  /* upvalue information */
-    //struct LClosure *cache;  /* last-created closure with this prototype */
-    String  *source;  /* used for debug information */
-    //GCObject *gclist;
-} Proto;
-
-//MiniLuaState Struct
-typedef struct MiniLuaState {
-    Proto *proto;
-    Value *registers;
-    size_t return_begin;
-    size_t return_end;
-} MiniLuaState;
-// --- End of type definitions
-
-
-
-//Function definitions
-//TODO put this on a header file
-llvm::Value* create_op_move_block();
-llvm::Value* create_op_loadk_block();
-llvm::Value* create_op_add_block();
-llvm::Value* create_op_sub_block();
-llvm::Value* create_op_mul_block();
-llvm::Value* create_op_div_block();
-llvm::Value* create_op_mod_block();
-llvm::Value* create_op_idiv_block();
-llvm::Value* create_op_pow_block();
-llvm::Value* create_op_unm_block();
-llvm::Value* create_op_not_block();
-llvm::Value* create_op_jmp_block();
-
-llvm::Value* create_op_eq_block();
-llvm::Value* create_op_lt_block();
-llvm::Value* create_op_le_block();
-llvm::Value* create_op_forloop_block();
-llvm::Value* create_op_forprep_block();
+#include <llvm/IR/IntrinsicInst.h>
+#include <llvm/IR/MDBuilder.h>
+#include <llvm/IR/Operator.h>
+#include <llvm/Passes/PassBuilder.h>
 
 
 
 // Globals
-llvm::LLVMContext context;
+std::unique_ptr<llvm::LLVMContext> OwnerContext(new llvm::LLVMContext);
+llvm::LLVMContext &context = *OwnerContext;
 std::unique_ptr<llvm::Module> Owner(new llvm::Module("step_module", context));
 llvm::Module *module = Owner.get();
 llvm::IRBuilder<> builder(context);
@@ -243,11 +52,15 @@ llvm::PointerType *p_proto_struct_type;
 llvm::StructType *miniluastate_struct_type;
 llvm::PointerType *p_miniluastate_struct_type;
 
+llvm::FunctionType *step_type;
+
 llvm::Function *step_func;
 llvm::Value *_mls;
 llvm::Value *_inst;
 llvm::Value *_op;
 llvm::Value *_constants;
+// when set, the builders use it instead of loading mls->registers
+llvm::Value *_registers = NULL;
 
 llvm::Function *llvm_memcpy;
 llvm::Function *llvm_floor;
@@ -255,24 +68,8 @@ llvm::Function *llvm_pow;
 
 llvm::Function *error; //used
 
-// debug errors
-llvm::Function *error_1;
-llvm::Function *error_2;
-llvm::Function *error_3;
-llvm::Function *error_4;
-llvm::Function *error_5;
-llvm::Function *error_6;
-
-// llvm::BasicBlock *error_block_1;
-// llvm::BasicBlock *error_block_2;
-// llvm::BasicBlock *error_block_3;
-// llvm::BasicBlock *error_block_4;
-// llvm::BasicBlock *error_block_5;
-// llvm::BasicBlock *error_block_6;
 //
-
-//
-llvm::Function *step_in_C;
+llvm::Function *step_in_C_func;
 //
 
 llvm::PHINode *return_phi_node;
@@ -281,98 +78,21 @@ llvm::BasicBlock *entry_block;
 llvm::BasicBlock *end_block;
 llvm::BasicBlock *op_move_block;
 llvm::BasicBlock *op_loadk_block;
-llvm::BasicBlock *op_add_block;
-llvm::BasicBlock *op_sub_block;
-llvm::BasicBlock *op_mul_block;
-llvm::BasicBlock *op_div_block;
-llvm::BasicBlock *op_mod_block;
-llvm::BasicBlock *op_idiv_block;
-llvm::BasicBlock *op_pow_block;
 llvm::BasicBlock *op_unm_block;
 llvm::BasicBlock *op_not_block;
 llvm::BasicBlock *op_jmp_block;
 llvm::BasicBlock *op_eq_block;
-llvm::BasicBlock *op_lt_block;
-llvm::BasicBlock *op_le_block;
 llvm::BasicBlock *op_forloop_block;
 llvm::BasicBlock *op_forprep_block;
+llvm::BasicBlock *op_loadbool_block;
+llvm::BasicBlock *op_loadnil_block;
+llvm::BasicBlock *op_test_block;
+llvm::BasicBlock *op_testset_block;
 llvm::BasicBlock *default_block;
 
 llvm::BasicBlock *error_block;
 
 //
-llvm::BasicBlock *op_add_1_block;
-llvm::BasicBlock *op_add_2_block;
-llvm::BasicBlock *op_add_3_block;
-llvm::BasicBlock *op_add_4_block;
-llvm::BasicBlock *op_add_5_block;
-llvm::BasicBlock *op_add_6_block;
-llvm::BasicBlock *op_add_7_block;
-llvm::BasicBlock *op_add_8_block;
-llvm::BasicBlock *op_add_9_block;
-llvm::BasicBlock *op_add_10_block;
-
-llvm::BasicBlock *op_sub_1_block;
-llvm::BasicBlock *op_sub_2_block;
-llvm::BasicBlock *op_sub_3_block;
-llvm::BasicBlock *op_sub_4_block;
-llvm::BasicBlock *op_sub_5_block;
-llvm::BasicBlock *op_sub_6_block;
-llvm::BasicBlock *op_sub_7_block;
-llvm::BasicBlock *op_sub_8_block;
-llvm::BasicBlock *op_sub_9_block;
-llvm::BasicBlock *op_sub_10_block;
-
-llvm::BasicBlock *op_mul_1_block;
-llvm::BasicBlock *op_mul_2_block;
-llvm::BasicBlock *op_mul_3_block;
-llvm::BasicBlock *op_mul_4_block;
-llvm::BasicBlock *op_mul_5_block;
-llvm::BasicBlock *op_mul_6_block;
-llvm::BasicBlock *op_mul_7_block;
-llvm::BasicBlock *op_mul_8_block;
-llvm::BasicBlock *op_mul_9_block;
-llvm::BasicBlock *op_mul_10_block;
-
-llvm::BasicBlock *op_div_1_block;
-llvm::BasicBlock *op_div_4_block;
-llvm::BasicBlock *op_div_5_block;
-llvm::BasicBlock *op_div_6_block;
-llvm::BasicBlock *op_div_7_block;
-llvm::BasicBlock *op_div_8_block;
-llvm::BasicBlock *op_div_9_block;
-llvm::BasicBlock *op_div_10_block;
-
-llvm::BasicBlock *op_mod_1_block;
-llvm::BasicBlock *op_mod_2_block;
-llvm::BasicBlock *op_mod_3_block;
-llvm::BasicBlock *op_mod_4_block;
-llvm::BasicBlock *op_mod_5_block;
-llvm::BasicBlock *op_mod_6_block;
-llvm::BasicBlock *op_mod_7_block;
-llvm::BasicBlock *op_mod_8_block;
-llvm::BasicBlock *op_mod_9_block;
-llvm::BasicBlock *op_mod_10_block;
-
-llvm::BasicBlock *op_idiv_1_block;
-llvm::BasicBlock *op_idiv_2_block;
-llvm::BasicBlock *op_idiv_3_block;
-llvm::BasicBlock *op_idiv_4_block;
-llvm::BasicBlock *op_idiv_5_block;
-llvm::BasicBlock *op_idiv_6_block;
-llvm::BasicBlock *op_idiv_7_block;
-llvm::BasicBlock *op_idiv_8_block;
-llvm::BasicBlock *op_idiv_9_block;
-llvm::BasicBlock *op_idiv_10_block;
-
-llvm::BasicBlock *op_pow_1_block;
-llvm::BasicBlock *op_pow_4_block;
-llvm::BasicBlock *op_pow_5_block;
-llvm::BasicBlock *op_pow_6_block;
-llvm::BasicBlock *op_pow_7_block;
-llvm::BasicBlock *op_pow_8_block;
-llvm::BasicBlock *op_pow_9_block;
-llvm::BasicBlock *op_pow_10_block;
 
 llvm::BasicBlock *op_unm_1_block;
 llvm::BasicBlock *op_unm_2_block;
@@ -392,30 +112,12 @@ llvm::BasicBlock *op_eq_8_block;
 llvm::BasicBlock *op_eq_9_block;
 llvm::BasicBlock *op_eq_10_block;
 
-llvm::BasicBlock *op_lt_1_block;
-llvm::BasicBlock *op_lt_2_block;
-llvm::BasicBlock *op_lt_3_block;
-llvm::BasicBlock *op_lt_4_block;
-llvm::BasicBlock *op_lt_5_block;
-llvm::BasicBlock *op_lt_6_block;
-llvm::BasicBlock *op_lt_7_block;
-llvm::BasicBlock *op_lt_8_block;
-llvm::BasicBlock *op_lt_9_block;
-llvm::BasicBlock *op_lt_10_block;
-llvm::BasicBlock *op_lt_11_block;
-
-llvm::BasicBlock *op_le_1_block;
-llvm::BasicBlock *op_le_2_block;
-llvm::BasicBlock *op_le_3_block;
-llvm::BasicBlock *op_le_4_block;
-llvm::BasicBlock *op_le_5_block;
-llvm::BasicBlock *op_le_6_block;
-llvm::BasicBlock *op_le_7_block;
-llvm::BasicBlock *op_le_8_block;
-llvm::BasicBlock *op_le_9_block;
-llvm::BasicBlock *op_le_10_block;
-llvm::BasicBlock *op_le_11_block;
 
+
+llvm::BasicBlock *op_forloop_0_block;
+llvm::BasicBlock *op_forloop_check_block;
+llvm::BasicBlock *op_forloop_int_block;
+llvm::BasicBlock *op_forloop_float_block;
 llvm::BasicBlock *op_forloop_1_block;
 llvm::BasicBlock *op_forloop_2_block;
 llvm::BasicBlock *op_forloop_3_block;
@@ -446,22 +148,35 @@ llvm::BasicBlock *op_forprep_8_block;
 llvm::BasicBlock *op_forprep_9_block;
 llvm::BasicBlock *op_forprep_10_block;
 llvm::BasicBlock *op_forprep_11_block;
-//
 
+llvm::BasicBlock *op_loadnil_1_block;
 
-int main() {
+llvm::BasicBlock *op_testset_1_block;
 
-    //necessary LLVM initializations
-    llvm::InitializeNativeTarget();
-    llvm::InitializeNativeTargetAsmPrinter();
-    llvm::InitializeNativeTargetAsmParser();
+// bitwise operations, indexed by bitwise_index(op)
+llvm::BasicBlock *op_bitwise_block[NUM_BITWISE_OPCODES];
+llvm::BasicBlock *op_bitwise_1_block[NUM_BITWISE_OPCODES];
 
-    //create the context and the main module
-//    llvm::LLVMContext context;
-//    std::unique_ptr<llvm::Module> Owner(new llvm::Module("step_module", context));
-//    llvm::Module *module = Owner.get();
+static uint32_t bitwise_index(uint32_t op) {
+    return (op == OP_BNOT) ? NUM_BITWISE_OPCODES - 1 : op - OP_BAND;
+}
+
+// opcodes.def arithmetic, indexed by op - OP_ADD
+llvm::BasicBlock *op_arith_block[NUM_ARITH_OPCODES];
+llvm::BasicBlock *op_arith_int_block[NUM_ARITH_OPCODES];
+llvm::BasicBlock *op_arith_float_block[NUM_ARITH_OPCODES];
+
+// opcodes.def order comparisons, indexed by op - OP_LT
+llvm::BasicBlock *op_compare_block[NUM_COMPARE_OPCODES];
+llvm::BasicBlock *op_compare_end_block[NUM_COMPARE_OPCODES];
+
+// superinstructions, indexed by op - OP_EQ_JMP
+llvm::BasicBlock *op_fused_block[NUM_FUSED_OPCODES];
+llvm::BasicBlock *op_fused_end_block[NUM_FUSED_OPCODES];
+//
 
 
+void create_types() {
     // --- Declarations
     //treating string_type enum as an int32
 
@@ -502,6 +217,7 @@ int main() {
     proto_elements.push_back(llvm::Type::getInt32Ty(context));    //lastlinedefined
     proto_elements.push_back(p_value_struct_type);                //*k
     proto_elements.push_back(llvm::Type::getInt32PtrTy(context)); //*code
+    proto_elements.push_back(llvm::Type::getInt8PtrTy(context));  //*types
     proto_elements.push_back(p_string_struct_type);               //*source
     proto_struct_type->setBody(proto_elements);
     // std::cout << "Struct Proto dump:\n";
@@ -528,43 +244,19 @@ int main() {
     args.push_back(llvm::Type::getInt32Ty(context)); //inst
     args.push_back(llvm::Type::getInt32Ty(context)); //op
     args.push_back(p_value_struct_type);             //constants
-    llvm::FunctionType *step_type = llvm::FunctionType::get(llvm::Type::getInt64Ty(context), args, false);
-    step_func = llvm::Function::Create(step_type, llvm::Function::ExternalLinkage, "step", module);
-
-    //get arguments
-    auto argiter = step_func->arg_begin();
-    _mls = &*argiter++;
-    _inst = &*argiter++;
-    _op = &*argiter++;
-    _constants = &*argiter++;
-    //_mls->setName("arg");
-
-    // std::cout << "Arguments received by interpret function dump:\n";
-    // _mls->dump();
-    //std::cout << _mls;
-    // std::cout << "\n";
-
+    step_type = llvm::FunctionType::get(llvm::Type::getInt64Ty(context), args, false);
+}
 
+void create_declarations() {
     //
-    step_in_C = llvm::Function::Create(step_type, llvm::Function::ExternalLinkage, "step_in_C", module);
-    std::vector<llvm::Value *> step_args;
-    step_args.push_back(_mls);
-    step_args.push_back(_inst);
-    step_args.push_back(_op);
-    step_args.push_back(_constants);
+    step_in_C_func = llvm::Function::Create(step_type, llvm::Function::ExternalLinkage, "step_in_C", module);
 
     std::vector<llvm::Type *> error_args;
     llvm::FunctionType *error_type = llvm::FunctionType::get(llvm::Type::getVoidTy(context), error_args, false);
     error = llvm::Function::Create(error_type, llvm::Function::ExternalLinkage, "error_default", module);
-
-    // debug errors
-    // error_1 = llvm::Function::Create(error_type, llvm::Function::ExternalLinkage, "error_1", module);
-    // error_2 = llvm::Function::Create(error_type, llvm::Function::ExternalLinkage, "error_2", module);
-    // error_3 = llvm::Function::Create(error_type, llvm::Function::ExternalLinkage, "error_3", module);
-    // error_4 = llvm::Function::Create(error_type, llvm::Function::ExternalLinkage, "error_4", module);
-    // error_5 = llvm::Function::Create(error_type, llvm::Function::ExternalLinkage, "error_5", module);
-    // error_6 = llvm::Function::Create(error_type, llvm::Function::ExternalLinkage, "error_6", module);
-    //
+    error->addFnAttr(llvm::Attribute::Cold);
+    error->addFnAttr(llvm::Attribute::NoReturn);
+    error->addFnAttr(llvm::Attribute::NoUnwind);
 
     //Creating llvm::memcpy function reference
     llvm::SmallVector<llvm::Type *, 3> vec_memcpy;
@@ -578,11 +270,52 @@ int main() {
     vec_floor.push_back(llvm::Type::getDoubleTy(context));  /* double */
     llvm_floor = llvm::Intrinsic::getDeclaration(module, llvm::Intrinsic::floor, vec_floor);
 
-    //Creating llvm::floor function reference
-    llvm::SmallVector<llvm::Type *, 2> vec_pow;
-    vec_pow.push_back(llvm::Type::getDoubleTy(context));  /* double */
+    //Creating llvm::pow function reference (overloaded on a single type)
+    llvm::SmallVector<llvm::Type *, 1> vec_pow;
     vec_pow.push_back(llvm::Type::getDoubleTy(context));  /* double */
     llvm_pow = llvm::Intrinsic::getDeclaration(module, llvm::Intrinsic::pow, vec_pow);
+}
+
+
+#ifndef STEP_NO_MAIN
+int main() {
+
+    //necessary LLVM initializations
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+    llvm::InitializeNativeTargetAsmParser();
+
+    //create the context and the main module
+//    llvm::LLVMContext context;
+//    std::unique_ptr<llvm::Module> Owner(new llvm::Module("step_module", context));
+//    llvm::Module *module = Owner.get();
+
+
+    create_types();
+
+    step_func = llvm::Function::Create(step_type, llvm::Function::ExternalLinkage, "step", module);
+
+    //get arguments
+    auto argiter = step_func->arg_begin();
+    _mls = &*argiter++;
+    _inst = &*argiter++;
+    _op = &*argiter++;
+    _constants = &*argiter++;
+    //_mls->setName("arg");
+
+    // std::cout << "Arguments received by interpret function dump:\n";
+    // _mls->dump();
+    //std::cout << _mls;
+    // std::cout << "\n";
+
+
+    create_declarations();
+
+    std::vector<llvm::Value *> step_args;
+    step_args.push_back(_mls);
+    step_args.push_back(_inst);
+    step_args.push_back(_op);
+    step_args.push_back(_constants);
 
     //create irbuilder
 //    llvm::IRBuilder<> builder(context);
@@ -603,72 +336,33 @@ int main() {
 
     error_block = llvm::BasicBlock::Create(context, "error_block", step_func);
 
-    //debug error
-    // error_block_1 = llvm::BasicBlock::Create(context, "error_block_1", step_func);
-    // error_block_2 = llvm::BasicBlock::Create(context, "error_block_2", step_func);
-    // error_block_3 = llvm::BasicBlock::Create(context, "error_block_3", step_func);
-    // error_block_4 = llvm::BasicBlock::Create(context, "error_block_4", step_func);
-    // error_block_5 = llvm::BasicBlock::Create(context, "error_block_5", step_func);
-    // error_block_6 = llvm::BasicBlock::Create(context, "error_block_6", step_func);
-    //
-
     // --- Create code for the entry block
     builder.SetInsertPoint(entry_block);
 
-    llvm::SwitchInst *theSwitch = builder.CreateSwitch(_op, default_block, 18);
+    llvm::SwitchInst *theSwitch = builder.CreateSwitch(_op, default_block, 22 + NUM_BITWISE_OPCODES + NUM_FUSED_OPCODES);
+
+    //create superinstructions
+    //they reuse the builders of the plain opcodes, which overwrite the
+    //op_*_block globals, so they must be created before them
+    llvm::Value *return_from_op_fused[NUM_FUSED_OPCODES];
+    for (uint32_t op = OP_EQ_JMP; op <= OP_IDIV_KI; op++) {
+        return_from_op_fused[op - OP_EQ_JMP] = create_op_block(op);
+    }
 
     //create OP_MOVE
     llvm::Value *return_from_op_move = create_op_move_block();
-    builder.CreateBr(end_block);
 
     //create OP_LOADK
     llvm::Value *return_from_op_loadk = create_op_loadk_block();
-    builder.CreateBr(end_block);
-
-    //create OP_ADD
-    builder.SetInsertPoint(op_add_block);
-    //call step_in_C
-    // llvm::Value *return_from_op_add = builder.CreateCall(step_in_C, step_args);
-    llvm::Value *return_from_op_add = create_op_add_block();
-
-    //create OP_SUB
-    builder.SetInsertPoint(op_sub_block);
-    // llvm::Value *return_from_op_sub = builder.CreateCall(step_in_C, step_args);
-    llvm::Value *return_from_op_sub = create_op_sub_block();
-
-    //create OP_MUL
-    builder.SetInsertPoint(op_mul_block);
-    // llvm::Value *return_from_op_mul = builder.CreateCall(step_in_C, step_args);
-    llvm::Value *return_from_op_mul = create_op_mul_block();
-
-    //create OP_DIV
-    builder.SetInsertPoint(op_div_block);
-    // llvm::Value *return_from_op_div = builder.CreateCall(step_in_C, step_args);
-    llvm::Value *return_from_op_div = create_op_div_block();
-
-    //create OP_MOD
-    builder.SetInsertPoint(op_mod_block);
-    // llvm::Value *return_from_op_mod = builder.CreateCall(step_in_C, step_args);
-    llvm::Value *return_from_op_mod = create_op_mod_block();
-
-    //create OP_IDIV
-    builder.SetInsertPoint(op_idiv_block);
-    // llvm::Value *return_from_op_idiv = builder.CreateCall(step_in_C, step_args);
-    llvm::Value *return_from_op_idiv = create_op_idiv_block();
-
-    //create OP_POW
-    builder.SetInsertPoint(op_pow_block);
-    // llvm::Value *return_from_op_pow = builder.CreateCall(step_in_C, step_args);
-    llvm::Value *return_from_op_pow = create_op_pow_block();
 
     //create OP_UNM
     builder.SetInsertPoint(op_unm_block);
-    // llvm::Value *return_from_op_unm = builder.CreateCall(step_in_C, step_args);
+    // llvm::Value *return_from_op_unm = builder.CreateCall(step_in_C_func, step_args);
     llvm::Value *return_from_op_unm = create_op_unm_block();
 
     //create OP_NOT
     builder.SetInsertPoint(op_not_block);
-    // llvm::Value *return_from_op_not = builder.CreateCall(step_in_C, step_args);
+    // llvm::Value *return_from_op_not = builder.CreateCall(step_in_C_func, step_args);
     llvm::Value *return_from_op_not = create_op_not_block();
 
     //create OP_JMP
@@ -678,33 +372,42 @@ int main() {
 
     //create OP_EQ
     builder.SetInsertPoint(op_eq_block);
-    // llvm::Value *return_from_op_eq = builder.CreateCall(step_in_C, step_args);
+    // llvm::Value *return_from_op_eq = builder.CreateCall(step_in_C_func, step_args);
     llvm::Value *return_from_op_eq = create_op_eq_block();
     // builder.CreateBr(end_block);
 
-    //create OP_LT
-    builder.SetInsertPoint(op_lt_block);
-    // llvm::Value *return_from_op_lt = builder.CreateCall(step_in_C, step_args);
-    llvm::Value *return_from_op_lt = create_op_lt_block();
-
-    //create OP_LE
-    builder.SetInsertPoint(op_le_block);
-    // llvm::Value *return_from_op_le = builder.CreateCall(step_in_C, step_args);
-    llvm::Value *return_from_op_le = create_op_le_block();
-
     //create OP_FORLOOP
     builder.SetInsertPoint(op_forloop_block);
-    // llvm::Value *return_from_op_forloop = builder.CreateCall(step_in_C, step_args);
+    // llvm::Value *return_from_op_forloop = builder.CreateCall(step_in_C_func, step_args);
     llvm::Value *return_from_op_forloop = create_op_forloop_block();
 
     //create OP_FORPREP
     builder.SetInsertPoint(op_forprep_block);
-    // llvm::Value *return_from_op_forprep = builder.CreateCall(step_in_C, step_args);
+    // llvm::Value *return_from_op_forprep = builder.CreateCall(step_in_C_func, step_args);
     llvm::Value *return_from_op_forprep = create_op_forprep_block();
 
+    //create the opcodes.def ops, OP_LOADBOOL, OP_LOADNIL, OP_TEST, OP_TESTSET
+    //and the bitwise ops
+    //the first block each builder appends is its entry
+    const uint32_t other_ops[] = {
+#define OPSPEC_ARITH(OP, INT, FLT, QUICK)   OP_##OP,
+#define OPSPEC_ARITH_FLOAT(OP, FLT)         OP_##OP,
+#define OPSPEC_COMPARE(OP, INT, FLT, QUICK) OP_##OP,
+#include "opcodes.def"
+        OP_LOADBOOL, OP_LOADNIL, OP_TEST, OP_TESTSET,
+        OP_BAND, OP_BOR, OP_BXOR, OP_SHL, OP_SHR, OP_BNOT};
+    const size_t num_other_ops = sizeof(other_ops) / sizeof(other_ops[0]);
+    llvm::Value *return_from_other_op[num_other_ops];
+    llvm::BasicBlock *other_op_block[num_other_ops];
+    for (size_t i = 0; i < num_other_ops; i++) {
+        llvm::BasicBlock *last = &step_func->back();
+        return_from_other_op[i] = create_op_block(other_ops[i]);
+        other_op_block[i] = last->getNextNode();
+    }
+
     //create DEFAULT
     builder.SetInsertPoint(default_block);
-    llvm::Value *return_from_op_default = builder.CreateCall(step_in_C, step_args);
+    llvm::Value *return_from_op_default = builder.CreateCall(step_in_C_func, step_args);
     builder.CreateBr(end_block);
 
     // ERROR BLOCK
@@ -712,82 +415,42 @@ int main() {
     builder.CreateCall(error);
     builder.CreateUnreachable();
 
-    //DEBUG error
-    // builder.SetInsertPoint(error_block_1);
-    // builder.CreateCall(error_1);
-    // builder.CreateUnreachable();
-    //
-    // builder.SetInsertPoint(error_block_2);
-    // builder.CreateCall(error_2);
-    // builder.CreateUnreachable();
-    //
-    // builder.SetInsertPoint(error_block_3);
-    // builder.CreateCall(error_3);
-    // builder.CreateUnreachable();
-    //
-    // builder.SetInsertPoint(error_block_4);
-    // builder.CreateCall(error_4);
-    // builder.CreateUnreachable();
-    //
-    // builder.SetInsertPoint(error_block_5);
-    // builder.CreateCall(error_5);
-    // builder.CreateUnreachable();
-    //
-    // builder.SetInsertPoint(error_block_6);
-    // builder.CreateCall(error_6);
-    // builder.CreateUnreachable();
-    //
-
     //create END label
     builder.SetInsertPoint(end_block);
     //create return_phi_node
     return_phi_node = builder.CreatePHI(llvm::Type::getInt64Ty(context), 19);
-    return_phi_node->addIncoming(return_from_op_move, op_move_block);
-    return_phi_node->addIncoming(return_from_op_loadk, op_loadk_block);
-    return_phi_node->addIncoming(return_from_op_add, op_add_3_block);
-    return_phi_node->addIncoming(return_from_op_add, op_add_10_block);
-    return_phi_node->addIncoming(return_from_op_sub, op_sub_3_block);
-    return_phi_node->addIncoming(return_from_op_sub, op_sub_10_block);
-    return_phi_node->addIncoming(return_from_op_mul, op_mul_3_block);
-    return_phi_node->addIncoming(return_from_op_mul, op_mul_10_block);
-    return_phi_node->addIncoming(return_from_op_div, op_div_10_block);
-    return_phi_node->addIncoming(return_from_op_mod, op_mod_3_block);
-    return_phi_node->addIncoming(return_from_op_mod, op_mod_10_block);
-    return_phi_node->addIncoming(return_from_op_idiv, op_idiv_3_block);
-    return_phi_node->addIncoming(return_from_op_idiv, op_idiv_10_block);
-    return_phi_node->addIncoming(return_from_op_pow, op_pow_10_block);
-    return_phi_node->addIncoming(return_from_op_unm, op_unm_1_block);
-    return_phi_node->addIncoming(return_from_op_unm, op_unm_2_block);
-    return_phi_node->addIncoming(return_from_op_not, op_not_3_block);
-    return_phi_node->addIncoming(return_from_op_jmp, op_jmp_block);
-    return_phi_node->addIncoming(return_from_op_eq, op_eq_10_block);
-    return_phi_node->addIncoming(return_from_op_lt, op_lt_11_block);
-    return_phi_node->addIncoming(return_from_op_le, op_le_11_block);
-    return_phi_node->addIncoming(llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)), op_forloop_13_block);
-    return_phi_node->addIncoming(llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)), op_forloop_17_block);
-    return_phi_node->addIncoming(return_from_op_forloop, op_forloop_18_block);
-    return_phi_node->addIncoming(return_from_op_forprep, op_forprep_11_block);
+    add_return_incoming(return_phi_node, OP_MOVE, return_from_op_move);
+    add_return_incoming(return_phi_node, OP_LOADK, return_from_op_loadk);
+    add_return_incoming(return_phi_node, OP_UNM, return_from_op_unm);
+    add_return_incoming(return_phi_node, OP_NOT, return_from_op_not);
+    add_return_incoming(return_phi_node, OP_JMP, return_from_op_jmp);
+    add_return_incoming(return_phi_node, OP_EQ, return_from_op_eq);
+    add_return_incoming(return_phi_node, OP_FORLOOP, return_from_op_forloop);
+    add_return_incoming(return_phi_node, OP_FORPREP, return_from_op_forprep);
+    for (size_t i = 0; i < num_other_ops; i++) {
+        add_return_incoming(return_phi_node, other_ops[i], return_from_other_op[i]);
+    }
+    for (uint32_t op = OP_EQ_JMP; op <= OP_IDIV_KI; op++) {
+        add_return_incoming(return_phi_node, op, return_from_op_fused[op - OP_EQ_JMP]);
+    }
     return_phi_node->addIncoming(return_from_op_default, default_block);
     builder.CreateRet(return_phi_node);
 
 
     theSwitch->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, OP_MOVE,    true)), op_move_block);
     theSwitch->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, OP_LOADK,   true)), op_loadk_block);
-    theSwitch->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, OP_ADD,     true)), op_add_block);
-    theSwitch->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, OP_SUB,     true)), op_sub_block);
-    theSwitch->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, OP_MUL,     true)), op_mul_block);
-    theSwitch->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, OP_DIV,     true)), op_div_block);
-    theSwitch->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, OP_MOD,     true)), op_mod_block);
-    theSwitch->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, OP_IDIV,    true)), op_idiv_block);
-    theSwitch->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, OP_POW,     true)), op_pow_block);
     theSwitch->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, OP_UNM,     true)), op_unm_block);
     theSwitch->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, OP_NOT,     true)), op_not_block);
     theSwitch->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, OP_JMP,     true)), op_jmp_block);
     theSwitch->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, OP_EQ,      true)), op_eq_block);
-    theSwitch->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, OP_LT,      true)), op_lt_block);
-    theSwitch->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, OP_LE,      true)), op_le_block);
     theSwitch->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, OP_FORLOOP, true)), op_forloop_block);
     theSwitch->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, OP_FORPREP, true)), op_forprep_block);
+    for (size_t i = 0; i < num_other_ops; i++) {
+        theSwitch->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, other_ops[i], true)), other_op_block[i]);
+    }
+    for (uint32_t op = OP_EQ_JMP; op <= OP_IDIV_KI; op++) {
+        theSwitch->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, op, true)), op_fused_block[op - OP_EQ_JMP]);
+    }
 
 
     //dump module to check ir
@@ -795,20 +458,269 @@ int main() {
     // module->dump();
     // std::cout << "\n";
 
+    add_alias_info(step_func);
+    add_branch_weights(step_func);
+    add_argument_attributes(step_func, 0, 3);
+
     //dump module to check ir
     freopen("step.ll", "w", stderr);
     module->dump();
 
     return 0;
 }
+#endif
+
+
+// Wires the pc offset returned by create_op_*_block into the phi node that
+// merges it, from every block of that opcode which branches to end_block.
+void add_return_incoming(llvm::PHINode *phi, uint32_t op, llvm::Value *ret) {
+    switch (op) {
+        case OP_MOVE:
+            phi->addIncoming(ret, op_move_block);
+            break;
+        case OP_LOADK:
+            phi->addIncoming(ret, op_loadk_block);
+            break;
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_MOD:
+        case OP_POW:
+        case OP_DIV:
+        case OP_IDIV:
+            if (op_arith_int_block[op - OP_ADD]) {
+                phi->addIncoming(ret, op_arith_int_block[op - OP_ADD]);
+            }
+            phi->addIncoming(ret, op_arith_float_block[op - OP_ADD]);
+            break;
+        case OP_UNM:
+            phi->addIncoming(ret, op_unm_1_block);
+            phi->addIncoming(ret, op_unm_2_block);
+            break;
+        case OP_NOT:
+            phi->addIncoming(ret, op_not_3_block);
+            break;
+        case OP_JMP:
+            phi->addIncoming(ret, op_jmp_block);
+            break;
+        case OP_EQ:
+            phi->addIncoming(ret, op_eq_10_block);
+            break;
+        case OP_LT:
+        case OP_LE:
+            phi->addIncoming(ret, op_compare_end_block[op - OP_LT]);
+            break;
+        case OP_FORLOOP:
+            phi->addIncoming(llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)), op_forloop_int_block);
+            phi->addIncoming(llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)), op_forloop_float_block);
+            phi->addIncoming(llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)), op_forloop_13_block);
+            phi->addIncoming(llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)), op_forloop_17_block);
+            phi->addIncoming(ret, op_forloop_18_block);
+            break;
+        case OP_FORPREP:
+            phi->addIncoming(ret, op_forprep_11_block);
+            break;
+        case OP_LOADBOOL:
+            phi->addIncoming(ret, op_loadbool_block);
+            break;
+        case OP_LOADNIL:
+            phi->addIncoming(ret, op_loadnil_1_block);
+            break;
+        case OP_TEST:
+            phi->addIncoming(ret, op_test_block);
+            break;
+        case OP_TESTSET:
+            phi->addIncoming(llvm::ConstantInt::get(context, llvm::APInt(64, 1, true)), op_testset_block);
+            phi->addIncoming(ret, op_testset_1_block);
+            break;
+        case OP_BAND:
+        case OP_BOR:
+        case OP_BXOR:
+        case OP_SHL:
+        case OP_SHR:
+        case OP_BNOT:
+            phi->addIncoming(ret, op_bitwise_1_block[bitwise_index(op)]);
+            break;
+        case OP_EQ_JMP:
+        case OP_LT_JMP:
+        case OP_LE_JMP:
+        case OP_ADD_KI:
+        case OP_SUB_KI:
+        case OP_MUL_KI:
+        case OP_MOD_KI:
+        case OP_IDIV_KI:
+            phi->addIncoming(ret, op_fused_end_block[op - OP_EQ_JMP]);
+            break;
+    }
+}
+
+
+llvm::Value* create_load(llvm::Value *ptr) {
+    return builder.CreateLoad(ptr->getType()->getPointerElementType(), ptr);
+}
+
+// --- Alias information
+// The builders only use a handful of pointer shapes: fields of Value (tag and
+// payload), fields of MiniLuaState and Proto, and instruction words. Each gets
+// its own TBAA type under a private root, so a store to a register is known
+// not to clobber mls->registers, the constants pointer or the code array.
+
+enum { TBAA_VALUE_TYP, TBAA_VALUE_PAYLOAD, TBAA_STATE, TBAA_PROTO, TBAA_CODE, NUM_TBAA };
+
+static llvm::MDNode* tbaa_tag(int kind) {
+    static const char *names[NUM_TBAA] = { "Value.typ", "Value.u", "MiniLuaState", "Proto", "Instruction" };
+    llvm::MDBuilder md(context);
+    llvm::MDNode *root = md.createTBAARoot("MiniLua TBAA");
+    llvm::MDNode *type = md.createTBAAScalarTypeNode(names[kind], root);
+    return md.createTBAAStructTagNode(type, type, 0);
+}
+
+// TBAA kind of a load or store through ptr, or -1 when it is not known.
+static int tbaa_kind(llvm::Value *ptr, llvm::Type *access) {
+    while (llvm::BitCastOperator *cast = llvm::dyn_cast<llvm::BitCastOperator>(ptr)) {
+        ptr = cast->getOperand(0);
+    }
+    llvm::GEPOperator *gep = llvm::dyn_cast<llvm::GEPOperator>(ptr);
+    if (gep) {
+        llvm::Type *base = gep->getSourceElementType();
+        if (base == miniluastate_struct_type) {
+            return TBAA_STATE;
+        }
+        if (base == proto_struct_type) {
+            return TBAA_PROTO;
+        }
+        if (base == value_struct_type && gep->getNumIndices() == 2) {
+            llvm::ConstantInt *field = llvm::dyn_cast<llvm::ConstantInt>(gep->getOperand(2));
+            if (field) {
+                return field->isZero() ? TBAA_VALUE_TYP : TBAA_VALUE_PAYLOAD;
+            }
+        }
+    }
+    // instruction words are read through the code or pc pointers
+    if (access->isIntegerTy(32) && (llvm::isa<llvm::Argument>(ptr) || (gep && gep->getSourceElementType()->isIntegerTy(32)))) {
+        return TBAA_CODE;
+    }
+    return -1;
+}
+
+// Attaches TBAA to every load and store of f, and describes Value copies
+// (16 byte memcpys) field by field with !tbaa.struct.
+void add_alias_info(llvm::Function *f) {
+    llvm::MDNode *tags[NUM_TBAA];
+    for (int kind = 0; kind < NUM_TBAA; kind++) {
+        tags[kind] = tbaa_tag(kind);
+    }
+    llvm::MDBuilder md(context);
+    std::vector<llvm::MDBuilder::TBAAStructField> fields;
+    fields.push_back(llvm::MDBuilder::TBAAStructField(0, 4, tags[TBAA_VALUE_TYP]));
+    fields.push_back(llvm::MDBuilder::TBAAStructField(8, 8, tags[TBAA_VALUE_PAYLOAD]));
+    llvm::MDNode *value_struct = md.createTBAAStructNode(fields);
+
+    for (llvm::BasicBlock &bb : *f) {
+        for (llvm::Instruction &inst : bb) {
+            int kind = -1;
+            if (llvm::LoadInst *load = llvm::dyn_cast<llvm::LoadInst>(&inst)) {
+                kind = tbaa_kind(load->getPointerOperand(), load->getType());
+            } else if (llvm::StoreInst *store = llvm::dyn_cast<llvm::StoreInst>(&inst)) {
+                kind = tbaa_kind(store->getPointerOperand(), store->getValueOperand()->getType());
+            } else if (llvm::MemCpyInst *copy = llvm::dyn_cast<llvm::MemCpyInst>(&inst)) {
+                llvm::ConstantInt *size = llvm::dyn_cast<llvm::ConstantInt>(copy->getLength());
+                if (size && size->getZExtValue() == sizeof(Value)) {
+                    copy->setMetadata(llvm::LLVMContext::MD_tbaa_struct, value_struct);
+                }
+            }
+            if (kind >= 0) {
+                inst.setMetadata(llvm::LLVMContext::MD_tbaa, tags[kind]);
+            }
+        }
+    }
+}
+
+// --- Branch weights
+// error_block and the switch defaults on a tag end in error_default, so their
+// edges get weight 1. Tag tests against LUA_TNUMINT (one operand or both and-ed)
+// favour the integer side. Same 2000:1 ratio as __builtin_expect.
+
+#define HOT_WEIGHT  2000
+#define COLD_WEIGHT 1
+
+static bool is_cold_block(llvm::BasicBlock *bb) {
+    return llvm::isa<llvm::UnreachableInst>(bb->getTerminator());
+}
+
+static bool is_int_tag_test(llvm::Value *cond) {
+    if (llvm::ICmpInst *cmp = llvm::dyn_cast<llvm::ICmpInst>(cond)) {
+        llvm::ConstantInt *tag = llvm::dyn_cast<llvm::ConstantInt>(cmp->getOperand(1));
+        return cmp->getPredicate() == llvm::ICmpInst::ICMP_EQ && tag && tag->getSExtValue() == LUA_TNUMINT;
+    }
+    llvm::BinaryOperator *op = llvm::dyn_cast<llvm::BinaryOperator>(cond);
+    return op && op->getOpcode() == llvm::Instruction::And
+        && is_int_tag_test(op->getOperand(0)) && is_int_tag_test(op->getOperand(1));
+}
+
+void add_branch_weights(llvm::Function *f) {
+    llvm::MDBuilder md(context);
+    for (llvm::BasicBlock &bb : *f) {
+        llvm::Instruction *term = bb.getTerminator();
+        if (llvm::BranchInst *br = llvm::dyn_cast<llvm::BranchInst>(term)) {
+            if (!br->isConditional()) {
+                continue;
+            }
+            bool cold_true = is_cold_block(br->getSuccessor(0));
+            bool cold_false = is_cold_block(br->getSuccessor(1));
+            if (cold_true != cold_false) {
+                br->setMetadata(llvm::LLVMContext::MD_prof, cold_true
+                    ? md.createBranchWeights(COLD_WEIGHT, HOT_WEIGHT)
+                    : md.createBranchWeights(HOT_WEIGHT, COLD_WEIGHT));
+            } else if (!cold_true && is_int_tag_test(br->getCondition())) {
+                br->setMetadata(llvm::LLVMContext::MD_prof, md.createBranchWeights(HOT_WEIGHT, COLD_WEIGHT));
+            }
+        } else if (llvm::SwitchInst *sw = llvm::dyn_cast<llvm::SwitchInst>(term)) {
+            std::vector<uint32_t> weights;
+            bool any_cold = false;
+            for (unsigned i = 0; i < sw->getNumSuccessors(); i++) {
+                bool cold = is_cold_block(sw->getSuccessor(i));
+                any_cold |= cold;
+                weights.push_back(cold ? COLD_WEIGHT : HOT_WEIGHT);
+            }
+            if (any_cold) {
+                sw->setMetadata(llvm::LLVMContext::MD_prof, md.createBranchWeights(weights));
+            }
+        }
+    }
+}
+
+// mls is only reached through the argument (and the calls it is passed to),
+// constants are only read.
+void add_argument_attributes(llvm::Function *f, int mls_arg, int constants_arg) {
+    if (mls_arg >= 0) {
+        f->addParamAttr(mls_arg, llvm::Attribute::NoAlias);
+        f->addDereferenceableParamAttr(mls_arg, sizeof(MiniLuaState));
+    }
+    if (constants_arg >= 0) {
+        f->addParamAttr(constants_arg, llvm::Attribute::NoAlias);
+        f->addParamAttr(constants_arg, llvm::Attribute::ReadOnly);
+    }
+}
 
+// mls->registers, or _registers when the caller already has it in hand
+llvm::Value* create_registers() {
+    if (_registers) {
+        return _registers;
+    }
+    std::vector<llvm::Value *> temp;
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)));
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true))); //registers offset
+    llvm::Value *registers_GEP = builder.CreateInBoundsGEP(miniluastate_struct_type, _mls, temp);
+    return create_load(registers_GEP);
+}
 
 llvm::Value* is_numerical(llvm::Value *v) {
     std::vector<llvm::Value *> temp;
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
     llvm::Value *v_type_ptr = builder.CreateInBoundsGEP(value_struct_type, v, temp);
-    llvm::Value *v_type = builder.CreateLoad(v_type_ptr);
+    llvm::Value *v_type = create_load(v_type_ptr);
 
     llvm::Value *is_int = builder.CreateICmpEQ(v_type, llvm::ConstantInt::get(context, llvm::APInt(32, LUA_TNUMINT, true)));
     llvm::Value *is_float = builder.CreateICmpEQ(v_type, llvm::ConstantInt::get(context, llvm::APInt(32, LUA_TNUMFLT, true)));
@@ -939,11 +851,342 @@ llvm::Value* create_sbx() {
     return sext;
 }
 
+// &v->typ and &v->u of a Value *v
+llvm::Value* create_type_ptr(llvm::Value *v) {
+    std::vector<llvm::Value *> temp;
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
+    return builder.CreateInBoundsGEP(value_struct_type, v, temp);
+}
+
+llvm::Value* create_payload_ptr(llvm::Value *v) {
+    std::vector<llvm::Value *> temp;
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
+    return builder.CreateInBoundsGEP(value_struct_type, v, temp);
+}
+
+void create_set_bool(llvm::Value *v, llvm::Value *b) {
+    builder.CreateStore(llvm::ConstantInt::get(context, llvm::APInt(32, LUA_TBOOLEAN, true)), create_type_ptr(v));
+    llvm::Value *b_ptr = builder.CreateBitCast(create_payload_ptr(v), llvm::Type::getInt32PtrTy(context));
+    builder.CreateStore(b, b_ptr);
+}
+
+// isTruthy(v): false only for nil and false. The payload is only looked at
+// through the select, so it may be anything for other types.
+llvm::Value* create_is_truthy(llvm::Value *v) {
+    llvm::Value *v_type = create_load(create_type_ptr(v));
+    llvm::Value *b_ptr = builder.CreateBitCast(create_payload_ptr(v), llvm::Type::getInt32PtrTy(context));
+    llvm::Value *b_true = builder.CreateICmpNE(create_load(b_ptr), llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
+    llvm::Value *is_bool = builder.CreateICmpEQ(v_type, llvm::ConstantInt::get(context, llvm::APInt(32, LUA_TBOOLEAN, true)));
+    llvm::Value *not_nil = builder.CreateICmpNE(v_type, llvm::ConstantInt::get(context, llvm::APInt(32, LUA_TNIL, true)));
+    return builder.CreateSelect(is_bool, b_true, not_nil);
+}
+
+// castToInteger(v) without the error: {has an integer representation, value}.
+// Floats qualify when they are integral and in the range of lua_integer.
+std::vector<llvm::Value *> create_tointeger(llvm::Value *v) {
+    std::vector<llvm::Value *> ret;
+
+    llvm::Value *v_type = create_load(create_type_ptr(v));
+    llvm::Value *v_int = create_load(create_payload_ptr(v));
+    llvm::Value *v_float = builder.CreateBitCast(v_int, llvm::Type::getDoubleTy(context));
+
+    llvm::Value *is_int = builder.CreateICmpEQ(v_type, llvm::ConstantInt::get(context, llvm::APInt(32, LUA_TNUMINT, true)));
+    llvm::Value *is_float = builder.CreateICmpEQ(v_type, llvm::ConstantInt::get(context, llvm::APInt(32, LUA_TNUMFLT, true)));
+
+    // fptosi is poison out of range, so the exactness test is behind a select
+    llvm::Value *in_range = builder.CreateAnd(
+        builder.CreateFCmpOGE(v_float, llvm::ConstantFP::get(llvm::Type::getDoubleTy(context), -0x1p63)),
+        builder.CreateFCmpOLT(v_float, llvm::ConstantFP::get(llvm::Type::getDoubleTy(context), 0x1p63)));
+    llvm::Value *converted = builder.CreateFPToSI(v_float, llvm::Type::getInt64Ty(context));
+    llvm::Value *exact = builder.CreateFCmpOEQ(builder.CreateSIToFP(converted, llvm::Type::getDoubleTy(context)), v_float);
+    llvm::Value *is_integral_float = builder.CreateAnd(is_float, builder.CreateSelect(in_range, exact, llvm::ConstantInt::getFalse(context)));
+
+    ret.push_back(builder.CreateOr(is_int, is_integral_float));
+    ret.push_back(builder.CreateSelect(is_int, v_int, converted));
+    return ret;
+}
+
+
+
+
+
+
+
+// Builds the handler for op in step_func and returns its pc offset, or NULL
+// when there is no IR for op (those go through step_in_C).
+llvm::Value* create_op_block(uint32_t op) {
+    switch (op) {
+        case OP_MOVE:    return create_op_move_block();
+        case OP_LOADK:   return create_op_loadk_block();
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_MOD:
+        case OP_POW:
+        case OP_DIV:
+        case OP_IDIV:    return create_op_arith_block(op);
+        case OP_UNM:     return create_op_unm_block();
+        case OP_NOT:     return create_op_not_block();
+        case OP_JMP:     return create_op_jmp_block();
+        case OP_EQ:      return create_op_eq_block();
+        case OP_LT:
+        case OP_LE:      return create_op_compare_block(op);
+        case OP_FORLOOP: return create_op_forloop_block();
+        case OP_FORPREP: return create_op_forprep_block();
+        case OP_LOADBOOL: return create_op_loadbool_block();
+        case OP_LOADNIL: return create_op_loadnil_block();
+        case OP_TEST:    return create_op_test_block();
+        case OP_TESTSET: return create_op_testset_block();
+        case OP_BAND:
+        case OP_BOR:
+        case OP_BXOR:
+        case OP_SHL:
+        case OP_SHR:
+        case OP_BNOT:    return create_op_bitwise_block(op);
+        case OP_EQ_JMP:
+        case OP_LT_JMP:
+        case OP_LE_JMP:  return create_op_cmp_jmp_block(op);
+        case OP_ADD_KI:
+        case OP_SUB_KI:
+        case OP_MUL_KI:
+        case OP_MOD_KI:
+        case OP_IDIV_KI: return create_op_arith_ki_block(op);
+        default:         return NULL;
+    }
+}
+
+// Emits inst at the current insert point of a function that runs a Proto
+// directly (jit.cpp, trace.cpp): the untagged IR of create_op_proven_block
+// when types says its operands are all TYPE_INT or all TYPE_FLT, else the
+// handler of create_op_block, else a call to step_in_C. Leaves the insert
+// point in a new block and returns the pc offset there. *called_C tells
+// whether step_in_C was used, which may also skip the next instruction.
+llvm::Value* create_inline_op(Instruction inst, Byte types, bool *called_C) {
+    uint32_t op = (inst >> POS_OP) & 0x3F;
+    _inst = llvm::ConstantInt::get(context, llvm::APInt(32, inst, false));
+    _op = llvm::ConstantInt::get(context, llvm::APInt(32, op, false));
+
+    // end_block is only inserted after the handler, so the handler's first
+    // block is the one following the current last block
+    llvm::BasicBlock *op_block = builder.GetInsertBlock();
+    llvm::Function *f = op_block->getParent();
+    llvm::BasicBlock *last = &f->back();
+    end_block = llvm::BasicBlock::Create(context, op_block->getName() + "_end");
+
+    llvm::BasicBlock *proven_block = NULL;
+    llvm::Value *ret = NULL;
+    if (types) {
+        ret = create_op_proven_block(op, types == TYPE_FLT);
+        proven_block = builder.GetInsertBlock();
+        builder.CreateBr(end_block);
+    } else {
+        ret = create_op_block(op);
+    }
+    *called_C = (ret == NULL);
+    if (ret && !proven_block) {
+        builder.SetInsertPoint(op_block);
+        builder.CreateBr(last->getNextNode());
+    } else if (!ret) {
+        std::vector<llvm::Value *> step_args;
+        step_args.push_back(_mls);
+        step_args.push_back(_inst);
+        step_args.push_back(_op);
+        step_args.push_back(_constants);
+        ret = builder.CreateCall(step_in_C_func, step_args);
+        builder.CreateBr(end_block);
+    }
+
+    end_block->insertInto(f);
+    builder.SetInsertPoint(end_block);
+    llvm::PHINode *offset_phi = builder.CreatePHI(llvm::Type::getInt64Ty(context), 2);
+    if (proven_block) {
+        offset_phi->addIncoming(ret, proven_block);
+    } else if (*called_C) {
+        offset_phi->addIncoming(ret, op_block);
+    } else {
+        add_return_incoming(offset_phi, op, ret);
+    }
+    return offset_phi;
+}
+
+// Possible pc offsets returned by the handler of inst, i.e. the successors of
+// its block besides the error path (and the skip of step_in_C).
+std::set<int64_t> pc_offsets(Instruction inst) {
+    std::set<int64_t> offsets;
+    uint32_t op = (inst >> POS_OP) & 0x3F;
+    int64_t sbx = (int64_t) ((inst >> POS_Bx) & MAXARG_Bx) - MAXARG_sBx;
+
+    switch (op) {
+        case OP_JMP:
+        case OP_FORPREP:
+            offsets.insert(sbx);
+            break;
+        case OP_FORLOOP:
+            offsets.insert(0);
+            offsets.insert(sbx);
+            break;
+        case OP_EQ:
+        case OP_LT:
+        case OP_LE:
+        case OP_LOADBOOL:
+        case OP_TEST:
+        case OP_TESTSET:
+            offsets.insert(0);
+            offsets.insert(1);
+            break;
+        case OP_EQ_JMP:
+        case OP_LT_JMP:
+        case OP_LE_JMP:
+            offsets.insert(1);
+            offsets.insert((int64_t) (((inst >> POS_A) & MAXARG_A) >> 1) - MAXARG_sJ + 1);
+            break;
+        default:
+            offsets.insert(0);
+            break;
+    }
+    return offsets;
+}
+
+
+// Operands, as RK values, whose tags choose the path of the handler of inst:
+// the ones create_op_proven_block reads untagged.
+std::vector<uint32_t> typed_operands(Instruction inst) {
+    std::vector<uint32_t> operands;
+    uint32_t a = (inst >> POS_A) & MAXARG_A;
+    switch ((inst >> POS_OP) & 0x3F) {
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_MOD:
+        case OP_POW:
+        case OP_DIV:
+        case OP_IDIV:
+        case OP_EQ:
+        case OP_LT:
+        case OP_LE:
+        case OP_EQ_JMP:
+        case OP_LT_JMP:
+        case OP_LE_JMP:
+        case OP_ADD_KI:
+        case OP_SUB_KI:
+        case OP_MUL_KI:
+        case OP_MOD_KI:
+        case OP_IDIV_KI:
+            operands.push_back((inst >> POS_B) & MAXARG_B);
+            operands.push_back((inst >> POS_C) & MAXARG_C);
+            break;
+        case OP_FORPREP:
+        case OP_FORLOOP:
+            operands.push_back(a);
+            operands.push_back(a + 1);
+            operands.push_back(a + 2);
+            break;
+    }
+    return operands;
+}
+
+static Value* rk_value(MiniLuaState *mls, uint32_t x) {
+    return (x & BITRK) ? &mls->proto->k[x & ~BITRK] : &mls->registers[x];
+}
+
+// TYPE_INT or TYPE_FLT when the typed operands of inst all hold that tag now
+Byte observed_types(MiniLuaState *mls, Instruction inst) {
+    std::vector<uint32_t> operands = typed_operands(inst);
+    if (operands.empty()) {
+        return 0;
+    }
+    int tag = rk_value(mls, operands[0])->typ;
+    for (uint32_t x : operands) {
+        if (rk_value(mls, x)->typ != tag) {
+            return 0;
+        }
+    }
+    return tag == LUA_TNUMINT ? TYPE_INT : tag == LUA_TNUMFLT ? TYPE_FLT : 0;
+}
 
+// Type guard in front of the untagged code of inst: goes on in a new block
+// only if the typed operands of inst hold the tags of types. Returns the
+// block taken otherwise, left empty for the caller to fill, or NULL when
+// there is nothing to check.
+llvm::BasicBlock* create_type_guard(Instruction inst, Byte types, const std::string &name) {
+    int tag = types == TYPE_INT ? LUA_TNUMINT : LUA_TNUMFLT;
+    llvm::Value *registers = create_registers();
+    llvm::Value *ok = NULL;
+    for (uint32_t x : typed_operands(inst)) {
+        if (x & BITRK) {
+            continue; // constants never change
+        }
+        llvm::Value *v = builder.CreateInBoundsGEP(value_struct_type, registers,
+                                                   llvm::ConstantInt::get(context, llvm::APInt(64, x, false)));
+        llvm::Value *is_tag = builder.CreateICmpEQ(create_load(create_type_ptr(v)),
+                                                   llvm::ConstantInt::get(context, llvm::APInt(32, tag, true)));
+        ok = ok ? builder.CreateAnd(ok, is_tag) : is_tag;
+    }
+    if (!ok) {
+        return NULL;
+    }
+
+    llvm::Function *f = builder.GetInsertBlock()->getParent();
+    llvm::BasicBlock *typed_block = llvm::BasicBlock::Create(context, name + "_typed", f);
+    llvm::BasicBlock *failed_block = llvm::BasicBlock::Create(context, name + "_guard", f);
+    llvm::MDBuilder md(context);
+    builder.CreateCondBr(ok, typed_block, failed_block, md.createBranchWeights(2000, 1));
+    builder.SetInsertPoint(typed_block);
+    return failed_block;
+}
 
+// OP_RETURN of a compiled chunk: stores the range of the results in mls,
+// then returns ret, or nothing when ret is NULL.
+void create_return_block(Instruction inst, llvm::Value *ret) {
+    uint32_t a = (inst >> POS_A) & MAXARG_A;
+    uint32_t b = (inst >> POS_B) & MAXARG_B;
+    if (b == 0) {
+        // not implemented: OP_RETURN with b == 0
+        builder.CreateCall(error);
+        builder.CreateUnreachable();
+        return;
+    }
 
+    std::vector<llvm::Value *> temp;
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)));
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 2, true))); //return_begin
+    llvm::Value *return_begin_GEP = builder.CreateInBoundsGEP(miniluastate_struct_type, _mls, temp);
+    builder.CreateStore(llvm::ConstantInt::get(context, llvm::APInt(64, a, false)), return_begin_GEP);
 
+    temp.clear();
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)));
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 3, true))); //return_end
+    llvm::Value *return_end_GEP = builder.CreateInBoundsGEP(miniluastate_struct_type, _mls, temp);
+    builder.CreateStore(llvm::ConstantInt::get(context, llvm::APInt(64, a + b - 1, false)), return_end_GEP);
+
+    if (ret) {
+        builder.CreateRet(ret);
+    } else {
+        builder.CreateRetVoid();
+    }
+}
 
+// The builders emit naive IR (every field goes through memory), so the code
+// generating from them runs the middle-end O3 pipeline over m. tm, when
+// given, lets the passes query the costs of the target.
+void optimize_module_O3(llvm::Module *m, llvm::TargetMachine *tm) {
+    llvm::LoopAnalysisManager lam;
+    llvm::FunctionAnalysisManager fam;
+    llvm::CGSCCAnalysisManager cgam;
+    llvm::ModuleAnalysisManager mam;
+
+    llvm::PassBuilder pb(tm);
+    pb.registerModuleAnalyses(mam);
+    pb.registerCGSCCAnalyses(cgam);
+    pb.registerFunctionAnalyses(fam);
+    pb.registerLoopAnalyses(lam);
+    pb.crossRegisterProxies(lam, fam, cgam, mam);
+
+    llvm::ModulePassManager mpm = pb.buildPerModuleDefaultPipeline(llvm::OptimizationLevel::O3);
+    mpm.run(*m, mam);
+}
 
 /* OPCODES */
 llvm::Value* create_op_move_block() {
@@ -952,10 +1195,7 @@ llvm::Value* create_op_move_block() {
     builder.SetInsertPoint(op_move_block);
 
     std::vector<llvm::Value *> temp;
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)));
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true))); //registers offset
-    llvm::Value *registers_GEP = builder.CreateInBoundsGEP(miniluastate_struct_type, _mls, temp);
-    llvm::Value *registers_LD = builder.CreateLoad(registers_GEP);
+    llvm::Value *registers_LD = create_registers();
 
     llvm::Value *ra = create_ra(registers_LD)[1];
     llvm::Value *ra_bitcast = create_bitcast(ra);
@@ -966,9 +1206,9 @@ llvm::Value* create_op_move_block() {
     temp.push_back(ra_bitcast);
     temp.push_back(rb_bitcast);
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(64, 16, true)));
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 8, true)));
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(1, 0, true)));
     builder.CreateCall(llvm_memcpy, temp);
+    builder.CreateBr(end_block);
 
     return llvm::ConstantInt::get(context, llvm::APInt(64, 0, true));
 }
@@ -980,10 +1220,7 @@ llvm::Value* create_op_loadk_block() {
     builder.SetInsertPoint(op_loadk_block);
 
     std::vector<llvm::Value *> temp;
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)));
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true))); //registers offset
-    llvm::Value *registers_GEP = builder.CreateInBoundsGEP(miniluastate_struct_type, _mls, temp);
-    llvm::Value *registers_LD = builder.CreateLoad(registers_GEP);
+    llvm::Value *registers_LD = create_registers();
 
     llvm::Value *ra = create_ra(registers_LD)[1];
     llvm::Value *ra_bitcast = create_bitcast(ra);
@@ -994,1110 +1231,163 @@ llvm::Value* create_op_loadk_block() {
     temp.push_back(ra_bitcast);
     temp.push_back(rb_bitcast);
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(64, 16, true)));
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 8, true)));
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(1, 0, true)));
     builder.CreateCall(llvm_memcpy, temp);
+    builder.CreateBr(end_block);
 
     return llvm::ConstantInt::get(context, llvm::APInt(64, 0, true));
 }
 
-llvm::Value* create_op_add_block() {
-    op_add_block = llvm::BasicBlock::Create(context, "op_add", step_func);
-
-    op_add_1_block = llvm::BasicBlock::Create(context, "op_add_1", step_func);
-    op_add_2_block = llvm::BasicBlock::Create(context, "op_add_2", step_func);
-    op_add_3_block = llvm::BasicBlock::Create(context, "op_add_3", step_func);
-    op_add_4_block = llvm::BasicBlock::Create(context, "op_add_4", step_func);
-    op_add_5_block = llvm::BasicBlock::Create(context, "op_add_5", step_func);
-    op_add_6_block = llvm::BasicBlock::Create(context, "op_add_6", step_func);
-    op_add_7_block = llvm::BasicBlock::Create(context, "op_add_7", step_func);
-    op_add_8_block = llvm::BasicBlock::Create(context, "op_add_8", step_func);
-    op_add_9_block = llvm::BasicBlock::Create(context, "op_add_9", step_func);
-    op_add_10_block = llvm::BasicBlock::Create(context, "op_add_10", step_func);
-
-    builder.SetInsertPoint(op_add_block);
-
-    //
-    std::vector<llvm::Value *> temp;
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)));
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true))); //registers offset
-    llvm::Value *registers_GEP = builder.CreateInBoundsGEP(miniluastate_struct_type, _mls, temp);
-    llvm::Value *registers_LD = builder.CreateLoad(registers_GEP);
-
-    std::vector<llvm::Value *> ra_ret = create_ra(registers_LD);
-    llvm::Value *ra = ra_ret[1]; //Value *a = R(A(inst));
-
-    llvm::Value *b_inst = create_B();
-    std::vector<llvm::Value *> rkb_return = create_rk(b_inst, registers_LD);
-    llvm::Value *rkb = rkb_return[2];
-    llvm::Value *rkb_LD = builder.CreateLoad(rkb);
-    llvm::Value *rkb_or = builder.CreateOr(llvm::ConstantInt::get(context, llvm::APInt(32, 16, true)), rkb_LD);
-    llvm::Value *rkb_is_numerical_condition = builder.CreateICmpEQ(rkb_or, llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)));
-    builder.CreateCondBr(rkb_is_numerical_condition, op_add_1_block, error_block);
-
-    //op_add_1_block
-    builder.SetInsertPoint(op_add_1_block);
-    llvm::Value *c_inst = create_C();
-    std::vector<llvm::Value *> rkc_return = create_rk(c_inst, registers_LD);
-    llvm::Value *rkc = rkc_return[2];
-    llvm::Value *rkc_LD = builder.CreateLoad(rkc);
-    llvm::Value *rkc_or = builder.CreateOr(llvm::ConstantInt::get(context, llvm::APInt(32, 16, true)), rkc_LD);
-    llvm::Value *rkc_is_numerical_condition = builder.CreateICmpEQ(rkc_or, llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)));
-    builder.CreateCondBr(rkc_is_numerical_condition, op_add_2_block, error_block);
-
-    builder.SetInsertPoint(op_add_2_block);
-    llvm::Value *rkb_is_int = builder.CreateICmpEQ(rkb_LD, llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)));
-    llvm::Value *rkc_is_int = builder.CreateICmpEQ(rkc_LD, llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)));
-    llvm::Value *both_int = builder.CreateAnd(rkb_is_int, rkc_is_int);
-    builder.CreateCondBr(both_int, op_add_3_block, op_add_4_block);
-
-    // XXX TODO discover why it seg faults when adding the third argument (the 0 on the commented line. On rkb and rkc!!!
-    // op_add_1_block true
-    builder.SetInsertPoint(op_add_3_block);
-    temp.clear();
-    temp.push_back(rkb_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *b_value_GEP = builder.CreateInBoundsGEP(value_struct_type, rkb_return[1], temp);
-    llvm::Value *b_value_LD = builder.CreateLoad(b_value_GEP);
-
-    temp.clear();
-    temp.push_back(rkc_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *c_value_GEP = builder.CreateInBoundsGEP(value_struct_type, rkc_return[1], temp);
-    llvm::Value *c_value_LD = builder.CreateLoad(c_value_GEP);
-
-    //ADD
-    llvm::Value *add_b_c = builder.CreateAdd(b_value_LD, c_value_LD);
-
-    temp.clear();
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *a_type = builder.CreateInBoundsGEP(value_struct_type, ra, temp);
-    builder.CreateStore(llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)), a_type);
-
-    temp.clear();
-    temp.push_back(ra_ret[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *a_value = builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp);
-    builder.CreateStore(add_b_c, a_value);
-    builder.CreateBr(end_block);
+// --- opcodes.def
+// The numeric opcodes are described once in opcodes.def; these primitives and
+// the two builders below turn each entry into IR.
+
+#define INT_ADD(x, y)       builder.CreateAdd(x, y)
+#define INT_SUB(x, y)       builder.CreateSub(x, y)
+#define INT_MUL(x, y)       builder.CreateMul(x, y)
+#define INT_REM(x, y)       builder.CreateSRem(x, y)
+#define INT_QUOT(x, y)      builder.CreateSDiv(x, y)
+#define INT_EQ(x, y)        builder.CreateICmpEQ(x, y)
+#define INT_LT(x, y)        builder.CreateICmpSLT(x, y)
+#define INT_LE(x, y)        builder.CreateICmpSLE(x, y)
+
+#define FLT_ADD(x, y)       builder.CreateFAdd(x, y)
+#define FLT_SUB(x, y)       builder.CreateFSub(x, y)
+#define FLT_MUL(x, y)       builder.CreateFMul(x, y)
+#define FLT_DIV(x, y)       builder.CreateFDiv(x, y)
+#define FLT_FMOD(x, y)      builder.CreateFRem(x, y)
+#define FLT_FLOORDIV(x, y)  builder.CreateCall(llvm_floor, builder.CreateFDiv(x, y))
+#define FLT_POW(x, y)       builder.CreateCall(llvm_pow, {x, y})
+#define FLT_EQ(x, y)        builder.CreateFCmpOEQ(x, y)
+#define FLT_LT(x, y)        builder.CreateFCmpOLT(x, y)
+#define FLT_LE(x, y)        builder.CreateFCmpOLE(x, y)
+
+// "op_add", "op_lt", ... for the blocks of op
+static std::string opspec_block_name(uint32_t op) {
+    const char *name = "";
+    switch (op) {
+#define OPSPEC_NAME(OP)                         case OP_##OP: name = #OP; break;
+#define OPSPEC_ARITH(OP, INT, FLT, QUICK)       OPSPEC_NAME(OP)
+#define OPSPEC_ARITH_FLOAT(OP, FLT)             OPSPEC_NAME(OP)
+#define OPSPEC_COMPARE(OP, INT, FLT, QUICK)     OPSPEC_NAME(OP)
+#define OPSPEC_EQUALITY(OP, INT, FLT, QUICK)    OPSPEC_NAME(OP)
+#include "opcodes.def"
+#undef OPSPEC_NAME
+    }
+    std::string block_name = "op_";
+    for (const char *c = name; *c; c++) {
+        block_name += (char) tolower(*c);
+    }
+    return block_name;
+}
 
-    // op_add_1_block false
-    builder.SetInsertPoint(op_add_4_block);
-    llvm::SwitchInst *switch_type = builder.CreateSwitch(rkb_LD, error_block, 2);
-    switch_type->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 3, true)), op_add_5_block);
-    switch_type->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)), op_add_6_block);
+// The INT primitive of op on two i64, or NULL for the ops which always work
+// on floats.
+static llvm::Value* create_int_primitive(uint32_t op, llvm::Value *x, llvm::Value *y) {
+    switch (op) {
+#define OPSPEC_ARITH(OP, INT, FLT, QUICK)       case OP_##OP: return INT_##INT(x, y);
+#define OPSPEC_COMPARE(OP, INT, FLT, QUICK)     case OP_##OP: return INT_##INT(x, y);
+#define OPSPEC_EQUALITY(OP, INT, FLT, QUICK)    case OP_##OP: return INT_##INT(x, y);
+#include "opcodes.def"
+        default: return NULL;
+    }
+}
 
-    // op_add_5_block (3)
-    builder.SetInsertPoint(op_add_5_block);
-    temp.clear();
-    temp.push_back(rkb_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *b_value_GEP_2 = builder.CreateInBoundsGEP(value_struct_type, rkb_return[1], temp);
-    llvm::Value *b_bitcast = builder.CreateBitCast(b_value_GEP_2, llvm::Type::getDoublePtrTy(context));
-    llvm::Value *b_load = builder.CreateLoad(llvm::Type::getDoubleTy(context), b_bitcast);
-    builder.CreateBr(op_add_7_block);
+static bool has_int_primitive(uint32_t op) {
+    switch (op) {
+#define OPSPEC_ARITH(OP, INT, FLT, QUICK)       case OP_##OP: return true;
+#define OPSPEC_COMPARE(OP, INT, FLT, QUICK)     case OP_##OP: return true;
+#define OPSPEC_EQUALITY(OP, INT, FLT, QUICK)    case OP_##OP: return true;
+#include "opcodes.def"
+        default: return false;
+    }
+}
 
-    // op_add_6_block (19)
-    builder.SetInsertPoint(op_add_6_block);
-    temp.clear();
-    temp.push_back(rkb_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *b_value_GEP_3 = builder.CreateInBoundsGEP(value_struct_type, rkb_return[1], temp);
-    llvm::Value *b_load_2 = builder.CreateLoad(b_value_GEP_3);
-    llvm::Value *b_sitofp = builder.CreateSIToFP(b_load_2, llvm::Type::getDoubleTy(context));
-    builder.CreateBr(op_add_7_block);
+// The FLT primitive of op on two doubles.
+static llvm::Value* create_float_primitive(uint32_t op, llvm::Value *x, llvm::Value *y) {
+    switch (op) {
+#define OPSPEC_ARITH(OP, INT, FLT, QUICK)       case OP_##OP: return FLT_##FLT(x, y);
+#define OPSPEC_ARITH_FLOAT(OP, FLT)             case OP_##OP: return FLT_##FLT(x, y);
+#define OPSPEC_COMPARE(OP, INT, FLT, QUICK)     case OP_##OP: return FLT_##FLT(x, y);
+#define OPSPEC_EQUALITY(OP, INT, FLT, QUICK)    case OP_##OP: return FLT_##FLT(x, y);
+#include "opcodes.def"
+        default: return NULL;
+    }
+}
 
+// castToFloat(v) for a Value known to be a number, given its tag
+static llvm::Value* create_tofloat(llvm::Value *v, llvm::Value *v_type) {
+    llvm::Value *v_int = create_load(create_payload_ptr(v));
+    llvm::Value *is_int = builder.CreateICmpEQ(v_type, llvm::ConstantInt::get(context, llvm::APInt(32, LUA_TNUMINT, true)));
+    return builder.CreateSelect(is_int,
+                                builder.CreateSIToFP(v_int, llvm::Type::getDoubleTy(context)),
+                                builder.CreateBitCast(v_int, llvm::Type::getDoubleTy(context)));
+}
 
-    // op_add_7_block
-    builder.SetInsertPoint(op_add_7_block);
-    llvm::PHINode *phi_node = builder.CreatePHI(llvm::Type::getDoubleTy(context), 2); //op
-    phi_node->addIncoming(b_load, op_add_5_block);
-    phi_node->addIncoming(b_sitofp, op_add_6_block);
-    llvm::SwitchInst *switch_type_2 = builder.CreateSwitch(rkc_LD, error_block, 2);
-    switch_type_2->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 3, true)), op_add_8_block);
-    switch_type_2->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)), op_add_9_block);
-
-    // op_add_8_block (3)
-    builder.SetInsertPoint(op_add_8_block);
-    temp.clear();
-    temp.push_back(rkc_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *c_value_GEP_2 = builder.CreateInBoundsGEP(value_struct_type, rkc_return[1], temp);
-    llvm::Value *c_bitcast_2 = builder.CreateBitCast(c_value_GEP_2, llvm::Type::getDoublePtrTy(context));
-    llvm::Value *c_load = builder.CreateLoad(llvm::Type::getDoubleTy(context), c_bitcast_2);
-    builder.CreateBr(op_add_10_block);
-
-    // op_add_9_block (19)
-    builder.SetInsertPoint(op_add_9_block);
-    temp.clear();
-    temp.push_back(rkc_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *c_value_GEP_3 = builder.CreateInBoundsGEP(value_struct_type, rkc_return[1], temp);
-    llvm::Value *c_load_2 = builder.CreateLoad(c_value_GEP_3);
-    llvm::Value *c_sitofp = builder.CreateSIToFP(c_load_2, llvm::Type::getDoubleTy(context));
-    builder.CreateBr(op_add_10_block);
-
-    builder.SetInsertPoint(op_add_10_block);
-    llvm::PHINode *phi_node_2 = builder.CreatePHI(llvm::Type::getDoubleTy(context), 2); //op
-    phi_node_2->addIncoming(c_load, op_add_8_block);
-    phi_node_2->addIncoming(c_sitofp, op_add_9_block);
-    llvm::Value *add_b_c_2 = builder.CreateFAdd(phi_node, phi_node_2);
-    temp.clear();
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *a_type_2 = builder.CreateInBoundsGEP(value_struct_type, ra, temp);
-    builder.CreateStore(llvm::ConstantInt::get(context, llvm::APInt(32, 3, true)), a_type_2);
-    temp.clear();
-    temp.push_back(ra_ret[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *a_value_2 = builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp);
-    llvm::Value *a_bitcast_2 = builder.CreateBitCast(a_value_2, llvm::Type::getDoublePtrTy(context));
-    builder.CreateStore(add_b_c_2, a_bitcast_2);
-    builder.CreateBr(end_block);
-    //
-
-
-    return llvm::ConstantInt::get(context, llvm::APInt(64, 0, true));
-}
-
-llvm::Value* create_op_sub_block() {
-    op_sub_block = llvm::BasicBlock::Create(context, "op_sub", step_func);
-
-    op_sub_1_block = llvm::BasicBlock::Create(context, "op_sub_1", step_func);
-    op_sub_2_block = llvm::BasicBlock::Create(context, "op_sub_2", step_func);
-    op_sub_3_block = llvm::BasicBlock::Create(context, "op_sub_3", step_func);
-    op_sub_4_block = llvm::BasicBlock::Create(context, "op_sub_4", step_func);
-    op_sub_5_block = llvm::BasicBlock::Create(context, "op_sub_5", step_func);
-    op_sub_6_block = llvm::BasicBlock::Create(context, "op_sub_6", step_func);
-    op_sub_7_block = llvm::BasicBlock::Create(context, "op_sub_7", step_func);
-    op_sub_8_block = llvm::BasicBlock::Create(context, "op_sub_8", step_func);
-    op_sub_9_block = llvm::BasicBlock::Create(context, "op_sub_9", step_func);
-    op_sub_10_block = llvm::BasicBlock::Create(context, "op_sub_10", step_func);
-
-    builder.SetInsertPoint(op_sub_block);
-
-    //
-    std::vector<llvm::Value *> temp;
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)));
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true))); //registers offset
-    llvm::Value *registers_GEP = builder.CreateInBoundsGEP(miniluastate_struct_type, _mls, temp);
-    llvm::Value *registers_LD = builder.CreateLoad(registers_GEP);
-
-    std::vector<llvm::Value *> ra_ret = create_ra(registers_LD);
-    llvm::Value *ra = ra_ret[1]; //Value *a = R(A(inst));
-
-    llvm::Value *b_inst = create_B();
-    std::vector<llvm::Value *> rkb_return = create_rk(b_inst, registers_LD);
-    llvm::Value *rkb = rkb_return[2];
-    llvm::Value *rkb_LD = builder.CreateLoad(rkb);
-    llvm::Value *rkb_or = builder.CreateOr(llvm::ConstantInt::get(context, llvm::APInt(32, 16, true)), rkb_LD);
-    llvm::Value *rkb_is_numerical_condition = builder.CreateICmpEQ(rkb_or, llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)));
-    builder.CreateCondBr(rkb_is_numerical_condition, op_sub_1_block, error_block);
-
-    //op_sub_1_block
-    builder.SetInsertPoint(op_sub_1_block);
-    llvm::Value *c_inst = create_C();
-    std::vector<llvm::Value *> rkc_return = create_rk(c_inst, registers_LD);
-    llvm::Value *rkc = rkc_return[2];
-    llvm::Value *rkc_LD = builder.CreateLoad(rkc);
-    llvm::Value *rkc_or = builder.CreateOr(llvm::ConstantInt::get(context, llvm::APInt(32, 16, true)), rkc_LD);
-    llvm::Value *rkc_is_numerical_condition = builder.CreateICmpEQ(rkc_or, llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)));
-    builder.CreateCondBr(rkc_is_numerical_condition, op_sub_2_block, error_block);
-
-    builder.SetInsertPoint(op_sub_2_block);
-    llvm::Value *rkb_is_int = builder.CreateICmpEQ(rkb_LD, llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)));
-    llvm::Value *rkc_is_int = builder.CreateICmpEQ(rkc_LD, llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)));
-    llvm::Value *both_int = builder.CreateAnd(rkb_is_int, rkc_is_int);
-    builder.CreateCondBr(both_int, op_sub_3_block, op_sub_4_block);
-
-    // XXX TODO discover why it seg faults when adding the third argument (the 0 on the commented line. On rkb and rkc!!!
-    // op_sub_1_block true
-    builder.SetInsertPoint(op_sub_3_block);
-    temp.clear();
-    temp.push_back(rkb_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *b_value_GEP = builder.CreateInBoundsGEP(value_struct_type, rkb_return[1], temp);
-    llvm::Value *b_value_LD = builder.CreateLoad(b_value_GEP);
-
-    temp.clear();
-    temp.push_back(rkc_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *c_value_GEP = builder.CreateInBoundsGEP(value_struct_type, rkc_return[1], temp);
-    llvm::Value *c_value_LD = builder.CreateLoad(c_value_GEP);
-
-    //SUB
-    llvm::Value *sub_b_c = builder.CreateSub(b_value_LD, c_value_LD);
-
-    temp.clear();
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *a_type = builder.CreateInBoundsGEP(value_struct_type, ra, temp);
-    builder.CreateStore(llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)), a_type);
-
-    temp.clear();
-    temp.push_back(ra_ret[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *a_value = builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp);
-    builder.CreateStore(sub_b_c, a_value);
-    builder.CreateBr(end_block);
-
-    // op_sub_1_block false
-    builder.SetInsertPoint(op_sub_4_block);
-    llvm::SwitchInst *switch_type = builder.CreateSwitch(rkb_LD, error_block, 2);
-    switch_type->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 3, true)), op_sub_5_block);
-    switch_type->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)), op_sub_6_block);
-
-    // op_sub_5_block (3)
-    builder.SetInsertPoint(op_sub_5_block);
-    temp.clear();
-    temp.push_back(rkb_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *b_value_GEP_2 = builder.CreateInBoundsGEP(value_struct_type, rkb_return[1], temp);
-    llvm::Value *b_bitcast = builder.CreateBitCast(b_value_GEP_2, llvm::Type::getDoublePtrTy(context));
-    llvm::Value *b_load = builder.CreateLoad(llvm::Type::getDoubleTy(context), b_bitcast);
-    builder.CreateBr(op_sub_7_block);
-
-    // op_sub_6_block (19)
-    builder.SetInsertPoint(op_sub_6_block);
-    temp.clear();
-    temp.push_back(rkb_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *b_value_GEP_3 = builder.CreateInBoundsGEP(value_struct_type, rkb_return[1], temp);
-    llvm::Value *b_load_2 = builder.CreateLoad(b_value_GEP_3);
-    llvm::Value *b_sitofp = builder.CreateSIToFP(b_load_2, llvm::Type::getDoubleTy(context));
-    builder.CreateBr(op_sub_7_block);
-
-
-    // op_sub_7_block
-    builder.SetInsertPoint(op_sub_7_block);
-    llvm::PHINode *phi_node = builder.CreatePHI(llvm::Type::getDoubleTy(context), 2); //op
-    phi_node->addIncoming(b_load, op_sub_5_block);
-    phi_node->addIncoming(b_sitofp, op_sub_6_block);
-    llvm::SwitchInst *switch_type_2 = builder.CreateSwitch(rkc_LD, error_block, 2);
-    switch_type_2->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 3, true)), op_sub_8_block);
-    switch_type_2->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)), op_sub_9_block);
-
-    // op_sub_8_block (3)
-    builder.SetInsertPoint(op_sub_8_block);
-    temp.clear();
-    temp.push_back(rkc_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *c_value_GEP_2 = builder.CreateInBoundsGEP(value_struct_type, rkc_return[1], temp);
-    llvm::Value *c_bitcast_2 = builder.CreateBitCast(c_value_GEP_2, llvm::Type::getDoublePtrTy(context));
-    llvm::Value *c_load = builder.CreateLoad(llvm::Type::getDoubleTy(context), c_bitcast_2);
-    builder.CreateBr(op_sub_10_block);
-
-    // op_sub_9_block (19)
-    builder.SetInsertPoint(op_sub_9_block);
-    temp.clear();
-    temp.push_back(rkc_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *c_value_GEP_3 = builder.CreateInBoundsGEP(value_struct_type, rkc_return[1], temp);
-    llvm::Value *c_load_2 = builder.CreateLoad(c_value_GEP_3);
-    llvm::Value *c_sitofp = builder.CreateSIToFP(c_load_2, llvm::Type::getDoubleTy(context));
-    builder.CreateBr(op_sub_10_block);
-
-    builder.SetInsertPoint(op_sub_10_block);
-    llvm::PHINode *phi_node_2 = builder.CreatePHI(llvm::Type::getDoubleTy(context), 2); //op
-    phi_node_2->addIncoming(c_load, op_sub_8_block);
-    phi_node_2->addIncoming(c_sitofp, op_sub_9_block);
-    llvm::Value *sub_b_c_2 = builder.CreateFSub(phi_node, phi_node_2);
-    temp.clear();
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *a_type_2 = builder.CreateInBoundsGEP(value_struct_type, ra, temp);
-    builder.CreateStore(llvm::ConstantInt::get(context, llvm::APInt(32, 3, true)), a_type_2);
-    temp.clear();
-    temp.push_back(ra_ret[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *a_value_2 = builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp);
-    llvm::Value *a_bitcast_2 = builder.CreateBitCast(a_value_2, llvm::Type::getDoublePtrTy(context));
-    builder.CreateStore(sub_b_c_2, a_bitcast_2);
-    builder.CreateBr(end_block);
-    //
-
-
-    return llvm::ConstantInt::get(context, llvm::APInt(64, 0, true));
-}
-
-llvm::Value* create_op_mul_block() {
-    op_mul_block = llvm::BasicBlock::Create(context, "op_mul", step_func);
-
-    op_mul_1_block = llvm::BasicBlock::Create(context, "op_mul_1", step_func);
-    op_mul_2_block = llvm::BasicBlock::Create(context, "op_mul_2", step_func);
-    op_mul_3_block = llvm::BasicBlock::Create(context, "op_mul_3", step_func);
-    op_mul_4_block = llvm::BasicBlock::Create(context, "op_mul_4", step_func);
-    op_mul_5_block = llvm::BasicBlock::Create(context, "op_mul_5", step_func);
-    op_mul_6_block = llvm::BasicBlock::Create(context, "op_mul_6", step_func);
-    op_mul_7_block = llvm::BasicBlock::Create(context, "op_mul_7", step_func);
-    op_mul_8_block = llvm::BasicBlock::Create(context, "op_mul_8", step_func);
-    op_mul_9_block = llvm::BasicBlock::Create(context, "op_mul_9", step_func);
-    op_mul_10_block = llvm::BasicBlock::Create(context, "op_mul_10", step_func);
-
-    builder.SetInsertPoint(op_mul_block);
-
-    //
-    std::vector<llvm::Value *> temp;
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)));
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true))); //registers offset
-    llvm::Value *registers_GEP = builder.CreateInBoundsGEP(miniluastate_struct_type, _mls, temp);
-    llvm::Value *registers_LD = builder.CreateLoad(registers_GEP);
-
-    std::vector<llvm::Value *> ra_ret = create_ra(registers_LD);
-    llvm::Value *ra = ra_ret[1]; //Value *a = R(A(inst));
-
-    llvm::Value *b_inst = create_B();
-    std::vector<llvm::Value *> rkb_return = create_rk(b_inst, registers_LD);
-    llvm::Value *rkb = rkb_return[2];
-    llvm::Value *rkb_LD = builder.CreateLoad(rkb);
-    llvm::Value *rkb_or = builder.CreateOr(llvm::ConstantInt::get(context, llvm::APInt(32, 16, true)), rkb_LD);
-    llvm::Value *rkb_is_numerical_condition = builder.CreateICmpEQ(rkb_or, llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)));
-    builder.CreateCondBr(rkb_is_numerical_condition, op_mul_1_block, error_block);
-
-    //op_mul_1_block
-    builder.SetInsertPoint(op_mul_1_block);
-    llvm::Value *c_inst = create_C();
-    std::vector<llvm::Value *> rkc_return = create_rk(c_inst, registers_LD);
-    llvm::Value *rkc = rkc_return[2];
-    llvm::Value *rkc_LD = builder.CreateLoad(rkc);
-    llvm::Value *rkc_or = builder.CreateOr(llvm::ConstantInt::get(context, llvm::APInt(32, 16, true)), rkc_LD);
-    llvm::Value *rkc_is_numerical_condition = builder.CreateICmpEQ(rkc_or, llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)));
-    builder.CreateCondBr(rkc_is_numerical_condition, op_mul_2_block, error_block);
-
-    builder.SetInsertPoint(op_mul_2_block);
-    llvm::Value *rkb_is_int = builder.CreateICmpEQ(rkb_LD, llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)));
-    llvm::Value *rkc_is_int = builder.CreateICmpEQ(rkc_LD, llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)));
-    llvm::Value *both_int = builder.CreateAnd(rkb_is_int, rkc_is_int);
-    builder.CreateCondBr(both_int, op_mul_3_block, op_mul_4_block);
-
-    // XXX TODO discover why it seg faults when adding the third argument (the 0 on the commented line. On rkb and rkc!!!
-    // op_mul_1_block true
-    builder.SetInsertPoint(op_mul_3_block);
-    temp.clear();
-    temp.push_back(rkb_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *b_value_GEP = builder.CreateInBoundsGEP(value_struct_type, rkb_return[1], temp);
-    llvm::Value *b_value_LD = builder.CreateLoad(b_value_GEP);
-
-    temp.clear();
-    temp.push_back(rkc_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *c_value_GEP = builder.CreateInBoundsGEP(value_struct_type, rkc_return[1], temp);
-    llvm::Value *c_value_LD = builder.CreateLoad(c_value_GEP);
-
-    //MUL
-    llvm::Value *mul_b_c = builder.CreateMul(b_value_LD, c_value_LD);
-
-    temp.clear();
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *a_type = builder.CreateInBoundsGEP(value_struct_type, ra, temp);
-    builder.CreateStore(llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)), a_type);
-
-    temp.clear();
-    temp.push_back(ra_ret[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *a_value = builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp);
-    builder.CreateStore(mul_b_c, a_value);
-    builder.CreateBr(end_block);
-
-    // op_mul_1_block false
-    builder.SetInsertPoint(op_mul_4_block);
-    llvm::SwitchInst *switch_type = builder.CreateSwitch(rkb_LD, error_block, 2);
-    switch_type->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 3, true)), op_mul_5_block);
-    switch_type->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)), op_mul_6_block);
-
-    // op_mul_5_block (3)
-    builder.SetInsertPoint(op_mul_5_block);
-    temp.clear();
-    temp.push_back(rkb_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *b_value_GEP_2 = builder.CreateInBoundsGEP(value_struct_type, rkb_return[1], temp);
-    llvm::Value *b_bitcast = builder.CreateBitCast(b_value_GEP_2, llvm::Type::getDoublePtrTy(context));
-    llvm::Value *b_load = builder.CreateLoad(llvm::Type::getDoubleTy(context), b_bitcast);
-    builder.CreateBr(op_mul_7_block);
-
-    // op_mul_6_block (19)
-    builder.SetInsertPoint(op_mul_6_block);
-    temp.clear();
-    temp.push_back(rkb_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *b_value_GEP_3 = builder.CreateInBoundsGEP(value_struct_type, rkb_return[1], temp);
-    llvm::Value *b_load_2 = builder.CreateLoad(b_value_GEP_3);
-    llvm::Value *b_sitofp = builder.CreateSIToFP(b_load_2, llvm::Type::getDoubleTy(context));
-    builder.CreateBr(op_mul_7_block);
-
-
-    // op_mul_7_block
-    builder.SetInsertPoint(op_mul_7_block);
-    llvm::PHINode *phi_node = builder.CreatePHI(llvm::Type::getDoubleTy(context), 2); //op
-    phi_node->addIncoming(b_load, op_mul_5_block);
-    phi_node->addIncoming(b_sitofp, op_mul_6_block);
-    llvm::SwitchInst *switch_type_2 = builder.CreateSwitch(rkc_LD, error_block, 2);
-    switch_type_2->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 3, true)), op_mul_8_block);
-    switch_type_2->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)), op_mul_9_block);
-
-    // op_mul_8_block (3)
-    builder.SetInsertPoint(op_mul_8_block);
-    temp.clear();
-    temp.push_back(rkc_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *c_value_GEP_2 = builder.CreateInBoundsGEP(value_struct_type, rkc_return[1], temp);
-    llvm::Value *c_bitcast_2 = builder.CreateBitCast(c_value_GEP_2, llvm::Type::getDoublePtrTy(context));
-    llvm::Value *c_load = builder.CreateLoad(llvm::Type::getDoubleTy(context), c_bitcast_2);
-    builder.CreateBr(op_mul_10_block);
-
-    // op_mul_9_block (19)
-    builder.SetInsertPoint(op_mul_9_block);
-    temp.clear();
-    temp.push_back(rkc_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *c_value_GEP_3 = builder.CreateInBoundsGEP(value_struct_type, rkc_return[1], temp);
-    llvm::Value *c_load_2 = builder.CreateLoad(c_value_GEP_3);
-    llvm::Value *c_sitofp = builder.CreateSIToFP(c_load_2, llvm::Type::getDoubleTy(context));
-    builder.CreateBr(op_mul_10_block);
-
-    builder.SetInsertPoint(op_mul_10_block);
-    llvm::PHINode *phi_node_2 = builder.CreatePHI(llvm::Type::getDoubleTy(context), 2); //op
-    phi_node_2->addIncoming(c_load, op_mul_8_block);
-    phi_node_2->addIncoming(c_sitofp, op_mul_9_block);
-    llvm::Value *mul_b_c_2 = builder.CreateFMul(phi_node, phi_node_2);
-    temp.clear();
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *a_type_2 = builder.CreateInBoundsGEP(value_struct_type, ra, temp);
-    builder.CreateStore(llvm::ConstantInt::get(context, llvm::APInt(32, 3, true)), a_type_2);
-    temp.clear();
-    temp.push_back(ra_ret[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *a_value_2 = builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp);
-    llvm::Value *a_bitcast_2 = builder.CreateBitCast(a_value_2, llvm::Type::getDoublePtrTy(context));
-    builder.CreateStore(mul_b_c_2, a_bitcast_2);
-    builder.CreateBr(end_block);
-    //
-
-
-    return llvm::ConstantInt::get(context, llvm::APInt(64, 0, true));
-}
-
-llvm::Value* create_op_div_block() {
-    op_div_block = llvm::BasicBlock::Create(context, "op_div", step_func);
-
-    op_div_1_block = llvm::BasicBlock::Create(context, "op_div_1", step_func);
-    op_div_4_block = llvm::BasicBlock::Create(context, "op_div_4", step_func);
-    op_div_5_block = llvm::BasicBlock::Create(context, "op_div_5", step_func);
-    op_div_6_block = llvm::BasicBlock::Create(context, "op_div_6", step_func);
-    op_div_7_block = llvm::BasicBlock::Create(context, "op_div_7", step_func);
-    op_div_8_block = llvm::BasicBlock::Create(context, "op_div_8", step_func);
-    op_div_9_block = llvm::BasicBlock::Create(context, "op_div_9", step_func);
-    op_div_10_block = llvm::BasicBlock::Create(context, "op_div_10", step_func);
-
-    builder.SetInsertPoint(op_div_block);
-
-    //
-    std::vector<llvm::Value *> temp;
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)));
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true))); //registers offset
-    llvm::Value *registers_GEP = builder.CreateInBoundsGEP(miniluastate_struct_type, _mls, temp);
-    llvm::Value *registers_LD = builder.CreateLoad(registers_GEP);
-
-    std::vector<llvm::Value *> ra_ret = create_ra(registers_LD);
-    llvm::Value *ra = ra_ret[1]; //Value *a = R(A(inst));
-
-    llvm::Value *b_inst = create_B();
-    std::vector<llvm::Value *> rkb_return = create_rk(b_inst, registers_LD);
-    llvm::Value *rkb = rkb_return[2];
-    llvm::Value *rkb_LD = builder.CreateLoad(rkb);
-    llvm::Value *rkb_or = builder.CreateOr(llvm::ConstantInt::get(context, llvm::APInt(32, 16, true)), rkb_LD);
-    llvm::Value *rkb_is_numerical_condition = builder.CreateICmpEQ(rkb_or, llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)));
-    builder.CreateCondBr(rkb_is_numerical_condition, op_div_1_block, error_block);
-
-    //op_div_1_block
-    builder.SetInsertPoint(op_div_1_block);
-    llvm::Value *c_inst = create_C();
-    std::vector<llvm::Value *> rkc_return = create_rk(c_inst, registers_LD);
-    llvm::Value *rkc = rkc_return[2];
-    llvm::Value *rkc_LD = builder.CreateLoad(rkc);
-    llvm::Value *rkc_or = builder.CreateOr(llvm::ConstantInt::get(context, llvm::APInt(32, 16, true)), rkc_LD);
-    llvm::Value *rkc_is_numerical_condition = builder.CreateICmpEQ(rkc_or, llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)));
-    builder.CreateCondBr(rkc_is_numerical_condition, op_div_4_block, error_block);
-
-    // op_div_4_block false
-    builder.SetInsertPoint(op_div_4_block);
-    llvm::SwitchInst *switch_type = builder.CreateSwitch(rkb_LD, error_block, 2);
-    switch_type->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 3, true)), op_div_5_block);
-    switch_type->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)), op_div_6_block);
-
-    // op_div_5_block (3)
-    builder.SetInsertPoint(op_div_5_block);
-    temp.clear();
-    temp.push_back(rkb_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *b_value_GEP_2 = builder.CreateInBoundsGEP(value_struct_type, rkb_return[1], temp);
-    llvm::Value *b_bitcast = builder.CreateBitCast(b_value_GEP_2, llvm::Type::getDoublePtrTy(context));
-    llvm::Value *b_load = builder.CreateLoad(llvm::Type::getDoubleTy(context), b_bitcast);
-    builder.CreateBr(op_div_7_block);
-
-    // op_div_6_block (19)
-    builder.SetInsertPoint(op_div_6_block);
-    temp.clear();
-    temp.push_back(rkb_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *b_value_GEP_3 = builder.CreateInBoundsGEP(value_struct_type, rkb_return[1], temp);
-    llvm::Value *b_load_2 = builder.CreateLoad(b_value_GEP_3);
-    llvm::Value *b_sitofp = builder.CreateSIToFP(b_load_2, llvm::Type::getDoubleTy(context));
-    builder.CreateBr(op_div_7_block);
-
-
-    // op_div_7_block
-    builder.SetInsertPoint(op_div_7_block);
-    llvm::PHINode *phi_node = builder.CreatePHI(llvm::Type::getDoubleTy(context), 2); //op
-    phi_node->addIncoming(b_load, op_div_5_block);
-    phi_node->addIncoming(b_sitofp, op_div_6_block);
-    llvm::SwitchInst *switch_type_2 = builder.CreateSwitch(rkc_LD, error_block, 2);
-    switch_type_2->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 3, true)), op_div_8_block);
-    switch_type_2->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)), op_div_9_block);
-
-    // op_div_8_block (3)
-    builder.SetInsertPoint(op_div_8_block);
-    temp.clear();
-    temp.push_back(rkc_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *c_value_GEP_2 = builder.CreateInBoundsGEP(value_struct_type, rkc_return[1], temp);
-    llvm::Value *c_bitcast_2 = builder.CreateBitCast(c_value_GEP_2, llvm::Type::getDoublePtrTy(context));
-    llvm::Value *c_load = builder.CreateLoad(llvm::Type::getDoubleTy(context), c_bitcast_2);
-    builder.CreateBr(op_div_10_block);
-
-    // op_div_9_block (19)
-    builder.SetInsertPoint(op_div_9_block);
-    temp.clear();
-    temp.push_back(rkc_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *c_value_GEP_3 = builder.CreateInBoundsGEP(value_struct_type, rkc_return[1], temp);
-    llvm::Value *c_load_2 = builder.CreateLoad(c_value_GEP_3);
-    llvm::Value *c_sitofp = builder.CreateSIToFP(c_load_2, llvm::Type::getDoubleTy(context));
-    builder.CreateBr(op_div_10_block);
-
-    builder.SetInsertPoint(op_div_10_block);
-    llvm::PHINode *phi_node_2 = builder.CreatePHI(llvm::Type::getDoubleTy(context), 2); //op
-    phi_node_2->addIncoming(c_load, op_div_8_block);
-    phi_node_2->addIncoming(c_sitofp, op_div_9_block);
-    llvm::Value *div_b_c_2 = builder.CreateFDiv(phi_node, phi_node_2);
-    temp.clear();
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *a_type_2 = builder.CreateInBoundsGEP(value_struct_type, ra, temp);
-    builder.CreateStore(llvm::ConstantInt::get(context, llvm::APInt(32, 3, true)), a_type_2);
-    temp.clear();
-    temp.push_back(ra_ret[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *a_value_2 = builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp);
-    llvm::Value *a_bitcast_2 = builder.CreateBitCast(a_value_2, llvm::Type::getDoublePtrTy(context));
-    builder.CreateStore(div_b_c_2, a_bitcast_2);
-    builder.CreateBr(end_block);
-    //
-
-
-    return llvm::ConstantInt::get(context, llvm::APInt(64, 0, true));
-}
-
-
-
-llvm::Value* create_op_mod_block() {
-    op_mod_block = llvm::BasicBlock::Create(context, "op_mod", step_func);
-
-    op_mod_1_block = llvm::BasicBlock::Create(context, "op_mod_1", step_func);
-    op_mod_2_block = llvm::BasicBlock::Create(context, "op_mod_2", step_func);
-    op_mod_3_block = llvm::BasicBlock::Create(context, "op_mod_3", step_func);
-    op_mod_4_block = llvm::BasicBlock::Create(context, "op_mod_4", step_func);
-    op_mod_5_block = llvm::BasicBlock::Create(context, "op_mod_5", step_func);
-    op_mod_6_block = llvm::BasicBlock::Create(context, "op_mod_6", step_func);
-    op_mod_7_block = llvm::BasicBlock::Create(context, "op_mod_7", step_func);
-    op_mod_8_block = llvm::BasicBlock::Create(context, "op_mod_8", step_func);
-    op_mod_9_block = llvm::BasicBlock::Create(context, "op_mod_9", step_func);
-    op_mod_10_block = llvm::BasicBlock::Create(context, "op_mod_10", step_func);
-
-    builder.SetInsertPoint(op_mod_block);
-
-    //
-    std::vector<llvm::Value *> temp;
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)));
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true))); //registers offset
-    llvm::Value *registers_GEP = builder.CreateInBoundsGEP(miniluastate_struct_type, _mls, temp);
-    llvm::Value *registers_LD = builder.CreateLoad(registers_GEP);
-
-    std::vector<llvm::Value *> ra_ret = create_ra(registers_LD);
-    llvm::Value *ra = ra_ret[1]; //Value *a = R(A(inst));
-
-    llvm::Value *b_inst = create_B();
-    std::vector<llvm::Value *> rkb_return = create_rk(b_inst, registers_LD);
-    llvm::Value *rkb = rkb_return[2];
-    llvm::Value *rkb_LD = builder.CreateLoad(rkb);
-    llvm::Value *rkb_or = builder.CreateOr(llvm::ConstantInt::get(context, llvm::APInt(32, 16, true)), rkb_LD);
-    llvm::Value *rkb_is_numerical_condition = builder.CreateICmpEQ(rkb_or, llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)));
-    builder.CreateCondBr(rkb_is_numerical_condition, op_mod_1_block, error_block);
-
-    //op_mod_1_block
-    builder.SetInsertPoint(op_mod_1_block);
-    llvm::Value *c_inst = create_C();
-    std::vector<llvm::Value *> rkc_return = create_rk(c_inst, registers_LD);
-    llvm::Value *rkc = rkc_return[2];
-    llvm::Value *rkc_LD = builder.CreateLoad(rkc);
-    llvm::Value *rkc_or = builder.CreateOr(llvm::ConstantInt::get(context, llvm::APInt(32, 16, true)), rkc_LD);
-    llvm::Value *rkc_is_numerical_condition = builder.CreateICmpEQ(rkc_or, llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)));
-    builder.CreateCondBr(rkc_is_numerical_condition, op_mod_2_block, error_block);
-
-    //op_mod_2_block
-    builder.SetInsertPoint(op_mod_2_block);
-    llvm::Value *rkb_is_int = builder.CreateICmpEQ(rkb_LD, llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)));
-    llvm::Value *rkc_is_int = builder.CreateICmpEQ(rkc_LD, llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)));
-    llvm::Value *both_int = builder.CreateAnd(rkb_is_int, rkc_is_int);
-    builder.CreateCondBr(both_int, op_mod_3_block, op_mod_4_block);
-
-    // XXX TODO discover why it seg faults when adding the third argument (the 0 on the commented line. On rkb and rkc!!!
-    // op_mod_3_block true
-    builder.SetInsertPoint(op_mod_3_block);
-    temp.clear();
-    temp.push_back(rkb_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *b_value_GEP = builder.CreateInBoundsGEP(value_struct_type, rkb_return[1], temp);
-    llvm::Value *b_value_LD = builder.CreateLoad(b_value_GEP);
-
-    temp.clear();
-    temp.push_back(rkc_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *c_value_GEP = builder.CreateInBoundsGEP(value_struct_type, rkc_return[1], temp);
-    llvm::Value *c_value_LD = builder.CreateLoad(c_value_GEP);
-
-    //MOD
-    llvm::Value *mod_b_c = builder.CreateSRem(b_value_LD, c_value_LD);
-
-    temp.clear();
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *a_type = builder.CreateInBoundsGEP(value_struct_type, ra, temp);
-    builder.CreateStore(llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)), a_type);
-
-    temp.clear();
-    temp.push_back(ra_ret[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *a_value = builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp);
-    builder.CreateStore(mod_b_c, a_value);
-    builder.CreateBr(end_block);
-
-    // op_mod_1_block false
-    builder.SetInsertPoint(op_mod_4_block);
-    llvm::SwitchInst *switch_type = builder.CreateSwitch(rkb_LD, error_block, 2);
-    switch_type->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 3, true)), op_mod_5_block);
-    switch_type->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)), op_mod_6_block);
-
-    // op_mod_5_block (3)
-    builder.SetInsertPoint(op_mod_5_block);
-    temp.clear();
-    temp.push_back(rkb_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *b_value_GEP_2 = builder.CreateInBoundsGEP(value_struct_type, rkb_return[1], temp);
-    llvm::Value *b_bitcast = builder.CreateBitCast(b_value_GEP_2, llvm::Type::getDoublePtrTy(context));
-    llvm::Value *b_load = builder.CreateLoad(llvm::Type::getDoubleTy(context), b_bitcast);
-    builder.CreateBr(op_mod_7_block);
-
-    // op_mod_6_block (19)
-    builder.SetInsertPoint(op_mod_6_block);
-    temp.clear();
-    temp.push_back(rkb_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *b_value_GEP_3 = builder.CreateInBoundsGEP(value_struct_type, rkb_return[1], temp);
-    llvm::Value *b_load_2 = builder.CreateLoad(b_value_GEP_3);
-    llvm::Value *b_sitofp = builder.CreateSIToFP(b_load_2, llvm::Type::getDoubleTy(context));
-    builder.CreateBr(op_mod_7_block);
-
-
-    // op_mod_7_block
-    builder.SetInsertPoint(op_mod_7_block);
-    llvm::PHINode *phi_node = builder.CreatePHI(llvm::Type::getDoubleTy(context), 2); //op
-    phi_node->addIncoming(b_load, op_mod_5_block);
-    phi_node->addIncoming(b_sitofp, op_mod_6_block);
-    llvm::SwitchInst *switch_type_2 = builder.CreateSwitch(rkc_LD, error_block, 2);
-    switch_type_2->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 3, true)), op_mod_8_block);
-    switch_type_2->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)), op_mod_9_block);
-
-    // op_mod_8_block (3)
-    builder.SetInsertPoint(op_mod_8_block);
-    temp.clear();
-    temp.push_back(rkc_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *c_value_GEP_2 = builder.CreateInBoundsGEP(value_struct_type, rkc_return[1], temp);
-    llvm::Value *c_bitcast_2 = builder.CreateBitCast(c_value_GEP_2, llvm::Type::getDoublePtrTy(context));
-    llvm::Value *c_load = builder.CreateLoad(llvm::Type::getDoubleTy(context), c_bitcast_2);
-    builder.CreateBr(op_mod_10_block);
-
-    // op_mod_9_block (19)
-    builder.SetInsertPoint(op_mod_9_block);
-    temp.clear();
-    temp.push_back(rkc_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *c_value_GEP_3 = builder.CreateInBoundsGEP(value_struct_type, rkc_return[1], temp);
-    llvm::Value *c_load_2 = builder.CreateLoad(c_value_GEP_3);
-    llvm::Value *c_sitofp = builder.CreateSIToFP(c_load_2, llvm::Type::getDoubleTy(context));
-    builder.CreateBr(op_mod_10_block);
-
-    builder.SetInsertPoint(op_mod_10_block);
-    llvm::PHINode *phi_node_2 = builder.CreatePHI(llvm::Type::getDoubleTy(context), 2); //op
-    phi_node_2->addIncoming(c_load, op_mod_8_block);
-    phi_node_2->addIncoming(c_sitofp, op_mod_9_block);
-    llvm::Value *mod_b_c_2 = builder.CreateFRem(phi_node, phi_node_2);
-    temp.clear();
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *a_type_2 = builder.CreateInBoundsGEP(value_struct_type, ra, temp);
-    builder.CreateStore(llvm::ConstantInt::get(context, llvm::APInt(32, 3, true)), a_type_2);
-    temp.clear();
-    temp.push_back(ra_ret[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *a_value_2 = builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp);
-    llvm::Value *a_bitcast_2 = builder.CreateBitCast(a_value_2, llvm::Type::getDoublePtrTy(context));
-    builder.CreateStore(mod_b_c_2, a_bitcast_2);
-    builder.CreateBr(end_block);
-    //
-
-
-    return llvm::ConstantInt::get(context, llvm::APInt(64, 0, true));
-}
-
-llvm::Value* create_op_idiv_block() {
-    op_idiv_block = llvm::BasicBlock::Create(context, "op_idiv", step_func);
-
-    op_idiv_1_block = llvm::BasicBlock::Create(context, "op_idiv_1", step_func);
-    op_idiv_2_block = llvm::BasicBlock::Create(context, "op_idiv_2", step_func);
-    op_idiv_3_block = llvm::BasicBlock::Create(context, "op_idiv_3", step_func);
-    op_idiv_4_block = llvm::BasicBlock::Create(context, "op_idiv_4", step_func);
-    op_idiv_5_block = llvm::BasicBlock::Create(context, "op_idiv_5", step_func);
-    op_idiv_6_block = llvm::BasicBlock::Create(context, "op_idiv_6", step_func);
-    op_idiv_7_block = llvm::BasicBlock::Create(context, "op_idiv_7", step_func);
-    op_idiv_8_block = llvm::BasicBlock::Create(context, "op_idiv_8", step_func);
-    op_idiv_9_block = llvm::BasicBlock::Create(context, "op_idiv_9", step_func);
-    op_idiv_10_block = llvm::BasicBlock::Create(context, "op_idiv_10", step_func);
-
-    builder.SetInsertPoint(op_idiv_block);
-
-    //
-    std::vector<llvm::Value *> temp;
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)));
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true))); //registers offset
-    llvm::Value *registers_GEP = builder.CreateInBoundsGEP(miniluastate_struct_type, _mls, temp);
-    llvm::Value *registers_LD = builder.CreateLoad(registers_GEP);
-
-    std::vector<llvm::Value *> ra_ret = create_ra(registers_LD);
-    llvm::Value *ra = ra_ret[1]; //Value *a = R(A(inst));
-
-    llvm::Value *b_inst = create_B();
-    std::vector<llvm::Value *> rkb_return = create_rk(b_inst, registers_LD);
-    llvm::Value *rkb = rkb_return[2];
-    llvm::Value *rkb_LD = builder.CreateLoad(rkb);
-    llvm::Value *rkb_or = builder.CreateOr(llvm::ConstantInt::get(context, llvm::APInt(32, 16, true)), rkb_LD);
-    llvm::Value *rkb_is_numerical_condition = builder.CreateICmpEQ(rkb_or, llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)));
-    builder.CreateCondBr(rkb_is_numerical_condition, op_idiv_1_block, error_block);
-
-    //op_idiv_1_block
-    builder.SetInsertPoint(op_idiv_1_block);
-    llvm::Value *c_inst = create_C();
-    std::vector<llvm::Value *> rkc_return = create_rk(c_inst, registers_LD);
-    llvm::Value *rkc = rkc_return[2];
-    llvm::Value *rkc_LD = builder.CreateLoad(rkc);
-    llvm::Value *rkc_or = builder.CreateOr(llvm::ConstantInt::get(context, llvm::APInt(32, 16, true)), rkc_LD);
-    llvm::Value *rkc_is_numerical_condition = builder.CreateICmpEQ(rkc_or, llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)));
-    builder.CreateCondBr(rkc_is_numerical_condition, op_idiv_2_block, error_block);
-
-    builder.SetInsertPoint(op_idiv_2_block);
-    llvm::Value *rkb_is_int = builder.CreateICmpEQ(rkb_LD, llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)));
-    llvm::Value *rkc_is_int = builder.CreateICmpEQ(rkc_LD, llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)));
-    llvm::Value *both_int = builder.CreateAnd(rkb_is_int, rkc_is_int);
-    builder.CreateCondBr(both_int, op_idiv_3_block, op_idiv_4_block);
-
-    // XXX TODO discover why it seg faults when adding the third argument (the 0 on the commented line. On rkb and rkc!!!
-    // op_idiv_1_block true
-    builder.SetInsertPoint(op_idiv_3_block);
-    temp.clear();
-    temp.push_back(rkb_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *b_value_GEP = builder.CreateInBoundsGEP(value_struct_type, rkb_return[1], temp);
-    llvm::Value *b_value_LD = builder.CreateLoad(b_value_GEP);
-
-    temp.clear();
-    temp.push_back(rkc_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *c_value_GEP = builder.CreateInBoundsGEP(value_struct_type, rkc_return[1], temp);
-    llvm::Value *c_value_LD = builder.CreateLoad(c_value_GEP);
-
-    //ADD
-    llvm::Value *idiv_b_c = builder.CreateSDiv(b_value_LD, c_value_LD);
-
-    temp.clear();
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *a_type = builder.CreateInBoundsGEP(value_struct_type, ra, temp);
-    builder.CreateStore(llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)), a_type);
-
-    temp.clear();
-    temp.push_back(ra_ret[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *a_value = builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp);
-    builder.CreateStore(idiv_b_c, a_value);
-    builder.CreateBr(end_block);
-
-    // op_idiv_1_block false
-    builder.SetInsertPoint(op_idiv_4_block);
-    llvm::SwitchInst *switch_type = builder.CreateSwitch(rkb_LD, error_block, 2);
-    switch_type->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 3, true)), op_idiv_5_block);
-    switch_type->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)), op_idiv_6_block);
-
-    // op_idiv_5_block (3)
-    builder.SetInsertPoint(op_idiv_5_block);
-    temp.clear();
-    temp.push_back(rkb_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *b_value_GEP_2 = builder.CreateInBoundsGEP(value_struct_type, rkb_return[1], temp);
-    llvm::Value *b_bitcast = builder.CreateBitCast(b_value_GEP_2, llvm::Type::getDoublePtrTy(context));
-    llvm::Value *b_load = builder.CreateLoad(llvm::Type::getDoubleTy(context), b_bitcast);
-    builder.CreateBr(op_idiv_7_block);
-
-    // op_idiv_6_block (19)
-    builder.SetInsertPoint(op_idiv_6_block);
-    temp.clear();
-    temp.push_back(rkb_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *b_value_GEP_3 = builder.CreateInBoundsGEP(value_struct_type, rkb_return[1], temp);
-    llvm::Value *b_load_2 = builder.CreateLoad(b_value_GEP_3);
-    llvm::Value *b_sitofp = builder.CreateSIToFP(b_load_2, llvm::Type::getDoubleTy(context));
-    builder.CreateBr(op_idiv_7_block);
-
-
-    // op_idiv_7_block
-    builder.SetInsertPoint(op_idiv_7_block);
-    llvm::PHINode *phi_node = builder.CreatePHI(llvm::Type::getDoubleTy(context), 2); //op
-    phi_node->addIncoming(b_load, op_idiv_5_block);
-    phi_node->addIncoming(b_sitofp, op_idiv_6_block);
-    llvm::SwitchInst *switch_type_2 = builder.CreateSwitch(rkc_LD, error_block, 2);
-    switch_type_2->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 3, true)), op_idiv_8_block);
-    switch_type_2->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)), op_idiv_9_block);
-
-    // op_idiv_8_block (3)
-    builder.SetInsertPoint(op_idiv_8_block);
-    temp.clear();
-    temp.push_back(rkc_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *c_value_GEP_2 = builder.CreateInBoundsGEP(value_struct_type, rkc_return[1], temp);
-    llvm::Value *c_bitcast_2 = builder.CreateBitCast(c_value_GEP_2, llvm::Type::getDoublePtrTy(context));
-    llvm::Value *c_load = builder.CreateLoad(llvm::Type::getDoubleTy(context), c_bitcast_2);
-    builder.CreateBr(op_idiv_10_block);
-
-    // op_idiv_9_block (19)
-    builder.SetInsertPoint(op_idiv_9_block);
-    temp.clear();
-    temp.push_back(rkc_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *c_value_GEP_3 = builder.CreateInBoundsGEP(value_struct_type, rkc_return[1], temp);
-    llvm::Value *c_load_2 = builder.CreateLoad(c_value_GEP_3);
-    llvm::Value *c_sitofp = builder.CreateSIToFP(c_load_2, llvm::Type::getDoubleTy(context));
-    builder.CreateBr(op_idiv_10_block);
-
-    builder.SetInsertPoint(op_idiv_10_block);
-    llvm::PHINode *phi_node_2 = builder.CreatePHI(llvm::Type::getDoubleTy(context), 2); //op
-    phi_node_2->addIncoming(c_load, op_idiv_8_block);
-    phi_node_2->addIncoming(c_sitofp, op_idiv_9_block);
-    llvm::Value *fdiv_b_c = builder.CreateFDiv(phi_node, phi_node_2);
-    temp.clear();
-    temp.push_back(fdiv_b_c);
-    llvm::Value *floor_fdiv_b_c = builder.CreateCall(llvm_floor, temp);
-    temp.clear();
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *a_type_2 = builder.CreateInBoundsGEP(value_struct_type, ra, temp);
-    builder.CreateStore(llvm::ConstantInt::get(context, llvm::APInt(32, 3, true)), a_type_2);
-    temp.clear();
-    temp.push_back(ra_ret[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *a_value_2 = builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp);
-    llvm::Value *a_bitcast_2 = builder.CreateBitCast(a_value_2, llvm::Type::getDoublePtrTy(context));
-    builder.CreateStore(floor_fdiv_b_c, a_bitcast_2);
-    builder.CreateBr(end_block);
-    //
-
-
-    return llvm::ConstantInt::get(context, llvm::APInt(64, 0, true));
-}
-
-llvm::Value* create_op_pow_block() {
-    op_pow_block = llvm::BasicBlock::Create(context, "op_pow", step_func);
-
-    op_pow_1_block = llvm::BasicBlock::Create(context, "op_pow_1", step_func);
-    op_pow_4_block = llvm::BasicBlock::Create(context, "op_pow_4", step_func);
-    op_pow_5_block = llvm::BasicBlock::Create(context, "op_pow_5", step_func);
-    op_pow_6_block = llvm::BasicBlock::Create(context, "op_pow_6", step_func);
-    op_pow_7_block = llvm::BasicBlock::Create(context, "op_pow_7", step_func);
-    op_pow_8_block = llvm::BasicBlock::Create(context, "op_pow_8", step_func);
-    op_pow_9_block = llvm::BasicBlock::Create(context, "op_pow_9", step_func);
-    op_pow_10_block = llvm::BasicBlock::Create(context, "op_pow_10", step_func);
-
-    builder.SetInsertPoint(op_pow_block);
-
-    //
-    std::vector<llvm::Value *> temp;
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)));
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true))); //registers offset
-    llvm::Value *registers_GEP = builder.CreateInBoundsGEP(miniluastate_struct_type, _mls, temp);
-    llvm::Value *registers_LD = builder.CreateLoad(registers_GEP);
-
-    std::vector<llvm::Value *> ra_ret = create_ra(registers_LD);
-    llvm::Value *ra = ra_ret[1]; //Value *a = R(A(inst));
-
-    llvm::Value *b_inst = create_B();
-    std::vector<llvm::Value *> rkb_return = create_rk(b_inst, registers_LD);
-    llvm::Value *rkb = rkb_return[2];
-    llvm::Value *rkb_LD = builder.CreateLoad(rkb);
-    llvm::Value *rkb_or = builder.CreateOr(llvm::ConstantInt::get(context, llvm::APInt(32, 16, true)), rkb_LD);
-    llvm::Value *rkb_is_numerical_condition = builder.CreateICmpEQ(rkb_or, llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)));
-    builder.CreateCondBr(rkb_is_numerical_condition, op_pow_1_block, error_block);
-
-    //op_pow_1_block
-    builder.SetInsertPoint(op_pow_1_block);
-    llvm::Value *c_inst = create_C();
-    std::vector<llvm::Value *> rkc_return = create_rk(c_inst, registers_LD);
-    llvm::Value *rkc = rkc_return[2];
-    llvm::Value *rkc_LD = builder.CreateLoad(rkc);
-    llvm::Value *rkc_or = builder.CreateOr(llvm::ConstantInt::get(context, llvm::APInt(32, 16, true)), rkc_LD);
-    llvm::Value *rkc_is_numerical_condition = builder.CreateICmpEQ(rkc_or, llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)));
-    builder.CreateCondBr(rkc_is_numerical_condition, op_pow_4_block, error_block);
-
-    // op_pow_4_block false
-    builder.SetInsertPoint(op_pow_4_block);
-    llvm::SwitchInst *switch_type = builder.CreateSwitch(rkb_LD, error_block, 2);
-    switch_type->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 3, true)), op_pow_5_block);
-    switch_type->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)), op_pow_6_block);
-
-    // op_pow_5_block (3)
-    builder.SetInsertPoint(op_pow_5_block);
-    temp.clear();
-    temp.push_back(rkb_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *b_value_GEP_2 = builder.CreateInBoundsGEP(value_struct_type, rkb_return[1], temp);
-    llvm::Value *b_bitcast = builder.CreateBitCast(b_value_GEP_2, llvm::Type::getDoublePtrTy(context));
-    llvm::Value *b_load = builder.CreateLoad(llvm::Type::getDoubleTy(context), b_bitcast);
-    builder.CreateBr(op_pow_7_block);
-
-    // op_pow_6_block (19)
-    builder.SetInsertPoint(op_pow_6_block);
-    temp.clear();
-    temp.push_back(rkb_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *b_value_GEP_3 = builder.CreateInBoundsGEP(value_struct_type, rkb_return[1], temp);
-    llvm::Value *b_load_2 = builder.CreateLoad(b_value_GEP_3);
-    llvm::Value *b_sitofp = builder.CreateSIToFP(b_load_2, llvm::Type::getDoubleTy(context));
-    builder.CreateBr(op_pow_7_block);
-
-
-    // op_pow_7_block
-    builder.SetInsertPoint(op_pow_7_block);
-    llvm::PHINode *phi_node = builder.CreatePHI(llvm::Type::getDoubleTy(context), 2); //op
-    phi_node->addIncoming(b_load, op_pow_5_block);
-    phi_node->addIncoming(b_sitofp, op_pow_6_block);
-    llvm::SwitchInst *switch_type_2 = builder.CreateSwitch(rkc_LD, error_block, 2);
-    switch_type_2->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 3, true)), op_pow_8_block);
-    switch_type_2->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)), op_pow_9_block);
-
-    // op_pow_8_block (3)
-    builder.SetInsertPoint(op_pow_8_block);
-    temp.clear();
-    temp.push_back(rkc_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *c_value_GEP_2 = builder.CreateInBoundsGEP(value_struct_type, rkc_return[1], temp);
-    llvm::Value *c_bitcast_2 = builder.CreateBitCast(c_value_GEP_2, llvm::Type::getDoublePtrTy(context));
-    llvm::Value *c_load = builder.CreateLoad(llvm::Type::getDoubleTy(context), c_bitcast_2);
-    builder.CreateBr(op_pow_10_block);
-
-    // op_pow_9_block (19)
-    builder.SetInsertPoint(op_pow_9_block);
-    temp.clear();
-    temp.push_back(rkc_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *c_value_GEP_3 = builder.CreateInBoundsGEP(value_struct_type, rkc_return[1], temp);
-    llvm::Value *c_load_2 = builder.CreateLoad(c_value_GEP_3);
-    llvm::Value *c_sitofp = builder.CreateSIToFP(c_load_2, llvm::Type::getDoubleTy(context));
-    builder.CreateBr(op_pow_10_block);
-
-    builder.SetInsertPoint(op_pow_10_block);
-    llvm::PHINode *phi_node_2 = builder.CreatePHI(llvm::Type::getDoubleTy(context), 2); //op
-    phi_node_2->addIncoming(c_load, op_pow_8_block);
-    phi_node_2->addIncoming(c_sitofp, op_pow_9_block);
-    temp.clear();
-    temp.push_back(phi_node);
-    temp.push_back(phi_node_2);
-    llvm::Value *pow_b_c = builder.CreateCall(llvm_pow, temp);
-    temp.clear();
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *a_type_2 = builder.CreateInBoundsGEP(value_struct_type, ra, temp);
-    builder.CreateStore(llvm::ConstantInt::get(context, llvm::APInt(32, 3, true)), a_type_2);
-    temp.clear();
-    temp.push_back(ra_ret[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *a_value_2 = builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp);
-    llvm::Value *a_bitcast_2 = builder.CreateBitCast(a_value_2, llvm::Type::getDoublePtrTy(context));
-    builder.CreateStore(pow_b_c, a_bitcast_2);
-    builder.CreateBr(end_block);
-    //
+// Operands of an opcodes.def op: RK(B) and RK(C) and their tags. Branches to
+// error_block unless both are numbers.
+static std::vector<llvm::Value *> create_numeric_operands(llvm::Value *registers_LD, llvm::BasicBlock *next_block) {
+    std::vector<llvm::Value *> ret;
+
+    std::vector<llvm::Value *> rkb_return = create_rk(create_B(), registers_LD);
+    std::vector<llvm::Value *> rkc_return = create_rk(create_C(), registers_LD);
+    llvm::Value *rkb = builder.CreateInBoundsGEP(value_struct_type, rkb_return[1], rkb_return[0]);
+    llvm::Value *rkc = builder.CreateInBoundsGEP(value_struct_type, rkc_return[1], rkc_return[0]);
+    llvm::Value *rkb_LD = create_load(rkb_return[2]);
+    llvm::Value *rkc_LD = create_load(rkc_return[2]);
+
+    // LUA_TNUMFLT | 16 == LUA_TNUMINT
+    llvm::Value *rkb_or = builder.CreateOr(llvm::ConstantInt::get(context, llvm::APInt(32, 16, true)), rkb_LD);
+    llvm::Value *rkc_or = builder.CreateOr(llvm::ConstantInt::get(context, llvm::APInt(32, 16, true)), rkc_LD);
+    llvm::Value *both_numerical = builder.CreateAnd(
+        builder.CreateICmpEQ(rkb_or, llvm::ConstantInt::get(context, llvm::APInt(32, LUA_TNUMINT, true))),
+        builder.CreateICmpEQ(rkc_or, llvm::ConstantInt::get(context, llvm::APInt(32, LUA_TNUMINT, true))));
+    builder.CreateCondBr(both_numerical, next_block, error_block);
+
+    ret.push_back(rkb);
+    ret.push_back(rkb_LD);
+    ret.push_back(rkc);
+    ret.push_back(rkc_LD);
+    return ret;
+}
+
+// R(A) := RK(B) op RK(C), for the OPSPEC_ARITH and OPSPEC_ARITH_FLOAT ops.
+llvm::Value* create_op_arith_block(uint32_t op) {
+    uint32_t index = op - OP_ADD;
+    std::string name = opspec_block_name(op);
+    bool has_int = has_int_primitive(op);
 
+    op_arith_block[index] = llvm::BasicBlock::Create(context, name, step_func);
+    llvm::BasicBlock *numerical_block = has_int ? llvm::BasicBlock::Create(context, name + "_1", step_func) : NULL;
+    op_arith_int_block[index] = has_int ? llvm::BasicBlock::Create(context, name + "_int", step_func) : NULL;
+    op_arith_float_block[index] = llvm::BasicBlock::Create(context, name + "_float", step_func);
+
+    builder.SetInsertPoint(op_arith_block[index]);
+    llvm::Value *registers_LD = create_registers();
+    llvm::Value *ra = create_ra(registers_LD)[1];
+    std::vector<llvm::Value *> operands = create_numeric_operands(registers_LD,
+        has_int ? numerical_block : op_arith_float_block[index]);
+    llvm::Value *rkb = operands[0], *rkb_LD = operands[1];
+    llvm::Value *rkc = operands[2], *rkc_LD = operands[3];
+
+    if (has_int) {
+        builder.SetInsertPoint(numerical_block);
+        llvm::Value *rkb_is_int = builder.CreateICmpEQ(rkb_LD, llvm::ConstantInt::get(context, llvm::APInt(32, LUA_TNUMINT, true)));
+        llvm::Value *rkc_is_int = builder.CreateICmpEQ(rkc_LD, llvm::ConstantInt::get(context, llvm::APInt(32, LUA_TNUMINT, true)));
+        builder.CreateCondBr(builder.CreateAnd(rkb_is_int, rkc_is_int), op_arith_int_block[index], op_arith_float_block[index]);
+
+        builder.SetInsertPoint(op_arith_int_block[index]);
+        llvm::Value *result = create_int_primitive(op, create_load(create_payload_ptr(rkb)), create_load(create_payload_ptr(rkc)));
+        builder.CreateStore(llvm::ConstantInt::get(context, llvm::APInt(32, LUA_TNUMINT, true)), create_type_ptr(ra));
+        builder.CreateStore(result, create_payload_ptr(ra));
+        builder.CreateBr(end_block);
+    }
+
+    builder.SetInsertPoint(op_arith_float_block[index]);
+    llvm::Value *result = create_float_primitive(op, create_tofloat(rkb, rkb_LD), create_tofloat(rkc, rkc_LD));
+    builder.CreateStore(llvm::ConstantInt::get(context, llvm::APInt(32, LUA_TNUMFLT, true)), create_type_ptr(ra));
+    builder.CreateStore(result, builder.CreateBitCast(create_payload_ptr(ra), llvm::Type::getDoublePtrTy(context)));
+    builder.CreateBr(end_block);
 
     return llvm::ConstantInt::get(context, llvm::APInt(64, 0, true));
 }
@@ -2111,10 +1401,7 @@ llvm::Value* create_op_unm_block() {
     builder.SetInsertPoint(op_unm_block);
 
     std::vector<llvm::Value *> temp;
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)));
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true))); //registers offset
-    llvm::Value *registers_GEP = builder.CreateInBoundsGEP(miniluastate_struct_type, _mls, temp);
-    llvm::Value *registers_LD = builder.CreateLoad(registers_GEP);
+    llvm::Value *registers_LD = create_registers();
 
     std::vector<llvm::Value *> ra_return = create_ra(registers_LD);
     llvm::Value * ra = ra_return[1];
@@ -2126,7 +1413,7 @@ llvm::Value* create_op_unm_block() {
     temp.push_back(b_inst_zext);
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
     llvm::Value *registers_bth = builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp); /* Value *b */
-    llvm::Value *b_LD = builder.CreateLoad(registers_bth);
+    llvm::Value *b_LD = create_load(registers_bth);
 
     llvm::SwitchInst *switch_type = builder.CreateSwitch(b_LD, error_block, 2);
     switch_type->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 3, true)), op_unm_1_block);
@@ -2139,7 +1426,7 @@ llvm::Value* create_op_unm_block() {
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
     llvm::Value *registers_bth_2 = builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp);
     llvm::Value *b_bitcast = builder.CreateBitCast(registers_bth_2, llvm::Type::getDoublePtrTy(context));
-    llvm::Value *b_value_LD = builder.CreateLoad(b_bitcast);
+    llvm::Value *b_value_LD = create_load(b_bitcast);
     llvm::Value *fsub = builder.CreateFSub(llvm::ConstantFP::get(llvm::Type::getDoubleTy(context), -0.0), b_value_LD);
 
     temp.clear();
@@ -2164,7 +1451,7 @@ llvm::Value* create_op_unm_block() {
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
     // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
     llvm::Value *registers_bth_3 = builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp);
-    llvm::Value *b_value_LD_2 = builder.CreateLoad(registers_bth_3);
+    llvm::Value *b_value_LD_2 = create_load(registers_bth_3);
     llvm::Value *sub = builder.CreateSub(llvm::ConstantInt::get(llvm::Type::getInt64Ty(context), 0), b_value_LD_2);
 
     temp.clear();
@@ -2194,10 +1481,7 @@ llvm::Value* create_op_not_block() {
     builder.SetInsertPoint(op_not_block);
 
     std::vector<llvm::Value *> temp;
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)));
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true))); //registers offset
-    llvm::Value *registers_GEP = builder.CreateInBoundsGEP(miniluastate_struct_type, _mls, temp);
-    llvm::Value *registers_LD = builder.CreateLoad(registers_GEP);
+    llvm::Value *registers_LD = create_registers();
 
     std::vector<llvm::Value *> ra_return = create_ra(registers_LD);
     llvm::Value * ra = ra_return[1];
@@ -2209,7 +1493,7 @@ llvm::Value* create_op_not_block() {
     temp.push_back(b_inst_zext);
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
     llvm::Value *registers_bth = builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp); /* Value *b */
-    llvm::Value *b_LD = builder.CreateLoad(registers_bth);
+    llvm::Value *b_LD = create_load(registers_bth);
     llvm::SwitchInst *switch_type = builder.CreateSwitch(b_LD, op_not_2_block, 2);
     switch_type->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)), op_not_3_block);
     switch_type->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)), op_not_1_block);
@@ -2220,7 +1504,7 @@ llvm::Value* create_op_not_block() {
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
     llvm::Value *registers_bth_2 = builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp); /* Value *b */
     llvm::Value *b_bitcast = builder.CreateBitCast(registers_bth_2, llvm::Type::getInt32PtrTy(context));
-    llvm::Value *b_LD_2 = builder.CreateLoad(b_bitcast);
+    llvm::Value *b_LD_2 = create_load(b_bitcast);
     llvm::Value *compare = builder.CreateICmpEQ(b_LD_2, llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
     builder.CreateBr(op_not_3_block);
 
@@ -2280,19 +1564,16 @@ llvm::Value* create_op_eq_block() {
 
     builder.SetInsertPoint(op_eq_block);
     std::vector<llvm::Value *> temp;
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)));
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true))); //registers offset
-    llvm::Value *registers_GEP = builder.CreateInBoundsGEP(miniluastate_struct_type, _mls, temp);
-    llvm::Value *registers_LD = builder.CreateLoad(registers_GEP);
+    llvm::Value *registers_LD = create_registers();
     llvm::Value *a = create_A(); // A(inst);
     llvm::Value *b_inst = create_B();
     std::vector<llvm::Value *> rkb_return = create_rk(b_inst, registers_LD);
     llvm::Value *rkb = rkb_return[2];
-    llvm::Value *rkb_LD = builder.CreateLoad(rkb);
+    llvm::Value *rkb_LD = create_load(rkb);
     llvm::Value *c_inst = create_C();
     std::vector<llvm::Value *> rkc_return = create_rk(c_inst, registers_LD);
     llvm::Value *rkc = rkc_return[2];
-    llvm::Value *rkc_LD = builder.CreateLoad(rkc);
+    llvm::Value *rkc_LD = create_load(rkc);
     llvm::SwitchInst *switch_type = builder.CreateSwitch(rkb_LD, error_block, 4);
     switch_type->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)), op_eq_1_block);
     switch_type->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)), op_eq_2_block);
@@ -2305,7 +1586,7 @@ llvm::Value* create_op_eq_block() {
 
     builder.SetInsertPoint(op_eq_2_block); // TBOOLEAN
     llvm::Value *rkc_is_bool = builder.CreateICmpEQ(rkc_LD, llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    builder.CreateCondBr(rkc_is_bool, op_eq_10_block, op_eq_3_block);
+    builder.CreateCondBr(rkc_is_bool, op_eq_3_block, op_eq_10_block);
 
     builder.SetInsertPoint(op_eq_3_block);
     temp.clear();
@@ -2313,13 +1594,13 @@ llvm::Value* create_op_eq_block() {
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
     llvm::Value *rkb_value = builder.CreateInBoundsGEP(value_struct_type, rkb_return[1], temp);
     llvm::Value *rkb_value_bitcast = builder.CreateBitCast(rkb_value, llvm::Type::getInt32PtrTy(context));
-    llvm::Value *rkb_value_load = builder.CreateLoad(rkb_value_bitcast);
+    llvm::Value *rkb_value_load = create_load(rkb_value_bitcast);
     temp.clear();
     temp.push_back(rkc_return[0]);
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
     llvm::Value *rkc_value = builder.CreateInBoundsGEP(value_struct_type, rkc_return[1], temp);
     llvm::Value *rkc_value_bitcast = builder.CreateBitCast(rkc_value, llvm::Type::getInt32PtrTy(context));
-    llvm::Value *rkc_value_load = builder.CreateLoad(rkc_value_bitcast);
+    llvm::Value *rkc_value_load = create_load(rkc_value_bitcast);
     llvm::Value *rkb_rkc_compare_bool = builder.CreateICmpEQ(rkb_value_load, rkc_value_load);
     builder.CreateBr(op_eq_10_block);
 
@@ -2334,13 +1615,13 @@ llvm::Value* create_op_eq_block() {
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
     llvm::Value *rkb_value_2 = builder.CreateInBoundsGEP(value_struct_type, rkb_return[1], temp);
     llvm::Value *rkb_value_bitcast_2 = builder.CreateBitCast(rkb_value_2, llvm::Type::getDoublePtrTy(context));
-    llvm::Value *rkb_value_load_2 = builder.CreateLoad(rkb_value_bitcast_2);
+    llvm::Value *rkb_value_load_2 = create_load(rkb_value_bitcast_2);
     temp.clear();
     temp.push_back(rkc_return[0]);
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
     llvm::Value *rkc_value_2 = builder.CreateInBoundsGEP(value_struct_type, rkc_return[1], temp);
     llvm::Value *rkc_value_bitcast_2 = builder.CreateBitCast(rkc_value_2, llvm::Type::getDoublePtrTy(context));
-    llvm::Value *rkc_value_load_2 = builder.CreateLoad(rkc_value_bitcast_2);
+    llvm::Value *rkc_value_load_2 = create_load(rkc_value_bitcast_2);
     llvm::Value *rkb_rkc_compare_fcmp = builder.CreateFCmpOEQ(rkb_value_load_2, rkc_value_load_2);
     builder.CreateBr(op_eq_10_block);
 
@@ -2350,12 +1631,12 @@ llvm::Value* create_op_eq_block() {
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
     llvm::Value *rkb_value_3 = builder.CreateInBoundsGEP(value_struct_type, rkb_return[1], temp);
     llvm::Value *rkb_value_bitcast_3 = builder.CreateBitCast(rkb_value_3, llvm::Type::getDoublePtrTy(context));
-    llvm::Value *rkb_value_load_3 = builder.CreateLoad(rkb_value_bitcast_3);
+    llvm::Value *rkb_value_load_3 = create_load(rkb_value_bitcast_3);
     temp.clear();
     temp.push_back(rkc_return[0]);
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
     llvm::Value *rkc_value_3 = builder.CreateInBoundsGEP(value_struct_type, rkc_return[1], temp);
-    llvm::Value *rkc_value_load_3 = builder.CreateLoad(rkc_value_3);
+    llvm::Value *rkc_value_load_3 = create_load(rkc_value_3);
     llvm::Value *rkc_value_sitofp = builder.CreateSIToFP(rkc_value_load_3, llvm::Type::getDoubleTy(context));
     llvm::Value *rkb_rkcint_compare_fcmp = builder.CreateFCmpOEQ(rkb_value_load_3, rkc_value_sitofp);
     builder.CreateBr(op_eq_10_block);
@@ -2371,12 +1652,12 @@ llvm::Value* create_op_eq_block() {
     temp.push_back(rkb_return[0]);
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
     llvm::Value *rkb_value_4 = builder.CreateInBoundsGEP(value_struct_type, rkb_return[1], temp);
-    llvm::Value *rkb_value_load_4 = builder.CreateLoad(rkb_value_4);
+    llvm::Value *rkb_value_load_4 = create_load(rkb_value_4);
     temp.clear();
     temp.push_back(rkc_return[0]);
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
     llvm::Value *rkc_value_4 = builder.CreateInBoundsGEP(value_struct_type, rkc_return[1], temp);
-    llvm::Value *rkc_value_load_4 = builder.CreateLoad(rkc_value_4);
+    llvm::Value *rkc_value_load_4 = create_load(rkc_value_4);
     llvm::Value *rkb_rkc_compare_icmp = builder.CreateICmpEQ(rkb_value_load_4, rkc_value_load_4);
     builder.CreateBr(op_eq_10_block);
 
@@ -2385,14 +1666,14 @@ llvm::Value* create_op_eq_block() {
     temp.push_back(rkb_return[0]);
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
     llvm::Value *rkb_value_5 = builder.CreateInBoundsGEP(value_struct_type, rkb_return[1], temp);
-    llvm::Value *rkb_value_load_5 = builder.CreateLoad(rkb_value_5);
+    llvm::Value *rkb_value_load_5 = create_load(rkb_value_5);
     llvm::Value *rkb_value_sitofp = builder.CreateSIToFP(rkb_value_load_5, llvm::Type::getDoubleTy(context));
     temp.clear();
     temp.push_back(rkc_return[0]);
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
     llvm::Value *rkc_value_5 = builder.CreateInBoundsGEP(value_struct_type, rkc_return[1], temp);
     llvm::Value *rkc_value_bitcast_5 = builder.CreateBitCast(rkc_value_5, llvm::Type::getDoublePtrTy(context));
-    llvm::Value *rkc_value_load_5 = builder.CreateLoad(rkc_value_bitcast_5);
+    llvm::Value *rkc_value_load_5 = create_load(rkc_value_bitcast_5);
     llvm::Value *rkbint_rkc_compare_fcmp = builder.CreateFCmpOEQ(rkb_value_sitofp, rkc_value_load_5);
     builder.CreateBr(op_eq_10_block);
 
@@ -2415,309 +1696,213 @@ llvm::Value* create_op_eq_block() {
     return zext_2;
 }
 
-llvm::Value* create_op_lt_block() {
-    op_lt_block = llvm::BasicBlock::Create(context, "op_lt", step_func);
-
-    op_lt_1_block = llvm::BasicBlock::Create(context, "op_lt_1", step_func);
-    op_lt_2_block = llvm::BasicBlock::Create(context, "op_lt_2", step_func);
-    op_lt_3_block = llvm::BasicBlock::Create(context, "op_lt_3", step_func);
-    op_lt_4_block = llvm::BasicBlock::Create(context, "op_lt_4", step_func);
-    op_lt_5_block = llvm::BasicBlock::Create(context, "op_lt_5", step_func);
-    op_lt_6_block = llvm::BasicBlock::Create(context, "op_lt_6", step_func);
-    op_lt_7_block = llvm::BasicBlock::Create(context, "op_lt_7", step_func);
-    op_lt_8_block = llvm::BasicBlock::Create(context, "op_lt_8", step_func);
-    op_lt_9_block = llvm::BasicBlock::Create(context, "op_lt_9", step_func);
-    op_lt_10_block = llvm::BasicBlock::Create(context, "op_lt_10", step_func);
-    op_lt_11_block = llvm::BasicBlock::Create(context, "op_lt_11", step_func);
-
-    builder.SetInsertPoint(op_lt_block);
-
-    //
-    std::vector<llvm::Value *> temp;
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)));
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true))); //registers offset
-    llvm::Value *registers_GEP = builder.CreateInBoundsGEP(miniluastate_struct_type, _mls, temp);
-    llvm::Value *registers_LD = builder.CreateLoad(registers_GEP);
-
-    llvm::Value *a = create_A(); //Value *a = A(inst);
-
-    llvm::Value *b_inst = create_B();
-    std::vector<llvm::Value *> rkb_return = create_rk(b_inst, registers_LD);
-    llvm::Value *rkb = rkb_return[2];
-    llvm::Value *rkb_LD = builder.CreateLoad(rkb);
-    llvm::Value *rkb_or = builder.CreateOr(llvm::ConstantInt::get(context, llvm::APInt(32, 16, true)), rkb_LD);
-    llvm::Value *rkb_is_numerical_condition = builder.CreateICmpEQ(rkb_or, llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)));
-    builder.CreateCondBr(rkb_is_numerical_condition, op_lt_1_block, error_block);
-
-    //op_lt_1_block
-    builder.SetInsertPoint(op_lt_1_block);
-    llvm::Value *c_inst = create_C();
-    std::vector<llvm::Value *> rkc_return = create_rk(c_inst, registers_LD);
-    llvm::Value *rkc = rkc_return[2];
-    llvm::Value *rkc_LD = builder.CreateLoad(rkc);
-    llvm::Value *rkc_or = builder.CreateOr(llvm::ConstantInt::get(context, llvm::APInt(32, 16, true)), rkc_LD);
-    llvm::Value *rkc_is_numerical_condition = builder.CreateICmpEQ(rkc_or, llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)));
-    builder.CreateCondBr(rkc_is_numerical_condition, op_lt_2_block, error_block);
-
-    builder.SetInsertPoint(op_lt_2_block);
-    llvm::Value *rkb_is_int = builder.CreateICmpEQ(rkb_LD, llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)));
-    llvm::Value *rkc_is_int = builder.CreateICmpEQ(rkc_LD, llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)));
-    llvm::Value *both_int = builder.CreateAnd(rkb_is_int, rkc_is_int);
-    builder.CreateCondBr(both_int, op_lt_3_block, op_lt_4_block);
-
-    // XXX TODO discover why it seg faults when adding the third argument (the 0 on the commented line. On rkb and rkc!!!
-    // op_lt_1_block true
-    builder.SetInsertPoint(op_lt_3_block);
-    temp.clear();
-    temp.push_back(rkb_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *b_value_GEP = builder.CreateInBoundsGEP(value_struct_type, rkb_return[1], temp);
-    llvm::Value *b_value_LD = builder.CreateLoad(b_value_GEP);
-
-    temp.clear();
-    temp.push_back(rkc_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *c_value_GEP = builder.CreateInBoundsGEP(value_struct_type, rkc_return[1], temp);
-    llvm::Value *c_value_LD = builder.CreateLoad(c_value_GEP);
-
-    //SLT
-    llvm::Value *slt_b_c = builder.CreateICmpSLT(b_value_LD, c_value_LD);
-    builder.CreateBr(op_lt_11_block);
-
-    // op_lt_1_block false
-    builder.SetInsertPoint(op_lt_4_block);
-    llvm::SwitchInst *switch_type = builder.CreateSwitch(rkb_LD, error_block, 2);
-    switch_type->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 3, true)), op_lt_5_block);
-    switch_type->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)), op_lt_6_block);
-
-    // op_lt_5_block (3)
-    builder.SetInsertPoint(op_lt_5_block);
-    temp.clear();
-    temp.push_back(rkb_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *b_value_GEP_2 = builder.CreateInBoundsGEP(value_struct_type, rkb_return[1], temp);
-    llvm::Value *b_bitcast = builder.CreateBitCast(b_value_GEP_2, llvm::Type::getDoublePtrTy(context));
-    llvm::Value *b_load = builder.CreateLoad(llvm::Type::getDoubleTy(context), b_bitcast);
-    builder.CreateBr(op_lt_7_block);
-
-    // op_lt_6_block (19)
-    builder.SetInsertPoint(op_lt_6_block);
-    temp.clear();
-    temp.push_back(rkb_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *b_value_GEP_3 = builder.CreateInBoundsGEP(value_struct_type, rkb_return[1], temp);
-    llvm::Value *b_load_2 = builder.CreateLoad(b_value_GEP_3);
-    llvm::Value *b_sitofp = builder.CreateSIToFP(b_load_2, llvm::Type::getDoubleTy(context));
-    builder.CreateBr(op_lt_7_block);
-
-
-    // op_lt_7_block
-    builder.SetInsertPoint(op_lt_7_block);
-    llvm::PHINode *phi_node = builder.CreatePHI(llvm::Type::getDoubleTy(context), 2); //op
-    phi_node->addIncoming(b_load, op_lt_5_block);
-    phi_node->addIncoming(b_sitofp, op_lt_6_block);
-    llvm::SwitchInst *switch_type_2 = builder.CreateSwitch(rkc_LD, error_block, 2);
-    switch_type_2->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 3, true)), op_lt_8_block);
-    switch_type_2->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)), op_lt_9_block);
-
-    // op_lt_8_block (3)
-    builder.SetInsertPoint(op_lt_8_block);
-    temp.clear();
-    temp.push_back(rkc_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *c_value_GEP_2 = builder.CreateInBoundsGEP(value_struct_type, rkc_return[1], temp);
-    llvm::Value *c_bitcast_2 = builder.CreateBitCast(c_value_GEP_2, llvm::Type::getDoublePtrTy(context));
-    llvm::Value *c_load = builder.CreateLoad(llvm::Type::getDoubleTy(context), c_bitcast_2);
-    builder.CreateBr(op_lt_10_block);
+// if ((RK(B) op RK(C)) ~= A) then pc++, for the OPSPEC_COMPARE ops.
+llvm::Value* create_op_compare_block(uint32_t op) {
+    uint32_t index = op - OP_LT;
+    std::string name = opspec_block_name(op);
 
-    // op_lt_9_block (19)
-    builder.SetInsertPoint(op_lt_9_block);
-    temp.clear();
-    temp.push_back(rkc_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *c_value_GEP_3 = builder.CreateInBoundsGEP(value_struct_type, rkc_return[1], temp);
-    llvm::Value *c_load_2 = builder.CreateLoad(c_value_GEP_3);
-    llvm::Value *c_sitofp = builder.CreateSIToFP(c_load_2, llvm::Type::getDoubleTy(context));
-    builder.CreateBr(op_lt_10_block);
+    op_compare_block[index] = llvm::BasicBlock::Create(context, name, step_func);
+    llvm::BasicBlock *numerical_block = llvm::BasicBlock::Create(context, name + "_1", step_func);
+    llvm::BasicBlock *int_block = llvm::BasicBlock::Create(context, name + "_int", step_func);
+    llvm::BasicBlock *float_block = llvm::BasicBlock::Create(context, name + "_float", step_func);
+    op_compare_end_block[index] = llvm::BasicBlock::Create(context, name + "_end", step_func);
 
-    builder.SetInsertPoint(op_lt_10_block);
-    llvm::PHINode *phi_node_2 = builder.CreatePHI(llvm::Type::getDoubleTy(context), 2); //op
-    phi_node_2->addIncoming(c_load, op_lt_8_block);
-    phi_node_2->addIncoming(c_sitofp, op_lt_9_block);
-    llvm::Value *olt_b_c_2 = builder.CreateFCmpOLT(phi_node, phi_node_2);
-    builder.CreateBr(op_lt_11_block);
-
-    builder.SetInsertPoint(op_lt_11_block);
-    llvm::PHINode *phi_node_3 = builder.CreatePHI(llvm::Type::getInt1Ty(context), 2);
-    phi_node_3->addIncoming(slt_b_c, op_lt_3_block);
-    phi_node_3->addIncoming(olt_b_c_2, op_lt_10_block);
-    llvm::Value *zext_vmLT = builder.CreateZExt(phi_node_3, llvm::Type::getInt32Ty(context));
-    llvm::Value *compare_vmLT_a = builder.CreateICmpNE(zext_vmLT, a);
-    llvm::Value *zext_result = builder.CreateZExt(compare_vmLT_a, llvm::Type::getInt64Ty(context));
+    builder.SetInsertPoint(op_compare_block[index]);
+    llvm::Value *registers_LD = create_registers();
+    llvm::Value *a = create_A();
+    std::vector<llvm::Value *> operands = create_numeric_operands(registers_LD, numerical_block);
+    llvm::Value *rkb = operands[0], *rkb_LD = operands[1];
+    llvm::Value *rkc = operands[2], *rkc_LD = operands[3];
+
+    builder.SetInsertPoint(numerical_block);
+    llvm::Value *rkb_is_int = builder.CreateICmpEQ(rkb_LD, llvm::ConstantInt::get(context, llvm::APInt(32, LUA_TNUMINT, true)));
+    llvm::Value *rkc_is_int = builder.CreateICmpEQ(rkc_LD, llvm::ConstantInt::get(context, llvm::APInt(32, LUA_TNUMINT, true)));
+    builder.CreateCondBr(builder.CreateAnd(rkb_is_int, rkc_is_int), int_block, float_block);
+
+    builder.SetInsertPoint(int_block);
+    llvm::Value *int_result = create_int_primitive(op, create_load(create_payload_ptr(rkb)), create_load(create_payload_ptr(rkc)));
+    builder.CreateBr(op_compare_end_block[index]);
+
+    builder.SetInsertPoint(float_block);
+    llvm::Value *float_result = create_float_primitive(op, create_tofloat(rkb, rkb_LD), create_tofloat(rkc, rkc_LD));
+    builder.CreateBr(op_compare_end_block[index]);
+
+    builder.SetInsertPoint(op_compare_end_block[index]);
+    llvm::PHINode *result = builder.CreatePHI(llvm::Type::getInt1Ty(context), 2);
+    result->addIncoming(int_result, int_block);
+    result->addIncoming(float_result, float_block);
+    llvm::Value *zext_result = builder.CreateZExt(result, llvm::Type::getInt32Ty(context));
+    llvm::Value *skip = builder.CreateICmpNE(zext_result, a);
+    llvm::Value *pc_offset = builder.CreateZExt(skip, llvm::Type::getInt64Ty(context));
     builder.CreateBr(end_block);
 
-    return zext_result;
+    return pc_offset;
 }
 
-llvm::Value* create_op_le_block() {
-    op_le_block = llvm::BasicBlock::Create(context, "op_le", step_func);
-
-    op_le_1_block = llvm::BasicBlock::Create(context, "op_le_1", step_func);
-    op_le_2_block = llvm::BasicBlock::Create(context, "op_le_2", step_func);
-    op_le_3_block = llvm::BasicBlock::Create(context, "op_le_3", step_func);
-    op_le_4_block = llvm::BasicBlock::Create(context, "op_le_4", step_func);
-    op_le_5_block = llvm::BasicBlock::Create(context, "op_le_5", step_func);
-    op_le_6_block = llvm::BasicBlock::Create(context, "op_le_6", step_func);
-    op_le_7_block = llvm::BasicBlock::Create(context, "op_le_7", step_func);
-    op_le_8_block = llvm::BasicBlock::Create(context, "op_le_8", step_func);
-    op_le_9_block = llvm::BasicBlock::Create(context, "op_le_9", step_func);
-    op_le_10_block = llvm::BasicBlock::Create(context, "op_le_10", step_func);
-    op_le_11_block = llvm::BasicBlock::Create(context, "op_le_11", step_func);
-
-    builder.SetInsertPoint(op_le_block);
-
-    //
-    std::vector<llvm::Value *> temp;
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)));
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true))); //registers offset
-    llvm::Value *registers_GEP = builder.CreateInBoundsGEP(miniluastate_struct_type, _mls, temp);
-    llvm::Value *registers_LD = builder.CreateLoad(registers_GEP);
-
-    llvm::Value *a = create_A(); //Value *a = A(inst);
-
-    llvm::Value *b_inst = create_B();
-    std::vector<llvm::Value *> rkb_return = create_rk(b_inst, registers_LD);
-    llvm::Value *rkb = rkb_return[2];
-    llvm::Value *rkb_LD = builder.CreateLoad(rkb);
-    llvm::Value *rkb_or = builder.CreateOr(llvm::ConstantInt::get(context, llvm::APInt(32, 16, true)), rkb_LD);
-    llvm::Value *rkb_is_numerical_condition = builder.CreateICmpEQ(rkb_or, llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)));
-    builder.CreateCondBr(rkb_is_numerical_condition, op_le_1_block, error_block);
-
-    //op_le_1_block
-    builder.SetInsertPoint(op_le_1_block);
-    llvm::Value *c_inst = create_C();
-    std::vector<llvm::Value *> rkc_return = create_rk(c_inst, registers_LD);
-    llvm::Value *rkc = rkc_return[2];
-    llvm::Value *rkc_LD = builder.CreateLoad(rkc);
-    llvm::Value *rkc_or = builder.CreateOr(llvm::ConstantInt::get(context, llvm::APInt(32, 16, true)), rkc_LD);
-    llvm::Value *rkc_is_numerical_condition = builder.CreateICmpEQ(rkc_or, llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)));
-    builder.CreateCondBr(rkc_is_numerical_condition, op_le_2_block, error_block);
-
-    builder.SetInsertPoint(op_le_2_block);
-    llvm::Value *rkb_is_int = builder.CreateICmpEQ(rkb_LD, llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)));
-    llvm::Value *rkc_is_int = builder.CreateICmpEQ(rkc_LD, llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)));
-    llvm::Value *both_int = builder.CreateAnd(rkb_is_int, rkc_is_int);
-    builder.CreateCondBr(both_int, op_le_3_block, op_le_4_block);
-
-    // XXX TODO discover why it seg faults when adding the third argument (the 0 on the commented line. On rkb and rkc!!!
-    // op_le_1_block true
-    builder.SetInsertPoint(op_le_3_block);
-    temp.clear();
-    temp.push_back(rkb_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *b_value_GEP = builder.CreateInBoundsGEP(value_struct_type, rkb_return[1], temp);
-    llvm::Value *b_value_LD = builder.CreateLoad(b_value_GEP);
-
-    temp.clear();
-    temp.push_back(rkc_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *c_value_GEP = builder.CreateInBoundsGEP(value_struct_type, rkc_return[1], temp);
-    llvm::Value *c_value_LD = builder.CreateLoad(c_value_GEP);
-
-    //SLT
-    llvm::Value *sle_b_c = builder.CreateICmpSLE(b_value_LD, c_value_LD);
-    builder.CreateBr(op_le_11_block);
-
-    // op_le_1_block false
-    builder.SetInsertPoint(op_le_4_block);
-    llvm::SwitchInst *switch_type = builder.CreateSwitch(rkb_LD, error_block, 2);
-    switch_type->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 3, true)), op_le_5_block);
-    switch_type->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)), op_le_6_block);
-
-    // op_le_5_block (3)
-    builder.SetInsertPoint(op_le_5_block);
-    temp.clear();
-    temp.push_back(rkb_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *b_value_GEP_2 = builder.CreateInBoundsGEP(value_struct_type, rkb_return[1], temp);
-    llvm::Value *b_bitcast = builder.CreateBitCast(b_value_GEP_2, llvm::Type::getDoublePtrTy(context));
-    llvm::Value *b_load = builder.CreateLoad(llvm::Type::getDoubleTy(context), b_bitcast);
-    builder.CreateBr(op_le_7_block);
+// --- Integer for loops
+// As in c-minilua's FORLOOP_I, an integer loop with a positive step keeps
+// the number of iterations left in R(A+1): FORPREP turns the limit into
+// that count, and FORLOOP counts it down instead of comparing the bumped
+// index with the limit, which could overflow past LUA_MAXINTEGER. Other
+// steps keep the limit. The index is bumped in wrapping arithmetic, like
+// Lua's intop(). hybrid.c's OP_FORPREP and OP_FORLOOP do the same in C.
 
-    // op_le_6_block (19)
-    builder.SetInsertPoint(op_le_6_block);
-    temp.clear();
-    temp.push_back(rkb_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *b_value_GEP_3 = builder.CreateInBoundsGEP(value_struct_type, rkb_return[1], temp);
-    llvm::Value *b_load_2 = builder.CreateLoad(b_value_GEP_3);
-    llvm::Value *b_sitofp = builder.CreateSIToFP(b_load_2, llvm::Type::getDoubleTy(context));
-    builder.CreateBr(op_le_7_block);
+static llvm::Value* create_i64(int64_t i) {
+    return llvm::ConstantInt::get(context, llvm::APInt(64, i, true));
+}
 
+// FORPREP on the payloads of integer control registers
+static void create_int_forprep(llvm::Value *init_ptr, llvm::Value *limit_ptr, llvm::Value *step_LD) {
+    llvm::Value *init_LD = create_load(init_ptr);
+    llvm::Value *limit_LD = create_load(limit_ptr);
+    llvm::Value *positive = builder.CreateICmpSGT(step_LD, create_i64(0));
+    // (limit - init) / step + 1, saturated, or 0 when init > limit
+    llvm::Value *quotient = builder.CreateUDiv(builder.CreateSub(limit_LD, init_LD),
+                                               builder.CreateSelect(positive, step_LD, create_i64(1)));
+    llvm::Value *count = builder.CreateAdd(quotient,
+        builder.CreateZExt(builder.CreateICmpNE(quotient, create_i64(-1)), llvm::Type::getInt64Ty(context)));
+    count = builder.CreateSelect(builder.CreateICmpSGT(init_LD, limit_LD), create_i64(0), count);
+    builder.CreateStore(builder.CreateSelect(positive, count, limit_LD), limit_ptr);
+    builder.CreateStore(builder.CreateSub(init_LD, step_LD), init_ptr);
+}
 
-    // op_le_7_block
-    builder.SetInsertPoint(op_le_7_block);
-    llvm::PHINode *phi_node = builder.CreatePHI(llvm::Type::getDoubleTy(context), 2); //op
-    phi_node->addIncoming(b_load, op_le_5_block);
-    phi_node->addIncoming(b_sitofp, op_le_6_block);
-    llvm::SwitchInst *switch_type_2 = builder.CreateSwitch(rkc_LD, error_block, 2);
-    switch_type_2->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 3, true)), op_le_8_block);
-    switch_type_2->addCase(llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)), op_le_9_block);
-
-    // op_le_8_block (3)
-    builder.SetInsertPoint(op_le_8_block);
-    temp.clear();
-    temp.push_back(rkc_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *c_value_GEP_2 = builder.CreateInBoundsGEP(value_struct_type, rkc_return[1], temp);
-    llvm::Value *c_bitcast_2 = builder.CreateBitCast(c_value_GEP_2, llvm::Type::getDoublePtrTy(context));
-    llvm::Value *c_load = builder.CreateLoad(llvm::Type::getDoubleTy(context), c_bitcast_2);
-    builder.CreateBr(op_le_10_block);
+// FORLOOP on the payloads of integer control registers. Returns whether the
+// loop goes on, and in *next the new index.
+static llvm::Value* create_int_forloop(llvm::Value *init_ptr, llvm::Value *limit_ptr, llvm::Value *step_LD,
+                                       llvm::Value **next) {
+    llvm::Value *limit_LD = create_load(limit_ptr);
+    *next = builder.CreateAdd(create_load(init_ptr), step_LD);
+    builder.CreateStore(*next, init_ptr);
+    llvm::Value *positive = builder.CreateICmpSGT(step_LD, create_i64(0));
+    builder.CreateStore(builder.CreateSelect(positive, builder.CreateSub(limit_LD, create_i64(1)), limit_LD), limit_ptr);
+    return builder.CreateSelect(positive, builder.CreateICmpNE(limit_LD, create_i64(0)),
+                                builder.CreateICmpSLE(*next, limit_LD));
+}
 
-    // op_le_9_block (19)
-    builder.SetInsertPoint(op_le_9_block);
-    temp.clear();
-    temp.push_back(rkc_return[0]);
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
-    // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
-    llvm::Value *c_value_GEP_3 = builder.CreateInBoundsGEP(value_struct_type, rkc_return[1], temp);
-    llvm::Value *c_load_2 = builder.CreateLoad(c_value_GEP_3);
-    llvm::Value *c_sitofp = builder.CreateSIToFP(c_load_2, llvm::Type::getDoubleTy(context));
-    builder.CreateBr(op_le_10_block);
+// --- Proven types
+// Untagged IR for the instructions whose operands inferTypes() proved to be
+// integers, or floats when is_float (see typeinfer.h). Tags are written where
+// a register may change type, but never loaded or tested. Emitted at the
+// current insert point; returns the pc offset.
+
+// FORPREP and FORLOOP on proven control registers. The loop variable is only
+// written when the loop goes on, so FORLOOP leaves the insert point in a new
+// block.
+static llvm::Value* create_proven_forloop(uint32_t op, bool is_float, llvm::Value *registers_LD) {
+    llvm::Type *payload_type = is_float ? llvm::Type::getDoubleTy(context) : llvm::Type::getInt64Ty(context);
+    llvm::Value *a = create_A();
+    llvm::Value *init = builder.CreateInBoundsGEP(value_struct_type, registers_LD, a);
+    llvm::Value *limit = builder.CreateInBoundsGEP(value_struct_type, registers_LD,
+        builder.CreateAdd(a, llvm::ConstantInt::get(context, llvm::APInt(32, 1, true))));
+    llvm::Value *step = builder.CreateInBoundsGEP(value_struct_type, registers_LD,
+        builder.CreateAdd(a, llvm::ConstantInt::get(context, llvm::APInt(32, 2, true))));
+
+    llvm::Value *init_ptr = builder.CreateBitCast(create_payload_ptr(init), payload_type->getPointerTo());
+    llvm::Value *init_LD = builder.CreateLoad(payload_type, init_ptr);
+    llvm::Value *step_LD = builder.CreateLoad(payload_type, builder.CreateBitCast(create_payload_ptr(step), payload_type->getPointerTo()));
+
+    llvm::Value *limit_ptr = builder.CreateBitCast(create_payload_ptr(limit), payload_type->getPointerTo());
+    if (op == OP_FORPREP) {
+        if (is_float) {
+            builder.CreateStore(builder.CreateFSub(init_LD, step_LD), init_ptr);
+        } else {
+            create_int_forprep(init_ptr, limit_ptr, step_LD);
+        }
+        return create_sbx();
+    }
+
+    llvm::Value *var = builder.CreateInBoundsGEP(value_struct_type, registers_LD,
+        builder.CreateAdd(a, llvm::ConstantInt::get(context, llvm::APInt(32, 3, true))));
+    llvm::Value *next;
+    llvm::Value *loop;
+    if (is_float) {
+        next = builder.CreateFAdd(init_LD, step_LD);
+        builder.CreateStore(next, init_ptr);
+        loop = builder.CreateFCmpOLE(next, builder.CreateLoad(payload_type, limit_ptr));
+    } else {
+        loop = create_int_forloop(init_ptr, limit_ptr, step_LD, &next);
+    }
+    llvm::Value *pc_offset = builder.CreateSelect(loop, create_sbx(), llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)));
+
+    llvm::BasicBlock *var_block = llvm::BasicBlock::Create(context, "forloop_proven_var", step_func);
+    llvm::BasicBlock *done_block = llvm::BasicBlock::Create(context, "forloop_proven_end", step_func);
+    builder.CreateCondBr(loop, var_block, done_block);
+
+    builder.SetInsertPoint(var_block);
+    builder.CreateStore(llvm::ConstantInt::get(context, llvm::APInt(32, is_float ? LUA_TNUMFLT : LUA_TNUMINT, true)), create_type_ptr(var));
+    builder.CreateStore(next, builder.CreateBitCast(create_payload_ptr(var), payload_type->getPointerTo()));
+    builder.CreateBr(done_block);
+
+    builder.SetInsertPoint(done_block);
+    return pc_offset;
+}
 
-    builder.SetInsertPoint(op_le_10_block);
-    llvm::PHINode *phi_node_2 = builder.CreatePHI(llvm::Type::getDoubleTy(context), 2); //op
-    phi_node_2->addIncoming(c_load, op_le_8_block);
-    phi_node_2->addIncoming(c_sitofp, op_le_9_block);
-    llvm::Value *ole_b_c_2 = builder.CreateFCmpOLE(phi_node, phi_node_2);
-    builder.CreateBr(op_le_11_block);
-
-    builder.SetInsertPoint(op_le_11_block);
-    llvm::PHINode *phi_node_3 = builder.CreatePHI(llvm::Type::getInt1Ty(context), 2);
-    phi_node_3->addIncoming(sle_b_c, op_le_3_block);
-    phi_node_3->addIncoming(ole_b_c_2, op_le_10_block);
-    llvm::Value *zext_vmLE = builder.CreateZExt(phi_node_3, llvm::Type::getInt32Ty(context));
-    llvm::Value *compare_vmLE_a = builder.CreateICmpNE(zext_vmLE, a);
-    llvm::Value *zext_result = builder.CreateZExt(compare_vmLE_a, llvm::Type::getInt64Ty(context));
-    builder.CreateBr(end_block);
+llvm::Value* create_op_proven_block(uint32_t op, bool is_float) {
+    llvm::Value *registers_LD = create_registers();
+    if (op == OP_FORPREP || op == OP_FORLOOP) {
+        return create_proven_forloop(op, is_float, registers_LD);
+    }
+
+    uint32_t generic_op = op;
+    switch (op) {
+        case OP_EQ_JMP:
+        case OP_LT_JMP:
+        case OP_LE_JMP:
+            generic_op = OP_EQ + (op - OP_EQ_JMP);
+            break;
+#define OPSPEC_ARITH(OP, INT, FLT, QUICK) case OP_##OP##_KI: generic_op = OP_##OP; break;
+#include "opcodes.def"
+    }
+
+    std::vector<llvm::Value *> rkb_return = create_rk(create_B(), registers_LD);
+    std::vector<llvm::Value *> rkc_return = create_rk(create_C(), registers_LD);
+    llvm::Value *b = create_load(create_payload_ptr(builder.CreateInBoundsGEP(value_struct_type, rkb_return[1], rkb_return[0])));
+    llvm::Value *c = create_load(create_payload_ptr(builder.CreateInBoundsGEP(value_struct_type, rkc_return[1], rkc_return[0])));
+    if (is_float) {
+        b = builder.CreateBitCast(b, llvm::Type::getDoubleTy(context));
+        c = builder.CreateBitCast(c, llvm::Type::getDoubleTy(context));
+    }
+
+    if (generic_op == OP_EQ || generic_op == OP_LT || generic_op == OP_LE) {
+        llvm::Value *result = is_float ? create_float_primitive(generic_op, b, c) : create_int_primitive(generic_op, b, c);
+        llvm::Value *zext_result = builder.CreateZExt(result, llvm::Type::getInt32Ty(context));
+        llvm::Value *a = create_A();
+        if (op == generic_op) {
+            return builder.CreateZExt(builder.CreateICmpNE(zext_result, a), llvm::Type::getInt64Ty(context));
+        }
+        // compare-and-jump: A holds the flag in its low bit and sJ above it
+        llvm::Value *flag = builder.CreateAnd(a, llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
+        llvm::Value *sj = builder.CreateSub(builder.CreateLShr(a, llvm::ConstantInt::get(context, llvm::APInt(32, 1, true))),
+                                            llvm::ConstantInt::get(context, llvm::APInt(32, MAXARG_sJ, true)));
+        llvm::Value *jump_offset = builder.CreateAdd(builder.CreateSExt(sj, llvm::Type::getInt64Ty(context)),
+                                                     llvm::ConstantInt::get(context, llvm::APInt(64, 1, true)));
+        return builder.CreateSelect(builder.CreateICmpNE(zext_result, flag),
+                                    llvm::ConstantInt::get(context, llvm::APInt(64, 1, true)), jump_offset);
+    }
 
-    return zext_result;
+    llvm::Value *ra = create_ra(registers_LD)[1];
+    if (!is_float && has_int_primitive(generic_op)) {
+        builder.CreateStore(llvm::ConstantInt::get(context, llvm::APInt(32, LUA_TNUMINT, true)), create_type_ptr(ra));
+        builder.CreateStore(create_int_primitive(generic_op, b, c), create_payload_ptr(ra));
+    } else {
+        if (!is_float) {
+            b = builder.CreateSIToFP(b, llvm::Type::getDoubleTy(context));
+            c = builder.CreateSIToFP(c, llvm::Type::getDoubleTy(context));
+        }
+        builder.CreateStore(llvm::ConstantInt::get(context, llvm::APInt(32, LUA_TNUMFLT, true)), create_type_ptr(ra));
+        builder.CreateStore(create_float_primitive(generic_op, b, c),
+                            builder.CreateBitCast(create_payload_ptr(ra), llvm::Type::getDoublePtrTy(context)));
+    }
+    return llvm::ConstantInt::get(context, llvm::APInt(64, 0, true));
 }
 
 llvm::Value* create_op_forloop_block() {
     op_forloop_block = llvm::BasicBlock::Create(context, "op_forloop", step_func);
 
+    op_forloop_0_block = llvm::BasicBlock::Create(context, "op_forloop_0", step_func);
+    op_forloop_check_block = llvm::BasicBlock::Create(context, "op_forloop_check", step_func);
+    op_forloop_int_block = llvm::BasicBlock::Create(context, "op_forloop_int", step_func);
+    op_forloop_float_block = llvm::BasicBlock::Create(context, "op_forloop_float", step_func);
     op_forloop_1_block = llvm::BasicBlock::Create(context, "op_forloop_1", step_func);
     op_forloop_2_block = llvm::BasicBlock::Create(context, "op_forloop_2", step_func);
     op_forloop_3_block = llvm::BasicBlock::Create(context, "op_forloop_3", step_func);
@@ -2741,10 +1926,7 @@ llvm::Value* create_op_forloop_block() {
     llvm::Value *a = create_A();
     llvm::Value *a_i64 = builder.CreateZExt(a, llvm::Type::getInt64Ty(context));
     std::vector<llvm::Value *> temp;
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)));
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true))); //registers offset
-    llvm::Value *registers_GEP = builder.CreateInBoundsGEP(miniluastate_struct_type, _mls, temp);
-    llvm::Value *registers_LD = builder.CreateLoad(registers_GEP);
+    llvm::Value *registers_LD = create_registers();
     temp.clear();
     temp.push_back(a_i64);
     llvm::Value *r_GEP = builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp);
@@ -2755,13 +1937,60 @@ llvm::Value* create_op_forloop_block() {
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)));
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
     llvm::Value *init_GEP = builder.CreateInBoundsGEP(value_struct_type, r_GEP, temp);
-    llvm::Value *init_LD = builder.CreateLoad(init_GEP);
+    llvm::Value *init_LD = create_load(init_GEP);
 
-    //
+    // fast paths: init, limit and step all integers or all floats, checked
+    // with a single test on the three tags
+    temp.clear();
+    temp.push_back(limit_offset);
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
+    llvm::Value *limit_type_LD = create_load(builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp));
+    temp.clear();
+    temp.push_back(step_offset);
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
+    llvm::Value *step_type_LD = create_load(builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp));
+    temp.clear();
+    temp.push_back(a_i64);
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
+    llvm::Value *init_int_GEP = builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp);
+    temp.clear();
+    temp.push_back(limit_offset);
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
+    llvm::Value *limit_int_GEP = builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp);
+    temp.clear();
+    temp.push_back(step_offset);
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
+    llvm::Value *step_int_GEP = builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp);
+    llvm::Value *types_and = builder.CreateAnd(builder.CreateAnd(init_LD, limit_type_LD), step_type_LD);
+    llvm::Value *types_or = builder.CreateOr(builder.CreateOr(init_LD, limit_type_LD), step_type_LD);
+    llvm::Value *all_int = builder.CreateICmpEQ(types_and, llvm::ConstantInt::get(context, llvm::APInt(32, LUA_TNUMINT, true)));
+    builder.CreateCondBr(all_int, op_forloop_int_block, op_forloop_0_block);
+
+    builder.SetInsertPoint(op_forloop_0_block);
+    llvm::Value *all_float = builder.CreateAnd(
+        builder.CreateICmpEQ(types_and, llvm::ConstantInt::get(context, llvm::APInt(32, LUA_TNUMFLT, true))),
+        builder.CreateICmpEQ(types_or, llvm::ConstantInt::get(context, llvm::APInt(32, LUA_TNUMFLT, true))));
     llvm::Value *init_or = builder.CreateOr(llvm::ConstantInt::get(context, llvm::APInt(32, 16, true)), init_LD);
     llvm::Value *init_is_numerical_condition = builder.CreateICmpEQ(init_or, llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)));
+    builder.CreateCondBr(all_float, op_forloop_float_block, op_forloop_check_block);
+    builder.SetInsertPoint(op_forloop_check_block);
     builder.CreateCondBr(init_is_numerical_condition, op_forloop_1_block, error_block);
 
+    // see create_int_forloop
+    builder.SetInsertPoint(op_forloop_int_block);
+    llvm::Value *next_int;
+    llvm::Value *int_loop = create_int_forloop(init_int_GEP, limit_int_GEP, create_load(step_int_GEP), &next_int);
+    builder.CreateCondBr(int_loop, op_forloop_18_block, end_block);
+
+    builder.SetInsertPoint(op_forloop_float_block);
+    llvm::Value *init_float_GEP = builder.CreateBitCast(init_int_GEP, llvm::Type::getDoublePtrTy(context));
+    llvm::Value *limit_float_GEP = builder.CreateBitCast(limit_int_GEP, llvm::Type::getDoublePtrTy(context));
+    llvm::Value *step_float_GEP = builder.CreateBitCast(step_int_GEP, llvm::Type::getDoublePtrTy(context));
+    llvm::Value *next_float = builder.CreateFAdd(create_load(init_float_GEP), create_load(step_float_GEP));
+    builder.CreateStore(next_float, init_float_GEP);
+    llvm::Value *float_done = builder.CreateFCmpUGT(next_float, create_load(limit_float_GEP));
+    builder.CreateCondBr(float_done, end_block, op_forloop_18_block);
+
     //
     //op_add_1_block
     builder.SetInsertPoint(op_forloop_1_block);
@@ -2769,7 +1998,7 @@ llvm::Value* create_op_forloop_block() {
     temp.push_back(step_offset);
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
     llvm::Value *step_GEP = builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp);
-    llvm::Value *step_LD = builder.CreateLoad(step_GEP);
+    llvm::Value *step_LD = create_load(step_GEP);
     llvm::Value *step_or = builder.CreateOr(llvm::ConstantInt::get(context, llvm::APInt(32, 16, true)), step_LD);
     llvm::Value *step_is_numerical_condition = builder.CreateICmpEQ(step_or, llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)));
     builder.CreateCondBr(step_is_numerical_condition, op_forloop_2_block, error_block);
@@ -2788,13 +2017,13 @@ llvm::Value* create_op_forloop_block() {
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
     // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
     llvm::Value *init_value_GEP = builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp);
-    llvm::Value *init_value_LD = builder.CreateLoad(init_value_GEP);
+    llvm::Value *init_value_LD = create_load(init_value_GEP);
     temp.clear();
     temp.push_back(step_offset);
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
     // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
     llvm::Value *step_value_GEP = builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp);
-    llvm::Value *step_value_LD = builder.CreateLoad(step_value_GEP);
+    llvm::Value *step_value_LD = create_load(step_value_GEP);
 
     //ADD
     llvm::Value *add_init_step = builder.CreateAdd(init_value_LD, step_value_LD);
@@ -2826,7 +2055,7 @@ llvm::Value* create_op_forloop_block() {
     temp.push_back(a_i64);
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
     llvm::Value *init_value_GEP_3 = builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp);
-    llvm::Value *init_int_load = builder.CreateLoad(init_value_GEP_3);
+    llvm::Value *init_int_load = create_load(init_value_GEP_3);
     llvm::Value *init_sitofp = builder.CreateSIToFP(init_int_load, llvm::Type::getDoubleTy(context));
     builder.CreateBr(op_forloop_7_block);
     //
@@ -2855,7 +2084,7 @@ llvm::Value* create_op_forloop_block() {
     temp.push_back(step_offset);
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
     llvm::Value *step_value_GEP_3 = builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp);
-    llvm::Value *step_int_load = builder.CreateLoad(step_value_GEP_3);
+    llvm::Value *step_int_load = create_load(step_value_GEP_3);
     llvm::Value *step_sitofp = builder.CreateSIToFP(step_int_load, llvm::Type::getDoubleTy(context));
     builder.CreateBr(op_forloop_10_block);
 
@@ -2891,7 +2120,7 @@ llvm::Value* create_op_forloop_block() {
     temp.push_back(limit_offset);
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
     llvm::Value *limit_GEP = builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp);
-    llvm::Value *limit_LD = builder.CreateLoad(limit_GEP);
+    llvm::Value *limit_LD = create_load(limit_GEP);
     llvm::Value *limit_or = builder.CreateOr(llvm::ConstantInt::get(context, llvm::APInt(32, 16, true)), limit_LD);
     llvm::Value *limit_is_numerical_condition = builder.CreateICmpEQ(limit_or, llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)));
     builder.CreateCondBr(limit_is_numerical_condition, op_forloop_12_block, error_block);
@@ -2900,15 +2129,15 @@ llvm::Value* create_op_forloop_block() {
     llvm::Value *init_type = builder.CreateICmpEQ(phi_node_5, llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)));
     llvm::Value *limit_type = builder.CreateICmpEQ(limit_LD, llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)));
     llvm::Value *and_types = builder.CreateAnd(init_type, limit_type);
-    llvm::Value *type_selector = builder.CreateSelect(and_types,init_type ,limit_type);
-    builder.CreateCondBr(type_selector, op_forloop_13_block, op_forloop_14_block);
+    // integer compare only when both are integers, otherwise convert to float
+    builder.CreateCondBr(and_types, op_forloop_13_block, op_forloop_14_block);
 
     builder.SetInsertPoint(op_forloop_13_block);
     temp.clear();
     temp.push_back(limit_offset);
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
     llvm::Value *limit_GEP_2 = builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp);
-    llvm::Value *limit_LD_2 = builder.CreateLoad(limit_GEP_2);
+    llvm::Value *limit_LD_2 = create_load(limit_GEP_2);
     //SLT
     llvm::Value *sgt_init_limit = builder.CreateICmpSGT(phi_node_3, limit_LD_2);
     builder.CreateCondBr(sgt_init_limit, end_block, op_forloop_18_block);
@@ -2927,7 +2156,7 @@ llvm::Value* create_op_forloop_block() {
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
     llvm::Value *limit_GEP_3 = builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp);
     llvm::Value *limit_bitcast = builder.CreateBitCast(limit_GEP_3, llvm::Type::getDoublePtrTy(context));
-    llvm::Value *limit_value = builder.CreateLoad(limit_bitcast);
+    llvm::Value *limit_value = create_load(limit_bitcast);
     builder.CreateBr(op_forloop_17_block);
 
     builder.SetInsertPoint(op_forloop_16_block);
@@ -2935,7 +2164,7 @@ llvm::Value* create_op_forloop_block() {
     temp.push_back(limit_offset);
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
     llvm::Value *limit_GEP_4 = builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp);
-    llvm::Value *limit_value_2 = builder.CreateLoad(limit_GEP_4);
+    llvm::Value *limit_value_2 = create_load(limit_GEP_4);
     llvm::Value *sitofp_2 = builder.CreateSIToFP(limit_value_2, llvm::Type::getDoubleTy(context));
     builder.CreateBr(op_forloop_17_block);
 
@@ -2958,7 +2187,6 @@ llvm::Value* create_op_forloop_block() {
     temp.push_back(var_bitcast);
     temp.push_back(init_bitcast);
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(64, 16, true)));
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 8, true)));
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(1, 0, true)));
     builder.CreateCall(llvm_memcpy, temp);
     builder.CreateBr(end_block);
@@ -2986,10 +2214,7 @@ llvm::Value* create_op_forprep_block() {
     llvm::Value *a = create_A();
     llvm::Value *a_i64 = builder.CreateZExt(a, llvm::Type::getInt64Ty(context));
     std::vector<llvm::Value *> temp;
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)));
-    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true))); //registers offset
-    llvm::Value *registers_GEP = builder.CreateInBoundsGEP(miniluastate_struct_type, _mls, temp);
-    llvm::Value *registers_LD = builder.CreateLoad(registers_GEP);
+    llvm::Value *registers_LD = create_registers();
     temp.clear();
     temp.push_back(a_i64);
     llvm::Value *r_GEP = builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp);
@@ -3000,7 +2225,7 @@ llvm::Value* create_op_forprep_block() {
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)));
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
     llvm::Value *init_GEP = builder.CreateInBoundsGEP(value_struct_type, r_GEP, temp);
-    llvm::Value *init_LD = builder.CreateLoad(init_GEP);
+    llvm::Value *init_LD = create_load(init_GEP);
 
     //
     llvm::Value *init_or = builder.CreateOr(llvm::ConstantInt::get(context, llvm::APInt(32, 16, true)), init_LD);
@@ -3014,7 +2239,7 @@ llvm::Value* create_op_forprep_block() {
     temp.push_back(step_offset);
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
     llvm::Value *step_GEP = builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp);
-    llvm::Value *step_LD = builder.CreateLoad(step_GEP);
+    llvm::Value *step_LD = create_load(step_GEP);
     llvm::Value *step_or = builder.CreateOr(llvm::ConstantInt::get(context, llvm::APInt(32, 16, true)), step_LD);
     llvm::Value *step_is_numerical_condition = builder.CreateICmpEQ(step_or, llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)));
     builder.CreateCondBr(step_is_numerical_condition, op_forprep_2_block, error_block);
@@ -3033,15 +2258,34 @@ llvm::Value* create_op_forprep_block() {
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
     // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
     llvm::Value *init_value_GEP = builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp);
-    llvm::Value *init_value_LD = builder.CreateLoad(init_value_GEP);
+    llvm::Value *init_value_LD = create_load(init_value_GEP);
     temp.clear();
     temp.push_back(step_offset);
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
     // temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
     llvm::Value *step_value_GEP = builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp);
-    llvm::Value *step_value_LD = builder.CreateLoad(step_value_GEP);
+    llvm::Value *step_value_LD = create_load(step_value_GEP);
+
+    // an integer limit too: see create_int_forprep
+    temp.clear();
+    temp.push_back(limit_offset);
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
+    llvm::Value *limit_type_LD = create_load(builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp));
+    temp.clear();
+    temp.push_back(limit_offset);
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
+    llvm::Value *limit_value_GEP = builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp);
+    llvm::BasicBlock *op_forprep_int_block = llvm::BasicBlock::Create(context, "op_forprep_int", step_func);
+    llvm::BasicBlock *op_forprep_sub_block = llvm::BasicBlock::Create(context, "op_forprep_sub", step_func);
+    llvm::Value *limit_is_int = builder.CreateICmpEQ(limit_type_LD, llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)));
+    builder.CreateCondBr(limit_is_int, op_forprep_int_block, op_forprep_sub_block);
+
+    builder.SetInsertPoint(op_forprep_int_block);
+    create_int_forprep(init_value_GEP, limit_value_GEP, step_value_LD);
+    builder.CreateBr(op_forprep_11_block);
 
     //ADD
+    builder.SetInsertPoint(op_forprep_sub_block);
     llvm::Value *sub_init_step = builder.CreateSub(init_value_LD, step_value_LD);
 
     builder.CreateStore(llvm::ConstantInt::get(context, llvm::APInt(32, 19, true)), init_GEP);
@@ -3070,7 +2314,7 @@ llvm::Value* create_op_forprep_block() {
     temp.push_back(a_i64);
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
     llvm::Value *init_value_GEP_3 = builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp);
-    llvm::Value *init_int_load = builder.CreateLoad(init_value_GEP_3);
+    llvm::Value *init_int_load = create_load(init_value_GEP_3);
     llvm::Value *init_sitofp = builder.CreateSIToFP(init_int_load, llvm::Type::getDoubleTy(context));
     builder.CreateBr(op_forprep_7_block);
     //
@@ -3099,7 +2343,7 @@ llvm::Value* create_op_forprep_block() {
     temp.push_back(step_offset);
     temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
     llvm::Value *step_value_GEP_3 = builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp);
-    llvm::Value *step_int_load = builder.CreateLoad(step_value_GEP_3);
+    llvm::Value *step_int_load = create_load(step_value_GEP_3);
     llvm::Value *step_sitofp = builder.CreateSIToFP(step_int_load, llvm::Type::getDoubleTy(context));
     builder.CreateBr(op_forprep_10_block);
 
@@ -3126,3 +2370,271 @@ llvm::Value* create_op_forprep_block() {
 
     return sbx;
 }
+
+
+llvm::Value* create_op_loadbool_block() {
+    op_loadbool_block = llvm::BasicBlock::Create(context, "op_loadbool", step_func);
+
+    builder.SetInsertPoint(op_loadbool_block);
+
+    llvm::Value *registers_LD = create_registers();
+    llvm::Value *ra = create_ra(registers_LD)[1];
+    create_set_bool(ra, create_B());
+
+    llvm::Value *skip = builder.CreateICmpNE(create_C(), llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
+    llvm::Value *offset = builder.CreateZExt(skip, llvm::Type::getInt64Ty(context));
+    builder.CreateBr(end_block);
+
+    return offset;
+}
+
+// R(A), ..., R(A+B) := nil, one type tag store per register
+llvm::Value* create_op_loadnil_block() {
+    op_loadnil_block = llvm::BasicBlock::Create(context, "op_loadnil", step_func);
+    op_loadnil_1_block = llvm::BasicBlock::Create(context, "op_loadnil_1", step_func);
+
+    builder.SetInsertPoint(op_loadnil_block);
+
+    llvm::Value *registers_LD = create_registers();
+    llvm::Value *a_inst = create_A();
+    llvm::Value *last = builder.CreateAdd(a_inst, create_B());
+    builder.CreateBr(op_loadnil_1_block);
+
+    builder.SetInsertPoint(op_loadnil_1_block);
+    llvm::PHINode *i = builder.CreatePHI(llvm::Type::getInt32Ty(context), 2);
+    i->addIncoming(a_inst, op_loadnil_block);
+
+    std::vector<llvm::Value *> temp;
+    temp.push_back(i);
+    llvm::Value *ri = builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp);
+    builder.CreateStore(llvm::ConstantInt::get(context, llvm::APInt(32, LUA_TNIL, true)), create_type_ptr(ri));
+
+    llvm::Value *next = builder.CreateAdd(i, llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
+    i->addIncoming(next, op_loadnil_1_block);
+    builder.CreateCondBr(builder.CreateICmpULT(i, last), op_loadnil_1_block, end_block);
+
+    return llvm::ConstantInt::get(context, llvm::APInt(64, 0, true));
+}
+
+// Skips the next instruction (the JMP) when the truthiness of R(A) differs
+// from C.
+llvm::Value* create_op_test_block() {
+    op_test_block = llvm::BasicBlock::Create(context, "op_test", step_func);
+
+    builder.SetInsertPoint(op_test_block);
+
+    llvm::Value *registers_LD = create_registers();
+    llvm::Value *ra = create_ra(registers_LD)[1];
+    llvm::Value *c_set = builder.CreateICmpNE(create_C(), llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
+    llvm::Value *skip = builder.CreateICmpNE(create_is_truthy(ra), c_set);
+    llvm::Value *offset = builder.CreateZExt(skip, llvm::Type::getInt64Ty(context));
+    builder.CreateBr(end_block);
+
+    return offset;
+}
+
+// As OP_TEST on R(B), but R(B) is copied to R(A) when the JMP is taken.
+llvm::Value* create_op_testset_block() {
+    op_testset_block = llvm::BasicBlock::Create(context, "op_testset", step_func);
+    op_testset_1_block = llvm::BasicBlock::Create(context, "op_testset_1", step_func);
+
+    builder.SetInsertPoint(op_testset_block);
+
+    llvm::Value *registers_LD = create_registers();
+    llvm::Value *ra = create_ra(registers_LD)[1];
+    llvm::Value *rb = create_rb(registers_LD)[1];
+    llvm::Value *c_set = builder.CreateICmpNE(create_C(), llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
+    llvm::Value *skip = builder.CreateICmpNE(create_is_truthy(rb), c_set);
+    builder.CreateCondBr(skip, end_block, op_testset_1_block);
+
+    builder.SetInsertPoint(op_testset_1_block);
+    std::vector<llvm::Value *> temp;
+    temp.push_back(create_bitcast(ra));
+    temp.push_back(create_bitcast(rb));
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(64, 16, true)));
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(1, 0, true)));
+    builder.CreateCall(llvm_memcpy, temp);
+    builder.CreateBr(end_block);
+
+    return llvm::ConstantInt::get(context, llvm::APInt(64, 0, true));
+}
+
+// luaV_shiftl: a negative y shifts right, 64 bits or more give 0.
+static llvm::Value* create_shiftl(llvm::Value *x, llvm::Value *y) {
+    llvm::Value *zero = llvm::ConstantInt::get(context, llvm::APInt(64, 0, true));
+    llvm::Value *is_right = builder.CreateICmpSLT(y, zero);
+    llvm::Value *amount = builder.CreateSelect(is_right, builder.CreateSub(zero, y), y);
+    llvm::Value *too_far = builder.CreateICmpUGE(amount, llvm::ConstantInt::get(context, llvm::APInt(64, 64, true)));
+    llvm::Value *amount_63 = builder.CreateAnd(amount, llvm::ConstantInt::get(context, llvm::APInt(64, 63, true)));
+    llvm::Value *shifted = builder.CreateSelect(is_right, builder.CreateLShr(x, amount_63), builder.CreateShl(x, amount_63));
+    return builder.CreateSelect(too_far, zero, shifted);
+}
+
+// BAND, BOR, BXOR, SHL, SHR and BNOT. The operands are converted with
+// create_tointeger, a number without an integer representation goes to
+// error_block.
+llvm::Value* create_op_bitwise_block(uint32_t op) {
+    uint32_t index = bitwise_index(op);
+    const char *names[] = {"op_band", "op_bor", "op_bxor", "op_shl", "op_shr", "op_bnot"};
+
+    op_bitwise_block[index] = llvm::BasicBlock::Create(context, names[index], step_func);
+    op_bitwise_1_block[index] = llvm::BasicBlock::Create(context, std::string(names[index]) + "_1", step_func);
+
+    builder.SetInsertPoint(op_bitwise_block[index]);
+
+    llvm::Value *registers_LD = create_registers();
+    llvm::Value *ra = create_ra(registers_LD)[1];
+
+    std::vector<llvm::Value *> b_int;
+    std::vector<llvm::Value *> c_int;
+    llvm::Value *is_integral;
+    if (op == OP_BNOT) {
+        b_int = create_tointeger(create_rb(registers_LD)[1]);
+        is_integral = b_int[0];
+    } else {
+        std::vector<llvm::Value *> rkb_return = create_rk(create_B(), registers_LD);
+        std::vector<llvm::Value *> rkc_return = create_rk(create_C(), registers_LD);
+        b_int = create_tointeger(builder.CreateInBoundsGEP(value_struct_type, rkb_return[1], rkb_return[0]));
+        c_int = create_tointeger(builder.CreateInBoundsGEP(value_struct_type, rkc_return[1], rkc_return[0]));
+        is_integral = builder.CreateAnd(b_int[0], c_int[0]);
+    }
+    builder.CreateCondBr(is_integral, op_bitwise_1_block[index], error_block);
+
+    builder.SetInsertPoint(op_bitwise_1_block[index]);
+    llvm::Value *result = NULL;
+    switch (op) {
+        case OP_BAND: result = builder.CreateAnd(b_int[1], c_int[1]); break;
+        case OP_BOR:  result = builder.CreateOr(b_int[1], c_int[1]);  break;
+        case OP_BXOR: result = builder.CreateXor(b_int[1], c_int[1]); break;
+        case OP_SHL:  result = create_shiftl(b_int[1], c_int[1]);     break;
+        case OP_SHR:  result = create_shiftl(b_int[1], builder.CreateNeg(c_int[1])); break;
+        case OP_BNOT: result = builder.CreateNot(b_int[1]);           break;
+    }
+
+    builder.CreateStore(llvm::ConstantInt::get(context, llvm::APInt(32, LUA_TNUMINT, true)), create_type_ptr(ra));
+    builder.CreateStore(result, create_payload_ptr(ra));
+    builder.CreateBr(end_block);
+
+    return llvm::ConstantInt::get(context, llvm::APInt(64, 0, true));
+}
+
+
+/* SUPERINSTRUCTIONS */
+// Compare-and-jump. The plain compare handler is built with A reduced to its
+// flag bit and branching to a local end block; its result (1 when the JMP
+// would be skipped) then selects between the two possible pc offsets.
+llvm::Value* create_op_cmp_jmp_block(uint32_t op) {
+    uint32_t index = op - OP_EQ_JMP;
+    const char *names[] = {"op_eq_jmp", "op_lt_jmp", "op_le_jmp"};
+
+    op_fused_block[index] = llvm::BasicBlock::Create(context, names[index], step_func);
+    op_fused_end_block[index] = llvm::BasicBlock::Create(context, std::string(names[index]) + "_end", step_func);
+
+    builder.SetInsertPoint(op_fused_block[index]);
+    llvm::Value *a_inst = create_A();
+    llvm::Value *sj = builder.CreateSub(builder.CreateLShr(a_inst, llvm::ConstantInt::get(context, llvm::APInt(32, 1, true))),
+                                        llvm::ConstantInt::get(context, llvm::APInt(32, MAXARG_sJ, true)));
+    llvm::Value *jump_offset = builder.CreateAdd(builder.CreateSExt(sj, llvm::Type::getInt64Ty(context)),
+                                                 llvm::ConstantInt::get(context, llvm::APInt(64, 1, true)));
+
+    llvm::Value *fused_inst = _inst;
+    llvm::BasicBlock *fused_end_block = end_block;
+    _inst = builder.CreateAnd(fused_inst, llvm::ConstantInt::get(context, llvm::APInt(32, (uint32_t) ~(0xFE << POS_A), false)));
+    end_block = op_fused_end_block[index];
+
+    llvm::Value *skip = NULL;
+    llvm::BasicBlock *cmp_block = NULL;
+    llvm::BasicBlock *cmp_end_block = NULL;
+    switch (op) {
+        case OP_EQ_JMP:
+            skip = create_op_eq_block();
+            cmp_block = op_eq_block;
+            cmp_end_block = op_eq_10_block;
+            break;
+        case OP_LT_JMP:
+        case OP_LE_JMP:
+            skip = create_op_compare_block(OP_LT + (op - OP_LT_JMP));
+            cmp_block = op_compare_block[op - OP_LT_JMP];
+            cmp_end_block = op_compare_end_block[op - OP_LT_JMP];
+            break;
+    }
+
+    builder.SetInsertPoint(op_fused_block[index]);
+    builder.CreateBr(cmp_block);
+
+    builder.SetInsertPoint(op_fused_end_block[index]);
+    llvm::PHINode *skip_phi = builder.CreatePHI(llvm::Type::getInt64Ty(context), 1);
+    skip_phi->addIncoming(skip, cmp_end_block);
+    llvm::Value *is_skip = builder.CreateICmpNE(skip_phi, llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)));
+    llvm::Value *offset = builder.CreateSelect(is_skip, llvm::ConstantInt::get(context, llvm::APInt(64, 1, true)), jump_offset);
+
+    _inst = fused_inst;
+    end_block = fused_end_block;
+    builder.CreateBr(end_block);
+
+    return offset;
+}
+
+// Arithmetic with an integer constant C. Only RK(B) has to be checked for
+// the integer case; everything else goes through the plain handler.
+llvm::Value* create_op_arith_ki_block(uint32_t op) {
+    uint32_t index = op - OP_EQ_JMP;
+    uint32_t generic_op = 0;
+    switch (op) {
+#define OPSPEC_ARITH(OP, INT, FLT, QUICK) case OP_##OP##_KI: generic_op = OP_##OP; break;
+#include "opcodes.def"
+    }
+    std::string name = opspec_block_name(generic_op) + "_ki";
+
+    op_fused_block[index] = llvm::BasicBlock::Create(context, name, step_func);
+    llvm::BasicBlock *int_block = llvm::BasicBlock::Create(context, name + "_int", step_func);
+    op_fused_end_block[index] = llvm::BasicBlock::Create(context, name + "_end", step_func);
+
+    llvm::BasicBlock *fused_end_block = end_block;
+    end_block = op_fused_end_block[index];
+
+    create_op_arith_block(generic_op);
+    llvm::BasicBlock *generic_block = op_arith_block[generic_op - OP_ADD];
+
+    builder.SetInsertPoint(op_fused_block[index]);
+    std::vector<llvm::Value *> temp;
+    llvm::Value *registers_LD = create_registers();
+
+    std::vector<llvm::Value *> ra_ret = create_ra(registers_LD);
+    std::vector<llvm::Value *> rkb_return = create_rk(create_B(), registers_LD);
+    llvm::Value *rkb_LD = create_load(rkb_return[2]);
+    llvm::Value *rkb_is_int = builder.CreateICmpEQ(rkb_LD, llvm::ConstantInt::get(context, llvm::APInt(32, LUA_TNUMINT, true)));
+    builder.CreateCondBr(rkb_is_int, int_block, generic_block);
+
+    builder.SetInsertPoint(int_block);
+    temp.clear();
+    temp.push_back(rkb_return[0]);
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
+    llvm::Value *b_value_LD = create_load(builder.CreateInBoundsGEP(value_struct_type, rkb_return[1], temp));
+
+    temp.clear();
+    temp.push_back(create_indexk(create_C()));
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
+    llvm::Value *c_value_LD = create_load(builder.CreateInBoundsGEP(value_struct_type, _constants, temp));
+
+    llvm::Value *result = create_int_primitive(generic_op, b_value_LD, c_value_LD);
+
+    temp.clear();
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true)));
+    llvm::Value *a_type = builder.CreateInBoundsGEP(value_struct_type, ra_ret[1], temp);
+    builder.CreateStore(llvm::ConstantInt::get(context, llvm::APInt(32, LUA_TNUMINT, true)), a_type);
+
+    temp.clear();
+    temp.push_back(ra_ret[0]);
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true)));
+    llvm::Value *a_value = builder.CreateInBoundsGEP(value_struct_type, registers_LD, temp);
+    builder.CreateStore(result, a_value);
+    builder.CreateBr(op_fused_end_block[index]);
+
+    builder.SetInsertPoint(op_fused_end_block[index]);
+    end_block = fused_end_block;
+    builder.CreateBr(end_block);
+
+    return llvm::ConstantInt::get(context, llvm::APInt(64, 0, true));
+}
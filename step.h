@@ -0,0 +1,308 @@
+/*
+* File: step.h
+*
+* Declarations shared by the step generator (step.cpp) and the code that
+* reuses its IR builders (jit.cpp, trace.cpp).
+*/
+
+#ifndef STEP_H
+#define STEP_H
+
+#include <memory>
+#include <set>
+#include <vector>
+
+// LLVM includes
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/DynamicLibrary.h>
+//
+
+#define SIZE_C          9
+#define SIZE_B          9
+#define SIZE_Bx         (SIZE_C + SIZE_B)
+#define SIZE_A          8
+#define SIZE_Ax         (SIZE_C + SIZE_B + SIZE_A)
+
+#define SIZE_OP         6
+
+#define POS_OP          0
+#define POS_A           (POS_OP + SIZE_OP)
+#define POS_C           (POS_A + SIZE_A)
+#define POS_B           (POS_C + SIZE_C)
+#define POS_Bx          POS_C
+#define POS_Ax          POS_A
+
+
+#define MAXARG_A        ((1<<SIZE_A)-1)
+#define MAXARG_B        ((1<<SIZE_B)-1)
+#define MAXARG_C        ((1<<SIZE_C)-1)
+
+#define MAXARG_Ax       ((1<<SIZE_Ax)-1)
+#define MAXARG_Bx       ((1<<SIZE_Bx)-1)
+#define MAXARG_sBx      (MAXARG_Bx>>1)    // 'sBx' is signed
+
+/* this bit 1 means constant (0 means register) */
+#define BITRK           (1 << (SIZE_B - 1))
+
+// Lua parameters
+#define LUAI_MAXSHORTLEN 40
+
+#define LUA_TNIL                0
+#define LUA_TBOOLEAN            1
+#define LUA_TLIGHTUSERDATA      2
+#define LUA_TNUMBER             3
+#define LUA_TSTRING             4
+#define LUA_TTABLE              5
+#define LUA_TFUNCTION           6
+#define LUA_TUSERDATA           7
+#define LUA_TTHREAD             8
+#define LUA_NUMTAGS             9
+
+#define LUA_TNUMFLT     (LUA_TNUMBER | (0 << 4))  /* float numbers */
+#define LUA_TNUMINT     (LUA_TNUMBER | (1 << 4))  /* integer numbers */
+
+#define LUA_TSHRSTR     (LUA_TSTRING | (0 << 4))  /* short strings */
+#define LUA_TLNGSTR     (LUA_TSTRING | (1 << 4))  /* long strings */
+
+
+typedef enum {
+/*----------------------------------------------------------------------
+name          code     args    description
+------------------------------------------------------------------------*/
+OP_MOVE       =  0, /*  A B     R(A) := R(B)                                    */
+OP_LOADK      =  1, /*  A Bx    R(A) := Kst(Bx)                                 */
+OP_LOADKX     =  2, /*  A       R(A) := Kst(extra arg)                          */
+OP_LOADBOOL   =  3, /*  A B C   R(A) := (Bool)B; if (C) pc++                    */
+OP_LOADNIL    =  4, /*  A B     R(A), R(A+1), ..., R(A+B) := nil                */
+OP_GETUPVAL   =  5, /*  A B     R(A) := UpValue[B]                              */
+
+OP_GETTABUP   =  6, /*  A B C   R(A) := UpValue[B][RK(C)]                       */
+OP_GETTABLE   =  7, /*  A B C   R(A) := R(B)[RK(C)]                             */
+
+OP_SETTABUP   =  8, /*  A B C   UpValue[A][RK(B)] := RK(C)                      */
+OP_SETUPVAL   =  9, /*  A B     UpValue[B] := R(A)                              */
+OP_SETTABLE   = 10, /*  A B C   R(A)[RK(B)] := RK(C)                            */
+
+OP_NEWTABLE   = 11, /*  A B C   R(A) := {} (size = B,C)                         */
+
+OP_SELF       = 12, /*  A B C   R(A+1) := R(B); R(A) := R(B)[RK(C)]   */
+
+OP_ADD        = 13, /*  A B C   R(A) := RK(B) + RK(C)                           */
+OP_SUB        = 14, /*  A B C   R(A) := RK(B) - RK(C)                           */
+OP_MUL        = 15, /*  A B C   R(A) := RK(B) * RK(C)                           */
+OP_MOD        = 16, /*  A B C   R(A) := RK(B) % RK(C)                           */
+OP_POW        = 17, /*  A B C   R(A) := RK(B) ^ RK(C)                           */
+OP_DIV        = 18, /*  A B C   R(A) := RK(B) / RK(C)                           */
+OP_IDIV       = 19, /*  A B C   R(A) := RK(B) // RK(C)                          */
+OP_BAND       = 20, /*  A B C   R(A) := RK(B) & RK(C)                           */
+OP_BOR        = 21, /*  A B C   R(A) := RK(B) | RK(C)                           */
+OP_BXOR       = 22, /*  A B C   R(A) := RK(B) ~ RK(C)                           */
+OP_SHL        = 23, /*  A B C   R(A) := RK(B) << RK(C)                          */
+OP_SHR        = 24, /*  A B C   R(A) := RK(B) >> RK(C)                          */
+OP_UNM        = 25, /*  A B     R(A) := -R(B)                                   */
+OP_BNOT       = 26, /*  A B     R(A) := ~R(B)                                   */
+OP_NOT        = 27, /*  A B     R(A) := not R(B)                                */
+OP_LEN        = 28, /*  A B     R(A) := length of R(B)                          */
+
+OP_CONCAT     = 29, /*  A B C   R(A) := R(B).. ... ..R(C)                       */
+
+OP_JMP        = 30, /*  A sBx   pc+=sBx; if (A) close all upvalues >= R(A - 1)  */
+OP_EQ         = 31, /*  A B C   if ((RK(B) == RK(C)) ~= A) then pc++            */
+OP_LT         = 32, /*  A B C   if ((RK(B) <  RK(C)) ~= A) then pc++            */
+OP_LE         = 33, /*  A B C   if ((RK(B) <= RK(C)) ~= A) then pc++            */
+
+OP_TEST       = 34, /*  A C     if not (R(A) <=> C) then pc++                   */
+OP_TESTSET    = 35, /*  A B C   if (R(B) <=> C) then R(A) := R(B) else pc++     */
+
+OP_CALL       = 36, /*  A B C   R(A), ... ,R(A+C-2) := R(A)(R(A+1), ... ,R(A+B-1)) */
+OP_TAILCALL   = 37, /*  A B C   return R(A)(R(A+1), ... ,R(A+B-1))              */
+OP_RETURN     = 38, /*  A B     return R(A), ... ,R(A+B-2)      (see note)      */
+
+OP_FORLOOP    = 39, /*  A sBx   R(A)+=R(A+2); if R(A) <?= R(A+1) then { pc+=sBx; R(A+3)=R(A) }*/
+OP_FORPREP    = 40, /*  A sBx   R(A)-=R(A+2); pc+=sBx                           */
+
+OP_TFORCALL   = 41, /*  A C     R(A+3), ... ,R(A+2+C) := R(A)(R(A+1), R(A+2));  */
+OP_TFORLOOP   = 42, /*  A sBx   if R(A+1) ~= nil then { R(A)=R(A+1); pc += sBx }*/
+
+OP_SETLIST    = 43, /*  A B C   R(A)[(C-1)*FPF+i] := R(A+i), 1 <= i <= B        */
+
+OP_CLOSURE    = 44, /*  A Bx    R(A) := closure(KPROTO[Bx])                     */
+
+OP_VARARG     = 45, /*  A B     R(A), R(A+1), ..., R(A+B-2) = vararg            */
+
+OP_EXTRAARG   = 46, /*  Ax      extra (larger) argument for previous opcode     */
+
+// superinstructions written by fuseCode in hybrid.c
+OP_EQ_JMP     = 47, /*  A B C   if ((RK(B) == RK(C)) == A&1) then pc+=sJ+1 else pc++  */
+OP_LT_JMP     = 48, /*  A B C   if ((RK(B) <  RK(C)) == A&1) then pc+=sJ+1 else pc++  */
+OP_LE_JMP     = 49, /*  A B C   if ((RK(B) <= RK(C)) == A&1) then pc+=sJ+1 else pc++  */
+OP_ADD_KI     = 50, /*  A B C   R(A) := RK(B) + K(C), K(C) is an integer                */
+OP_SUB_KI     = 51, /*  A B C   R(A) := RK(B) - K(C), K(C) is an integer                */
+OP_MUL_KI     = 52, /*  A B C   R(A) := RK(B) * K(C), K(C) is an integer                */
+OP_MOD_KI     = 53, /*  A B C   R(A) := RK(B) % K(C), K(C) is an integer                */
+OP_IDIV_KI    = 54, /*  A B C   R(A) := RK(B) // K(C), K(C) is an integer               */
+} OpCode;
+
+#define NUM_FUSED_OPCODES   (1 + OP_IDIV_KI - OP_EQ_JMP)
+
+// the OPSPEC_ARITH and OPSPEC_ARITH_FLOAT ops of opcodes.def, OP_ADD..OP_IDIV,
+// and its OPSPEC_COMPARE ops, OP_LT and OP_LE, share one builder each
+#define NUM_ARITH_OPCODES   (1 + OP_IDIV - OP_ADD)
+#define NUM_COMPARE_OPCODES (1 + OP_LE - OP_LT)
+
+// BAND, BOR, BXOR, SHL, SHR and BNOT share one builder
+#define NUM_BITWISE_OPCODES 6
+
+// sJ, the jump of a compare-and-jump, lives in A(inst) >> 1, excess-MAXARG_sJ
+#define MAXARG_sJ       63
+
+
+
+// --- Type definitions copied from c-minilua.c
+typedef uint8_t Byte;
+typedef int32_t Int;
+typedef uint32_t Instruction;
+typedef int64_t lua_integer;
+typedef double lua_float;
+
+typedef enum { SHORT_STRING, LONG_STRING } StringType;
+typedef struct {
+    StringType typ;
+    const char *str;
+} String;
+
+typedef struct {
+    int typ;
+    union {
+        int b;
+        lua_integer i;
+        lua_float n;
+    } u;
+} Value;
+
+// Function prototype
+typedef struct Proto {
+    Byte numparams;  /* number of fixed parameters */
+    Byte is_vararg;
+    Byte maxstacksize;  /* number of registers needed by this function */
+    Int sizeupvalues;  /* size of 'upvalues' */
+    Int sizek;  /* size of 'k' */
+    Int sizecode;
+    //Int sizelineinfo;
+    Int sizep;  /* size of 'p' */
+    //Int sizelocvars;
+    Int linedefined;  /* debug information  */
+    Int lastlinedefined;  /* debug information  */
+    Value *k;  /* constants used by the function */
+    Instruction *code;  /* opcodes */
+    Byte *types;  /* register types before each pc, see inferTypes() */
+    //struct Proto **p;  /* functions defined inside the function */
+    //int *lineinfo;  /* map from opcodes to source lines (debug information) */
+    //LocVar *locvars;  /* information about local variables (debug information) */
+    //Upvaldesc *upvalues;  /* upvalue information */
+    //struct LClosure *cache;  /* last-created closure with this prototype */
+    String  *source;  /* used for debug information */
+    //GCObject *gclist;
+} Proto;
+
+// Proven operand types, as returned by operandTypes() (see typeinfer.h)
+#define TYPE_INT        (1 << 2)
+#define TYPE_FLT        (1 << 3)
+
+//MiniLuaState Struct
+typedef struct MiniLuaState {
+    Proto *proto;
+    Value *registers;
+    size_t return_begin;
+    size_t return_end;
+} MiniLuaState;
+// --- End of type definitions
+
+
+
+//Function definitions
+void create_types();
+void create_declarations();
+void add_return_incoming(llvm::PHINode *phi, uint32_t op, llvm::Value *ret);
+void add_alias_info(llvm::Function *f);
+void add_branch_weights(llvm::Function *f);
+void add_argument_attributes(llvm::Function *f, int mls_arg, int constants_arg);
+
+llvm::Value* create_load(llvm::Value *ptr);
+llvm::Value* create_registers();
+llvm::Value* create_type_ptr(llvm::Value *v);
+llvm::Value* create_payload_ptr(llvm::Value *v);
+void create_set_bool(llvm::Value *v, llvm::Value *b);
+llvm::Value* create_is_truthy(llvm::Value *v);
+std::vector<llvm::Value *> create_tointeger(llvm::Value *v);
+llvm::Value* create_op_block(uint32_t op);
+llvm::Value* create_inline_op(Instruction inst, Byte types, bool *called_C);
+std::set<int64_t> pc_offsets(Instruction inst);
+std::vector<uint32_t> typed_operands(Instruction inst);
+Byte observed_types(MiniLuaState *mls, Instruction inst);
+llvm::BasicBlock* create_type_guard(Instruction inst, Byte types, const std::string &name);
+void create_return_block(Instruction inst, llvm::Value *ret);
+void optimize_module_O3(llvm::Module *m, llvm::TargetMachine *tm = NULL);
+
+llvm::Value* create_op_move_block();
+llvm::Value* create_op_loadk_block();
+llvm::Value* create_op_arith_block(uint32_t op);
+llvm::Value* create_op_unm_block();
+llvm::Value* create_op_not_block();
+llvm::Value* create_op_jmp_block();
+
+llvm::Value* create_op_eq_block();
+llvm::Value* create_op_compare_block(uint32_t op);
+llvm::Value* create_op_proven_block(uint32_t op, bool is_float);
+llvm::Value* create_op_forloop_block();
+llvm::Value* create_op_forprep_block();
+llvm::Value* create_op_loadbool_block();
+llvm::Value* create_op_loadnil_block();
+llvm::Value* create_op_test_block();
+llvm::Value* create_op_testset_block();
+llvm::Value* create_op_bitwise_block(uint32_t op);
+
+llvm::Value* create_op_cmp_jmp_block(uint32_t op);
+llvm::Value* create_op_arith_ki_block(uint32_t op);
+
+
+
+// Globals (defined in step.cpp)
+extern std::unique_ptr<llvm::LLVMContext> OwnerContext;
+extern llvm::LLVMContext &context;
+extern std::unique_ptr<llvm::Module> Owner;
+extern llvm::Module *module;
+extern llvm::IRBuilder<> builder;
+
+extern llvm::StructType *string_struct_type;
+extern llvm::PointerType *p_string_struct_type;
+
+extern llvm::StructType *value_struct_type;
+extern llvm::PointerType *p_value_struct_type;
+
+extern llvm::StructType *proto_struct_type;
+extern llvm::PointerType *p_proto_struct_type;
+
+extern llvm::StructType *miniluastate_struct_type;
+extern llvm::PointerType *p_miniluastate_struct_type;
+
+extern llvm::FunctionType *step_type;
+
+extern llvm::Function *step_func;
+extern llvm::Value *_mls;
+extern llvm::Value *_inst;
+extern llvm::Value *_op;
+extern llvm::Value *_constants;
+extern llvm::Value *_registers;
+
+extern llvm::Function *error;
+extern llvm::Function *step_in_C_func;
+
+extern llvm::BasicBlock *end_block;
+extern llvm::BasicBlock *error_block;
+
+#endif
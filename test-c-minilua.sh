@@ -13,7 +13,7 @@ nerrors=0
 errorFilenames=()
 
 for filename in ./examples/*.byte; do
-    if [[ "${filename}" != @("./examples/fizzbuzz.byte"|"./examples/minimize-int.byte"|"./examples/minimize-real.byte"|"./examples/odd_even.byte"|"./examples/relop.byte"|"./examples/sum-of-f.byte") ]]; then
+    if [[ "${filename}" != @("./examples/fizzbuzz.byte"|"./examples/minimize-int.byte"|"./examples/minimize-real.byte"|"./examples/odd_even.byte"|"./examples/sum-of-f.byte") ]]; then
        
         n=$(($n + 1))
         
@@ -48,11 +48,10 @@ if [ $nerrors != 0 ] ; then
 fi
 echo ""
 echo "Files that do not run on c-minilua because of not implemented functions: "
-echo "  6 files: "
+echo "  5 files: "
 echo "    ./examples/fizzbuzz.byte"
 echo "    ./examples/minimize-int.byte"
 echo "    ./examples/minimize-real.byte"
 echo "    ./examples/odd_even.byte"
-echo "    ./examples/relop.byte"
 echo "    ./examples/sum-of-f.byte"
 
@@ -0,0 +1,382 @@
+/*
+* File: threaded.cpp
+*
+* Tail-call threaded interpreter. Instead of one step() with a switch that
+* interpret() calls per instruction, every opcode gets its own function
+* built by the create_op_*_block functions of step.cpp. A handler ends by
+* loading the next instruction and doing a musttail call through
+* dispatch_table, so control never returns to a central loop and pc,
+* registers and constants stay in argument registers:
+*
+*   void handler(MiniLuaState *mls, Instruction *pc, Value *registers, Value *constants)
+*
+* Opcodes without IR share a handler that calls step_in_C. The generated
+* threaded.ll defines interpret() and is linked with hybrid.c:
+* make hybrid-threaded
+*
+* With --indirectbr the same handlers are emitted as blocks of a single
+* interpret() function that dispatch with indirectbr, so LLVM sees the whole
+* interpreter at once (indirectbr.ll, make hybrid-indirectbr).
+*/
+
+#include <cstdio>
+#include <cstring>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "step.h"
+
+// LLVM includes
+#include <llvm/IR/Verifier.h>
+#include <llvm/Support/raw_ostream.h>
+//
+
+#define NUM_DISPATCH    (1 << SIZE_OP)
+
+
+static llvm::FunctionType *handler_type;
+static llvm::PointerType *p_handler_type;
+static llvm::GlobalVariable *dispatch_table;
+
+
+static llvm::Function* create_handler_function(const std::string &name) {
+    llvm::Function *f = llvm::Function::Create(handler_type, llvm::Function::InternalLinkage, name, module);
+    add_argument_attributes(f, 0, 3);
+
+    // the builders read these globals instead of step's arguments
+    auto argiter = f->arg_begin();
+    step_func = f;
+    _mls = &*argiter++;
+    llvm::Value *pc = &*argiter++;
+    _registers = &*argiter++;
+    _constants = &*argiter++;
+    pc->setName("pc");
+
+    llvm::BasicBlock *entry = llvm::BasicBlock::Create(context, "entry", f);
+    builder.SetInsertPoint(entry);
+    _inst = create_load(pc);
+    return f;
+}
+
+// &pc[1 + offset]
+static llvm::Value* create_next_pc(llvm::Value *pc, llvm::Value *offset) {
+    llvm::Value *step = builder.CreateAdd(offset, llvm::ConstantInt::get(context, llvm::APInt(64, 1, true)));
+    return builder.CreateInBoundsGEP(llvm::Type::getInt32Ty(context), pc, step);
+}
+
+// pc += 1 + offset; musttail dispatch_table[OP(*pc)](mls, pc, registers, constants)
+static void create_dispatch(llvm::Function *f, llvm::Value *offset) {
+    auto argiter = f->arg_begin();
+    llvm::Value *mls = &*argiter++;
+    llvm::Value *pc = &*argiter++;
+    llvm::Value *registers = &*argiter++;
+    llvm::Value *constants = &*argiter++;
+
+    llvm::Value *next_pc = create_next_pc(pc, offset);
+    llvm::Value *next_inst = create_load(next_pc);
+    llvm::Value *next_op = builder.CreateAnd(next_inst, llvm::ConstantInt::get(context, llvm::APInt(32, 0x3F, false)));
+
+    std::vector<llvm::Value *> temp;
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)));
+    temp.push_back(builder.CreateZExt(next_op, llvm::Type::getInt64Ty(context)));
+    llvm::Value *handler_GEP = builder.CreateInBoundsGEP(dispatch_table->getValueType(), dispatch_table, temp);
+    llvm::Value *handler = builder.CreateLoad(p_handler_type, handler_GEP);
+
+    std::vector<llvm::Value *> args;
+    args.push_back(mls);
+    args.push_back(next_pc);
+    args.push_back(registers);
+    args.push_back(constants);
+    llvm::CallInst *call = builder.CreateCall(handler_type, handler, args);
+    call->setTailCallKind(llvm::CallInst::TCK_MustTail);
+    builder.CreateRetVoid();
+}
+
+// Handler for op built from create_op_block, or NULL if op has no IR.
+static llvm::Function* create_op_handler(uint32_t op) {
+    llvm::Function *f = create_handler_function("handler_" + std::to_string(op));
+    _op = llvm::ConstantInt::get(context, llvm::APInt(32, op, false));
+
+    llvm::BasicBlock *entry = &f->back();
+    error_block = llvm::BasicBlock::Create(context, "error_block", f);
+    end_block = llvm::BasicBlock::Create(context, "end");
+
+    llvm::Value *ret = create_op_block(op);
+    if (!ret) {
+        f->eraseFromParent();
+        delete end_block;
+        return NULL;
+    }
+
+    builder.SetInsertPoint(entry);
+    builder.CreateBr(error_block->getNextNode());
+
+    builder.SetInsertPoint(error_block);
+    builder.CreateCall(error);
+    builder.CreateUnreachable();
+
+    end_block->insertInto(f);
+    builder.SetInsertPoint(end_block);
+    llvm::PHINode *offset_phi = builder.CreatePHI(llvm::Type::getInt64Ty(context), 2);
+    add_return_incoming(offset_phi, op, ret);
+    create_dispatch(f, offset_phi);
+    return f;
+}
+
+// Every opcode without IR: step_in_C(mls, inst, OP(inst), constants).
+static llvm::Function* create_default_handler() {
+    llvm::Function *f = create_handler_function("handler_default");
+    _op = builder.CreateAnd(_inst, llvm::ConstantInt::get(context, llvm::APInt(32, 0x3F, false)));
+
+    std::vector<llvm::Value *> step_args;
+    step_args.push_back(_mls);
+    step_args.push_back(_inst);
+    step_args.push_back(_op);
+    step_args.push_back(_constants);
+    llvm::Value *offset = builder.CreateCall(step_in_C_func, step_args);
+    create_dispatch(f, offset);
+    return f;
+}
+
+// mls->return_begin = A(inst); mls->return_end = A(inst) + B(inst) - 1
+static void create_return(llvm::Value *mls, llvm::Value *inst) {
+    llvm::Value *a = builder.CreateAnd(builder.CreateLShr(inst, POS_A), MAXARG_A);
+    llvm::Value *b = builder.CreateAnd(builder.CreateLShr(inst, POS_B), MAXARG_B);
+    llvm::Value *end = builder.CreateAdd(a, builder.CreateAdd(b, llvm::ConstantInt::get(context, llvm::APInt(32, -1, true))));
+
+    std::vector<llvm::Value *> temp;
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)));
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 2, true))); //return_begin
+    llvm::Value *return_begin_GEP = builder.CreateInBoundsGEP(miniluastate_struct_type, mls, temp);
+    builder.CreateStore(builder.CreateZExt(a, llvm::Type::getInt64Ty(context)), return_begin_GEP);
+
+    temp.clear();
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)));
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 3, true))); //return_end
+    llvm::Value *return_end_GEP = builder.CreateInBoundsGEP(miniluastate_struct_type, mls, temp);
+    builder.CreateStore(builder.CreateZExt(end, llvm::Type::getInt64Ty(context)), return_end_GEP);
+
+    builder.CreateRetVoid();
+}
+
+static llvm::Function* create_return_handler() {
+    llvm::Function *f = create_handler_function("handler_return");
+    create_return(_mls, _inst);
+    return f;
+}
+
+// Loads mls->registers, mls->proto->k and mls->proto->code at the insert point.
+static void load_frame(llvm::Value *mls, llvm::Value **registers, llvm::Value **k, llvm::Value **code) {
+    std::vector<llvm::Value *> temp;
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)));
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 0, true))); //proto
+    llvm::Value *proto_LD = create_load(builder.CreateInBoundsGEP(miniluastate_struct_type, mls, temp));
+    temp.clear();
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)));
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 1, true))); //registers
+    *registers = create_load(builder.CreateInBoundsGEP(miniluastate_struct_type, mls, temp));
+    temp.clear();
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)));
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 9, true))); //k
+    *k = create_load(builder.CreateInBoundsGEP(proto_struct_type, proto_LD, temp));
+    temp.clear();
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)));
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(32, 10, true))); //code
+    *code = create_load(builder.CreateInBoundsGEP(proto_struct_type, proto_LD, temp));
+}
+
+// void interpret(MiniLuaState *mls): enters the handler of the first instruction.
+static void create_interpret() {
+    llvm::FunctionType *interpret_type = llvm::FunctionType::get(llvm::Type::getVoidTy(context), p_miniluastate_struct_type, false);
+    llvm::Function *f = llvm::Function::Create(interpret_type, llvm::Function::ExternalLinkage, "interpret", module);
+    add_argument_attributes(f, 0, -1);
+    llvm::Value *mls = &*f->arg_begin();
+
+    llvm::BasicBlock *entry = llvm::BasicBlock::Create(context, "entry", f);
+    builder.SetInsertPoint(entry);
+
+    llvm::Value *registers_LD, *k_LD, *code_LD;
+    load_frame(mls, &registers_LD, &k_LD, &code_LD);
+
+    llvm::Value *op = builder.CreateAnd(create_load(code_LD), llvm::ConstantInt::get(context, llvm::APInt(32, 0x3F, false)));
+    std::vector<llvm::Value *> temp;
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)));
+    temp.push_back(builder.CreateZExt(op, llvm::Type::getInt64Ty(context)));
+    llvm::Value *handler = builder.CreateLoad(p_handler_type,
+        builder.CreateInBoundsGEP(dispatch_table->getValueType(), dispatch_table, temp));
+
+    std::vector<llvm::Value *> args;
+    args.push_back(mls);
+    args.push_back(code_LD);
+    args.push_back(registers_LD);
+    args.push_back(k_LD);
+    builder.CreateCall(handler_type, handler, args);
+    builder.CreateRetVoid();
+}
+
+
+// handler functions, dispatch_table and interpret()
+static void create_threaded_interpret() {
+    std::vector<llvm::Type *> args;
+    args.push_back(p_miniluastate_struct_type);         //*mls
+    args.push_back(llvm::Type::getInt32PtrTy(context)); //*pc
+    args.push_back(p_value_struct_type);                //*registers
+    args.push_back(p_value_struct_type);                //*constants
+    handler_type = llvm::FunctionType::get(llvm::Type::getVoidTy(context), args, false);
+    p_handler_type = llvm::PointerType::get(handler_type, 0);
+
+    // filled in once every handler exists
+    llvm::ArrayType *table_type = llvm::ArrayType::get(p_handler_type, NUM_DISPATCH);
+    dispatch_table = new llvm::GlobalVariable(*module, table_type, true,
+        llvm::GlobalValue::InternalLinkage, NULL, "dispatch_table");
+
+    llvm::Function *handler_default = create_default_handler();
+    std::vector<llvm::Constant *> handlers(NUM_DISPATCH, handler_default);
+    handlers[OP_RETURN] = create_return_handler();
+    for (uint32_t op = 0; op < NUM_DISPATCH; op++) {
+        llvm::Function *f = create_op_handler(op);
+        if (f) {
+            handlers[op] = f;
+        }
+    }
+    dispatch_table->setInitializer(llvm::ConstantArray::get(table_type, handlers));
+
+    create_interpret();
+}
+
+
+// --- Single function mode (--indirectbr)
+// interpret() holds the entry, every handler and OP_RETURN. Handlers end in
+// an indirectbr through dispatch_labels, a table of blockaddresses, and pc
+// lives in an alloca that mem2reg turns into phis.
+
+static llvm::Value *pc_ptr;
+static std::vector<llvm::IndirectBrInst *> dispatch_branches;
+
+// pc = next_pc; goto *dispatch_labels[OP(*pc)]
+static void create_indirect_dispatch(llvm::Value *next_pc) {
+    builder.CreateStore(next_pc, pc_ptr);
+    llvm::Value *next_op = builder.CreateAnd(create_load(next_pc), llvm::ConstantInt::get(context, llvm::APInt(32, 0x3F, false)));
+
+    std::vector<llvm::Value *> temp;
+    temp.push_back(llvm::ConstantInt::get(context, llvm::APInt(64, 0, true)));
+    temp.push_back(builder.CreateZExt(next_op, llvm::Type::getInt64Ty(context)));
+    llvm::Value *label = builder.CreateLoad(llvm::Type::getInt8PtrTy(context),
+        builder.CreateInBoundsGEP(dispatch_table->getValueType(), dispatch_table, temp));
+    dispatch_branches.push_back(builder.CreateIndirectBr(label, NUM_DISPATCH));
+}
+
+static void create_indirectbr_interpret() {
+    llvm::FunctionType *interpret_type = llvm::FunctionType::get(llvm::Type::getVoidTy(context), p_miniluastate_struct_type, false);
+    llvm::Function *f = llvm::Function::Create(interpret_type, llvm::Function::ExternalLinkage, "interpret", module);
+    add_argument_attributes(f, 0, -1);
+    llvm::Value *mls = &*f->arg_begin();
+
+    llvm::ArrayType *table_type = llvm::ArrayType::get(llvm::Type::getInt8PtrTy(context), NUM_DISPATCH);
+    dispatch_table = new llvm::GlobalVariable(*module, table_type, true,
+        llvm::GlobalValue::InternalLinkage, NULL, "dispatch_labels");
+
+    llvm::BasicBlock *entry = llvm::BasicBlock::Create(context, "entry", f);
+    builder.SetInsertPoint(entry);
+    pc_ptr = builder.CreateAlloca(llvm::Type::getInt32PtrTy(context), NULL, "pc");
+    llvm::Value *code_LD;
+    load_frame(mls, &_registers, &_constants, &code_LD);
+    create_indirect_dispatch(code_LD);
+
+    // the builders read these globals instead of step's arguments
+    step_func = f;
+    _mls = mls;
+    error_block = llvm::BasicBlock::Create(context, "error_block", f);
+    builder.SetInsertPoint(error_block);
+    builder.CreateCall(error);
+    builder.CreateUnreachable();
+
+    // opcodes without IR
+    llvm::BasicBlock *default_block = llvm::BasicBlock::Create(context, "handler_default", f);
+    builder.SetInsertPoint(default_block);
+    llvm::Value *pc = create_load(pc_ptr);
+    _inst = create_load(pc);
+    _op = builder.CreateAnd(_inst, llvm::ConstantInt::get(context, llvm::APInt(32, 0x3F, false)));
+    std::vector<llvm::Value *> step_args;
+    step_args.push_back(_mls);
+    step_args.push_back(_inst);
+    step_args.push_back(_op);
+    step_args.push_back(_constants);
+    llvm::Value *offset = builder.CreateCall(step_in_C_func, step_args);
+    create_indirect_dispatch(create_next_pc(pc, offset));
+
+    std::vector<llvm::BasicBlock *> labels(NUM_DISPATCH, default_block);
+
+    labels[OP_RETURN] = llvm::BasicBlock::Create(context, "handler_return", f);
+    builder.SetInsertPoint(labels[OP_RETURN]);
+    create_return(mls, create_load(create_load(pc_ptr)));
+
+    for (uint32_t op = 0; op < NUM_DISPATCH; op++) {
+        llvm::BasicBlock *handler = llvm::BasicBlock::Create(context, "handler_" + std::to_string(op), f);
+        builder.SetInsertPoint(handler);
+        pc = create_load(pc_ptr);
+        _inst = create_load(pc);
+        _op = llvm::ConstantInt::get(context, llvm::APInt(32, op, false));
+        end_block = llvm::BasicBlock::Create(context, "handler_" + std::to_string(op) + "_end");
+
+        llvm::Value *ret = create_op_block(op);
+        if (!ret) {
+            handler->eraseFromParent();
+            delete end_block;
+            continue;
+        }
+        builder.SetInsertPoint(handler);
+        builder.CreateBr(handler->getNextNode());
+
+        end_block->insertInto(f);
+        builder.SetInsertPoint(end_block);
+        llvm::PHINode *offset_phi = builder.CreatePHI(llvm::Type::getInt64Ty(context), 2);
+        add_return_incoming(offset_phi, op, ret);
+        create_indirect_dispatch(create_next_pc(pc, offset_phi));
+        labels[op] = handler;
+    }
+
+    std::vector<llvm::Constant *> addresses;
+    std::set<llvm::BasicBlock *> destinations;
+    for (llvm::BasicBlock *label : labels) {
+        addresses.push_back(llvm::BlockAddress::get(f, label));
+        destinations.insert(label);
+    }
+    dispatch_table->setInitializer(llvm::ConstantArray::get(table_type, addresses));
+    for (llvm::IndirectBrInst *branch : dispatch_branches) {
+        for (llvm::BasicBlock *destination : destinations) {
+            branch->addDestination(destination);
+        }
+    }
+}
+
+
+int main(int argc, char **argv) {
+    create_types();
+    create_declarations();
+
+    const char *output = "threaded.ll";
+    if (argc > 1 && strcmp(argv[1], "--indirectbr") == 0) {
+        create_indirectbr_interpret();
+        output = "indirectbr.ll";
+    } else {
+        create_threaded_interpret();
+    }
+    for (llvm::Function &f : *module) {
+        add_alias_info(&f);
+        add_branch_weights(&f);
+    }
+
+    if (llvm::verifyModule(*module, &llvm::errs())) {
+        return 1;
+    }
+    // llc only runs the backend, so the middle-end pipeline is run here
+    optimize_module_O3(module);
+
+    //dump module to check ir
+    freopen(output, "w", stderr);
+    module->dump();
+
+    return 0;
+}
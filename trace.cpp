@@ -0,0 +1,452 @@
+/*
+* File: trace.cpp
+*
+* Tracing JIT. interpret() runs the Proto through step_in_C and counts the
+* backward jumps into every pc. When one of those loop headers gets hot, the
+* instructions executed from there are recorded, along with the tags of their
+* numeric operands, until control comes back to the header. The trace is then
+* compiled by LLVM into one straight-line function that loops on itself:
+*
+* - each instruction is emitted by create_inline_op, untagged behind a guard
+*   on the recorded tags (no guard when typeinfer.h already proved them);
+* - each branch becomes a guard on the direction it took when recorded.
+*
+* A failing guard leaves through a side exit, which returns to the
+* interpreter. An exit taken HOT_EXIT times gets a side trace, recorded from
+* the pc it resumes at, that the exit calls directly from then on. Side traces
+* end by jumping into the trace they reach (usually their root), so the
+* branches of a loop body all run as compiled code.
+*
+* MINILUA_TRACE=1 in the environment reports the recorded traces on stderr,
+* MINILUA_JIT_DUMP=1 prints their optimized IR. MINILUA_PERF_MAP and
+* MINILUA_JITDUMP name the traces for perf, see perfmap.h.
+*
+* Like jit.cpp, this file replaces interpret() and is linked with hybrid.c,
+* which provides the loader, main(), step_in_C and error_default:
+* make trace
+*/
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "perfmap.h"
+#include "step.h"
+
+// LLVM includes
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
+#include <llvm/ExecutionEngine/Orc/ObjectTransformLayer.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/Object/ObjectFile.h>
+#include <llvm/Object/SymbolSize.h>
+#include <llvm/Support/raw_ostream.h>
+//
+
+
+// backward jumps into a pc before a trace is recorded from it
+#define HOT_LOOP            56
+// times a side exit is taken before a side trace is recorded from it
+#define HOT_EXIT            10
+// recorded instructions before the recording is aborted
+#define MAX_TRACE_LENGTH    200
+// aborted recordings before a loop header or an exit is given up
+#define MAX_ABORTS          4
+
+
+// Defined in hybrid.c
+extern "C" size_t step_in_C(MiniLuaState *mls, Instruction inst, uint32_t op, Value *constants);
+extern "C" void error_default();
+extern "C" Byte operandTypes(Proto *f, int pc);
+
+// Returns the TraceExit it left through.
+typedef int64_t (*trace_func)(MiniLuaState *);
+
+struct Trace;
+
+typedef struct TraceExit {
+    int pc;              /* where the interpreter resumes */
+    int count;           /* times taken */
+    int aborts;          /* aborted side trace recordings */
+    trace_func side;     /* side trace called by the exit, read by the trace code */
+} TraceExit;
+
+typedef struct Trace {
+    int start;
+    trace_func f;
+    std::vector<std::unique_ptr<TraceExit>> exits;
+} Trace;
+
+typedef struct RecordedInstruction {
+    int pc;
+    Instruction inst;
+    Byte types;          /* TYPE_INT or TYPE_FLT when all typed operands had that tag */
+    int64_t offset;      /* pc offset returned when recorded */
+} RecordedInstruction;
+
+typedef struct ProtoTraces {
+    std::vector<int> hotcount;      /* backward jumps into pc, -1 once given up */
+    std::vector<int> aborts;
+    std::vector<Trace *> roots;     /* trace recorded from the loop header at pc */
+} ProtoTraces;
+
+static std::unique_ptr<llvm::orc::LLJIT> jit;
+static llvm::orc::ThreadSafeContext jit_context;
+static std::map<Proto *, ProtoTraces> proto_traces;
+static std::vector<std::unique_ptr<Trace>> traces;
+static bool verbose = false;
+static std::map<std::string, size_t> function_sizes;  // of the objects linked, for perfmap.h
+
+// recording state
+static bool recording = false;
+static int record_start;
+static TraceExit *record_exit;      /* exit the side trace is for, NULL for a root */
+static std::vector<RecordedInstruction> record;
+
+
+static void fatal(const char *msg) {
+    fprintf(stderr, "trace: %s\n", msg);
+    exit(1);
+}
+
+// see inspect_object in jit.cpp
+static void read_function_sizes(const llvm::MemoryBuffer &obj) {
+    auto file = llvm::object::ObjectFile::createObjectFile(obj.getMemBufferRef());
+    if (!file) {
+        llvm::consumeError(file.takeError());
+        return;
+    }
+    for (auto &symbol : llvm::object::computeSymbolSizes(**file)) {
+        auto type = symbol.first.getType();
+        auto name = symbol.first.getName();
+        if (type && name && *type == llvm::object::SymbolRef::ST_Function) {
+            function_sizes[name->str()] = symbol.second;
+        } else {
+            llvm::consumeError(type.takeError());
+            llvm::consumeError(name.takeError());
+        }
+    }
+}
+
+static void init_jit() {
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+    llvm::InitializeNativeTargetAsmParser();
+
+    auto jit_or_error = llvm::orc::LLJITBuilder().create();
+    if (!jit_or_error) {
+        llvm::logAllUnhandledErrors(jit_or_error.takeError(), llvm::errs(), "trace: ");
+        exit(1);
+    }
+    jit = std::move(*jit_or_error);
+    if (perfEnabled()) {
+        jit->getObjTransformLayer().setTransform([](std::unique_ptr<llvm::MemoryBuffer> obj)
+                -> llvm::Expected<std::unique_ptr<llvm::MemoryBuffer>> {
+            read_function_sizes(*obj);
+            return obj;
+        });
+    }
+
+    llvm::orc::JITDylib &dylib = jit->getMainJITDylib();
+    char prefix = jit->getDataLayout().getGlobalPrefix();
+    dylib.addGenerator(llvm::cantFail(
+        llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(prefix)));
+
+    llvm::orc::MangleAndInterner mangle(jit->getExecutionSession(), jit->getDataLayout());
+    llvm::orc::SymbolMap helpers;
+    helpers[mangle("step_in_C")] = llvm::JITEvaluatedSymbol(
+        llvm::pointerToJITTargetAddress(&step_in_C), llvm::JITSymbolFlags::Exported);
+    helpers[mangle("error_default")] = llvm::JITEvaluatedSymbol(
+        llvm::pointerToJITTargetAddress(&error_default), llvm::JITSymbolFlags::Exported);
+    llvm::cantFail(dylib.define(llvm::orc::absoluteSymbols(helpers)));
+
+    // see init_jit in jit.cpp
+    create_types();
+    Owner.reset();
+    jit_context = llvm::orc::ThreadSafeContext(std::move(OwnerContext));
+
+    verbose = getenv("MINILUA_TRACE") != NULL;
+}
+
+
+// --- Recording
+
+static void start_recording(int pc, TraceExit *exit) {
+    recording = true;
+    record_start = pc;
+    record_exit = exit;
+    record.clear();
+}
+
+static void abort_recording(ProtoTraces &pt, const char *why) {
+    if (verbose) {
+        fprintf(stderr, "trace: %s trace at pc %d aborted, %s\n",
+                record_exit ? "side" : "root", record_start + 1, why);
+    }
+    if (record_exit) {
+        record_exit->count = 0;
+        record_exit->aborts++;
+    } else if (++pt.aborts[record_start] >= MAX_ABORTS) {
+        pt.hotcount[record_start] = -1;
+    } else {
+        pt.hotcount[record_start] = 0;
+    }
+    recording = false;
+}
+
+
+// --- Compilation
+
+static llvm::FunctionType* trace_type() {
+    return llvm::FunctionType::get(llvm::Type::getInt64Ty(context), p_miniluastate_struct_type, false);
+}
+
+// Returns from the trace with its result, calling f last
+static void create_tail_call(llvm::Value *f) {
+    llvm::CallInst *call = builder.CreateCall(trace_type(), f, _mls);
+    call->setTailCallKind(llvm::CallInst::TCK_MustTail);
+    builder.CreateRet(call);
+}
+
+// A new exit of t resuming at pc: calls its side trace once there is one,
+// else returns it to the interpreter.
+static llvm::BasicBlock* create_exit(Trace *t, int pc) {
+    t->exits.push_back(std::unique_ptr<TraceExit>(new TraceExit{pc, 0, 0, NULL}));
+    TraceExit *e = t->exits.back().get();
+
+    llvm::IRBuilderBase::InsertPointGuard guard(builder);
+    llvm::Function *f = builder.GetInsertBlock()->getParent();
+    llvm::BasicBlock *exit_block = llvm::BasicBlock::Create(context, "exit_" + std::to_string(pc + 1), f);
+    llvm::BasicBlock *side_block = llvm::BasicBlock::Create(context, "exit_side", f);
+    llvm::BasicBlock *return_block = llvm::BasicBlock::Create(context, "exit_return", f);
+
+    llvm::PointerType *p_trace_type = trace_type()->getPointerTo();
+    builder.SetInsertPoint(exit_block);
+    llvm::Value *side_ptr = llvm::ConstantExpr::getIntToPtr(
+        llvm::ConstantInt::get(context, llvm::APInt(64, (uint64_t) &e->side, false)), p_trace_type->getPointerTo());
+    llvm::Value *side = builder.CreateLoad(p_trace_type, side_ptr);
+    builder.CreateCondBr(builder.CreateIsNull(side), return_block, side_block);
+
+    builder.SetInsertPoint(side_block);
+    create_tail_call(side);
+
+    builder.SetInsertPoint(return_block);
+    builder.CreateRet(llvm::ConstantInt::get(context, llvm::APInt(64, (uint64_t) e, false)));
+    return exit_block;
+}
+
+// Leaves through an exit at r.pc, before r runs, unless its typed operands
+// have the tags they had when recorded.
+static void create_type_guards(Trace *t, const RecordedInstruction &r) {
+    llvm::BasicBlock *failed_block = create_type_guard(r.inst, r.types, "pc_" + std::to_string(r.pc + 1));
+    if (failed_block) {
+        llvm::IRBuilderBase::InsertPointGuard guard(builder);
+        builder.SetInsertPoint(failed_block);
+        builder.CreateBr(create_exit(t, r.pc));
+    }
+}
+
+// Emits "i64 name(MiniLuaState *mls)" running the recorded instructions of t.
+// After the last one, it jumps to the start again, or calls link when given.
+static llvm::Function* create_trace_function(Proto *p, Trace *t, const std::string &name, trace_func link) {
+    llvm::Function *f = llvm::Function::Create(trace_type(), llvm::Function::ExternalLinkage, name, module);
+
+    // the builders read these globals instead of step's arguments
+    step_func = f;
+    _mls = &*f->arg_begin();
+    _constants = llvm::ConstantExpr::getIntToPtr(
+        llvm::ConstantInt::get(context, llvm::APInt(64, (uint64_t) p->k, false)), p_value_struct_type);
+
+    llvm::BasicBlock *entry = llvm::BasicBlock::Create(context, "entry", f);
+    std::vector<llvm::BasicBlock *> blocks;
+    for (const RecordedInstruction &r : record) {
+        blocks.push_back(llvm::BasicBlock::Create(context, "pc_" + std::to_string(r.pc + 1), f));
+    }
+    llvm::BasicBlock *loop_end = llvm::BasicBlock::Create(context, "loop_end", f);
+    error_block = llvm::BasicBlock::Create(context, "error_block", f);
+
+    builder.SetInsertPoint(entry);
+    builder.CreateBr(blocks[0]);
+
+    builder.SetInsertPoint(error_block);
+    builder.CreateCall(error);
+    builder.CreateUnreachable();
+
+    for (size_t i = 0; i < record.size(); i++) {
+        const RecordedInstruction &r = record[i];
+        builder.SetInsertPoint(blocks[i]);
+
+        Byte types = operandTypes(p, r.pc);
+        if (!types && r.types) {
+            create_type_guards(t, r);
+            types = r.types;
+        }
+
+        bool called_C;
+        llvm::Value *pc_offset = create_inline_op(r.inst, types, &called_C);
+        std::set<int64_t> offsets = pc_offsets(r.inst);
+        if (called_C) {
+            // step_in_C may also skip the next instruction
+            offsets.insert(1);
+        }
+
+        // the recorded direction stays in the trace, the others exit
+        llvm::BasicBlock *next = i + 1 < record.size() ? blocks[i + 1] : loop_end;
+        if (offsets.size() == 1) {
+            builder.CreateBr(next);
+            continue;
+        }
+        llvm::SwitchInst *sw = builder.CreateSwitch(pc_offset, error_block, offsets.size());
+        for (int64_t offset : offsets) {
+            int64_t target = r.pc + 1 + offset;
+            if (offset == r.offset) {
+                sw->addCase(llvm::ConstantInt::get(context, llvm::APInt(64, offset, true)), next);
+            } else if (target >= 0 && target < p->sizecode) {
+                sw->addCase(llvm::ConstantInt::get(context, llvm::APInt(64, offset, true)), create_exit(t, target));
+            }
+        }
+    }
+
+    builder.SetInsertPoint(loop_end);
+    if (link) {
+        create_tail_call(llvm::ConstantExpr::getIntToPtr(
+            llvm::ConstantInt::get(context, llvm::APInt(64, (uint64_t) link, false)), trace_type()->getPointerTo()));
+    } else {
+        builder.CreateBr(blocks[0]);
+    }
+
+    add_alias_info(f);
+    add_branch_weights(f);
+    add_argument_attributes(f, 0, -1);
+    return f;
+}
+
+// Compiles the recording into a new trace, which the loop header or the exit
+// it was recorded from starts with from now on. end is the pc the recording
+// stopped at: the start again, or the start of another trace.
+static void stop_recording(Proto *p, ProtoTraces &pt, int end) {
+    recording = false;
+    Trace *t = new Trace();
+    traces.push_back(std::unique_ptr<Trace>(t));
+    t->start = record_start;
+
+    trace_func link = pt.roots[end] ? pt.roots[end]->f : NULL;
+    std::string name = "trace_" + std::to_string(traces.size() - 1);
+    if (verbose) {
+        fprintf(stderr, "%s: %s trace at pc %d, %zu instructions, %s pc %d\n", name.c_str(),
+                record_exit ? "side" : "root", record_start + 1, record.size(),
+                link ? "links to" : "loops to", end + 1);
+    }
+
+    std::unique_ptr<llvm::Module> owner(new llvm::Module(name, context));
+    module = owner.get();
+    module->setDataLayout(jit->getDataLayout());
+    module->setTargetTriple(jit->getTargetTriple().str());
+
+    create_declarations();
+    create_trace_function(p, t, name, link);
+
+    if (llvm::verifyModule(*module, &llvm::errs())) {
+        module->print(llvm::errs(), NULL);
+        fatal("invalid module");
+    }
+    optimize_module_O3(module);
+
+    if (getenv("MINILUA_JIT_DUMP")) {
+        module->print(llvm::errs(), NULL);
+    }
+
+    llvm::cantFail(jit->addIRModule(llvm::orc::ThreadSafeModule(std::move(owner), jit_context)));
+    t->f = (trace_func) llvm::cantFail(jit->lookup(name)).getAddress();
+    if (perfEnabled()) {
+        int first = record_start, last = record_start;
+        for (const RecordedInstruction &r : record) {
+            first = std::min(first, r.pc);
+            last = std::max(last, r.pc);
+        }
+        perfRegisterRange(p->source->str, p->linedefined, record_exit ? "side trace" : "trace",
+                          first, last, (const void *) t->f, function_sizes[name]);
+    }
+
+    if (record_exit) {
+        record_exit->side = t->f;
+    } else {
+        pt.roots[record_start] = t;
+    }
+}
+
+
+// --- Interpreter
+
+// Runs t and returns the pc to resume at
+static size_t run_trace(MiniLuaState *mls, Trace *t) {
+    TraceExit *e = (TraceExit *) t->f(mls);
+    if (!e->side && e->aborts < MAX_ABORTS && ++e->count >= HOT_EXIT) {
+        start_recording(e->pc, e);
+    }
+    return e->pc;
+}
+
+extern "C" void interpret(MiniLuaState *mls) {
+    if (!jit) {
+        init_jit();
+    }
+
+    Proto *p = mls->proto;
+    ProtoTraces &pt = proto_traces[p];
+    if (pt.roots.empty()) {
+        pt.hotcount.assign(p->sizecode, 0);
+        pt.aborts.assign(p->sizecode, 0);
+        pt.roots.assign(p->sizecode, NULL);
+    }
+
+    size_t pc = 0;
+    for (;;) {
+        Instruction inst = p->code[pc];
+        uint32_t op = (inst >> POS_OP) & 0x3F;
+
+        if (op == OP_RETURN) {
+            if (recording) {
+                abort_recording(pt, "left the function");
+            }
+            uint32_t a = (inst >> POS_A) & MAXARG_A;
+            uint32_t b = (inst >> POS_B) & MAXARG_B;
+            if (b == 0) {
+                // not implemented: OP_RETURN with b == 0, as in jit.cpp
+                error_default();
+            }
+            mls->return_begin = a;
+            mls->return_end = a + b - 1;
+            return;
+        }
+
+        if (recording) {
+            record.push_back(RecordedInstruction{(int) pc, inst, observed_types(mls, inst), 0});
+        }
+        int64_t offset = (int64_t) step_in_C(mls, inst, op, p->k);
+        size_t next = pc + 1 + offset;
+
+        if (recording) {
+            record.back().offset = offset;
+            if (pt.roots[next] || (int) next == record_start) {
+                stop_recording(p, pt, next);
+            } else if (record.size() >= MAX_TRACE_LENGTH) {
+                abort_recording(pt, "too long");
+            }
+        }
+
+        // backward jumps close loops: run the trace of the header, or count
+        // towards recording one
+        if (offset < 0 && !recording) {
+            if (pt.roots[next]) {
+                next = run_trace(mls, pt.roots[next]);
+            } else if (pt.hotcount[next] >= 0 && ++pt.hotcount[next] >= HOT_LOOP) {
+                start_recording(next, NULL);
+            }
+        }
+        pc = next;
+    }
+}
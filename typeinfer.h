@@ -0,0 +1,331 @@
+/*
+* File: typeinfer.h
+*
+* Static type inference over a Proto. An abstract interpretation of
+* f->code and f->k computes, for every pc and register, the set of types the
+* register may hold before the instruction at pc runs. Loops are followed
+* around their back edges until nothing changes.
+*
+* Included by c-minilua.c and hybrid.c after their Proto, Value, opcode and
+* instruction decoding definitions; f->code must still hold the original
+* Lua opcodes (run it before fuseCode). The result is stored in f->types and
+* read back through operandTypes(), which is what the interpreters and the
+* JIT use to pick handlers without tag tests. MINILUA_TYPES=1 in the
+* environment makes loadFunction print the instructions it could specialize.
+*/
+
+// Sets of possible types. A register that may hold anything is TYPE_ANY, one
+// that is never reached holds no type at all.
+#define TYPE_NIL        (1 << 0)
+#define TYPE_BOOL       (1 << 1)
+#define TYPE_INT        (1 << 2)
+#define TYPE_FLT        (1 << 3)
+#define TYPE_OTHER      (1 << 4)
+#define TYPE_ANY        (TYPE_NIL | TYPE_BOOL | TYPE_INT | TYPE_FLT | TYPE_OTHER)
+#define TYPE_NUMBER     (TYPE_INT | TYPE_FLT)
+
+// types of register r before pc
+#define TYPES_AT(f, pc)  (&(f)->types[(size_t) (pc) * (f)->maxstacksize])
+
+static
+Byte constantType(Value *k)
+{
+    switch (k->typ) {
+        case LUA_TNIL:     return TYPE_NIL;
+        case LUA_TBOOLEAN: return TYPE_BOOL;
+        case LUA_TNUMINT:  return TYPE_INT;
+        case LUA_TNUMFLT:  return TYPE_FLT;
+        default:           return TYPE_OTHER;
+    }
+}
+
+static
+Byte rkType(Proto *f, Byte *regs, uint32_t x)
+{
+    return ISK(x) ? constantType(&f->k[INDEXK(x)]) : regs[x];
+}
+
+// Result of an arithmetic opcode with integer and float cases: integers when
+// both operands can be integers, floats when either can be a float.
+// Non-numbers raise an error, so they add nothing.
+static
+Byte arithType(Byte b, Byte c)
+{
+    Byte t = 0;
+    if ((b & TYPE_INT) && (c & TYPE_INT)) {
+        t |= TYPE_INT;
+    }
+    if (((b & TYPE_FLT) && (c & TYPE_NUMBER)) || ((c & TYPE_FLT) && (b & TYPE_NUMBER))) {
+        t |= TYPE_FLT;
+    }
+    return t;
+}
+
+// DIV and POW always give floats
+static
+Byte floatArithType(Byte b, Byte c)
+{
+    return ((b & TYPE_NUMBER) && (c & TYPE_NUMBER)) ? TYPE_FLT : 0;
+}
+
+static
+void setTypes(Byte *regs, int from, int to, Byte t)
+{
+    for (int r = from; r < to; r++) {
+        regs[r] = t;
+    }
+}
+
+// Joins regs into the state before pc. Returns whether it changed.
+static
+int joinTypes(Proto *f, int pc, Byte *regs)
+{
+    if (pc < 0 || pc >= f->sizecode) {
+        return 0;
+    }
+    Byte *in = TYPES_AT(f, pc);
+    int changed = 0;
+    for (int r = 0; r < f->maxstacksize; r++) {
+        if ((in[r] | regs[r]) != in[r]) {
+            in[r] |= regs[r];
+            changed = 1;
+        }
+    }
+    return changed;
+}
+
+void inferTypes(Proto *f)
+{
+    int n = f->maxstacksize;
+    f->types = calloc((size_t) f->sizecode * n + 1, sizeof(Byte));
+    if (f->sizecode == 0) {
+        return;
+    }
+
+    // registers hold whatever the previous run left in them
+    Byte *out = calloc(n + 1, sizeof(Byte));
+    Byte *out_jump = calloc(n + 1, sizeof(Byte));
+    Byte *pending = calloc(f->sizecode, sizeof(Byte));
+    int *worklist = calloc(f->sizecode, sizeof(int));
+    int nwork = 0;
+
+    setTypes(TYPES_AT(f, 0), 0, n, TYPE_ANY);
+    worklist[nwork++] = 0;
+    pending[0] = 1;
+
+    while (nwork > 0) {
+        int pc = worklist[--nwork];
+        pending[pc] = 0;
+
+        Instruction instr = f->code[pc];
+        uint32_t op = OP(instr);
+        int a = A(instr);
+        Byte *in = TYPES_AT(f, pc);
+        memcpy(out, in, n);
+
+        // successors: the next pc, and possibly a second one reached with
+        // the registers in out_jump
+        int next = pc + 1;
+        int jump = -1;
+
+        switch (op) {
+            case OP_MOVE:
+                out[a] = in[B(instr)];
+                break;
+            case OP_LOADK:
+                out[a] = constantType(&f->k[Bx(instr)]);
+                break;
+            case OP_LOADKX:
+                if (pc + 1 < f->sizecode) {
+                    out[a] = constantType(&f->k[Ax(f->code[pc + 1])]);
+                }
+                break;
+            case OP_LOADBOOL:
+                out[a] = TYPE_BOOL;
+                if (C(instr)) {
+                    next = pc + 2;
+                }
+                break;
+            case OP_LOADNIL:
+                setTypes(out, a, a + B(instr) + 1, TYPE_NIL);
+                break;
+
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_MOD:
+            case OP_IDIV:
+                out[a] = arithType(rkType(f, in, B(instr)), rkType(f, in, C(instr)));
+                break;
+            case OP_DIV:
+            case OP_POW:
+                out[a] = floatArithType(rkType(f, in, B(instr)), rkType(f, in, C(instr)));
+                break;
+            case OP_UNM:
+                out[a] = in[B(instr)] & TYPE_NUMBER;
+                break;
+            case OP_BAND:
+            case OP_BOR:
+            case OP_BXOR:
+            case OP_SHL:
+            case OP_SHR:
+            case OP_BNOT:
+                out[a] = TYPE_INT;
+                break;
+            case OP_NOT:
+                out[a] = TYPE_BOOL;
+                break;
+
+            case OP_JMP:
+                next = pc + 1 + sBx(instr);
+                break;
+            case OP_EQ:
+            case OP_LT:
+            case OP_LE:
+            case OP_TEST:
+                jump = pc + 2;
+                memcpy(out_jump, out, n);
+                break;
+            case OP_TESTSET:
+                // R(A) := R(B) only when the following JMP is taken
+                jump = pc + 2;
+                memcpy(out_jump, out, n);
+                out[a] = in[B(instr)];
+                break;
+
+            case OP_FORPREP: {
+                Byte init = in[a], limit = in[a + 1], step = in[a + 2];
+                // c-minilua may convert a loop to floats, or turn the limit
+                // into an iteration count
+                if (init != TYPE_INT || limit != TYPE_INT || step != TYPE_INT) {
+                    init |= TYPE_FLT;
+                    limit |= TYPE_FLT | TYPE_INT;
+                    step |= TYPE_FLT;
+                }
+                out[a] = arithType(init, step);
+                out[a + 1] = limit;
+                out[a + 2] = step;
+                next = pc + 1 + sBx(instr);
+            } break;
+            case OP_FORLOOP:
+                out[a] = arithType(in[a], in[a + 2]);
+                jump = pc + 1 + sBx(instr);
+                memcpy(out_jump, out, n);
+                out_jump[a + 3] = out[a];
+                break;
+
+            case OP_TFORCALL:
+                setTypes(out, a + 3, n, TYPE_ANY);
+                break;
+            case OP_TFORLOOP:
+                jump = pc + 1 + sBx(instr);
+                memcpy(out_jump, out, n);
+                out_jump[a] = in[a + 1];
+                break;
+
+            case OP_CALL:
+            case OP_VARARG:
+                setTypes(out, a, n, TYPE_ANY);
+                break;
+            case OP_SELF:
+                out[a] = TYPE_ANY;
+                out[a + 1] = TYPE_ANY;
+                break;
+            case OP_GETUPVAL:
+            case OP_GETTABUP:
+            case OP_GETTABLE:
+            case OP_NEWTABLE:
+            case OP_LEN:
+            case OP_CONCAT:
+            case OP_CLOSURE:
+                out[a] = TYPE_ANY;
+                break;
+
+            case OP_SETTABUP:
+            case OP_SETUPVAL:
+            case OP_SETTABLE:
+            case OP_SETLIST:
+            case OP_EXTRAARG:
+                break;
+
+            case OP_RETURN:
+            case OP_TAILCALL:
+                next = -1;
+                break;
+
+            default:
+                setTypes(out, 0, n, TYPE_ANY);
+                break;
+        }
+
+        if (joinTypes(f, next, out) && !pending[next]) {
+            pending[next] = 1;
+            worklist[nwork++] = next;
+        }
+        if (joinTypes(f, jump, out_jump) && !pending[jump]) {
+            pending[jump] = 1;
+            worklist[nwork++] = jump;
+        }
+    }
+
+    free(out);
+    free(out_jump);
+    free(pending);
+    free(worklist);
+}
+
+// TYPE_INT when the numeric operands of the instruction at pc are proven to
+// be integers, TYPE_FLT when they are proven to be floats, 0 otherwise. The
+// operands are RK(B) and RK(C) for arithmetic and comparisons, the control
+// registers for FORPREP and FORLOOP.
+Byte operandTypes(Proto *f, int pc)
+{
+    Instruction instr = f->code[pc];
+    Byte *in = TYPES_AT(f, pc);
+    Byte t;
+
+    switch (OP(instr)) {
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_MOD:
+        case OP_IDIV:
+        case OP_DIV:
+        case OP_POW:
+        case OP_EQ:
+        case OP_LT:
+        case OP_LE:
+        // superinstructions keep B and C, for when f->code is fused in place
+        case OP_EQ_JMP:
+        case OP_LT_JMP:
+        case OP_LE_JMP:
+        case OP_ADD_KI:
+        case OP_SUB_KI:
+        case OP_MUL_KI:
+        case OP_MOD_KI:
+        case OP_IDIV_KI:
+            t = rkType(f, in, B(instr)) | rkType(f, in, C(instr));
+            break;
+        case OP_FORPREP:
+        case OP_FORLOOP:
+            t = in[A(instr)] | in[A(instr) + 1] | in[A(instr) + 2];
+            break;
+        default:
+            return 0;
+    }
+    return (t == TYPE_INT || t == TYPE_FLT) ? t : 0;
+}
+
+void printTypes(Proto *f)
+{
+    int count = 0;
+    for (int pc = 0; pc < f->sizecode; pc++) {
+        Byte t = operandTypes(f, pc);
+        if (t) {
+            fprintf(stderr, "  code[%d] = %-10s%s\n", pc + 1, lua_opnames[OP(f->code[pc])],
+                    t == TYPE_INT ? "int" : "float");
+            count++;
+        }
+    }
+    fprintf(stderr, "%d of %d instructions specialized\n", count, f->sizecode);
+}